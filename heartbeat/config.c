@@ -25,6 +25,7 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
@@ -57,6 +58,7 @@
 #include <hb_api.h>
 #include <hb_config.h>
 #include <hb_api_core.h>
+#include <hb_snapshot.h>
 #include <clplumbing/cl_syslog.h>
 #include <clplumbing/cl_misc.h>
 #include <ha_version.h>
@@ -114,6 +116,9 @@ static int ha_config_check_boolean(const char *);
 static int set_memreserve(const char *);
 static int set_quorum_server(const char * value);
 static int set_syslog_logfilefmt(const char * value);
+static int set_metrics_socket(const char * value);
+static int set_media_ratelimit(const char * value);
+static int set_media_bufmax(const char * value);
 #ifdef ALLOWPOLLCHOICE
   static int set_normalpoll(const char *);
 #endif
@@ -180,6 +185,12 @@ struct directive {
 ,{KEY_CONFIG_WRITES_ENABLED, ha_config_check_boolean, TRUE,"on", "write configuration changes to disk (valid only with: "KEY_PACEMAKER" on)"}
 ,{KEY_MEMRESERVE, set_memreserve, TRUE, "6500", "number of kbytes to preallocate in heartbeat"}
 ,{KEY_QSERVER,set_quorum_server, TRUE, NULL, "the name or ip of quorum server"}
+,{KEY_METRICSOCK, set_metrics_socket, TRUE, NULL, "unix socket to serve Prometheus metrics on"}
+,{KEY_MEDIAFILTER, ha_config_check_boolean, TRUE, "off", "filter UDP media packets in the kernel"}
+,{KEY_MEDIARATE, set_media_ratelimit, TRUE, "0", "packets/second from each sender past the read processes"}
+,{KEY_MEDIABUFMAX, set_media_bufmax, TRUE, "4194304", "largest socket buffer (bytes) to grow IP media to"}
+,{KEY_SERIALFRAME, ha_config_check_boolean, TRUE, "on", "use binary framing with serial peers which offer it"}
+,{KEY_SERIALZLIB, ha_config_check_boolean, TRUE, "off", "compress large messages over framed serial links"}
 };
 
 
@@ -583,6 +594,7 @@ init_node_link_info(struct node_info *   node)
 		}
 		lnk->name = sysmedia[j]->name;
 		lnk->lastupdate = cticks;
+		memset(&lnk->stats, 0, sizeof(lnk->stats));
 		strncpy(lnk->status, DEADSTATUS, sizeof(lnk->status));
 		lnk[1].name = NULL;
 		++node->nlinks;
@@ -1371,6 +1383,7 @@ add_node(const char * value, int nodetype)
 	hip->nodetype = nodetype;
 	add_nametable(hip->nodename, hip);
 	init_node_link_info(hip);
+	hb_snapshot_dirty();
 	if (nodetype == PINGNODE_I) {
 		hip->dead_ticks
 			=	msto_longclock(config->deadping_ms);
@@ -1406,6 +1419,7 @@ set_node_weight(const char* value, int weight)
 	}
 	
 	hip->weight = weight;
+	hb_snapshot_dirty();
 	return HA_OK;	
 }
 
@@ -1433,6 +1447,7 @@ set_node_site(const char* value, const char* site)
 		return HA_FAIL;
 	}
 	strncpy(hip->site, site, sizeof(hip->site));
+	hb_snapshot_dirty();
 	return HA_OK;	
 }
 
@@ -1485,6 +1500,7 @@ remove_node(const char* value, int deletion)
 	}
 	
 	config->nodecount -- ;
+	hb_snapshot_dirty();
 
 	tables_remove(hip->nodename, &hip->uuid);		
 	
@@ -2555,6 +2571,51 @@ set_corerootdir(const char* value)
 	return HA_OK;
 }
 
+static int
+set_metrics_socket(const char * value)
+{
+	if (value == NULL || *value != '/') {
+		cl_log(LOG_ERR, "%s must be an absolute path [%s]"
+		,	KEY_METRICSOCK, value ? value : "");
+		return HA_FAIL;
+	}
+	/* hb_metrics_init() picks it up from the parameter table */
+	return HA_OK;
+}
+
+static int
+set_media_ratelimit(const char * value)
+{
+	long	rate;
+	char *	end;
+
+	if (value == NULL || (rate = strtol(value, &end, 10)) < 0
+	||	end == value || *end != EOS) {
+		cl_log(LOG_ERR, "%s must be a number of packets per second"
+		" (0 for no limit) [%s]", KEY_MEDIARATE, value ? value : "");
+		return HA_FAIL;
+	}
+	/* The read processes pick it up from the parameter table */
+	return HA_OK;
+}
+
+static int
+set_media_bufmax(const char * value)
+{
+	long	bytes;
+	char *	end;
+
+	if (value == NULL || (bytes = strtol(value, &end, 10)) < 0
+	||	bytes > INT_MAX || end == value || *end != EOS) {
+		cl_log(LOG_ERR, "%s must be a number of bytes"
+		" (0 to leave socket buffers alone) [%s]"
+		,	KEY_MEDIABUFMAX, value ? value : "");
+		return HA_FAIL;
+	}
+	/* The read and write processes pick it up from the parameter table */
+	return HA_OK;
+}
+
 static int fail_if_after_pacemaker(const char *directive)
 {
 	if (GetParameterValue(KEY_PACEMAKER)) {
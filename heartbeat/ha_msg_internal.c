@@ -29,6 +29,7 @@
 #include <heartbeat.h>
 #include <ha_msg.h>
 #include <heartbeat_private.h>
+#include <hb_metrics.h>
 #include <clplumbing/netstring.h>
 
 #define		MINFIELDS	30
@@ -352,6 +353,9 @@ isauthentic(const struct ha_msg * m)
 	}
 	
  out:	
+	if (!ret) {
+		HBM_INC(HBM_AUTH_FAILURES);
+	}
 	if (buf_malloced && msgbuf){
 		free(msgbuf);
 	}
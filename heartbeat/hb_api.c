@@ -85,6 +85,7 @@
 #include <hb_api_core.h>
 #include <hb_config.h>
 #include <hb_resource.h>
+#include <hb_snapshot.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
@@ -93,11 +94,16 @@
 #include <clplumbing/netstring.h>
 #include <clplumbing/cpulimits.h>
 #include "hb_signal.h"
+#include "hb_metrics.h"
+#include "hb_trace.h"
+#include "hb_sockbuf.h"
+#include "hb_ping.h"
 
 /* Definitions of API query handlers */
 static int api_ping_iflist(const struct ha_msg *msg, struct node_info *node, struct ha_msg *resp, client_proc_t *client, const char **failreason);
 static int api_signoff(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client, const char **failreason);
 static int api_setfilter(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client, const char **failreason);
+static int api_setmsgfilter(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client, const char **failreason);
 static int api_setsignal(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client, const char **failreason);
 static int api_nodelist(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client, const char **failreason);
 static int api_nodestatus(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client, const char **failreason);
@@ -113,11 +119,14 @@ static int api_get_resources(const struct ha_msg *msg, struct ha_msg *resp, clie
 static int api_get_uuid(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client, const char **failreason);
 static int api_get_nodename(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client, const char **failreason);
 static int api_set_sendqlen(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client, const char **failreason);
+static int api_clusterstate(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client, const char **failreason);
+static int api_changes(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client, const char **failreason);
 gboolean ProcessAnAPIRequest(client_proc_t *client);
 
 struct api_query_handler query_handler_list[] = {
 	{API_SIGNOFF, api_signoff},
 	{API_SETFILTER, api_setfilter},
+	{API_SETMSGFILTER, api_setmsgfilter},
 	{API_SETSIGNAL, api_setsignal},
 	{API_NODELIST, api_nodelist},
 	{API_NODESTATUS, api_nodestatus},
@@ -132,7 +141,9 @@ struct api_query_handler query_handler_list[] = {
 	{API_GETRESOURCES, api_get_resources},
 	{API_GETUUID, api_get_uuid},
 	{API_GETNAME, api_get_nodename},
-	{API_SET_SENDQLEN, api_set_sendqlen}
+	{API_SET_SENDQLEN, api_set_sendqlen},
+	{API_GETCLUSTERSTATE, api_clusterstate},
+	{API_GETCHANGES, api_changes}
 };
 
 extern int UseOurOwnPoll;
@@ -143,10 +154,14 @@ client_proc_t *client_list = NULL;	/* List of all our API clients */
 extern struct node_info *curnode;
 
 static unsigned long client_generation = 0;
+static GTRIGSource *client_signal_trigger = NULL;
 #define MAX_CLIENT_GEN 64
 
 static void api_process_request(client_proc_t *client, struct ha_msg *msg);
 static void api_send_client_msg(client_proc_t *client, struct ha_msg *msg);
+static void api_send_client_ipcmsg(client_proc_t *client, struct ha_msg *msg, IPC_Message *imsg);
+static void api_signal_client(client_proc_t *client);
+static gboolean api_flush_client_signals(gpointer data);
 static void api_send_client_status(client_proc_t *client, const char *status, const char *reason);
 static void api_remove_client_int(client_proc_t *client, const char *rsn);
 static int api_add_client(client_proc_t *chan, struct ha_msg *msg);
@@ -295,6 +310,227 @@ nextstep:
  * oblivion by Alan Robertson <alanr@unix.sh>
  *
  */
+/*
+ *	Clients are indexed so delivering a message only touches the
+ *	clients which want it:
+ *
+ *	client_by_id:		client_id -> client, for F_TOID messages
+ *	treatment_subscribers:	one list per treatment bit, holding the
+ *				clients without a type filter whose
+ *				desired_types include it
+ *	type_subscribers:	F_TYPE -> list of the clients whose type
+ *				filter (API_SETMSGFILTER) includes it
+ *	filtered_subscribers:	one list per treatment bit, holding the
+ *				clients with a type filter, for the
+ *				F_ORDERSEQ messages which go past it
+ *
+ *	A client is taken out of all of them when it signs off or goes away.
+ */
+#define API_NTREATMENTS	6	/* Bits in ALLTREATMENTS */
+static GHashTable *client_by_id = NULL;
+static GList *treatment_subscribers[API_NTREATMENTS];
+static GHashTable *type_subscribers = NULL;
+static GList *filtered_subscribers[API_NTREATMENTS];
+
+static int
+api_treatment_index(int msgtype)
+{
+	int j;
+
+	for (j = 0; j < API_NTREATMENTS; ++j) {
+		if (msgtype == (1 << j)) {
+			return j;
+		}
+	}
+	return -1;
+}
+
+static void
+api_index_type(gpointer key, gpointer value, gpointer user_data)
+{
+	client_proc_t *client = user_data;
+	GList *list;
+
+	list = g_hash_table_lookup(type_subscribers, key);
+	g_hash_table_insert(type_subscribers, g_strdup(key), g_list_prepend(list, client));
+}
+
+static void
+api_unindex_type(gpointer key, gpointer value, gpointer user_data)
+{
+	client_proc_t *client = user_data;
+	GList *list;
+
+	list = g_list_remove(g_hash_table_lookup(type_subscribers, key), client);
+	if (list == NULL) {
+		g_hash_table_remove(type_subscribers, key);
+	} else {
+		g_hash_table_insert(type_subscribers, g_strdup(key), list);
+	}
+}
+
+/*
+ *	Add a client to (or remove it from) the delivery lists matching
+ *	its current desired_types and type filter.  Call with FALSE
+ *	before changing either, and with TRUE afterwards.
+ */
+static void
+api_index_client(client_proc_t *client, gboolean add)
+{
+	GList **lists = treatment_subscribers;
+	int j;
+
+	if (add && client->removereason != NULL) {
+		/* On its way out - see api_signoff() */
+		return;
+	}
+	if (client->type_filter != NULL) {
+		lists = filtered_subscribers;
+		if (type_subscribers == NULL && add) {
+			type_subscribers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+		}
+		if (type_subscribers != NULL) {
+			g_hash_table_foreach(client->type_filter, add ? api_index_type : api_unindex_type, client);
+			if (g_hash_table_size(type_subscribers) == 0) {
+				g_hash_table_destroy(type_subscribers);
+				type_subscribers = NULL;
+			}
+		}
+	}
+	for (j = 0; j < API_NTREATMENTS; ++j) {
+		if ((client->desired_types & (1 << j)) == 0) {
+			continue;
+		}
+		if (add) {
+			lists[j] = g_list_prepend(lists[j], client);
+		} else {
+			lists[j] = g_list_remove(lists[j], client);
+		}
+	}
+}
+
+static void
+api_index_client_id(client_proc_t *client)
+{
+	if (client_by_id == NULL) {
+		client_by_id = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+	g_hash_table_insert(client_by_id, client->client_id, client);
+}
+
+static void
+api_unindex_client(client_proc_t *client)
+{
+	api_index_client(client, FALSE);
+	if (client_by_id != NULL && client->client_id[0] != EOS
+	    && g_hash_table_lookup(client_by_id, client->client_id) == client) {
+		g_hash_table_remove(client_by_id, client->client_id);
+	}
+}
+
+static void
+api_free_type(gpointer key, gpointer value, gpointer user_data)
+{
+	g_list_free(value);
+}
+
+/* Free the delivery indexes, at shutdown */
+void
+api_shutdown(void)
+{
+	int j;
+
+	for (j = 0; j < API_NTREATMENTS; ++j) {
+		g_list_free(treatment_subscribers[j]);
+		treatment_subscribers[j] = NULL;
+		g_list_free(filtered_subscribers[j]);
+		filtered_subscribers[j] = NULL;
+	}
+	if (type_subscribers != NULL) {
+		g_hash_table_foreach(type_subscribers, api_free_type, NULL);
+		g_hash_table_destroy(type_subscribers);
+		type_subscribers = NULL;
+	}
+	if (client_by_id != NULL) {
+		g_hash_table_destroy(client_by_id);
+		client_by_id = NULL;
+	}
+}
+
+/* Does the client's node filter (if any) let this message through? */
+static gboolean
+api_node_filter_ok(client_proc_t *client, struct ha_msg *msg)
+{
+	const char *from;
+
+	if (client->node_filter == NULL || (from = ha_msg_value(msg, F_ORIG)) == NULL) {
+		return TRUE;
+	}
+	return g_hash_table_lookup(client->node_filter, from) != NULL;
+}
+
+/*
+ *	Hand a message to one client, encoding it first if no one
+ *	else has wanted it yet.  Returns FALSE if it can't be encoded.
+ */
+static gboolean
+api_deliver_to_client(client_proc_t *client, struct ha_msg *msg, IPC_Message **imsg)
+{
+	char *smsg;
+	size_t len;
+
+	if (client->chan->ch_status != IPC_CONNECT) {
+		return TRUE;
+	}
+	if (should_msg_sendto_client(client, msg)) {
+		/* Encode it once, for everyone who wants it */
+		if (*imsg == NULL) {
+			if ((smsg = msg2wirefmt(msg, &len)) == NULL) {
+				cl_log(LOG_ERR, "%s: cannot convert message", __FUNCTION__);
+				return FALSE;
+			}
+			*imsg = hb_new_ipcmsg(smsg, len, client->chan, 1);
+			free(smsg);
+			if (*imsg == NULL) {
+				cl_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+				return FALSE;
+			}
+		}
+		api_send_client_ipcmsg(client, msg, *imsg);
+	} else {
+		/* This happens when join/leave messages is
+		 * received but there are messages before 
+		 * that are missing. The join/leave messages
+		 * will be queued and not delivered until all
+		 * messages before them are received and 
+		 * delivered. 
+		 */
+
+		/* do nothing */
+	}
+	if (client->removereason && !client->isindispatch) {
+		if (ANYDEBUG) {
+			cl_log(LOG_DEBUG, "%s: client is %s", __FUNCTION__, client->client_id);
+		}
+		api_remove_client_pid(client->pid, client->removereason);
+	}
+	return TRUE;
+}
+
+/*
+ *	Would a client's type filter let this message through?  Messages
+ *	stamped with F_ORDERSEQ always get through: a gap would hold up
+ *	the client's ordered delivery, so its library filters those
+ *	after putting them in order.
+ */
+static gboolean
+api_type_filter_ok(client_proc_t *client, const struct ha_msg *msg, const char *type)
+{
+	return client->type_filter == NULL
+	    || (type != NULL && g_hash_table_lookup(client->type_filter, type) != NULL)
+	    || ha_msg_value(msg, F_ORDERSEQ) != NULL;
+}
+
 /*
  *	Monitor messages.  Pass them along to interested clients (if any)
  */
@@ -303,7 +539,8 @@ api_heartbeat_monitor(struct ha_msg *msg, int msgtype, const char *iface)
 {
 	const char *clientid;
 	client_proc_t *client;
-	client_proc_t *nextclient;
+	IPC_Message *imsg = NULL;
+	int tindex;
 
 	/* This kicks out most messages, since debug clients are rare */
 
@@ -318,59 +555,94 @@ api_heartbeat_monitor(struct ha_msg *msg, int msgtype, const char *iface)
 		return;
 	}
 
+	/* Nobody should hear about a change before the snapshot shows it */
+	if (msgtype != APICALL) {
+		hb_snapshot_update();
+	}
+
 	/* See who this message is addressed to (if anyone) */
 
 	clientid = ha_msg_value(msg, F_TOID);
 
-	for (client = client_list; client != NULL; client = nextclient) {
-		/*
-		 * "client" might be removed by api_send_client_msg()
-		 * so, we'd better fetch the next client now!
-		 */
-		nextclient = client->next;
-
-		/* Is this message addressed to us? */
-		if (clientid != NULL && strcmp(clientid, client->client_id) != 0) {
-			continue;
-		}
-		if (client->chan->ch_status != IPC_CONNECT) {
-			continue;
+	if (clientid != NULL) {
+		/* If this is addressed to a client, then no one else should get it */
+		if (client_by_id != NULL
+		    && (client = g_hash_table_lookup(client_by_id, clientid)) != NULL
+		    && (msgtype & client->desired_types) != 0) {
+			api_deliver_to_client(client, msg, &imsg);
 		}
 
-		/* Is this one of the types of messages we're interested in? */
+	} else if ((tindex = api_treatment_index(msgtype)) >= 0) {
+		GList *node;
+		GList *next;
+		const char *type = ha_msg_value(msg, F_TYPE);
+		gboolean ok = TRUE;
+
+		for (node = treatment_subscribers[tindex]; ok && node != NULL; node = next) {
+			/*
+			 * "client" might be removed by api_deliver_to_client()
+			 * so, we'd better fetch the next client now!
+			 */
+			next = node->next;
+			client = node->data;
+			if (api_node_filter_ok(client, msg)) {
+				ok = api_deliver_to_client(client, msg, &imsg);
+			}
+		}
 
-		if ((msgtype & client->desired_types) != 0) {
-			if (should_msg_sendto_client(client, msg)) {
-				api_send_client_msg(client, msg);
-			} else {
-				/* This happens when join/leave messages is
-				 * received but there are messages before 
-				 * that are missing. The join/leave messages
-				 * will be queued and not delivered until all
-				 * messages before them are received and 
-				 * delivered. 
-				 */
-
-				/* do nothing */
+		/* Then the clients which only want some message types */
+		if (ok && type_subscribers != NULL && type != NULL) {
+			node = g_hash_table_lookup(type_subscribers, type);
+			for (; ok && node != NULL; node = next) {
+				next = node->next;
+				client = node->data;
+				if ((msgtype & client->desired_types) != 0 && api_node_filter_ok(client, msg)) {
+					ok = api_deliver_to_client(client, msg, &imsg);
+				}
 			}
-			if (client->removereason && !client->isindispatch) {
-				if (ANYDEBUG) {
-					cl_log(LOG_DEBUG, "%s: client is %s", __FUNCTION__, client->client_id);
+		}
+
+		/* ... and the ones which don't, if it's an ordered message */
+		if (ok && ha_msg_value(msg, F_ORDERSEQ) != NULL) {
+			for (node = filtered_subscribers[tindex]; ok && node != NULL; node = next) {
+				next = node->next;
+				client = node->data;
+				if ((type != NULL && g_hash_table_lookup(client->type_filter, type) != NULL)
+				    || !api_node_filter_ok(client, msg)) {
+					continue;
 				}
-				api_remove_client_pid(client->pid, client->removereason);
+				ok = api_deliver_to_client(client, msg, &imsg);
 			}
 		}
 
-		/* If this is addressed to us, then no one else should get it */
-		if (clientid != NULL) {
-			break;	/* No one else should get it */
+	} else {
+		client_proc_t *nextclient;
+		const char *type = ha_msg_value(msg, F_TYPE);
+
+		/* More than one treatment bit - look at everyone */
+		for (client = client_list; client != NULL; client = nextclient) {
+			nextclient = client->next;
+			if ((msgtype & client->desired_types) == 0 || !api_node_filter_ok(client, msg)
+			    || !api_type_filter_ok(client, msg, type)) {
+				continue;
+			}
+			if (!api_deliver_to_client(client, msg, &imsg)) {
+				break;
+			}
 		}
 	}
+	if (imsg != NULL) {
+		/* Drop our own reference - the channels hold theirs */
+		imsg->msg_done(imsg);
+	}
 }
 
 /*
  *	Periodically clean up after dead clients...
  *	In case we somehow miss them...
+ *	A client which has gone away has hung up its end of the channel,
+ *	so resume_io() will notice the disconnect without us probing
+ *	its pid.
  */
 gboolean
 api_audit_clients(gpointer p)
@@ -381,7 +653,11 @@ api_audit_clients(gpointer p)
 	for (client = client_list; client != NULL; client = nextclient) {
 		nextclient = client->next;
 
-		if (CL_KILL(client->pid, 0) < 0 && errno == ESRCH) {
+		if (client->chan == NULL || client->isindispatch) {
+			continue;
+		}
+		client->chan->ops->resume_io(client->chan);
+		if (!IPC_ISRCONN(client->chan)) {
 			cl_log(LOG_INFO, "api_audit_clients: client %ld died", (long)client->pid);
 			client->removereason = NULL;
 			api_remove_client_pid(client->pid, "died-audit");
@@ -420,7 +696,67 @@ api_setfilter(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *clie
 	} else if ((client->desired_types & DEBUGTREATMENTS) != 0 && (mask & DEBUGTREATMENTS) == 0) {
 		--debug_client_count;
 	}
+	api_index_client(client, FALSE);
 	client->desired_types = mask;
+	api_index_client(client, TRUE);
+	return I_API_RET;
+}
+
+/*
+ *	Turn a space separated list into a set, or NULL for an empty
+ *	or missing list (which means "everything").
+ */
+static GHashTable *
+api_make_filter(const char *list)
+{
+	GHashTable *set = NULL;
+	gchar **names;
+	int j;
+
+	if (list == NULL) {
+		return NULL;
+	}
+	names = g_strsplit(list, " ", 0);
+	for (j = 0; names[j] != NULL; ++j) {
+		if (names[j][0] == EOS) {
+			continue;
+		}
+		if (set == NULL) {
+			set = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+		}
+		g_hash_table_insert(set, g_strdup(names[j]), GINT_TO_POINTER(1));
+	}
+	g_strfreev(names);
+	return set;
+}
+
+static void
+api_free_filters(client_proc_t *client)
+{
+	if (client->type_filter != NULL) {
+		g_hash_table_destroy(client->type_filter);
+		client->type_filter = NULL;
+	}
+	if (client->node_filter != NULL) {
+		g_hash_table_destroy(client->node_filter);
+		client->node_filter = NULL;
+	}
+}
+
+/**********************************************************************
+ * API_SETMSGFILTER: Set the message types and origin nodes we want
+ *
+ * Either list may be omitted or empty, meaning no restriction.
+ * Messages addressed to the client (F_TOID) are never filtered.
+ **********************************************************************/
+static int
+api_setmsgfilter(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client, const char **failreason)
+{
+	api_index_client(client, FALSE);
+	api_free_filters(client);
+	client->type_filter = api_make_filter(ha_msg_value(msg, F_FILTERTYPES));
+	client->node_filter = api_make_filter(ha_msg_value(msg, F_FILTERNODES));
+	api_index_client(client, TRUE);
 	return I_API_RET;
 }
 
@@ -440,6 +776,8 @@ api_signoff(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client
 		client->seq_snapshot_table = NULL;
 	}
 
+	/* Nothing more goes to them, whenever they're actually removed */
+	api_unindex_client(client);
 	client->removereason = API_SIGNOFF;
 	return I_API_IGN;
 }
@@ -465,6 +803,9 @@ api_setsignal(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *clie
 	}
 
 	client->signal = oursig;
+	if (oursig == 0) {
+		client->sigpending = FALSE;
+	}
 	return I_API_RET;
 }
 
@@ -487,15 +828,22 @@ msg_mod_nodetype(struct ha_msg *resp, const int nodetype)
 	return ha_msg_mod(resp, F_NODETYPE, ntype);
 }
 
-static int
-msg_mod_nodestatus(struct ha_msg *resp, const struct node_info *node)
+/* The status we report for a node (suppressed or not) */
+const char *
+api_node_status(const struct node_info *node)
 {
 	const char *status = NULL;
 	if (node->saved_status_msg)
 		status = ha_msg_value(node->saved_status_msg, F_STATUS);
 	if (!status)
 		status = node->status;
-	return ha_msg_mod(resp, F_STATUS, status);
+	return status;
+}
+
+static int
+msg_mod_nodestatus(struct ha_msg *resp, const struct node_info *node)
+{
+	return ha_msg_mod(resp, F_STATUS, api_node_status(node));
 }
 
 static int
@@ -664,6 +1012,31 @@ api_iflist(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client,
 	return I_API_IGN;
 }
 
+/* Add the ping engine's echo statistics for a ping node (RTT in ms) */
+static int
+api_add_ping_stats(struct ha_msg *resp, const char *medianame)
+{
+	static const char *names[] = {F_LINKRCVD, F_LINKLOST, F_LINKRTT};
+	unsigned long values[DIMOF(names)];
+	struct hb_ping_stats st;
+	char buf[32];
+	unsigned j;
+
+	if (!hb_ping_stats(medianame, &st)) {
+		return HA_OK;	/* Not one of the ping engine's */
+	}
+	values[0] = st.rcvd;
+	values[1] = st.lost;
+	values[2] = (st.rtt + 999) / 1000;
+	for (j = 0; j < DIMOF(names); ++j) {
+		snprintf(buf, sizeof(buf), "%lu", values[j]);
+		if (ha_msg_mod(resp, names[j], buf) != HA_OK) {
+			return HA_FAIL;
+		}
+	}
+	return HA_OK;
+}
+
 static int
 api_ping_iflist(const struct ha_msg *msg, struct node_info *node, struct ha_msg *resp, client_proc_t *client, const char **failreason)
 {
@@ -680,6 +1053,10 @@ api_ping_iflist(const struct ha_msg *msg, struct node_info *node, struct ha_msg
 				cl_log(LOG_ERR, "api_ping_iflist: cannot mod ifstatus");
 				return I_API_IGN;
 			}
+			if (api_add_ping_stats(resp, lnk->name) != HA_OK) {
+				cl_log(LOG_ERR, "api_ping_iflist: cannot add ping statistics");
+				return I_API_IGN;
+			}
 			if (ha_msg_mod(resp, F_APIRESULT, API_OK) != HA_OK) {
 				cl_log(LOG_ERR, "api_ping_iflist: cannot mod apiresult");
 				return I_API_IGN;
@@ -695,6 +1072,36 @@ api_ping_iflist(const struct ha_msg *msg, struct node_info *node, struct ha_msg
  * API_IFSTATUS: Return the status of the given interface...
  *********************************************************************/
 
+/* Add the rolling receive statistics for a link (see update_link_stats()) */
+static int
+api_add_link_stats(struct ha_msg *resp, const struct link *lnk)
+{
+	const struct link_stats *ls = &lnk->stats;
+	struct {
+		const char *name;
+		unsigned long value;
+	} fields[] = {
+		{F_LINKRCVD,	ls->rcvd},
+		{F_LINKLOST,	ls->lost},
+		{F_LINKDUP,	ls->dup},
+		{F_LINKJITTER,	ls->jitter >> LINKSTAT_SHIFT},
+		{F_LINKSKEW,	ls->skew >> LINKSTAT_SHIFT},
+		{F_LINKRTT,	ls->rttsamples ? ls->rtt : 0},
+		{F_LINKAGE,	longclockto_ms(sub_longclock(time_longclock(), lnk->lastupdate))},
+		{F_LINKOVFL,	hb_sockbuf_overflow(lnk->name)},
+	};
+	char buf[32];
+	unsigned j;
+
+	for (j = 0; j < DIMOF(fields); ++j) {
+		snprintf(buf, sizeof(buf), "%lu", fields[j].value);
+		if (ha_msg_mod(resp, fields[j].name, buf) != HA_OK) {
+			return HA_FAIL;
+		}
+	}
+	return HA_OK;
+}
+
 static int
 api_ifstatus(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client, const char **failreason)
 {
@@ -715,6 +1122,11 @@ api_ifstatus(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *clien
 		cl_log(LOG_ERR, "name: %s, value: %s (if=%s)", F_STATUS, iface->status, ciface);
 		return I_API_IGN;
 	}
+	hb_fold_stale_link_stats(node, iface);
+	if (api_add_link_stats(resp, iface) != HA_OK) {
+		cl_log(LOG_ERR, "api_ifstatus: cannot add link statistics (if=%s)", ciface);
+		return I_API_IGN;
+	}
 	return I_API_RET;
 }
 
@@ -818,6 +1230,109 @@ api_num_nodes(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *clie
 
 }
 
+/**********************************************************************
+ * API_GETCLUSTERSTATE: Return every node and link in one message
+ *********************************************************************/
+
+/*
+ * F_CLUSTERSTATE has one line per node, with tab separated fields:
+ *	name status type weight site [ifname ifstatus]...
+ * listing the same interfaces API_IFLIST would.  It's left out if the
+ * client already has the current F_STATEVERSION.
+ */
+static int
+api_clusterstate(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client, const char **failreason)
+{
+	const char *csince;
+	unsigned long since = 0;
+	unsigned long version;
+	char vbuf[32];
+	GString *state;
+	int j;
+	int k;
+	int rc;
+
+	if ((csince = ha_msg_value(msg, F_STATEVERSION)) != NULL && sscanf(csince, "%lu", &since) != 1) {
+		*failreason = "EINVAL";
+		return I_API_BADREQ;
+	}
+	version = hb_snapshot_version();
+	snprintf(vbuf, sizeof(vbuf), "%lu", version);
+	if (ha_msg_add(resp, F_STATEVERSION, vbuf) != HA_OK) {
+		cl_log(LOG_ERR, "api_clusterstate: cannot add field");
+		return I_API_IGN;
+	}
+	if (version != 0 && version == since) {
+		return I_API_RET;
+	}
+
+	state = g_string_sized_new(128 * config->nodecount);
+	for (j = 0; j < config->nodecount; ++j) {
+		const struct node_info *node = &config->nodes[j];
+		const struct link *lnk;
+
+		g_string_append_printf(state, "%s\t%s\t%s\t%d\t%s", node->nodename, api_node_status(node),
+			(node->nodetype == PINGNODE_I ? PINGNODE : NORMALNODE), node->weight, node->site);
+		for (k = 0; k < MAXMEDIA && (lnk = &node->links[k], lnk->name); ++k) {
+			if (node->nodetype == PINGNODE_I ? strcmp(lnk->name, node->nodename) != 0 : lnk->isping) {
+				continue;
+			}
+			g_string_append_printf(state, "\t%s\t%s", lnk->name, lnk->status);
+		}
+		g_string_append_c(state, '\n');
+	}
+	rc = ha_msg_add(resp, F_CLUSTERSTATE, state->str);
+	g_string_free(state, TRUE);
+	if (rc != HA_OK) {
+		cl_log(LOG_ERR, "api_clusterstate: cannot add " F_CLUSTERSTATE " field");
+		*failreason = "ENOMEM";
+		return I_API_BADREQ;
+	}
+	return I_API_RET;
+}
+
+/**********************************************************************
+ * API_GETCHANGES: Return what changed since a given state version
+ *********************************************************************/
+
+/*
+ * F_CHANGES has one line per change, with tab separated fields:
+ *	version kind node item value
+ * If the change log doesn't go back far enough, we say F_RESYNC instead,
+ * and the client needs to start over from API_GETCLUSTERSTATE.  No
+ * changes, no F_CHANGES.
+ */
+static int
+api_changes(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *client, const char **failreason)
+{
+	const char *csince;
+	unsigned long since;
+	char vbuf[32];
+	GString *changes;
+	int rc;
+
+	if ((csince = ha_msg_value(msg, F_STATEVERSION)) == NULL || sscanf(csince, "%lu", &since) != 1) {
+		*failreason = "EINVAL";
+		return I_API_BADREQ;
+	}
+	changes = g_string_new("");
+	if (!hb_snapshot_changes(since, changes)) {
+		rc = ha_msg_add(resp, F_RESYNC, "yes");
+	} else if (changes->len > 0) {
+		rc = ha_msg_add(resp, F_CHANGES, changes->str);
+	} else {
+		rc = HA_OK;
+	}
+	g_string_free(changes, TRUE);
+	snprintf(vbuf, sizeof(vbuf), "%lu", hb_snapshot_version());
+	if (rc != HA_OK || ha_msg_add(resp, F_STATEVERSION, vbuf) != HA_OK) {
+		cl_log(LOG_ERR, "api_changes: cannot add field");
+		*failreason = "ENOMEM";
+		return I_API_BADREQ;
+	}
+	return I_API_RET;
+}
+
 /**********************************************************************
  * API_GET_PARAMETER: Return the value of the given parameter...
  *********************************************************************/
@@ -916,11 +1431,13 @@ api_set_sendqlen(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *c
 
 	if (ret != HA_OK) {
 		cl_log(LOG_ERR, "api_set_sendqlen: getting field F_SENDQLEN failed");
+		*failreason = "EINVAL";
 		return I_API_IGN;
 	}
 
 	if (length <= 0) {
 		cl_log(LOG_ERR, "api_set_sendqlen: invalid length value(%d)", length);
+		*failreason = "EINVAL";
 		return I_API_IGN;
 	}
 
@@ -928,7 +1445,8 @@ api_set_sendqlen(const struct ha_msg *msg, struct ha_msg *resp, client_proc_t *c
 
 	client->chan->ops->set_send_qlen(client->chan, length);
 
-	return I_API_IGN;
+	/* Only send_request() callers wait for an answer */
+	return ha_msg_value(msg, F_REQID) != NULL ? I_API_RET : I_API_IGN;
 
 }
 
@@ -942,6 +1460,29 @@ add_client_gen(client_proc_t *client, struct ha_msg *msg)
 	return ha_msg_mod(msg, F_CLIENT_GENERATION, buf);
 }
 
+/*
+ * Tell a client we're not going to answer its F_REQID-tagged request
+ * otherwise.  It keeps the request pending until it hears back.
+ */
+static void
+api_fail_request(client_proc_t *client, const char *reqid, const char *failreason)
+{
+	struct ha_msg *resp;
+
+	if ((resp = ha_msg_new(4)) == NULL
+	    || ha_msg_add(resp, F_TYPE, T_APIRESP) != HA_OK
+	    || ha_msg_add(resp, F_REQID, reqid) != HA_OK
+	    || ha_msg_add(resp, F_APIRESULT, API_FAILURE) != HA_OK
+	    || (failreason != NULL && ha_msg_add(resp, F_COMMENT, failreason) != HA_OK)) {
+		cl_log(LOG_ERR, "%s: cannot answer request %s", __FUNCTION__, reqid);
+	} else {
+		api_send_client_msg(client, resp);
+	}
+	if (resp != NULL) {
+		ha_msg_del(resp);
+	}
+}
+
 /*
  * Process an API request message from one of our clients
  */
@@ -952,9 +1493,12 @@ api_process_request(client_proc_t *fromclient, struct ha_msg *msg)
 	const char *reqtype;
 	const char *fromid;
 	const char *pid;
+	const char *reqid = NULL;
+	const char *result;
 	client_proc_t *client;
 	struct ha_msg *resp = NULL;
 	const char *failreason = NULL;
+	gboolean answered = FALSE;
 	int x;
 
 	if (msg == NULL || (msgtype = ha_msg_value(msg, F_TYPE)) == NULL) {
@@ -1024,6 +1568,8 @@ api_process_request(client_proc_t *fromclient, struct ha_msg *msg)
 	fromid = ha_msg_value(msg, F_FROMID);
 	pid = ha_msg_value(msg, F_PID);
 	reqtype = ha_msg_value(msg, F_APIREQ);
+	/* Whatever goes wrong from here on, a tagged request gets an answer */
+	reqid = ha_msg_value(msg, F_REQID);
 
 	if ((fromid == NULL && pid == NULL) || reqtype == NULL) {
 		cl_log(LOG_ERR, "api_process_request: no fromid/pid/reqtype in message.");
@@ -1048,9 +1594,15 @@ api_process_request(client_proc_t *fromclient, struct ha_msg *msg)
 		cl_log(LOG_ERR, "api_process_request: cannot add field/3");
 		goto freeandexitresp;
 	}
+	/* ... and which one of them, if they have several outstanding */
+	if (reqid != NULL && ha_msg_add(resp, F_REQID, reqid) != HA_OK) {
+		cl_log(LOG_ERR, "api_process_request: cannot add field/3.1");
+		goto freeandexitresp;
+	}
 
 	if ((client = find_client(fromid, pid)) == NULL) {
 		cl_log(LOG_ERR, "api_process_request: msg from non-client");
+		failreason = "EPERM";
 		goto freeandexitresp;
 	}
 
@@ -1059,6 +1611,7 @@ api_process_request(client_proc_t *fromclient, struct ha_msg *msg)
 		cl_log(LOG_ERR, "Client mismatch! (impersonation?)");
 		cl_log(LOG_INFO, "pids (%ld vs %ld), Client IDs (%s vs %s)", (long)client->pid, (long)fromclient->pid, client->client_id,
 		       fromclient->client_id);
+		failreason = "EPERM";
 		goto freeandexitresp;
 	}
 
@@ -1070,6 +1623,9 @@ api_process_request(client_proc_t *fromclient, struct ha_msg *msg)
 			ret = query_handler_list[x].handler(msg, resp, client, &failreason);
 			switch (ret) {
 			case I_API_IGN:
+				/* API_NODELIST and API_IFLIST send their own, ending with API_OK */
+				result = ha_msg_value(resp, F_APIRESULT);
+				answered = result != NULL && strcmp(result, API_OK) == 0;
 				goto freeandexitresp;
 			case I_API_RET:
 				if (ha_msg_mod(resp, F_APIRESULT, API_OK)
@@ -1078,6 +1634,7 @@ api_process_request(client_proc_t *fromclient, struct ha_msg *msg)
 					goto freeandexitresp;
 				}
 				api_send_client_msg(client, resp);
+				answered = TRUE;
 				goto freeandexitresp;
 
 			case I_API_BADREQ:
@@ -1105,10 +1662,14 @@ bad_req:
 		}
 	}
 	api_send_client_msg(client, resp);
+	answered = TRUE;
 freeandexitresp:
 	ha_msg_del(resp);
 	resp = NULL;
 freeandexit:
+	if (reqid != NULL && !answered) {
+		api_fail_request(fromclient, reqid, failreason);
+	}
 	if (msg != NULL) {
 		ha_msg_del(msg);
 		msg = NULL;
@@ -1138,6 +1699,7 @@ process_registerevent(IPC_Channel *chan, gpointer user_data)
 	client->desired_types = DEFAULTREATMENT;
 	client->signal = 0;
 	client->chan = chan;
+	api_index_client(client, TRUE);
 	client->gsource = G_main_add_IPC_Channel(PRI_CLIENTMSG, chan, FALSE, APIclients_input_dispatch, client, G_remove_client);
 	G_main_setdescription((GSource *)client->gsource, "API client");
 	G_main_setmaxdispatchdelay((GSource *)client->gsource, config->heartbeat_ms);
@@ -1425,6 +1987,7 @@ api_send_client_status(client_proc_t *client, const char *status, const char *re
 static void
 api_send_client_msg(client_proc_t *client, struct ha_msg *msg)
 {
+	HB_TRACE_MSG(api__send, msg, client->client_id);
 	if (msg2ipcchan(msg, client->chan) != HA_OK) {
 		if (!client->removereason) {
 			if (client->chan->failreason[0] == EOS) {
@@ -1435,14 +1998,79 @@ api_send_client_msg(client_proc_t *client, struct ha_msg *msg)
 		}
 	}
 
-	if (CL_KILL(client->pid, client->signal) < 0 && errno == ESRCH) {
-		if (ANYDEBUG) {
-			cl_log(LOG_DEBUG, "api_send_client: client %ld died", (long)client->pid);
-		}
+	api_signal_client(client);
+}
+
+/*
+ *	Queue an already encoded message to a client process.
+ *	The message may be shared with other clients' channels.
+ */
+static void
+api_send_client_ipcmsg(client_proc_t *client, struct ha_msg *msg, IPC_Message *imsg)
+{
+	IPC_Channel *chan = client->chan;
+
+	HB_TRACE_MSG(api__send, msg, client->client_id);
+	hb_ref_ipcmsg(imsg);
+	imsg->msg_ch = chan;
+	if (chan->ops->send(chan, imsg) != IPC_OK) {
+		imsg->msg_done(imsg);
 		if (!client->removereason) {
-			client->removereason = "died";
+			if (chan->failreason[0] == EOS) {
+				client->removereason = "sendfail";
+			} else {
+				client->removereason = chan->failreason;
+			}
+		}
+	}
+	api_signal_client(client);
+}
+
+/*
+ *	Note that a client has new messages.  Clients which asked for a
+ *	signal get at most one per main loop cycle, however many messages
+ *	they got.  Everyone else just waits for their channel to become
+ *	readable - no syscall at all on our side.
+ */
+static void
+api_signal_client(client_proc_t *client)
+{
+	if (client->signal == 0 || client->sigpending) {
+		return;
+	}
+	client->sigpending = TRUE;
+	if (client_signal_trigger == NULL) {
+		client_signal_trigger = G_main_add_TriggerHandler(PRI_READPKT, api_flush_client_signals, NULL, NULL);
+	}
+	G_main_set_trigger(client_signal_trigger);
+}
+
+static gboolean
+api_flush_client_signals(gpointer data)
+{
+	client_proc_t *client;
+	client_proc_t *nextclient;
+
+	for (client = client_list; client != NULL; client = nextclient) {
+		nextclient = client->next;
+
+		if (!client->sigpending) {
+			continue;
+		}
+		client->sigpending = FALSE;
+		if (CL_KILL(client->pid, client->signal) < 0 && errno == ESRCH) {
+			if (ANYDEBUG) {
+				cl_log(LOG_DEBUG, "api_send_client: client %ld died", (long)client->pid);
+			}
+			if (!client->removereason) {
+				client->removereason = "died";
+			}
+			if (!client->isindispatch) {
+				api_remove_client_pid(client->pid, client->removereason);
+			}
 		}
 	}
+	return TRUE;
 }
 
 int
@@ -1516,6 +2144,8 @@ api_remove_client_int(client_proc_t *req, const char *reason)
 	if ((req->desired_types & DEBUGTREATMENTS) != 0) {
 		--debug_client_count;
 	}
+	api_unindex_client(req);
+	api_free_filters(req);
 
 	/* Locate the client data structure in our list */
 
@@ -1540,6 +2170,8 @@ api_remove_client_int(client_proc_t *req, const char *reason)
 
 	if (req == client) {
 
+		hb_snapshot_dirty();
+		hb_snapshot_update();
 		api_send_client_status(req, LEAVESTATUS, reason);
 		/* Zap! */
 		memset(client, 0, sizeof(*client));
@@ -1637,6 +2269,7 @@ api_add_client(client_proc_t *client, struct ha_msg *msg)
 
 	if (fromid != NULL) {
 		strncpy(client->client_id, fromid, sizeof(client->client_id));
+		client->client_id[sizeof(client->client_id)-1] = EOS;
 		if (atoi(client->client_id) == pid) {
 			client->iscasual = 1;
 		} else {
@@ -1647,6 +2280,7 @@ api_add_client(client_proc_t *client, struct ha_msg *msg)
 			 , "%d", pid);
 		client->iscasual = 1;
 	}
+	api_index_client_id(client);
 
 	/* Encourage better realtime behavior by heartbeat */
 	client->chan->ops->set_recv_qlen(client->chan, 0);
@@ -1673,6 +2307,8 @@ api_add_client(client_proc_t *client, struct ha_msg *msg)
 	client->uid = uid;
 	client->gid = gid;
 	if (api_check_client_authorization(client)) {
+		hb_snapshot_dirty();
+		hb_snapshot_update();
 		api_send_client_status(client, JOINSTATUS, API_SIGNON);
 	} else {
 		cl_log(LOG_WARNING, "Client [%s] pid %d failed authorization [%s]",
@@ -1754,6 +2390,13 @@ find_client(const char *fromid, const char *cpid)
 		pid = atoi(cpid);
 	}
 
+	if (cpid == NULL) {
+		if (fromid == NULL || client_by_id == NULL) {
+			return NULL;
+		}
+		return g_hash_table_lookup(client_by_id, fromid);
+	}
+
 	for (client = client_list; client != NULL; client = client->next) {
 		if (cpid && client->pid == pid) {
 			return (client);
@@ -1770,6 +2413,7 @@ APIclients_input_dispatch(IPC_Channel *chan, gpointer user_data)
 {
 	client_proc_t *client = user_data;
 	gboolean ret = TRUE;
+	hbm_time_t start = hb_metrics_now();
 
 	hb_signal_process_pending();
 	if (DEBUGDETAILS) {
@@ -1797,6 +2441,7 @@ APIclients_input_dispatch(IPC_Channel *chan, gpointer user_data)
 	}
 
 getout:
+	hb_metrics_observe(HBM_DISPATCH_API, start);
 	if (DEBUGDETAILS) {
 		cl_log(LOG_DEBUG, "return %d;", ret);
 		cl_log(LOG_DEBUG, "}/*APIclients_input_dispatch*/;");
@@ -1815,6 +2460,7 @@ all_clients_pause(void)
 	}
 
 	cl_log(LOG_INFO, "all clients are now paused");
+	hb_metrics_flowcontrol(TRUE);
 
 	for (client = client_list; client != NULL; client = client->next) {
 		G_main_IPC_Channel_pause(client->gsource);
@@ -1834,6 +2480,7 @@ all_clients_resume(void)
 	}
 
 	cl_log(LOG_INFO, "all clients are now resumed");
+	hb_metrics_flowcontrol(FALSE);
 
 	for (client = client_list; client != NULL; client = client->next) {
 		G_main_IPC_Channel_resume(client->gsource);
@@ -1911,11 +2558,10 @@ ProcessAnAPIRequest(client_proc_t *client)
 	}
 
 getout:
-	/* May have gotten a message from 'client' */
-	if (CL_KILL(client->pid, 0) < 0 && errno == ESRCH) {
-		/* Oops... he's dead */
+	/* Hung up, and nothing left to read from 'client'? */
+	if (!IPC_ISRCONN(client->chan) && !client->removereason) {
 		if (ANYDEBUG) {
-			cl_log(LOG_DEBUG, "Client pid %ld died (input)", (long)client->pid);
+			cl_log(LOG_DEBUG, "Client pid %ld hung up (input)", (long)client->pid);
 		}
 		client->removereason = "died";
 	}
@@ -0,0 +1,109 @@
+/*
+ * hb_dedup.c: remember which packets we've already processed, so copies
+ *		heard on other media can be dealt with cheaply
+ *
+ * With redundant media every packet arrives once per medium, and every
+ * copy used to be parsed and authenticated before should_drop_message()
+ * found out it had already been seen.  For each node we keep a sliding
+ * bitmap of the last HB_DEDUP_WINDOW sequence numbers (of its current
+ * generation) whose packets got through authentication, along with a
+ * fingerprint of each packet.  A later packet with the same generation,
+ * sequence number and fingerprint is a byte for byte copy of one which
+ * authenticated, so authenticating it again can't tell us anything.
+ *
+ * Whether such a copy may skip the full treatment is up to the caller;
+ * the node's seqtrack has the last word on what's been seen.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <string.h>
+#include <glib.h>
+#include <heartbeat.h>
+#include <hb_config.h>
+#include <hb_dedup.h>
+
+struct dedup_node {
+	seqno_t		gen;
+	seqno_t		top;			/* Highest seq recorded */
+	guint64		bits;			/* Bit n: top-n recorded */
+	guint32		fp[HB_DEDUP_WINDOW];	/* Indexed by seq */
+};
+
+static struct dedup_node	dedup[MAXNODE];
+
+static struct dedup_node *
+dedup_lookup(const struct node_info * node)
+{
+	int	j = node - config->nodes;
+
+	return (j < 0 || j >= MAXNODE) ? NULL : &dedup[j];
+}
+
+/* FNV-1a of the whole packet */
+guint32
+hb_dedup_fingerprint(const void * pkt, int len)
+{
+	const unsigned char *	p = pkt;
+	const unsigned char *	end = p + len;
+	guint32			h = 2166136261U;
+
+	for (; p < end; ++p) {
+		h = (h ^ *p) * 16777619U;
+	}
+	return h;
+}
+
+/* This packet from this node has been through the full treatment */
+void
+hb_dedup_record(const struct node_info * node, seqno_t gen, seqno_t seq
+,	guint32 fp)
+{
+	struct dedup_node *	d = dedup_lookup(node);
+
+	if (d == NULL || seq == 0) {
+		return;
+	}
+	if (gen != d->gen || d->top == 0) {
+		d->gen = gen;
+		d->top = seq;
+		d->bits = 0;
+	}
+	if (seq > d->top) {
+		d->bits = (seq - d->top >= HB_DEDUP_WINDOW)
+		?	0 : d->bits << (seq - d->top);
+		d->top = seq;
+	}else if (d->top - seq >= HB_DEDUP_WINDOW) {
+		/* Too old to be worth remembering */
+		return;
+	}
+	d->bits |= (guint64)1 << (d->top - seq);
+	d->fp[seq % HB_DEDUP_WINDOW] = fp;
+}
+
+/* Is this a copy of a packet we've recorded? */
+gboolean
+hb_dedup_check(const struct node_info * node, seqno_t gen, seqno_t seq
+,	guint32 fp)
+{
+	const struct dedup_node *	d = dedup_lookup(node);
+
+	if (d == NULL || d->top == 0 || gen != d->gen
+	||	seq > d->top || d->top - seq >= HB_DEDUP_WINDOW) {
+		return FALSE;
+	}
+	return (d->bits & ((guint64)1 << (d->top - seq))) != 0
+	&&	d->fp[seq % HB_DEDUP_WINDOW] == fp;
+}
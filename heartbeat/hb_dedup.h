@@ -0,0 +1,33 @@
+/*
+ * hb_dedup.h: remember which packets we've already processed, so copies
+ *		heard on other media can be dealt with cheaply
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _HB_DEDUP_H
+#define _HB_DEDUP_H
+
+#include <heartbeat.h>
+
+/* How many of each node's most recent sequence numbers we remember */
+#define	HB_DEDUP_WINDOW	64
+
+guint32	hb_dedup_fingerprint(const void * pkt, int len);
+void	hb_dedup_record(const struct node_info * node, seqno_t gen
+,		seqno_t seq, guint32 fp);
+gboolean hb_dedup_check(const struct node_info * node, seqno_t gen
+,		seqno_t seq, guint32 fp);
+
+#endif /* _HB_DEDUP_H */
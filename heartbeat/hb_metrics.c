@@ -0,0 +1,659 @@
+/*
+ * hb_metrics.c: Prometheus-format metrics for heartbeat internals
+ *
+ * The master control process keeps a small fixed registry of counters
+ * and latency histograms, and serves a text rendering of them (plus a
+ * few gauges sampled at scrape time) on a local unix stream socket.
+ *
+ * The socket is handled entirely from the main loop at PRI_DUMPSTATS
+ * with non-blocking I/O, so a slow or stuck scraper can never hold up
+ * heartbeats.  A scraper may either just connect and read, or speak
+ * HTTP/1.0 to it (e.g. curl --unix-socket <path> http://localhost/).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/ipc.h>
+#include <heartbeat.h>
+#include <hb_api_core.h>
+#include <hb_metrics.h>
+#include <hb_proc.h>
+
+#ifndef MSG_NOSIGNAL
+#	define MSG_NOSIGNAL	0
+#endif
+
+/* How long we wait for an HTTP request line before answering anyway */
+#define	METRICS_REQUEST_MS	250
+/* Scrapes are rare - don't let anyone tie up lots of descriptors */
+#define	METRICS_MAXCONN		4
+
+extern struct hb_media*		sysmedia[MAXMEDIA];
+extern int			nummedia;
+extern struct msg_xmit_hist	msghist;
+extern client_proc_t*		client_list;
+
+unsigned long		hb_metrics_counters[HBM_NCOUNTERS];
+static unsigned long	drops[HBM_NDROPS];
+static unsigned long	media_in[MAXMEDIA];
+static unsigned long	media_out[MAXMEDIA];
+
+static unsigned long	fc_pauses;
+static hbm_time_t	fc_paused_us;	/* total, excluding current pause */
+static hbm_time_t	fc_pause_start;	/* 0 if not paused */
+
+/* Histogram bucket upper bounds, in microseconds */
+static const hbm_time_t	hist_bounds[] = {
+	50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+	100000, 250000, 1000000
+};
+#define	NBUCKETS	DIMOF(hist_bounds)
+
+struct hbm_hist {
+	unsigned long	buckets[NBUCKETS+1];	/* last one is +Inf */
+	unsigned long	count;
+	hbm_time_t	sum;
+};
+static struct hbm_hist	histograms[HBM_NHISTOGRAMS];
+
+static const char *	counter_names[HBM_NCOUNTERS][2] = {
+	{"hb_auth_failures_total"
+	,	"Messages which failed authentication."},
+	{"hb_rexmit_requests_sent_total"
+	,	"Retransmission requests sent to other nodes."},
+	{"hb_rexmit_requests_received_total"
+	,	"Retransmission requests received from other nodes."},
+	{"hb_rexmit_packets_sent_total"
+	,	"Packets retransmitted in reply to requests."},
+	{"hb_rexmit_naks_sent_total"
+	,	"Retransmission requests we could not satisfy."},
+};
+static const char *	drop_reasons[HBM_NDROPS] = {
+	"unreadable", "malformed", "unknown_node", "testloss"
+,	"duplicate", "ignored"
+};
+static const char *	hist_sources[HBM_NHISTOGRAMS] = {
+	"cluster", "api", "fifo"
+};
+
+struct metrics_conn {
+	int		fd;
+	GIOChannel*	ch;
+	guint		watch;
+	guint		timer;
+	GString*	out;
+	gsize		sent;
+};
+
+static int		listen_fd = -1;
+static GIOChannel*	listen_ch = NULL;
+static guint		listen_watch = 0;
+static char *		listen_path = NULL;
+static int		nconn = 0;
+
+void
+hb_metrics_drop(enum hbm_drop reason)
+{
+	++drops[reason];
+}
+
+void
+hb_metrics_media_in(int medianum)
+{
+	if (medianum >= 0 && medianum < MAXMEDIA) {
+		++media_in[medianum];
+	}
+}
+
+void
+hb_metrics_media_out(int medianum)
+{
+	if (medianum >= 0 && medianum < MAXMEDIA) {
+		++media_out[medianum];
+	}
+}
+
+/*
+ * longclock_t is only as fine as times(2), which is far too coarse
+ * for dispatch latencies - so we keep our own microsecond clock.
+ */
+hbm_time_t
+hb_metrics_now(void)
+{
+#if defined(CLOCK_MONOTONIC)
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+		return (hbm_time_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+	}
+#endif
+	{
+		struct timeval	tv;
+		gettimeofday(&tv, NULL);
+		return (hbm_time_t)tv.tv_sec * 1000000ULL + tv.tv_usec;
+	}
+}
+
+void
+hb_metrics_observe(enum hbm_histogram which, hbm_time_t start)
+{
+	struct hbm_hist*	h = &histograms[which];
+	hbm_time_t		now = hb_metrics_now();
+	hbm_time_t		us = now > start ? now - start : 0;
+	unsigned		j;
+
+	for (j=0; j < NBUCKETS && us > hist_bounds[j]; ++j) {
+		/* Nothing */
+	}
+	++h->buckets[j];
+	++h->count;
+	h->sum += us;
+}
+
+void
+hb_metrics_flowcontrol(gboolean paused)
+{
+	if (paused) {
+		if (fc_pause_start == 0) {
+			++fc_pauses;
+			fc_pause_start = hb_metrics_now();
+		}
+	}else if (fc_pause_start != 0) {
+		fc_paused_us += hb_metrics_now() - fc_pause_start;
+		fc_pause_start = 0;
+	}
+}
+
+/*
+ * Rendering
+ */
+
+static void
+metric_header(GString* s, const char * name, const char * type
+,	const char * help)
+{
+	g_string_append_printf(s, "# HELP %s %s\n# TYPE %s %s\n"
+	,	name, help, name, type);
+}
+
+/* Label values may not contain raw backslashes, quotes or newlines */
+static void
+append_label(GString* s, const char * name, const char * value)
+{
+	const char *	cp;
+
+	g_string_append_printf(s, "%s=\"", name);
+	for (cp = value ? value : ""; *cp; ++cp) {
+		switch (*cp) {
+			case '\\':	g_string_append(s, "\\\\");	break;
+			case '"':	g_string_append(s, "\\\"");	break;
+			case '\n':	g_string_append(s, "\\n");	break;
+			default:	g_string_append_c(s, *cp);	break;
+		}
+	}
+	g_string_append_c(s, '"');
+}
+
+static void
+render_media(GString* s, const char * name, const char * help
+,	const unsigned long * values)
+{
+	int	j;
+
+	metric_header(s, name, "counter", help);
+	for (j=0; j < nummedia; ++j) {
+		struct hb_media*	mp = sysmedia[j];
+
+		if (mp == NULL) {
+			continue;
+		}
+		g_string_append_printf(s, "%s{", name);
+		append_label(s, "medium", mp->name);
+		g_string_append_c(s, ',');
+		append_label(s, "type", mp->type);
+		g_string_append_printf(s, "} %lu\n", values[j]);
+	}
+}
+
+static void
+render_histograms(GString* s)
+{
+	static const char *	name = "hb_dispatch_duration_seconds";
+	int			h;
+	unsigned		j;
+
+	metric_header(s, name, "histogram"
+	,	"Time spent in main loop dispatch functions.");
+	for (h=0; h < HBM_NHISTOGRAMS; ++h) {
+		const struct hbm_hist*	hp = &histograms[h];
+		unsigned long		cumulative = 0;
+
+		for (j=0; j <= NBUCKETS; ++j) {
+			cumulative += hp->buckets[j];
+			g_string_append_printf(s, "%s_bucket{source=\"%s\",le="
+			,	name, hist_sources[h]);
+			if (j < NBUCKETS) {
+				g_string_append_printf(s, "\"%g\"} %lu\n"
+				,	hist_bounds[j] / 1000000.0, cumulative);
+			}else{
+				g_string_append_printf(s, "\"+Inf\"} %lu\n"
+				,	cumulative);
+			}
+		}
+		g_string_append_printf(s, "%s_sum{source=\"%s\"} %.6f\n"
+		,	name, hist_sources[h], hp->sum / 1000000.0);
+		g_string_append_printf(s, "%s_count{source=\"%s\"} %lu\n"
+		,	name, hist_sources[h], hp->count);
+	}
+}
+
+static void
+render_clients(GString* s)
+{
+	static const char *	name = "hb_api_client_send_queue_length";
+	client_proc_t*		client;
+	int			nclients = 0;
+
+	metric_header(s, name, "gauge"
+	,	"Messages queued in heartbeat for each API client.");
+	for (client = client_list; client != NULL; client = client->next) {
+		IPC_Channel*	ch = client->chan;
+
+		++nclients;
+		if (ch == NULL || ch->send_queue == NULL) {
+			continue;
+		}
+		g_string_append_printf(s, "%s{", name);
+		append_label(s, "client", client->client_id);
+		g_string_append_printf(s, ",pid=\"%d\"} %lu\n"
+		,	(int)client->pid
+		,	(unsigned long)ch->send_queue->current_qlen);
+	}
+	metric_header(s, "hb_api_clients", "gauge"
+	,	"Currently signed on API clients.");
+	g_string_append_printf(s, "hb_api_clients %d\n", nclients);
+}
+
+/* The read processes count what media_filter throws away */
+static void
+render_filtered(GString* s)
+{
+	unsigned long	rejected[MAXMEDIA];
+	unsigned long	kfiltered[MAXMEDIA];
+	int		j;
+
+	memset(rejected, 0, sizeof(rejected));
+	memset(kfiltered, 0, sizeof(kfiltered));
+	for (j=0; j < procinfo->nprocs && j < MAXPROCS; ++j) {
+		volatile struct process_info*	p = &procinfo->info[j];
+
+		if (p->type == PROC_HBREAD
+		&&	p->medianum >= 0 && p->medianum < MAXMEDIA) {
+			rejected[p->medianum] += p->pktrejected;
+			kfiltered[p->medianum] += p->pktkfiltered;
+		}
+	}
+	render_media(s, "hb_packets_filtered_total"
+	,	"Inbound packets rejected by the read process"
+	" (media_filter), per medium.", rejected);
+	render_media(s, "hb_packets_kernel_filtered_total"
+	,	"Inbound packets dropped by the kernel packet filter"
+	" (media_filter), estimated by sampling, per medium.", kfiltered);
+}
+
+static void
+render_sockbufs(GString* s)
+{
+	static const char *	name = "hb_socket_buffer_bytes";
+	unsigned long		overflow[MAXMEDIA];
+	int			rcvbuf[MAXMEDIA];
+	int			sndbuf[MAXMEDIA];
+	int			j;
+
+	memset(overflow, 0, sizeof(overflow));
+	memset(rcvbuf, 0, sizeof(rcvbuf));
+	memset(sndbuf, 0, sizeof(sndbuf));
+	for (j=0; j < procinfo->nprocs && j < MAXPROCS; ++j) {
+		volatile struct process_info*	p = &procinfo->info[j];
+
+		if (p->medianum < 0 || p->medianum >= MAXMEDIA) {
+			continue;
+		}
+		if (p->type == PROC_HBREAD) {
+			overflow[p->medianum] += p->rxqoverflow;
+			rcvbuf[p->medianum] = p->rcvbuf;
+		}else if (p->type == PROC_HBWRITE) {
+			sndbuf[p->medianum] = p->sndbuf;
+		}
+	}
+	render_media(s, "hb_packets_overflow_total"
+	,	"Inbound packets dropped by the kernel because our receive"
+	" buffer was full, per medium.", overflow);
+
+	metric_header(s, name, "gauge"
+	,	"Socket buffer sizes, as autotuned up to media_bufmax.");
+	for (j=0; j < nummedia; ++j) {
+		struct hb_media*	mp = sysmedia[j];
+
+		if (mp == NULL || (rcvbuf[j] == 0 && sndbuf[j] == 0)) {
+			continue;
+		}
+		g_string_append_printf(s, "%s{", name);
+		append_label(s, "medium", mp->name);
+		g_string_append_printf(s, ",direction=\"receive\"} %d\n"
+		,	rcvbuf[j]);
+		g_string_append_printf(s, "%s{", name);
+		append_label(s, "medium", mp->name);
+		g_string_append_printf(s, ",direction=\"send\"} %d\n"
+		,	sndbuf[j]);
+	}
+}
+
+static void
+render_classified(GString* s)
+{
+	static const char *	names[HB_RC_NVERDICTS] = HB_RC_NAMES;
+	unsigned long		counts[HB_RC_NVERDICTS];
+	int			j;
+	int			k;
+
+	memset(counts, 0, sizeof(counts));
+	for (j=0; j < procinfo->nprocs && j < MAXPROCS; ++j) {
+		volatile struct process_info*	p = &procinfo->info[j];
+
+		if (p->type == PROC_HBREAD) {
+			for (k=0; k < HB_RC_NVERDICTS; ++k) {
+				counts[k] += p->rclass[k];
+			}
+		}
+	}
+	metric_header(s, "hb_packets_classified_total", "counter"
+	,	"Inbound packets sorted by the read processes before"
+	" reaching the master control process, by verdict.");
+	for (k=0; k < HB_RC_NVERDICTS; ++k) {
+		g_string_append_printf(s
+		,	"hb_packets_classified_total{verdict=\"%s\"} %lu\n"
+		,	names[k], counts[k]);
+	}
+}
+
+static GString*
+render_metrics(void)
+{
+	GString*	s = g_string_sized_new(4096);
+	hbm_time_t	paused_us = fc_paused_us;
+	int		j;
+
+	render_media(s, "hb_packets_received_total"
+	,	"Cluster packets received, per medium.", media_in);
+	render_media(s, "hb_packets_sent_total"
+	,	"Cluster packets handed to each medium for sending."
+	,	media_out);
+	render_filtered(s);
+	render_sockbufs(s);
+	render_classified(s);
+
+	metric_header(s, "hb_packets_dropped_total", "counter"
+	,	"Inbound cluster packets not delivered, by reason.");
+	for (j=0; j < HBM_NDROPS; ++j) {
+		g_string_append_printf(s
+		,	"hb_packets_dropped_total{reason=\"%s\"} %lu\n"
+		,	drop_reasons[j], drops[j]);
+	}
+
+	for (j=0; j < HBM_NCOUNTERS; ++j) {
+		metric_header(s, counter_names[j][0], "counter"
+		,	counter_names[j][1]);
+		g_string_append_printf(s, "%s %lu\n"
+		,	counter_names[j][0], hb_metrics_counters[j]);
+	}
+
+	metric_header(s, "hb_xmit_history_depth", "gauge"
+	,	"Packets held in the transmit history.");
+	g_string_append_printf(s, "hb_xmit_history_depth %lu\n"
+	,	msghist.hiseq - msghist.lowseq);
+	metric_header(s, "hb_xmit_history_unacked", "gauge"
+	,	"Packets sent but not yet ACKed by every node.");
+	g_string_append_printf(s, "hb_xmit_history_unacked %lu\n"
+	,	msghist.hiseq - msghist.ackseq);
+	metric_header(s, "hb_xmit_history_size", "gauge"
+	,	"Capacity of the transmit history.");
+	g_string_append_printf(s, "hb_xmit_history_size %d\n", MAXMSGHIST);
+
+	if (fc_pause_start != 0) {
+		paused_us += hb_metrics_now() - fc_pause_start;
+	}
+	metric_header(s, "hb_flowcontrol_paused", "gauge"
+	,	"1 if API clients are currently paused by flow control.");
+	g_string_append_printf(s, "hb_flowcontrol_paused %d\n"
+	,	fc_pause_start != 0);
+	metric_header(s, "hb_flowcontrol_pauses_total", "counter"
+	,	"Times flow control paused API clients.");
+	g_string_append_printf(s, "hb_flowcontrol_pauses_total %lu\n"
+	,	fc_pauses);
+	metric_header(s, "hb_flowcontrol_paused_seconds_total", "counter"
+	,	"Time API clients have spent paused by flow control.");
+	g_string_append_printf(s, "hb_flowcontrol_paused_seconds_total %.6f\n"
+	,	paused_us / 1000000.0);
+
+	render_clients(s);
+	render_histograms(s);
+	return s;
+}
+
+/*
+ * Serving
+ */
+
+static void
+conn_destroy(struct metrics_conn* c)
+{
+	if (c->watch) {
+		g_source_remove(c->watch);
+	}
+	if (c->timer) {
+		g_source_remove(c->timer);
+	}
+	g_io_channel_unref(c->ch);
+	close(c->fd);
+	if (c->out) {
+		g_string_free(c->out, TRUE);
+	}
+	free(c);
+	--nconn;
+}
+
+/* Write as much as the socket will take; TRUE when there is more */
+static gboolean
+conn_write(GIOChannel* ch, GIOCondition cond, gpointer data)
+{
+	struct metrics_conn*	c = data;
+
+	while (c->sent < c->out->len) {
+		ssize_t	rc = send(c->fd, c->out->str + c->sent
+		,	c->out->len - c->sent, MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return TRUE;
+			}
+			break;
+		}
+		c->sent += rc;
+	}
+	c->watch = 0;
+	conn_destroy(c);
+	return FALSE;
+}
+
+static void
+conn_reply(struct metrics_conn* c, gboolean http)
+{
+	GString*	body = render_metrics();
+
+	if (c->timer) {
+		g_source_remove(c->timer);
+		c->timer = 0;
+	}
+	if (c->watch) {
+		g_source_remove(c->watch);
+		c->watch = 0;
+	}
+	if (http) {
+		c->out = g_string_sized_new(body->len + 128);
+		g_string_append_printf(c->out, "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %lu\r\n\r\n", (unsigned long)body->len);
+		g_string_append_len(c->out, body->str, body->len);
+		g_string_free(body, TRUE);
+	}else{
+		c->out = body;
+	}
+	if (conn_write(c->ch, G_IO_OUT, c)) {
+		c->watch = g_io_add_watch_full(c->ch, PRI_DUMPSTATS
+		,	G_IO_OUT|G_IO_ERR|G_IO_HUP, conn_write, c, NULL);
+	}
+}
+
+static gboolean
+conn_request(GIOChannel* ch, GIOCondition cond, gpointer data)
+{
+	struct metrics_conn*	c = data;
+	char			buf[512];
+	ssize_t			rc;
+
+	rc = recv(c->fd, buf, sizeof(buf), 0);
+	if (rc < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return TRUE;
+	}
+	/* We only care about the method - the path is ignored */
+	c->watch = 0;
+	conn_reply(c, rc >= 4 && (strncmp(buf, "GET ", 4) == 0
+	||	strncmp(buf, "HEAD", 4) == 0));
+	return FALSE;
+}
+
+static gboolean
+conn_timeout(gpointer data)
+{
+	struct metrics_conn*	c = data;
+
+	c->timer = 0;
+	conn_reply(c, FALSE);
+	return FALSE;
+}
+
+static gboolean
+metrics_accept(GIOChannel* ch, GIOCondition cond, gpointer data)
+{
+	struct metrics_conn*	c;
+	int			fd;
+
+	if ((fd = accept(listen_fd, NULL, NULL)) < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			cl_perror("metrics: accept failed");
+		}
+		return TRUE;
+	}
+	if (nconn >= METRICS_MAXCONN
+	||	fcntl(fd, F_SETFL, O_NONBLOCK) < 0
+	||	fcntl(fd, F_SETFD, FD_CLOEXEC) < 0
+	||	(c = MALLOCT(struct metrics_conn)) == NULL) {
+		close(fd);
+		return TRUE;
+	}
+	memset(c, 0, sizeof(*c));
+	++nconn;
+	c->fd = fd;
+	c->ch = g_io_channel_unix_new(fd);
+	c->watch = g_io_add_watch_full(c->ch, PRI_DUMPSTATS
+	,	G_IO_IN|G_IO_ERR|G_IO_HUP, conn_request, c, NULL);
+	c->timer = g_timeout_add_full(PRI_DUMPSTATS, METRICS_REQUEST_MS
+	,	conn_timeout, c, NULL);
+	return TRUE;
+}
+
+int
+hb_metrics_init(const char * sockpath)
+{
+	struct sockaddr_un	addr;
+
+	if (listen_fd >= 0) {
+		return HA_OK;
+	}
+	if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+		cl_log(LOG_ERR, "metrics socket path [%s] too long", sockpath);
+		return HA_FAIL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, sockpath, sizeof(addr.sun_path)-1);
+
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		cl_perror("metrics: cannot create socket");
+		return HA_FAIL;
+	}
+	/* Leftover from a previous incarnation? */
+	unlink(sockpath);
+	if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+	||	chmod(sockpath, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP) < 0
+	||	listen(listen_fd, METRICS_MAXCONN) < 0
+	||	fcntl(listen_fd, F_SETFL, O_NONBLOCK) < 0
+	||	fcntl(listen_fd, F_SETFD, FD_CLOEXEC) < 0) {
+		cl_perror("metrics: cannot listen on [%s]", sockpath);
+		close(listen_fd);
+		listen_fd = -1;
+		return HA_FAIL;
+	}
+	listen_path = strdup(sockpath);
+	listen_ch = g_io_channel_unix_new(listen_fd);
+	listen_watch = g_io_add_watch_full(listen_ch, PRI_DUMPSTATS
+	,	G_IO_IN, metrics_accept, NULL, NULL);
+	cl_log(LOG_INFO, "Serving metrics on %s", sockpath);
+	return HA_OK;
+}
+
+void
+hb_metrics_shutdown(void)
+{
+	if (listen_fd < 0) {
+		return;
+	}
+	g_source_remove(listen_watch);
+	g_io_channel_unref(listen_ch);
+	close(listen_fd);
+	listen_fd = -1;
+	if (listen_path) {
+		unlink(listen_path);
+		free(listen_path);
+		listen_path = NULL;
+	}
+}
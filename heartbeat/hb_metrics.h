@@ -0,0 +1,73 @@
+/*
+ * hb_metrics.h: counters, gauges and histograms for heartbeat internals,
+ *		served in Prometheus text format on a local unix socket.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _HB_METRICS_H
+#define _HB_METRICS_H
+
+#include <glib.h>
+
+/*
+ * Everything in here is only touched by the master control process.
+ * Updating a metric is an array increment - no locking, no syscalls,
+ * so it is safe to do on every packet.
+ */
+
+enum hbm_counter {
+	HBM_AUTH_FAILURES,	/* isauthentic() rejected a message */
+	HBM_REXMIT_REQ_SENT,	/* T_REXMIT requests we sent */
+	HBM_REXMIT_REQ_RCVD,	/* T_REXMIT requests addressed to us */
+	HBM_REXMIT_SENT,	/* packets we retransmitted */
+	HBM_REXMIT_NAKS,	/* T_NAKREXMIT we had to send */
+	HBM_NCOUNTERS
+};
+
+/* Why an inbound cluster packet was not delivered */
+enum hbm_drop {
+	HBM_DROP_UNREADABLE,	/* would not parse or authenticate */
+	HBM_DROP_MALFORMED,	/* missing or bad from/ts/type/seq */
+	HBM_DROP_UNKNOWN_NODE,	/* from a node not in our config */
+	HBM_DROP_TESTLOSS,	/* OnlyForTesting rcvloss */
+	HBM_DROP_DUPLICATE,	/* already heard on another link */
+	HBM_DROP_IGNORED,	/* stale, replayed, or not for us */
+	HBM_NDROPS
+};
+
+enum hbm_histogram {
+	HBM_DISPATCH_CLUSTER,	/* read_child_dispatch() */
+	HBM_DISPATCH_API,	/* APIclients_input_dispatch() */
+	HBM_DISPATCH_FIFO,	/* FIFO_child_msg_dispatch() */
+	HBM_NHISTOGRAMS
+};
+
+typedef unsigned long long	hbm_time_t;	/* microseconds */
+
+extern unsigned long	hb_metrics_counters[HBM_NCOUNTERS];
+#define	HBM_INC(c)	(++hb_metrics_counters[(c)])
+
+void		hb_metrics_drop(enum hbm_drop reason);
+void		hb_metrics_media_in(int medianum);
+void		hb_metrics_media_out(int medianum);
+void		hb_metrics_flowcontrol(gboolean paused);
+
+hbm_time_t	hb_metrics_now(void);
+void		hb_metrics_observe(enum hbm_histogram which, hbm_time_t start);
+
+int		hb_metrics_init(const char * sockpath);
+void		hb_metrics_shutdown(void);
+
+#endif /* _HB_METRICS_H */
@@ -0,0 +1,1192 @@
+/*
+ * hb_ping.c: one ICMP echo engine for all ping, ping6 and ping_group media
+ *
+ * Each "ping", "ping6" and "ping_group" line is a medium of its own, and
+ * each medium used to get its own raw socket and its own read and write
+ * processes.  Every one of those read processes got a copy of every echo
+ * reply on the host and had to look through it, so the cost of a ping
+ * node grew with the number of ping nodes.
+ *
+ * Now the ping plugins just hand their hosts to us.  The first of their
+ * media to be opened does the I/O for all of them: one raw socket per
+ * address family (ICMP for ping and ping_group, ICMPv6 for ping6), one
+ * read process and one write process.  The others (mp->iomedium) get no
+ * processes at all.
+ *
+ * The write process makes up each ping node's own signed T_NS_STATUS
+ * message, with its own ICMP sequence number, and leaves it in shared
+ * memory.  The read process, which is waiting for replies anyway, echoes
+ * it off each of the node's hosts, spread evenly over the first half of
+ * the heartbeat interval rather than all at once.  The write process
+ * never waits, so it never holds up the rest of our media.  Each round
+ * of echoes has a sequence counter around it, so the read process never
+ * sends one the write process is halfway through making up.
+ *
+ * The kernel only wakes the read process for echo replies carrying our
+ * ICMP id (a socket filter).  The reply's source address is hashed to
+ * find the host, and its sequence number tells which of the host's last
+ * few echoes it answers.  The message it carries is then checked as it
+ * always was, and the first answer for each ping node and sequence number
+ * goes on to the master control process.
+ *
+ * How many echoes each host has been sent, how many were answered and
+ * how many never were, and the round trip time, are kept in shared
+ * memory, for api_ping_iflist() to report.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <poll.h>
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif /* HAVE_NETINET_IN_H */
+
+#ifdef HAVE_NETINET_IN_SYSTM_H
+#	include <netinet/in_systm.h>
+#endif /* HAVE_NETINET_IN_SYSTM_H */
+
+#ifdef HAVE_NETINET_IP_H
+#	include <netinet/ip.h>
+#endif /* HAVE_NETINET_IP_H */
+
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#ifdef HAVE_LINUX_FILTER_H
+#	include <linux/filter.h>
+#endif
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/uids.h>
+#include <heartbeat.h>
+#include <ha_msg.h>
+#include <hb_sockbuf.h>
+#include <hb_ping.h>
+
+#ifndef MAP_ANONYMOUS
+#	define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+#ifdef linux
+#	define	ICMP_HDR_SZ	sizeof(struct icmphdr)	/* 8 */
+#else
+#	define	ICMP_HDR_SZ	8
+#endif
+#define	ICMP6_HDR_SZ	8
+
+#define	PING_BARRIER()	__sync_synchronize()
+#define	PING_HASHSIZE	256	/* Must be a power of two */
+#define	PING_NSLOT	128	/* How old ping sequence numbers can be
+				   to still count */
+#define	PING_NPROBE	4	/* Echoes per host we can match replies to */
+#define	PING_NOHOST	(-1)
+#define	PING_MAXPKT	1024	/* ICMP header and status message */
+#define	PING_TRIES	8	/* Reads of a round that's being rewritten */
+
+/* One echo request.  sentus == 0: none */
+struct ping_probe {
+	volatile guint16	seq;
+	volatile guint16	acked;
+	volatile unsigned long long sentus;	/* CLOCK_MONOTONIC */
+};
+
+/* Shared: the read process keeps these, the master reports them */
+struct ping_hoststate {
+	struct ping_probe	probe[PING_NPROBE];
+	int			nextprobe;
+	volatile unsigned long	sent;
+	volatile unsigned long	lost;
+	volatile unsigned long	rcvd;
+	volatile unsigned long	rtt;		/* usec */
+};
+
+/* One ping node's echo request.  len == 0: none this round */
+struct ping_echo {
+	char			pkt[PING_MAXPKT];	/* First: aligned */
+	int			len;
+	guint16			seq;
+};
+
+/*
+ * Every ping node's echo for one heartbeat.  The write process bumps seq
+ * before and after making it up: odd means it's being rewritten.
+ */
+struct ping_round {
+	volatile unsigned	seq;
+	unsigned long long	start;		/* CLOCK_MONOTONIC */
+	unsigned long long	gap;		/* Between hosts (usec) */
+	struct ping_echo	echo[MAXMEDIA];	/* By target */
+};
+
+/*
+ * Shared: the write process makes up each round in round[(gen+1)%2],
+ * then bumps gen.  The read process sends the latest one, round[gen%2],
+ * host by host.
+ */
+struct ping_rounds {
+	volatile unsigned	gen;		/* 0: no round yet */
+	struct ping_round	round[2];
+};
+
+struct ping_host {
+	union {
+		struct sockaddr		sa;
+		struct sockaddr_in	in;
+		struct sockaddr_in6	in6;
+	}			addr;
+	socklen_t		addrlen;
+	int			target;
+	int			hnext;		/* Next in its hash bucket */
+};
+
+/* A ping node: the hosts of one ping or ping_group medium */
+struct ping_target {
+	struct hb_media*	mp;
+	const char *		plugin;		/* Goes in F_COMMENT */
+	int			family;		/* Of all its hosts */
+	int			first;		/* Its hosts[] */
+	int			nhosts;
+	int			slot[PING_NSLOT];	/* Read process */
+};
+
+static struct ping_target	targets[MAXMEDIA];
+static int			ntargets = 0;
+static struct ping_host *	hosts = NULL;
+static int			nhosts = 0;
+static int			hostroom = 0;
+static struct ping_hoststate *	hoststate = NULL;	/* NULL: not started */
+static int			buckets[PING_HASHSIZE];
+static struct hb_media*		iomp = NULL;	/* Does the I/O for all */
+static int			sock = -1;		/* ICMP */
+static int			sock6 = -1;		/* ICMPv6 */
+static guint16			ident;
+static guint16			nextseq = 0;	/* Write process */
+static struct ping_rounds *	rounds = NULL;
+static int			wakefd[2] = {-1, -1};	/* Write -> read */
+static unsigned			rdgen = 0;	/* Read process: round */
+static int			rdnext = 0;	/* ... and host we're at */
+
+static int	in_cksum(u_short * buf, size_t nbytes);
+static int	ping_wait(void);
+
+static unsigned long long
+ping_now_us(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000ULL
+	+	ts.tv_nsec / 1000;
+}
+
+static int
+ping_hash(const struct sockaddr * sa)
+{
+	guint32	a;
+
+	if (sa->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *	in6
+		=	(const struct sockaddr_in6 *)sa;
+		guint32				w[4];
+
+		memcpy(w, &in6->sin6_addr, sizeof(w));
+		a = ntohl(w[0] ^ w[1] ^ w[2] ^ w[3]);
+	}else{
+		a = ntohl(((const struct sockaddr_in *)sa)->sin_addr.s_addr);
+	}
+	a ^= a >> 16;
+	a ^= a >> 8;
+	return a & (PING_HASHSIZE-1);
+}
+
+static gboolean
+ping_sameaddr(const struct ping_host * host, const struct sockaddr * sa)
+{
+	if (host->addr.sa.sa_family != sa->sa_family) {
+		return FALSE;
+	}
+	if (sa->sa_family == AF_INET6) {
+		return memcmp(&host->addr.in6.sin6_addr
+		,	&((const struct sockaddr_in6 *)sa)->sin6_addr
+		,	sizeof(struct in6_addr)) == 0;
+	}
+	return host->addr.in.sin_addr.s_addr
+	==	((const struct sockaddr_in *)sa)->sin_addr.s_addr;
+}
+
+static const char *
+ping_ntop(const struct sockaddr * sa)
+{
+	static char	buf[INET6_ADDRSTRLEN];
+	const void *	a;
+
+	if (sa->sa_family == AF_INET6) {
+		a = &((const struct sockaddr_in6 *)sa)->sin6_addr;
+	}else{
+		a = &((const struct sockaddr_in *)sa)->sin_addr;
+	}
+	if (inet_ntop(sa->sa_family, a, buf, sizeof(buf)) == NULL) {
+		return "?";
+	}
+	return buf;
+}
+
+/* The socket for a host's address family */
+static int
+ping_sockfor(const struct ping_host * host)
+{
+	return host->addr.sa.sa_family == AF_INET6 ? sock6 : sock;
+}
+
+static struct ping_target *
+ping_target(const struct hb_media* mp)
+{
+	int	j;
+
+	for (j=0; j < ntargets; ++j) {
+		if (targets[j].mp == mp) {
+			return &targets[j];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * ping6 hosts are IPv6 addresses, as they always were.  Anything else is
+ * an IPv4 address or host name.
+ */
+static int
+ping_resolve(const char * plugin, const char * host, struct ping_host * ph)
+{
+	memset(ph, 0, sizeof(*ph));
+	if (strcmp(plugin, "ping6") == 0) {
+		struct sockaddr_in6 *	in6 = &ph->addr.in6;
+
+#ifdef HAVE_SOCKADDR_IN_SIN_LEN
+		in6->sin6_len = sizeof(struct sockaddr_in6);
+#endif
+		in6->sin6_family = AF_INET6;
+		if (inet_pton(AF_INET6, host, (void *)&in6->sin6_addr) <= 0) {
+			cl_log(LOG_ERR, "%s: not an IPv6 address: %s"
+			,	plugin, host);
+			return HA_FAIL;
+		}
+		ph->addrlen = sizeof(struct sockaddr_in6);
+		return HA_OK;
+	}
+#ifdef HAVE_SOCKADDR_IN_SIN_LEN
+	ph->addr.in.sin_len = sizeof(struct sockaddr_in);
+#endif
+	ph->addr.in.sin_family = AF_INET;
+	if (inet_pton(AF_INET, host, (void *)&ph->addr.in.sin_addr) <= 0) {
+		struct hostent *hep;
+		hep = gethostbyname(host);
+		if (hep == NULL || hep->h_addrtype != AF_INET) {
+			cl_log(LOG_ERR, "unknown host: %s: %s"
+			,	host, strerror(errno));
+			return HA_FAIL;
+		}
+		memcpy(&ph->addr.in.sin_addr, hep->h_addr
+		,	sizeof(ph->addr.in.sin_addr));
+	}
+	ph->addrlen = sizeof(struct sockaddr_in);
+	return HA_OK;
+}
+
+/*
+ * Add a host to ping for medium mp.  All of a medium's hosts have to be
+ * added before the next medium's.
+ */
+int
+hb_ping_add(struct hb_media* mp, const char * plugin, const char * host)
+{
+	struct ping_target *	t = NULL;
+	struct ping_host	ph;
+
+	if (hoststate != NULL) {
+		cl_log(LOG_ERR, "%s: too late to add ping host %s"
+		,	__FUNCTION__, host);
+		return HA_FAIL;
+	}
+	if (ping_resolve(plugin, host, &ph) != HA_OK) {
+		return HA_FAIL;
+	}
+
+	if (ntargets > 0 && targets[ntargets-1].mp == mp) {
+		t = &targets[ntargets-1];
+	}else if (ping_target(mp) != NULL) {
+		cl_log(LOG_ERR, "%s: hosts for %s added out of turn"
+		,	__FUNCTION__, mp->name);
+		return HA_FAIL;
+	}else if (ntargets >= MAXMEDIA) {
+		cl_log(LOG_ERR, "%s: too many ping media", __FUNCTION__);
+		return HA_FAIL;
+	}
+	if (nhosts >= hostroom) {
+		int			newroom = (hostroom ? 2*hostroom : 16);
+		struct ping_host *	newhosts;
+
+		newhosts = realloc(hosts, newroom * sizeof(*hosts));
+		if (newhosts == NULL) {
+			cl_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+			return HA_FAIL;
+		}
+		hosts = newhosts;
+		hostroom = newroom;
+	}
+	if (t == NULL) {
+		t = &targets[ntargets++];
+		memset(t, 0, sizeof(*t));
+		t->mp = mp;
+		t->plugin = plugin;
+		t->family = ph.addr.sa.sa_family;
+		t->first = nhosts;
+	}
+	hosts[nhosts] = ph;
+	hosts[nhosts].target = t - targets;
+	hosts[nhosts].hnext = PING_NOHOST;
+	++nhosts;
+	++t->nhosts;
+	return HA_OK;
+}
+
+/* Freeze the host table, and share the statistics with our children */
+static int
+ping_start(void)
+{
+	void *	map;
+	int	j;
+	int	k;
+
+	if (hoststate != NULL) {
+		return HA_OK;
+	}
+	if (nhosts == 0) {
+		return HA_FAIL;
+	}
+	map = mmap(NULL, sizeof(*rounds), PROT_READ|PROT_WRITE
+	,	MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		cl_perror("%s: cannot map ping rounds", __FUNCTION__);
+		return HA_FAIL;
+	}
+	rounds = map;
+	memset(rounds, 0, sizeof(*rounds));
+	if (pipe(wakefd) < 0) {
+		cl_perror("%s: cannot create ping pipe", __FUNCTION__);
+		munmap(rounds, sizeof(*rounds));
+		rounds = NULL;
+		return HA_FAIL;
+	}
+	for (j=0; j < 2; ++j) {
+		if (fcntl(wakefd[j], F_SETFD, FD_CLOEXEC) < 0
+		||	fcntl(wakefd[j], F_SETFL, O_NONBLOCK) < 0) {
+			cl_perror("%s: cannot set up ping pipe", __FUNCTION__);
+		}
+	}
+	map = mmap(NULL, nhosts * sizeof(*hoststate), PROT_READ|PROT_WRITE
+	,	MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		cl_perror("%s: cannot map ping statistics", __FUNCTION__);
+		close(wakefd[0]);
+		close(wakefd[1]);
+		wakefd[0] = wakefd[1] = -1;
+		munmap(rounds, sizeof(*rounds));
+		rounds = NULL;
+		return HA_FAIL;
+	}
+	hoststate = map;
+	memset(hoststate, 0, nhosts * sizeof(*hoststate));
+
+	for (j=0; j < PING_HASHSIZE; ++j) {
+		buckets[j] = PING_NOHOST;
+	}
+	for (j=0; j < nhosts; ++j) {
+		int	h = ping_hash(&hosts[j].addr.sa);
+
+		hosts[j].hnext = buckets[h];
+		buckets[h] = j;
+	}
+	for (j=0; j < ntargets; ++j) {
+		for (k=0; k < PING_NSLOT; ++k) {
+			targets[j].slot[k] = -1;
+		}
+	}
+	ident = getpid() & 0xFFFF;
+	return HA_OK;
+}
+
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_FILTER)
+/*
+ * Only echo replies with our id need wake the read process.  ICMP
+ * sockets see the IP header first; ICMPv6 sockets don't.
+ */
+static void
+ping_attach_bpf(int sockfd, int family)
+{
+	struct sock_filter	code[] = {
+		/* 0 */	BPF_STMT(BPF_LDX|BPF_B|BPF_MSH, 0),
+		/* 1 */	BPF_STMT(BPF_LD|BPF_B|BPF_IND, 0),
+		/* 2 */	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ICMP_ECHOREPLY, 0, 3),
+		/* 3 */	BPF_STMT(BPF_LD|BPF_H|BPF_IND, 4),
+		/* 4 */	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 0, 1),
+		/* 5 */	BPF_STMT(BPF_RET|BPF_K, 0xffffffffU),
+		/* 6 */	BPF_STMT(BPF_RET|BPF_K, 0),
+	};
+	struct sock_fprog	prog;
+
+	if (family == AF_INET6) {
+		/* No IP header: X stays 0 */
+		code[0].code = BPF_LDX|BPF_W|BPF_IMM;
+		code[0].k = 0;
+		code[2].k = ICMP6_ECHO_REPLY;
+	}
+	code[4].k = ident;
+
+	prog.len = DIMOF(code);
+	prog.filter = code;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER
+	,	&prog, sizeof(prog)) < 0) {
+		/* The read process will sort them out itself */
+		cl_perror("%s: setsockopt(SO_ATTACH_FILTER)", __FUNCTION__);
+	}
+}
+#else
+static void
+ping_attach_bpf(int sockfd, int family)
+{
+}
+#endif
+
+static int
+ping_socket(int family)
+{
+	const char *		pname = (family == AF_INET6 ? "ipv6-icmp" : "icmp");
+	struct protoent *	proto;
+	int			sockfd;
+
+	if ((proto = getprotobyname(pname)) == NULL) {
+		cl_perror("protocol %s is unknown", pname);
+		return -1;
+	}
+	if ((sockfd = socket(family, SOCK_RAW, proto->p_proto)) < 0) {
+		cl_perror("Can't open RAW %s socket.", pname);
+		return -1;
+	}
+	if (fcntl(sockfd, F_SETFD, FD_CLOEXEC)) {
+		cl_perror("Error setting the close-on-exec flag");
+	}
+#ifdef ICMP6_FILTER
+	if (family == AF_INET6) {
+		struct icmp6_filter	filt;
+
+		ICMP6_FILTER_SETBLOCKALL(&filt);
+		ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filt);
+		if (setsockopt(sockfd, IPPROTO_ICMPV6, ICMP6_FILTER
+		,	&filt, sizeof(filt)) < 0) {
+			cl_perror("%s: setsockopt(ICMP6_FILTER)", __FUNCTION__);
+		}
+	}
+#endif
+	ping_attach_bpf(sockfd, family);
+	return sockfd;
+}
+
+/* Do we have any hosts of this address family? */
+static gboolean
+ping_hasfamily(int family)
+{
+	int	j;
+
+	for (j=0; j < ntargets; ++j) {
+		if (targets[j].family == family) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Called (in the master control process) to open each ping medium.
+ * The first one opened gets the socket, the others go through it.
+ */
+int
+hb_ping_open(struct hb_media* mp)
+{
+	if (ping_target(mp) == NULL) {
+		cl_log(LOG_ERR, "%s: no hosts to ping for %s"
+		,	__FUNCTION__, mp->name);
+		return HA_FAIL;
+	}
+	if (ping_start() != HA_OK) {
+		return HA_FAIL;
+	}
+	if (iomp != NULL && iomp != mp) {
+		mp->iomedium = iomp;
+		return HA_OK;
+	}
+	if (sock < 0 && ping_hasfamily(AF_INET)
+	&&	(sock = ping_socket(AF_INET)) < 0) {
+		return HA_FAIL;
+	}
+	if (sock6 < 0 && ping_hasfamily(AF_INET6)
+	&&	(sock6 = ping_socket(AF_INET6)) < 0) {
+		return HA_FAIL;
+	}
+	/* Buffer statistics are per medium: the ICMP socket's, if any */
+	hb_sockbuf_open(mp, sock >= 0 ? sock : sock6, sock >= 0 ? sock : sock6);
+	if (iomp == NULL) {
+		cl_log(LOG_INFO, "ping heartbeat started: %d hosts"
+		" for %d ping nodes.", nhosts, ntargets);
+	}
+	iomp = mp;
+	return HA_OK;
+}
+
+/*
+ * Before we've started, closing a medium forgets its hosts (the plugin
+ * is giving up on it).  After that, only closing the medium doing the
+ * I/O does anything.
+ */
+int
+hb_ping_close(struct hb_media* mp)
+{
+	struct ping_target *	t = ping_target(mp);
+	int			rc = HA_OK;
+
+	if (hoststate == NULL) {
+		if (t != NULL && t == &targets[ntargets-1]) {
+			nhosts = t->first;
+			--ntargets;
+		}
+		return HA_OK;
+	}
+	if (mp == iomp && (sock >= 0 || sock6 >= 0)) {
+		if (sock >= 0 && close(sock) < 0) {
+			rc = HA_FAIL;
+		}
+		if (sock6 >= 0 && close(sock6) < 0) {
+			rc = HA_FAIL;
+		}
+		sock = sock6 = -1;
+		close(wakefd[0]);
+		close(wakefd[1]);
+		wakefd[0] = wakefd[1] = -1;
+	}
+	return rc;
+}
+
+/* Find the echo a reply answers: by source address, then sequence number */
+static int
+ping_match(const struct sockaddr * addr, guint16 seq
+,	struct ping_probe ** prp)
+{
+	int	h;
+	int	k;
+
+	for (h = buckets[ping_hash(addr)]; h != PING_NOHOST
+	;	h = hosts[h].hnext) {
+		if (!ping_sameaddr(&hosts[h], addr)) {
+			continue;
+		}
+		for (k=0; k < PING_NPROBE; ++k) {
+			struct ping_probe *	pr = &hoststate[h].probe[k];
+
+			if (pr->sentus != 0 && pr->seq == seq) {
+				*prp = pr;
+				return h;
+			}
+		}
+	}
+	return PING_NOHOST;
+}
+
+static void
+ping_answered(struct ping_hoststate * hs, struct ping_probe * pr)
+{
+	unsigned long long	sentus = pr->sentus;
+	unsigned long		rtt;
+
+	if (pr->acked || sentus == 0) {
+		return;		/* We heard this one already */
+	}
+	pr->acked = TRUE;
+	rtt = (unsigned long)(ping_now_us() - sentus);
+	if (hs->rcvd == 0) {
+		hs->rtt = rtt;
+	}else{
+		hs->rtt = (7*hs->rtt + rtt)/8;
+	}
+	++hs->rcvd;
+}
+
+/* Is this what we sent this ping node? */
+static gboolean
+ping_verify(const struct ping_target * t, const char * pkt, int len)
+{
+	struct ha_msg *	msg;
+	const char *	comment;
+	const char *	orig;
+	gboolean	ours;
+
+	if ((msg = wirefmt2msg(pkt, len, MSG_NEEDAUTH)) == NULL) {
+		return FALSE;
+	}
+	comment = ha_msg_value(msg, F_COMMENT);
+	orig = ha_msg_value(msg, F_ORIG);
+	ours = comment != NULL && strcmp(comment, t->plugin) == 0
+	&&	orig != NULL && strcmp(orig, t->mp->name) == 0;
+	ha_msg_del(msg);
+	return ours;
+}
+
+/*
+ * Is this an echo reply to us?  If so, where's the message it carries?
+ * ICMP packets come with their IP header, ICMPv6 ones don't.
+ */
+static gboolean
+ping_parse(int family, const char * pkt, int numbytes
+,	const struct sockaddr * from, guint16 * seqp, int * offp)
+{
+	int	hlen = 0;
+	guint8	type;
+	guint16	id;
+	guint16	seq;
+
+	if (family == AF_INET) {
+		hlen = ((const struct ip *)pkt)->ip_hl * 4;
+	}
+	if (numbytes < hlen + ICMP_HDR_SZ) {
+		cl_log(LOG_WARNING, "ping packet too short (%d bytes) from %s"
+		,	numbytes, ping_ntop(from));
+		return FALSE;
+	}
+	/* Echo requests and replies look the same in ICMP and ICMPv6 */
+	type = (guint8)pkt[hlen];
+	memcpy(&id, pkt + hlen + 4, sizeof(id));
+	memcpy(&seq, pkt + hlen + 6, sizeof(seq));
+	if (type != (family == AF_INET6 ? ICMP6_ECHO_REPLY : ICMP_ECHOREPLY)
+	||	id != htons(ident)) {
+		return FALSE;
+	}
+	*seqp = ntohs(seq);
+	*offp = hlen + ICMP_HDR_SZ;
+	return TRUE;
+}
+
+/*
+ * Receive a heartbeat ping reply packet, for any ping node.
+ */
+static char ping_pkt[MAXLINE];
+void *
+hb_ping_read(struct hb_media* mp, int * lenp)
+{
+	union {
+		char		cbuf[MAXLINE+ICMP_HDR_SZ];
+		struct ip	ip;
+	}buf;
+	union {
+		struct sockaddr		sa;
+		struct sockaddr_in	in;
+		struct sockaddr_in6	in6;
+	}			their_addr;
+	socklen_t		addr_len;
+	const char *		msgstart;
+	struct ping_target *	t;
+	struct ping_probe *	pr = NULL;
+	int			sockfd;
+	int			numbytes;
+	int			off;
+	int			pktlen;
+	int			h;
+	guint16			seq;
+	size_t			slotn;
+
+	*lenp = 0;
+	if (mp != iomp || (sock < 0 && sock6 < 0)) {
+		errno = EBADF;
+		return NULL;
+	}
+	for (;;) {	/* Not every echo reply is one of ours */
+		if ((sockfd = ping_wait()) < 0) {
+			return NULL;
+		}
+		addr_len = sizeof(their_addr);
+		memset(&their_addr, 0, sizeof(their_addr));
+		numbytes = hb_sockbuf_recvfrom(mp, sockfd, buf.cbuf
+		,	sizeof(buf.cbuf)-1, 0, &their_addr.sa, &addr_len);
+		if (numbytes < 0) {
+			if (errno != EINTR) {
+				cl_perror("Error receiving from ping socket");
+			}
+			return NULL;
+		}
+		/* Avoid potential buffer overruns */
+		buf.cbuf[numbytes] = EOS;
+
+		if (!ping_parse(sockfd == sock6 ? AF_INET6 : AF_INET
+		,	buf.cbuf, numbytes, &their_addr.sa, &seq, &off)) {
+			continue;
+		}
+		if ((h = ping_match(&their_addr.sa, seq, &pr))
+		==	PING_NOHOST) {
+			continue;	/* Not to us, or too late */
+		}
+		t = &targets[hosts[h].target];
+
+		if (DEBUGPKT) {
+			cl_log(LOG_DEBUG, "got %d byte packet from %s"
+			,	numbytes, ping_ntop(&their_addr.sa));
+		}
+		msgstart = buf.cbuf + off;
+		pktlen = numbytes - off;
+		if (DEBUGPKTCONT) {
+			cl_log(LOG_DEBUG, "%s", msgstart);
+		}
+		if (!ping_verify(t, msgstart, pktlen)) {
+			continue;
+		}
+		ping_answered(&hoststate[h], pr);
+
+		/* One answer per ping node and echo is plenty */
+		slotn = seq % PING_NSLOT;
+		if (t->slot[slotn] == seq) {
+			continue;
+		}
+		t->slot[slotn] = seq;
+
+		memcpy(ping_pkt, msgstart, pktlen);
+		ping_pkt[pktlen] = EOS;
+		*lenp = pktlen + 1;
+		return ping_pkt;
+	}
+}
+
+static int
+ping_sendto(int h, const struct ping_echo * e)
+{
+	struct ping_host *	host = &hosts[h];
+	struct ping_hoststate *	hs = &hoststate[h];
+	struct ping_probe *	pr = &hs->probe[hs->nextprobe];
+	static gboolean		needroot = FALSE;
+	ssize_t			rc;
+	int			saveerrno;
+
+	/* The echo this one replaces was never answered */
+	if (pr->sentus != 0 && !pr->acked) {
+		++hs->lost;
+	}
+	pr->sentus = 0;
+	PING_BARRIER();
+	pr->seq = e->seq;
+	pr->acked = FALSE;
+	PING_BARRIER();
+	pr->sentus = ping_now_us();
+	hs->nextprobe = (hs->nextprobe + 1) % PING_NPROBE;
+
+retry:
+	if (needroot) {
+		return_to_orig_privs();
+	}
+	rc = sendto(ping_sockfor(host), e->pkt, e->len, MSG_DONTWAIT
+	,	&host->addr.sa, host->addrlen);
+	saveerrno = errno;
+	if (needroot) {
+		return_to_dropped_privs();
+	}
+	if (rc != (ssize_t)e->len) {
+		if (saveerrno == EPERM && !needroot) {
+			needroot = TRUE;
+			goto retry;
+		}
+		pr->sentus = 0;
+		if (!iomp->suppresserrs) {
+			errno = saveerrno;
+			cl_perror("Error sending ping to %s"
+			,	ping_ntop(&host->addr.sa));
+			cl_log(LOG_INFO, "euid=%lu egid=%lu"
+			,	(unsigned long) geteuid()
+			,	(unsigned long) getegid());
+		}
+		errno = saveerrno;
+		return HA_FAIL;
+	}
+	++hs->sent;
+
+	if (DEBUGPKT) {
+		cl_log(LOG_DEBUG, "sent %d bytes to %s"
+		,	(int)rc, ping_ntop(&host->addr.sa));
+	}
+	return HA_OK;
+}
+
+/*
+ * The read process: copy out the echo for host rdnext in the latest
+ * round, and when it's due.  If the write process is making up that
+ * round (its seq is odd, or changes under us), try again.  Returns 1 if
+ * there's an echo, 0 if there isn't (or it's nothing left of this round)
+ * or -1 if we couldn't get a clean copy.
+ */
+static int
+ping_next_echo(struct ping_echo * e, unsigned long long * when)
+{
+	const struct ping_round *	r;
+	unsigned			gen;
+	unsigned			before;
+	int				tries;
+
+	for (tries=0; tries < PING_TRIES; ++tries) {
+		if ((gen = rounds->gen) == 0) {
+			return 0;
+		}
+		if (gen != rdgen) {
+			/* Anything left of the last round is too late now */
+			rdgen = gen;
+			rdnext = 0;
+		}
+		if (rdnext >= nhosts) {
+			return 0;
+		}
+		r = &rounds->round[gen % 2];
+		before = r->seq;
+		if (before & 1) {
+			continue;
+		}
+		PING_BARRIER();
+		*when = r->start + r->gap * rdnext;
+		memcpy(e, &r->echo[hosts[rdnext].target], sizeof(*e));
+		PING_BARRIER();
+		if (r->seq == before && rounds->gen == gen
+		&&	e->len >= 0 && e->len <= PING_MAXPKT) {
+			return 1;
+		}
+	}
+	return -1;
+}
+
+/*
+ * The read process: send whatever echoes of the latest round are due.
+ * Returns how many ms until the next one is, or -1 if there are none.
+ */
+static int
+ping_send_due(void)
+{
+	struct ping_echo	e;
+	unsigned long long	when;
+	unsigned long long	now = ping_now_us();
+	int			rc;
+
+	while ((rc = ping_next_echo(&e, &when)) > 0) {
+		if (when > now) {
+			return (int)((when - now + 999) / 1000);
+		}
+		if (e.len > 0) {
+			(void)ping_sendto(rdnext, &e);
+		}
+		++rdnext;
+	}
+	/* Still being rewritten: look again shortly */
+	return rc < 0 ? 1 : -1;
+}
+
+/*
+ * The read process: send echoes as they come due until there's a reply
+ * to read.  Returns the socket it's on, or -1 (errno set) if interrupted.
+ */
+static int
+ping_wait(void)
+{
+	static int	last = -1;	/* Take turns if both are ready */
+	struct pollfd	pfd[3];
+	char		junk[64];
+	int		timeout;
+	int		j;
+
+	pfd[0].fd = wakefd[0];
+	pfd[1].fd = sock;
+	pfd[2].fd = sock6;
+	for (;;) {
+		timeout = ping_send_due();
+		for (j=0; j < 3; ++j) {
+			/* poll() ignores negative fds */
+			pfd[j].events = POLLIN;
+			pfd[j].revents = 0;
+		}
+		if (poll(pfd, 3, timeout) < 0) {
+			if (errno != EINTR) {
+				cl_perror("Error waiting on ping socket");
+			}
+			return -1;
+		}
+		if (pfd[0].revents) {
+			/* A new round: ping_send_due() will see it */
+			while (read(wakefd[0], junk, sizeof(junk)) > 0) {
+				;
+			}
+		}
+		if (pfd[1].revents && (last != sock || !pfd[2].revents)) {
+			return (last = sock);
+		}
+		if (pfd[2].revents) {
+			return (last = sock6);
+		}
+	}
+}
+
+/*
+ * The write process: make up this ping node's status message and the
+ * echo request to carry it.
+ */
+static int
+ping_make_echo(struct ping_target * t, const char * ts, struct ping_echo * e)
+{
+	struct ha_msg *	nmsg;
+	char *		pkt;
+	size_t		size;
+	struct icmp *	icp;
+
+	e->len = 0;
+
+	/*
+	 * We populate the following fields in the packet we create:
+	 *
+	 * F_TYPE:	T_NS_STATUS
+	 * F_STATUS:	ping
+	 * F_COMMENT:	the plugin's name (ping, ping6 or ping_group)
+	 * F_ORIG:	the ping node's name
+	 * F_TIME:	local timestamp (from the status message)
+	 * F_AUTH:	added by add_msg_auth()
+	 */
+	if ((nmsg = ha_msg_new(5)) == NULL) {
+		cl_log(LOG_ERR, "%s: cannot create new message", __FUNCTION__);
+		return HA_FAIL;
+	}
+	if (ha_msg_add(nmsg, F_TYPE, T_NS_STATUS) != HA_OK
+	||	ha_msg_add(nmsg, F_STATUS, PINGSTATUS) != HA_OK
+	||	ha_msg_add(nmsg, F_COMMENT, t->plugin) != HA_OK
+	||	ha_msg_add(nmsg, F_ORIG, t->mp->name) != HA_OK
+	||	ha_msg_add(nmsg, F_TIME, ts) != HA_OK) {
+		ha_msg_del(nmsg); nmsg = NULL;
+		cl_log(LOG_ERR, "%s: cannot add fields to message"
+		,	__FUNCTION__);
+		return HA_FAIL;
+	}
+	if (add_msg_auth(nmsg) != HA_OK) {
+		ha_msg_del(nmsg); nmsg = NULL;
+		cl_log(LOG_ERR, "%s: cannot add auth field to message"
+		,	__FUNCTION__);
+		return HA_FAIL;
+	}
+	pkt = msg2wirefmt(nmsg, &size);
+	ha_msg_del(nmsg); nmsg = NULL;
+	if (pkt == NULL) {
+		cl_log(LOG_ERR, "%s: cannot convert message to string"
+		,	__FUNCTION__);
+		return HA_FAIL;
+	}
+	if (size + ICMP_HDR_SZ > sizeof(e->pkt)) {
+		cl_log(LOG_ERR, "%s: %d byte ping packet for %s too big"
+		,	__FUNCTION__, (int)size, t->mp->name);
+		free(pkt);
+		return HA_FAIL;
+	}
+
+	e->seq = nextseq++;
+	if (t->family == AF_INET6) {
+		struct icmp6_hdr *	icp6 = (struct icmp6_hdr *)e->pkt;
+
+		/* The kernel fills in ICMPv6 checksums */
+		icp6->icmp6_type = ICMP6_ECHO_REQUEST;
+		icp6->icmp6_code = 0;
+		icp6->icmp6_cksum = 0;
+		icp6->icmp6_seq = htons(e->seq);
+		icp6->icmp6_id = htons(ident);
+		memcpy(e->pkt + ICMP6_HDR_SZ, pkt, size);
+	}else{
+		icp = (struct icmp *)e->pkt;
+		icp->icmp_type = ICMP_ECHO;
+		icp->icmp_code = 0;
+		icp->icmp_cksum = 0;
+		icp->icmp_seq = htons(e->seq);
+		icp->icmp_id = htons(ident);
+		memcpy(icp->icmp_data, pkt, size);
+
+		/* Compute the ICMP checksum */
+		icp->icmp_cksum = in_cksum((u_short *)icp, size + ICMP_HDR_SZ);
+	}
+	free(pkt); pkt = NULL;
+
+	if (DEBUGPKTCONT) {
+		cl_log(LOG_DEBUG, "ping pkt: %s", e->pkt + ICMP_HDR_SZ);
+	}
+	e->len = size + ICMP_HDR_SZ;
+	return HA_OK;
+}
+
+/*
+ * Send a heartbeat packet to every ping node
+ *
+ * The peculiar thing here is that we don't send the packet we're given at all
+ *
+ * Instead, we send out the packets we want to hear back from them, just
+ * as though we were they ;-)  That's what comes of having such dumb
+ * devices as "members" of our cluster...
+ *
+ * We only make them up; the read process sends them (see ping_send_due).
+ *
+ * We ignore packets we're given to write that aren't "status" packets.
+ */
+int
+hb_ping_write(struct hb_media* mp, void * p, int len)
+{
+	struct ha_msg *		msg;
+	struct ping_round *	r;
+	const char *		type;
+	const char *		ts;
+	int			rc = HA_OK;
+	int			j;
+
+	if (mp != iomp || (sock < 0 && sock6 < 0)) {
+		errno = EBADF;
+		return HA_FAIL;
+	}
+	if ((msg = wirefmt2msg(p, len, MSG_NEEDAUTH)) == NULL) {
+		cl_log(LOG_ERR, "%s: cannot convert wirefmt to msg"
+		,	__FUNCTION__);
+		return HA_FAIL;
+	}
+	type = ha_msg_value(msg, F_TYPE);
+	if (type == NULL || strcmp(type, T_STATUS) != 0
+	||	(ts = ha_msg_value(msg, F_TIME)) == NULL) {
+		ha_msg_del(msg);
+		return HA_OK;
+	}
+
+	/* Spread over the first half of the interval */
+	r = &rounds->round[(rounds->gen + 1) % 2];
+	++r->seq;
+	PING_BARRIER();
+	r->start = ping_now_us();
+	r->gap = 0;
+	if (nhosts > 1) {
+		r->gap = (unsigned long long)config->heartbeat_ms * 500 / nhosts;
+	}
+	for (j=0; j < ntargets; ++j) {
+		if (ping_make_echo(&targets[j], ts, &r->echo[j]) != HA_OK) {
+			rc = HA_FAIL;
+		}
+	}
+	ha_msg_del(msg);
+	PING_BARRIER();
+	++r->seq;
+	++rounds->gen;
+
+	/* Wake up the read process; if the pipe's full, it's awake */
+	if (write(wakefd[1], "", 1) < 0 && errno != EAGAIN) {
+		cl_perror("%s: cannot wake the ping read process"
+		,	__FUNCTION__);
+	}
+	return rc;
+}
+
+/*
+ * The master control process: echo statistics for one ping medium
+ * (which is named after its ping node), summed over its hosts.
+ */
+gboolean
+hb_ping_stats(const char * medianame, struct hb_ping_stats * st)
+{
+	const struct ping_target *	t = NULL;
+	unsigned long long		rttsum = 0;
+	int				nrtt = 0;
+	int				j;
+
+	memset(st, 0, sizeof(*st));
+	if (hoststate == NULL) {
+		return FALSE;
+	}
+	for (j=0; j < ntargets; ++j) {
+		if (strcmp(targets[j].mp->name, medianame) == 0) {
+			t = &targets[j];
+			break;
+		}
+	}
+	if (t == NULL) {
+		return FALSE;
+	}
+	st->nhosts = t->nhosts;
+	for (j = t->first; j < t->first + t->nhosts; ++j) {
+		const struct ping_hoststate *	hs = &hoststate[j];
+
+		st->sent += hs->sent;
+		st->rcvd += hs->rcvd;
+		st->lost += hs->lost;
+		if (hs->rcvd != 0) {
+			rttsum += hs->rtt;
+			++nrtt;
+		}
+	}
+	st->rtt = (nrtt ? (unsigned long)(rttsum / nrtt) : 0);
+	return TRUE;
+}
+
+/*
+ * in_cksum --
+ *	Checksum routine for Internet Protocol family headers (C Version)
+ *	This function taken from Mike Muuss' ping program.
+ */
+static int
+in_cksum (u_short *addr, size_t len)
+{
+	size_t		nleft = len;
+	u_short *	w = addr;
+	int		sum = 0;
+	u_short		answer = 0;
+
+	/*
+	 * The IP checksum algorithm is simple: using a 32 bit accumulator (sum)
+	 * add sequential 16 bit words to it, and at the end, folding back all
+	 * the carry bits from the top 16 bits into the lower 16 bits.
+	 */
+	while (nleft > 1) {
+		sum += *w++;
+		nleft -= 2;
+	}
+
+	/* Mop up an odd byte, if necessary */
+	if (nleft == 1) {
+		sum += *(u_char*)w;
+	}
+
+	/* Add back carry bits from top 16 bits to low 16 bits */
+
+	sum = (sum >> 16) + (sum & 0xffff);	/* add hi 16 to low 16 */
+	sum += (sum >> 16);			/* add carry */
+	answer = ~sum;				/* truncate to 16 bits */
+
+	return answer;
+}
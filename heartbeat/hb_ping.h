@@ -0,0 +1,43 @@
+/*
+ * hb_ping.h: one ICMP echo engine for all ping, ping6 and ping_group media
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _HB_PING_H
+#define _HB_PING_H
+
+#include <heartbeat.h>
+
+/* What we know about the echoes sent to one ping node */
+struct hb_ping_stats {
+	int		nhosts;		/* Addresses we ping for it */
+	unsigned long	sent;		/* Echo requests */
+	unsigned long	rcvd;		/* ... answered */
+	unsigned long	lost;		/* ... never answered */
+	unsigned long	rtt;		/* Smoothed round trip (usec), 0: none */
+};
+
+/* Called by the ping plugins (via CommImports) */
+int	hb_ping_add(struct hb_media* mp, const char * plugin
+,		const char * host);
+int	hb_ping_open(struct hb_media* mp);
+int	hb_ping_close(struct hb_media* mp);
+void *	hb_ping_read(struct hb_media* mp, int * lenp);
+int	hb_ping_write(struct hb_media* mp, void * msg, int len);
+
+/* Master control process */
+gboolean hb_ping_stats(const char * medianame, struct hb_ping_stats * st);
+
+#endif /* _HB_PING_H */
@@ -0,0 +1,223 @@
+/*
+ * hb_pktfilter.c: kernel packet filtering for UDP heartbeat media
+ *
+ * With "media_filter on", every packet we send over a medium whose
+ * plugin asks for it (bcast, mcast, ucast) starts with a small header:
+ * a magic number and a hash of our cluster name.  When the plugin opens
+ * the medium it hands us its receive socket, and we attach a classic
+ * BPF program to it which only passes packets with our header followed
+ * by the start of a heartbeat message.  Packets from other clusters on
+ * the same port or multicast group, and garbage, are then dropped in
+ * the kernel without waking up our read process, let alone the master
+ * control process.
+ *
+ * A classic BPF program has nowhere to count what it drops, so it lets
+ * a random 1 in HB_PKTF_SAMPLE of them through, cut down to one byte,
+ * and the read process counts those for it.  Where we can't attach the
+ * filter, the read process makes the same checks itself.
+ *
+ * All nodes must agree on media_filter, as they must on msgfmt.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef HAVE_LINUX_FILTER_H
+#	include <linux/filter.h>
+#endif
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/cl_misc.h>
+#include <heartbeat.h>
+#include <ha_msg.h>
+#include <hb_api.h>
+#include <hb_config.h>
+#include <hb_pktfilter.h>
+
+/*
+ * A UDP socket filter sees the UDP header before our payload, and can't
+ * trim a packet to less than that.
+ */
+#define	UDPHDRLEN	8
+
+static char	ourhdr[HB_PKTF_HDRLEN];
+static int	ourhdr_ready = FALSE;
+static char *	wbuf = NULL;		/* Write child only */
+static int	wbufsize = 0;
+
+/* The first four bytes of s, as BPF_LD|BPF_W loads them */
+static guint32
+pktf_word(const char * s)
+{
+	return ((guint32)(unsigned char)s[0] << 24)
+	|	((guint32)(unsigned char)s[1] << 16)
+	|	((guint32)(unsigned char)s[2] << 8)
+	|	(guint32)(unsigned char)s[3];
+}
+
+/* FNV-1a of the cluster name */
+static guint32
+pktf_cluster_hash(void)
+{
+	const char *	p;
+	guint32		h = 2166136261U;
+
+	for (p = config->cluster; *p != EOS; ++p) {
+		h = (h ^ (unsigned char)*p) * 16777619U;
+	}
+	return h;
+}
+
+static const char *
+pktf_header(void)
+{
+	guint32		w;
+
+	if (!ourhdr_ready) {
+		w = htonl(HB_PKTF_MAGIC);
+		memcpy(ourhdr, &w, sizeof(w));
+		w = htonl(pktf_cluster_hash());
+		memcpy(ourhdr+sizeof(w), &w, sizeof(w));
+		ourhdr_ready = TRUE;
+	}
+	return ourhdr;
+}
+
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_FILTER)
+static int
+pktf_attach_bpf(int sockfd)
+{
+	struct sock_filter	code[] = {
+		/* 0 */	BPF_STMT(BPF_LD|BPF_W|BPF_ABS, UDPHDRLEN),
+		/* 1 */	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 0, 5),
+		/* 2 */	BPF_STMT(BPF_LD|BPF_W|BPF_ABS, UDPHDRLEN+4),
+		/* 3 */	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 0, 3),
+		/* 4 */	BPF_STMT(BPF_LD|BPF_W|BPF_ABS
+			,	UDPHDRLEN+HB_PKTF_HDRLEN),
+		/* 5 */	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 6, 0),
+		/* 6 */	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 5, 0),
+		/* Not ours: pass 1 in HB_PKTF_SAMPLE, cut to one byte */
+#ifdef SKF_AD_RANDOM
+		/* 7 */	BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF+SKF_AD_RANDOM),
+#else
+		/* 7 */	BPF_JUMP(BPF_JMP|BPF_JA, 3, 0, 0),
+#endif
+		/* 8 */	BPF_STMT(BPF_ALU|BPF_AND|BPF_K, HB_PKTF_SAMPLE-1),
+		/* 9 */	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 0, 1),
+		/* 10 */	BPF_STMT(BPF_RET|BPF_K, UDPHDRLEN+1),
+		/* 11 */	BPF_STMT(BPF_RET|BPF_K, 0),
+		/* Ours: all of it */
+		/* 12 */	BPF_STMT(BPF_RET|BPF_K, 0xffffffffU),
+	};
+	struct sock_fprog	prog;
+
+	code[1].k = HB_PKTF_MAGIC;
+	code[3].k = pktf_cluster_hash();
+	code[5].k = pktf_word(MSG_START);
+	code[6].k = pktf_word(MSG_START_NETSTRING);
+
+	prog.len = DIMOF(code);
+	prog.filter = code;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER
+	,	&prog, sizeof(prog)) < 0) {
+		cl_perror("%s: setsockopt(SO_ATTACH_FILTER)", __FUNCTION__);
+		return HA_FAIL;
+	}
+	return HA_OK;
+}
+#else
+static int
+pktf_attach_bpf(int sockfd)
+{
+	return HA_FAIL;
+}
+#endif
+
+/*
+ * Called by a plugin's open function with the socket it reads from.
+ * Does nothing unless media_filter is on.
+ */
+void
+hb_pktfilter_attach(struct hb_media* mp, int sockfd)
+{
+	const char *	value = GetParameterValue(KEY_MEDIAFILTER);
+	int		on = FALSE;
+
+	if (value == NULL || cl_str_to_boolean(value, &on) != HA_OK || !on) {
+		return;
+	}
+	mp->pktframed = TRUE;
+	mp->pktfiltered = (pktf_attach_bpf(sockfd) == HA_OK);
+	if (mp->pktfiltered) {
+		cl_log(LOG_INFO, "%s %s: kernel packet filter attached"
+		,	mp->type, mp->name);
+	}else{
+		cl_log(LOG_WARNING, "%s %s: no kernel packet filter"
+		" - filtering in the read process instead"
+		,	mp->type, mp->name);
+	}
+}
+
+/*
+ * Is this packet (as the plugin's read function returned it, with a
+ * trailing EOS) one of ours?
+ */
+enum hb_pktf_verdict
+hb_pktfilter_check(const struct hb_media* mp, const void * pkt, int len)
+{
+	const char *	p = pkt;
+
+	--len;	/* The EOS */
+	if (len == 1 && mp->pktfiltered) {
+		/* Nothing of ours is that short: the filter cut it */
+		return HB_PKTF_SAMPLED;
+	}
+	if (len < HB_PKTF_HDRLEN + (int)sizeof(MSG_START)-1
+	||	memcmp(p, pktf_header(), HB_PKTF_HDRLEN) != 0) {
+		return HB_PKTF_REJECT;
+	}
+	p += HB_PKTF_HDRLEN;
+	if (strncmp(p, MSG_START, sizeof(MSG_START)-1) != 0
+	&&	strncmp(p, MSG_START_NETSTRING
+	,		sizeof(MSG_START_NETSTRING)-1) != 0) {
+		return HB_PKTF_REJECT;
+	}
+	return HB_PKTF_PASS;
+}
+
+/* Write a message to a filtered medium, with our header on the front */
+int
+hb_pktfilter_write(struct hb_media* mp, const void * msg, int len)
+{
+	if (len + HB_PKTF_HDRLEN > wbufsize) {
+		char *	newbuf = realloc(wbuf, len + HB_PKTF_HDRLEN);
+
+		if (newbuf == NULL) {
+			errno = ENOMEM;
+			return HA_FAIL;
+		}
+		wbuf = newbuf;
+		wbufsize = len + HB_PKTF_HDRLEN;
+	}
+	memcpy(wbuf, pktf_header(), HB_PKTF_HDRLEN);
+	memcpy(wbuf + HB_PKTF_HDRLEN, msg, len);
+	return mp->vf->write(mp, wbuf, len + HB_PKTF_HDRLEN);
+}
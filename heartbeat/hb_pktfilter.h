@@ -0,0 +1,49 @@
+/*
+ * hb_pktfilter.h: kernel packet filtering for UDP heartbeat media
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _HB_PKTFILTER_H
+#define _HB_PKTFILTER_H
+
+#include <heartbeat.h>
+
+/*
+ * Header on every packet of a filtered medium, in network byte order:
+ * HB_PKTF_MAGIC, then a hash of the cluster name.  The heartbeat
+ * message itself follows.
+ */
+#define	HB_PKTF_MAGIC	0x48426631	/* "HBf1" */
+#define	HB_PKTF_HDRLEN	8
+
+/* The kernel lets through 1 in this many foreign packets, for counting */
+#define	HB_PKTF_SAMPLE	64
+
+enum hb_pktf_verdict {
+	HB_PKTF_PASS,		/* Ours: strip the header and carry on */
+	HB_PKTF_SAMPLED,	/* Counting sample of kernel drops */
+	HB_PKTF_REJECT		/* Not ours */
+};
+
+/* Called by plugins (via CommImports) when they open a medium */
+void	hb_pktfilter_attach(struct hb_media* mp, int sockfd);
+
+/* Read and write child processes */
+enum hb_pktf_verdict
+	hb_pktfilter_check(const struct hb_media* mp, const void * pkt
+,		int len);
+int	hb_pktfilter_write(struct hb_media* mp, const void * msg, int len);
+
+#endif /* _HB_PKTFILTER_H */
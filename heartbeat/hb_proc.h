@@ -25,6 +25,7 @@
 #include <ha_msg.h>
 #include <clplumbing/longclock.h>
 #include <heartbeat.h>
+#include <hb_rclass.h>
 
 enum process_type {
 	PROC_UNDEF=0,		/* OOPS! ;-) */
@@ -48,6 +49,12 @@ struct process_info {
 	pid_t			pid;		/* Process' PID */
 	int			medianum;	/* Which media index does this process go with? */
 	hb_msg_stats_t		msgstats;
+	unsigned long		pktrejected;	/* Read: not ours (media_filter) */
+	unsigned long		pktkfiltered;	/* Read: estimated kernel drops */
+	unsigned long		rclass[HB_RC_NVERDICTS]; /* Read: verdicts */
+	unsigned long		rxqoverflow;	/* Read: receive buffer full */
+	int			rcvbuf;		/* Read: SO_RCVBUF */
+	int			sndbuf;		/* Write: SO_SNDBUF */
 };
 
 
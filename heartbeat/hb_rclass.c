@@ -0,0 +1,538 @@
+/*
+ * hb_rclass.c: classify inbound packets in the read processes
+ *
+ * Every packet a read process gets used to go to the master control
+ * process, which parsed it, checked its signature and only then found
+ * out (in should_drop_message()) that it was a replay, a copy of
+ * something it had already seen, or from a node it doesn't know.
+ *
+ * The master control process now publishes, in shared memory, the
+ * generation of each node and the lowest sequence number from it that
+ * it could still want (its last one, or the oldest it is still missing),
+ * and whether unknown nodes may join.  Before passing a packet on, the
+ * read process picks F_TYPE, F_ORIG, F_SEQ and F_HBGENERATION out of it
+ * without parsing the rest, and drops it if the master control process
+ * certainly would: an older generation, or a sequence number below that
+ * floor.  A copy of the last message (which still keeps its link up) is
+ * always passed on.  Anything we can't make sense of goes through too.
+ * The stale copies were still heard on our link, so we count them (and
+ * the highest sequence number among them) in shared memory, for the
+ * master control process to add to the link's statistics.
+ *
+ * Optionally (media_ratelimit), it also limits how many packets per
+ * second each sender may get through to the master control process.
+ * Senders are told apart by source address, not by F_ORIG: anyone can
+ * write any node's name in there, and use up its share.
+ *
+ * Nodes are matched by name.  None of this happens while an API client
+ * wants to see dropped packets.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_STRINGS_H
+#include <strings.h>
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif /* HAVE_NETINET_IN_H */
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/longclock.h>
+#include <clplumbing/Gmain_timeout.h>
+#include <heartbeat.h>
+#include <ha_msg.h>
+#include <hb_api.h>
+#include <hb_config.h>
+#include <heartbeat_private.h>
+#include <hb_rclass.h>
+
+#ifndef MAP_ANONYMOUS
+#	define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+#define	RC_BARRIER()	__sync_synchronize()
+#define	RC_TRIES	3	/* To get a stable read of the table */
+#define	RC_NBUCKET	256	/* Rate limit buckets: one per sender */
+#define	RC_PROBES	4	/* Buckets a sender may hash to */
+#define	RC_KEYLEN	(1+HOSTLENG)
+
+/* Token bucket, in thousandths of a packet, for one sender */
+struct rc_bucket {
+	char		key[RC_KEYLEN];	/* See rc_key() */
+	int		keylen;		/* 0: unused */
+	unsigned long	tokens;
+	longclock_t	last;
+};
+
+static struct hb_seen*	seen = NULL;
+static struct hb_rc_stale (*stale)[MAXNODE] = NULL;	/* [medium][node] */
+static guint		refresh_id = 0;
+
+/* Read processes only */
+static long		ratelimit = -1;		/* Packets/second; 0: none */
+static struct rc_bucket	buckets[RC_NBUCKET];
+static struct rc_bucket	overflow;	/* For senders with no room */
+
+static void
+seen_begin(void)
+{
+	++seen->seq;
+	RC_BARRIER();
+}
+
+static void
+seen_end(void)
+{
+	RC_BARRIER();
+	++seen->seq;
+}
+
+static void
+seen_fill(struct hb_seen_node * s, const struct node_info * node)
+{
+	const struct seqtrack *	t = &node->track;
+	seqno_t			floor = 0;
+	int			j;
+
+	strncpy(s->nodename, node->nodename, sizeof(s->nodename)-1);
+	s->nodename[sizeof(s->nodename)-1] = EOS;
+	s->generation = t->generation;
+	if (node->nodetype == NORMALNODE_I && t->last_seq != NOSEQUENCE
+	&&	STRNCMP_CONST(node->status, DEADSTATUS) != 0
+	&&	STRNCMP_CONST(node->status, INITSTATUS) != 0) {
+		/* Returning dead nodes and the like are none of ours */
+		floor = t->last_seq;
+		for (j=0; j < t->nmissing; ++j) {
+			if (t->seqmissing[j] != NOSEQUENCE
+			&&	t->seqmissing[j] < floor) {
+				floor = t->seqmissing[j];
+			}
+		}
+	}
+	s->floor = floor;
+}
+
+/* Republish everything: nodes come and go, and so do debug clients */
+static gboolean
+seen_refresh(gpointer data)
+{
+	int	j;
+
+	seen_begin();
+	seen->flags = (debug_client_count > 0 ? 0 : HB_SEEN_ACTIVE)
+	|	(config->rtjoinconfig != HB_JOIN_NONE ? HB_SEEN_STRANGERS : 0);
+	for (j=0; j < config->nodecount; ++j) {
+		seen_fill(&seen->nodes[j], &config->nodes[j]);
+	}
+	seen->nnodes = config->nodecount;
+	seen_end();
+	return TRUE;
+}
+
+int
+hb_rclass_init(void)
+{
+	void *	map;
+
+	if (seen != NULL) {
+		return HA_OK;
+	}
+	map = mmap(NULL, sizeof(*seen), PROT_READ|PROT_WRITE
+	,	MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		cl_perror("%s: cannot map seen table", __FUNCTION__);
+		return HA_FAIL;
+	}
+	seen = map;
+	memset(seen, 0, sizeof(*seen));
+	seen_refresh(NULL);
+
+	map = mmap(NULL, MAXMEDIA * sizeof(*stale), PROT_READ|PROT_WRITE
+	,	MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		/* The links' statistics will just have holes */
+		cl_perror("%s: cannot map stale counts", __FUNCTION__);
+	}else{
+		stale = map;
+		memset(stale, 0, MAXMEDIA * sizeof(*stale));
+	}
+	return HA_OK;
+}
+
+void
+hb_rclass_start(void)
+{
+	if (seen == NULL || refresh_id != 0) {
+		return;
+	}
+	refresh_id = Gmain_timeout_add_full(PRI_DUMPSTATS, 1000
+	,	seen_refresh, NULL, NULL);
+	G_main_setall_id(refresh_id, "seen table refresh", 1000, 50);
+}
+
+/* We've just dealt with a message from this node */
+void
+hb_rclass_seen(const struct node_info * node)
+{
+	int	j;
+
+	if (seen == NULL) {
+		return;
+	}
+	j = node - config->nodes;
+	if (j < 0 || j >= MAXNODE) {
+		return;
+	}
+	seen_begin();
+	seen_fill(&seen->nodes[j], node);
+	if (j >= seen->nnodes) {
+		seen->nnodes = j+1;
+	}
+	seen_end();
+}
+
+/* What our read process for medianum dropped as stale from this node */
+gboolean
+hb_rclass_stale(int medianum, const struct node_info * node
+,	struct hb_rc_stale * st)
+{
+	int	j = node - config->nodes;
+
+	if (stale == NULL || medianum < 0 || medianum >= MAXMEDIA
+	||	j < 0 || j >= MAXNODE) {
+		return FALSE;
+	}
+	st->gen = stale[medianum][j].gen;
+	st->maxseq = stale[medianum][j].maxseq;
+	RC_BARRIER();
+	st->count = stale[medianum][j].count;
+	return TRUE;
+}
+
+/* Note a stale copy from the nodeidx'th node, heard on medianum */
+static void
+rc_note_stale(int medianum, int nodeidx, const struct hb_rc_peek * pk)
+{
+	struct hb_rc_stale *	st;
+
+	if (stale == NULL || medianum < 0 || medianum >= MAXMEDIA) {
+		return;
+	}
+	st = &stale[medianum][nodeidx];
+	if (pk->gen != st->gen || pk->seq > st->maxseq) {
+		st->gen = pk->gen;
+		st->maxseq = pk->seq;
+	}
+	RC_BARRIER();
+	++st->count;
+}
+
+/*
+ * Who a packet is from, as far as the rate limiter is concerned: its
+ * source address.  Each read process has buckets of its own, so that's
+ * per medium too.  Media which don't tell us (serial) have only the
+ * name in F_ORIG to go by, but nobody off the wire can write on them.
+ */
+static int
+rc_key(const struct sockaddr * from, const char * orig, char * key)
+{
+	const void *	addr = NULL;
+	size_t		len = 0;
+
+	if (from != NULL && from->sa_family == AF_INET) {
+		addr = &((const struct sockaddr_in *)from)->sin_addr;
+		len = sizeof(struct in_addr);
+	}else if (from != NULL && from->sa_family == AF_INET6) {
+		addr = &((const struct sockaddr_in6 *)from)->sin6_addr;
+		len = sizeof(struct in6_addr);
+	}
+	if (addr != NULL) {
+		key[0] = 'a';
+		memcpy(key+1, addr, len);
+	}else{
+		key[0] = 'n';
+		len = strnlen(orig, HOSTLENG);
+		memcpy(key+1, orig, len);
+	}
+	return 1 + (int)len;
+}
+
+/*
+ * Find this sender's bucket.  A bucket nobody has used for a second is
+ * full again, so it can go to someone else.  Senders who find all of
+ * theirs busy share the overflow bucket, and don't touch anyone else's.
+ */
+static struct rc_bucket *
+rc_bucket(const char * key, int keylen, longclock_t now)
+{
+	struct rc_bucket *	idle = NULL;
+	guint			h = 0;
+	int			j;
+
+	for (j=0; j < keylen; ++j) {
+		h = (h << 5) + h + (unsigned char)key[j];
+	}
+	for (j=0; j < RC_PROBES; ++j) {
+		struct rc_bucket *	b = &buckets[(h + j) % RC_NBUCKET];
+
+		if (b->keylen == keylen && memcmp(b->key, key, keylen) == 0) {
+			return b;
+		}
+		if (idle == NULL && (b->keylen == 0
+		||	longclockto_ms(sub_longclock(now, b->last)) > 1000)) {
+			idle = b;
+		}
+	}
+	if (idle == NULL) {
+		return &overflow;
+	}
+	memcpy(idle->key, key, keylen);
+	idle->keylen = keylen;
+	idle->last = zero_longclock;
+	return idle;
+}
+
+/* Is there room for one more packet from this sender? */
+static gboolean
+rc_rate_ok(const struct sockaddr * from, const char * orig)
+{
+	struct rc_bucket*	b;
+	longclock_t		now = time_longclock();
+	char			key[RC_KEYLEN];
+	unsigned long		full;
+	unsigned long		ms;
+
+	if (ratelimit < 0) {
+		const char *	value = GetParameterValue(KEY_MEDIARATE);
+
+		ratelimit = (value != NULL ? atol(value) : 0L);
+		if (ratelimit < 0) {
+			ratelimit = 0;
+		}
+	}
+	if (ratelimit == 0) {
+		return TRUE;
+	}
+	b = rc_bucket(key, rc_key(from, orig, key), now);
+	full = (unsigned long)ratelimit * 1000;	/* A second's worth */
+
+	if (cmp_longclock(b->last, zero_longclock) == 0) {
+		b->tokens = full;
+	}else{
+		ms = longclockto_ms(sub_longclock(now, b->last));
+		if (ms > 1000) {
+			ms = 1000;
+		}
+		b->tokens += ms * (unsigned long)ratelimit;
+		if (b->tokens > full) {
+			b->tokens = full;
+		}
+	}
+	b->last = now;
+	if (b->tokens < 1000) {
+		return FALSE;
+	}
+	b->tokens -= 1000;
+	return TRUE;
+}
+
+/* Parse a hex number which makes up the whole of [p, end) */
+static gboolean
+rc_hex(const char * p, const char * end, seqno_t * value)
+{
+	seqno_t		v = 0;
+
+	if (p == NULL || p == end || end - p > 16) {
+		return FALSE;
+	}
+	for (; p < end; ++p) {
+		int	c = (unsigned char)*p;
+
+		if (c >= '0' && c <= '9') {
+			v = v*16 + (c - '0');
+		}else if (c >= 'a' && c <= 'f') {
+			v = v*16 + (c - 'a' + 10);
+		}else if (c >= 'A' && c <= 'F') {
+			v = v*16 + (c - 'A' + 10);
+		}else{
+			return FALSE;
+		}
+	}
+	*value = v;
+	return TRUE;
+}
+
+#define	RC_FIELD(line, len, name)	((len) > sizeof(name "=")-1 \
+		&&	memcmp((line), name "=", sizeof(name "=")-1) == 0)
+
+/* Copy [p, end) into a string of size 'size', if it fits */
+static gboolean
+rc_copy(char * s, size_t size, const char * p, const char * end)
+{
+	if (p == NULL || (size_t)(end - p) >= size) {
+		return FALSE;
+	}
+	memcpy(s, p, end - p);
+	s[end - p] = EOS;
+	return TRUE;
+}
+
+/*
+ * Pick the type, origin, sequence number and generation out of a
+ * classic-format packet without parsing the rest of it.  A trailing
+ * EOS (as the plugins' read functions add) is allowed for.  FALSE if
+ * it's not in the classic format, or any of them is missing or bad.
+ */
+gboolean
+hb_rclass_peek(const void * pkt, int len, struct hb_rc_peek * pk)
+{
+	const char *	p = pkt;
+	const char *	end = p + len;
+	const char *	type = NULL;
+	const char *	orig = NULL;
+	const char *	cseq = NULL;
+	const char *	cgen = NULL;
+	const char *	typeend = NULL;
+	const char *	origend = NULL;
+	const char *	cseqend = NULL;
+	const char *	cgenend = NULL;
+
+	if (len > 0 && end[-1] == EOS) {
+		--end;
+	}
+	if (end - p < (int)sizeof(MSG_START)-1
+	||	memcmp(p, MSG_START, sizeof(MSG_START)-1) != 0) {
+		return FALSE;
+	}
+	p += sizeof(MSG_START)-1;
+	while (p < end && (orig == NULL || type == NULL || cseq == NULL
+	||	cgen == NULL)) {
+		const char *	nl = memchr(p, '\n', end - p);
+		size_t		linelen;
+
+		if (nl == NULL) {
+			break;
+		}
+		linelen = nl - p;
+		/* ha_msg_value() finds the first of each, and so do we */
+		if (type == NULL && RC_FIELD(p, linelen, F_TYPE)) {
+			type = p + sizeof(F_TYPE "=")-1;
+			typeend = nl;
+		}else if (orig == NULL && RC_FIELD(p, linelen, F_ORIG)) {
+			orig = p + sizeof(F_ORIG "=")-1;
+			origend = nl;
+		}else if (cseq == NULL && RC_FIELD(p, linelen, F_SEQ)) {
+			cseq = p + sizeof(F_SEQ "=")-1;
+			cseqend = nl;
+		}else if (cgen == NULL && RC_FIELD(p, linelen
+		,		F_HBGENERATION)) {
+			cgen = p + sizeof(F_HBGENERATION "=")-1;
+			cgenend = nl;
+		}else if (strncmp(p, MSG_END, sizeof(MSG_END)-1) == 0) {
+			break;
+		}
+		p = nl + 1;
+	}
+	if (!rc_copy(pk->type, sizeof(pk->type), type, typeend)
+	||	!rc_copy(pk->from, sizeof(pk->from), orig, origend)) {
+		return FALSE;
+	}
+	pk->seq = 0;
+	pk->gen = 0;
+	pk->hasseq = (strncmp(pk->type, NOSEQ_PREFIX
+	,	sizeof(NOSEQ_PREFIX)-1) != 0);
+	if (!pk->hasseq) {
+		/* No sequence numbers to go by */
+		return TRUE;
+	}
+	return rc_hex(cseq, cseqend, &pk->seq)
+	&&	(cgen == NULL || rc_hex(cgen, cgenend, &pk->gen));
+}
+
+/*
+ * Decide what to do with a packet (as the plugin's read function
+ * returned it, with a trailing EOS) before it goes any further.
+ * from is where it came from, if the plugin told us (NULL if not).
+ */
+enum hb_rc_verdict
+hb_rclass_classify(const void * pkt, int len, int medianum
+,	const struct sockaddr * from)
+{
+	struct hb_rc_peek	pk;
+	struct hb_seen_node	node;
+	int		flags = 0;
+	int		nodeidx = -1;
+	int		tries;
+	int		j;
+
+	if (seen == NULL || !hb_rclass_peek(pkt, len, &pk)) {
+		return HB_RC_UNPARSED;
+	}
+
+	/* Find the sender in what the master control process published */
+	for (tries=0; tries < RC_TRIES; ++tries) {
+		unsigned	before = seen->seq;
+
+		if (before & 1) {
+			continue;
+		}
+		RC_BARRIER();
+		flags = seen->flags;
+		nodeidx = -1;
+		for (j=0; j < seen->nnodes && j < MAXNODE; ++j) {
+			if (strcasecmp(seen->nodes[j].nodename, pk.from) == 0) {
+				node = seen->nodes[j];
+				nodeidx = j;
+				break;
+			}
+		}
+		RC_BARRIER();
+		if (seen->seq == before) {
+			break;
+		}
+	}
+	if (tries >= RC_TRIES) {
+		return HB_RC_UNPARSED;
+	}
+
+	if (!rc_rate_ok(from, pk.from)) {
+		return HB_RC_RATE;
+	}
+	if ((flags & HB_SEEN_ACTIVE) == 0) {
+		return HB_RC_PASS;
+	}
+	if (nodeidx < 0) {
+		return (flags & HB_SEEN_STRANGERS) ? HB_RC_PASS : HB_RC_UNKNOWN;
+	}
+	if (!pk.hasseq) {
+		return HB_RC_PASS;
+	}
+	if (pk.gen < node.generation) {
+		return HB_RC_REPLAY;
+	}
+	if (pk.gen == node.generation && node.floor != 0
+	&&	pk.seq < node.floor) {
+		rc_note_stale(medianum, nodeidx, &pk);
+		return HB_RC_STALE;
+	}
+	return HB_RC_PASS;
+}
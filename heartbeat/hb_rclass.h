@@ -0,0 +1,89 @@
+/*
+ * hb_rclass.h: classify inbound packets in the read processes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _HB_RCLASS_H
+#define _HB_RCLASS_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <heartbeat.h>
+
+enum hb_rc_verdict {
+	HB_RC_PASS,		/* On to the master control process */
+	HB_RC_UNPARSED,		/* Ditto, but we couldn't tell what it was */
+	HB_RC_REPLAY,		/* Dropped: older generation */
+	HB_RC_STALE,		/* Dropped: already seen (or given up on) */
+	HB_RC_UNKNOWN,		/* Dropped: from a node we don't know */
+	HB_RC_RATE,		/* Dropped: sender over media_ratelimit */
+	HB_RC_NVERDICTS
+};
+#define	HB_RC_NAMES	{"pass", "unparsed", "replay", "stale", "unknown" \
+,			"ratelimit"}
+
+/* What the master control process has already seen from each node */
+struct hb_seen_node {
+	char		nodename[HOSTLENG];
+	seqno_t		generation;
+	seqno_t		floor;		/* Drop seq < floor; 0: don't */
+};
+
+#define	HB_SEEN_ACTIVE		0x1	/* Drop what we can */
+#define	HB_SEEN_STRANGERS	0x2	/* Unknown nodes may join */
+
+struct hb_seen {
+	volatile unsigned	seq;	/* odd while being updated */
+	int			flags;
+	int			nnodes;
+	struct hb_seen_node	nodes[MAXNODE];
+};
+
+/* The fields of a classic-format packet that decide what becomes of it */
+#define	HB_RC_TYPELEN	64
+struct hb_rc_peek {
+	char		type[HB_RC_TYPELEN];
+	char		from[HOSTLENG];
+	gboolean	hasseq;		/* FALSE: a NOSEQ_PREFIX type */
+	seqno_t		seq;
+	seqno_t		gen;
+};
+
+gboolean hb_rclass_peek(const void * pkt, int len, struct hb_rc_peek * pk);
+
+/*
+ * The copies one read process dropped as stale from one node, which
+ * were still heard on its link.  Kept by the read process, counted into
+ * the link's statistics by the master control process.
+ */
+struct hb_rc_stale {
+	volatile unsigned long	count;
+	volatile seqno_t	gen;		/* of maxseq */
+	volatile seqno_t	maxseq;
+};
+
+/* Master control process */
+int	hb_rclass_init(void);		/* Before forking the read processes */
+void	hb_rclass_start(void);		/* In the main loop */
+void	hb_rclass_seen(const struct node_info * node);
+gboolean hb_rclass_stale(int medianum, const struct node_info * node
+,		struct hb_rc_stale * st);
+
+/* Read processes */
+enum hb_rc_verdict
+	hb_rclass_classify(const void * pkt, int len, int medianum
+,		const struct sockaddr * from);
+
+#endif /* _HB_RCLASS_H */
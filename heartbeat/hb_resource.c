@@ -36,6 +36,7 @@
 #include <clplumbing/cl_signal.h>
 #include <clplumbing/Gmain_timeout.h>
 #include <clplumbing/realtime.h>
+#include <hb_trace.h>
 
 /**************************************************************************
  *
@@ -420,6 +421,7 @@ notify_world(struct ha_msg * msg, const char * ostatus)
 	||	 !FilterNotifications(fp)) {
 		return;
 	}
+	HB_TRACE_MSG(notify__world, msg, ostatus ? ostatus : "");
 
 	if (ANYDEBUG) {
 		cl_log(LOG_DEBUG
@@ -33,6 +33,7 @@
 #include <clplumbing/Gmain_timeout.h>
 #include <clplumbing/GSource.h>
 #include <clplumbing/cl_random.h>
+#include <hb_metrics.h>
 
 
 static void	schedule_rexmit_request(struct node_info* node, seqno_t seq, int delay);
@@ -192,6 +193,7 @@ send_rexmit_request( gpointer data)
 		ha_msg_del(hmsg);
 		return FALSE;
 	}
+	HBM_INC(HBM_REXMIT_REQ_SENT);
 	
 	node->track.last_rexmit_req = time_longclock();	
 	
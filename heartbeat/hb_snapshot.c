@@ -0,0 +1,473 @@
+/*
+ * hb_snapshot.c: publish cluster state for API clients in shared memory
+ *
+ * The master control process keeps a read-only (to everyone else) copy
+ * of node and link status, weights, sites, local client ids and our
+ * resource state in a file under HA_VARRUNDIR, which the client library
+ * maps.  That lets get_nodestatus() and friends answer without a round
+ * trip through the API socket.  See hb_snapshot.h for the locking.
+ *
+ * The code which changes node, link or client state calls
+ * hb_snapshot_dirty(), and the snapshot is rebuilt before the next
+ * message is handed to API clients, so nobody can hear about a change
+ * before the snapshot shows it.  Otherwise handing a message over costs
+ * a flag test and a look at the resource state.  It's also rebuilt once
+ * per heartbeat interval to catch anything which didn't say so.  It's
+ * only written to when something actually changed.
+ *
+ * Each change also bumps the state version and goes into a bounded
+ * change log, so API clients can ask for just what changed since the
+ * version they last saw (API_GETCHANGES) instead of re-reading it all.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <grp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/Gmain_timeout.h>
+#include <heartbeat.h>
+#include <ha_msg.h>
+#include <hb_api_core.h>
+#include <hb_snapshot.h>
+#include <hb_resource.h>
+
+extern client_proc_t*		client_list;
+extern struct node_info*	curnode;
+
+#define	CHANGELOG_SIZE	256
+
+struct hb_change {
+	unsigned long	version;
+	const char *	kind;
+	char		node[HOSTLENG];
+	char		item[HOSTLENG];
+	char		value[HOSTLENG];
+};
+
+static struct hb_snapshot*	shared = NULL;
+static struct hb_snapshot	staging;
+static struct hb_snapshot	current;	/* As of 'version' */
+static gboolean			have_state = FALSE;
+static gboolean			dirty = TRUE;	/* staging may be stale */
+static unsigned long		version = 0;
+static guint			refresh_id = 0;
+
+static struct hb_change		changelog[CHANGELOG_SIZE];
+static int			clfirst = 0;	/* Oldest entry */
+static int			clcount = 0;
+static unsigned long		clfloor = 0;	/* Every change since is logged */
+
+static gboolean	hb_snapshot_refresh(gpointer data);
+
+static void
+snapshot_build(struct hb_snapshot * s)
+{
+	client_proc_t*	client;
+	int		j;
+	int		k;
+
+	s->nnodes = 0;
+	s->nlinks = 0;
+	for (j=0; j < config->nodecount && j < MAXNODE; ++j) {
+		const struct node_info *	node = &config->nodes[j];
+		struct hb_snap_node *		sn = &s->nodes[s->nnodes++];
+
+		strncpy(sn->name, node->nodename, sizeof(sn->name));
+		strncpy(sn->status, api_node_status(node)
+		,	sizeof(sn->status));
+		strncpy(sn->site, node->site, sizeof(sn->site));
+		sn->nodetype = node->nodetype;
+		sn->weight = node->weight;
+		sn->firstlink = s->nlinks;
+		sn->nlinks = 0;
+
+		/* Just the links API_IFLIST would list */
+		for (k=0; k < MAXMEDIA && node->links[k].name; ++k) {
+			const struct link *	lnk = &node->links[k];
+			struct hb_snap_link *	sl;
+
+			if (node->nodetype == PINGNODE_I
+			?	strcmp(lnk->name, node->nodename) != 0
+			:	lnk->isping) {
+				continue;
+			}
+			if (s->nlinks >= HB_SNAP_MAXLINKS) {
+				sn->nlinks = -1;
+				break;
+			}
+			sl = &s->links[s->nlinks++];
+			strncpy(sl->name, lnk->name, sizeof(sl->name));
+			strncpy(sl->status, lnk->status, sizeof(sl->status));
+			++sn->nlinks;
+		}
+		if (sn->nlinks < 0) {
+			s->nlinks = sn->firstlink;
+		}
+	}
+
+	s->nclients = 0;
+	for (client = client_list; client != NULL; client = client->next) {
+		if (client->pid == 0 || client->removereason) {
+			continue;
+		}
+		if (s->nclients >= HB_SNAP_MAXCLIENTS) {
+			s->nclients = -1;
+			break;
+		}
+		strncpy(s->clients[s->nclients++], client->client_id
+		,	HB_SNAP_CLIENTIDLEN);
+	}
+
+	strncpy(s->resources, DoManageResources ? hb_rsc_resource_state() : ""
+	,	sizeof(s->resources));
+}
+
+static gboolean
+snapshot_changed(const struct hb_snapshot * a, const struct hb_snapshot * b)
+{
+	return a->nnodes != b->nnodes
+	||	a->nlinks != b->nlinks
+	||	a->nclients != b->nclients
+	||	strcmp(a->resources, b->resources) != 0
+	||	memcmp(a->nodes, b->nodes, a->nnodes*sizeof(a->nodes[0])) != 0
+	||	memcmp(a->links, b->links, a->nlinks*sizeof(a->links[0])) != 0
+	||	(a->nclients > 0
+	&&	 memcmp(a->clients, b->clients
+		,	a->nclients*sizeof(a->clients[0])) != 0);
+}
+
+static void
+changelog_add(const char * kind, const char * node, const char * item
+,	const char * value)
+{
+	struct hb_change *	c;
+
+	if (clcount == CHANGELOG_SIZE) {
+		/* Anyone older than this will have to resync */
+		clfloor = changelog[clfirst].version;
+		clfirst = (clfirst + 1) % CHANGELOG_SIZE;
+		--clcount;
+	}
+	c = &changelog[(clfirst + clcount) % CHANGELOG_SIZE];
+	++clcount;
+	c->version = version;
+	c->kind = kind;
+	strncpy(c->node, node, sizeof(c->node)-1);
+	strncpy(c->item, item, sizeof(c->item)-1);
+	strncpy(c->value, value, sizeof(c->value)-1);
+}
+
+static const struct hb_snap_node *
+changelog_find_node(const struct hb_snapshot * s, int hint, const char * name)
+{
+	int	j;
+
+	if (hint < s->nnodes && strcmp(s->nodes[hint].name, name) == 0) {
+		return &s->nodes[hint];
+	}
+	for (j=0; j < s->nnodes; ++j) {
+		if (strcmp(s->nodes[j].name, name) == 0) {
+			return &s->nodes[j];
+		}
+	}
+	return NULL;
+}
+
+static gboolean
+changelog_has_client(const struct hb_snapshot * s, const char * id)
+{
+	int	j;
+
+	for (j=0; j < s->nclients; ++j) {
+		if (strncmp(s->clients[j], id, HB_SNAP_CLIENTIDLEN) == 0) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Log everything that differs between two successive snapshots */
+static void
+changelog_diff(const struct hb_snapshot * old, const struct hb_snapshot * new)
+{
+	static const struct hb_snap_node	none;
+	char					buf[32];
+	int					j;
+	int					k;
+
+	for (j=0; j < new->nnodes; ++j) {
+		const struct hb_snap_node *	nn = &new->nodes[j];
+		const struct hb_snap_node *	on;
+
+		if ((on = changelog_find_node(old, j, nn->name)) == NULL) {
+			on = &none;
+		}
+		if (strcmp(on->status, nn->status) != 0) {
+			changelog_add("node", nn->name, "", nn->status);
+		}
+		if (on == &none || on->weight != nn->weight) {
+			snprintf(buf, sizeof(buf), "%d", nn->weight);
+			changelog_add("weight", nn->name, "", buf);
+		}
+		if (on == &none || strcmp(on->site, nn->site) != 0) {
+			changelog_add("site", nn->name, "", nn->site);
+		}
+		for (k=0; k < nn->nlinks; ++k) {
+			const struct hb_snap_link *	nl
+			=	&new->links[nn->firstlink+k];
+			const struct hb_snap_link *	ol = NULL;
+
+			if (k < on->nlinks && strcmp(nl->name
+			,	old->links[on->firstlink+k].name) == 0) {
+				ol = &old->links[on->firstlink+k];
+			}
+			if (ol == NULL || strcmp(ol->status, nl->status) != 0) {
+				changelog_add("link", nn->name, nl->name
+				,	nl->status);
+			}
+		}
+	}
+	for (j=0; j < old->nnodes; ++j) {
+		if (changelog_find_node(new, j, old->nodes[j].name) == NULL) {
+			changelog_add("node", old->nodes[j].name, "", "deleted");
+		}
+	}
+
+	for (j=0; j < new->nclients; ++j) {
+		if (!changelog_has_client(old, new->clients[j])) {
+			changelog_add("client", curnode->nodename
+			,	new->clients[j], JOINSTATUS);
+		}
+	}
+	for (j=0; j < old->nclients; ++j) {
+		if (!changelog_has_client(new, old->clients[j])) {
+			changelog_add("client", curnode->nodename
+			,	old->clients[j], LEAVESTATUS);
+		}
+	}
+
+	if (strcmp(old->resources, new->resources) != 0) {
+		changelog_add("resources", curnode->nodename, ""
+		,	new->resources);
+	}
+}
+
+static void
+snapshot_begin(void)
+{
+	++shared->seq;
+	HB_SNAP_BARRIER();
+}
+
+static void
+snapshot_end(void)
+{
+	shared->version = version;
+	HB_SNAP_BARRIER();
+	++shared->seq;
+}
+
+/* Copy the current state out to the shared snapshot */
+static void
+snapshot_publish(void)
+{
+	if (shared == NULL) {
+		return;
+	}
+	snapshot_begin();
+	shared->nnodes = current.nnodes;
+	shared->nlinks = current.nlinks;
+	shared->nclients = current.nclients;
+	memcpy(shared->resources, current.resources, sizeof(shared->resources));
+	memcpy(shared->nodes, current.nodes
+	,	current.nnodes*sizeof(current.nodes[0]));
+	memcpy(shared->links, current.links
+	,	current.nlinks*sizeof(current.links[0]));
+	if (current.nclients > 0) {
+		memcpy(shared->clients, current.clients
+		,	current.nclients*sizeof(current.clients[0]));
+	}
+	snapshot_end();
+}
+
+/* The current state version; never 0 */
+unsigned long
+hb_snapshot_version(void)
+{
+	hb_snapshot_update();
+	return version;
+}
+
+/* Node, link or client state changed: rebuild before the next message */
+void
+hb_snapshot_dirty(void)
+{
+	dirty = TRUE;
+}
+
+void
+hb_snapshot_update(void)
+{
+	/*
+	 * Resource state changes all over hb_resource.c, but it's
+	 * cheap enough to just look at it.
+	 */
+	if (have_state && !dirty
+	&&	strncmp(current.resources
+		,	DoManageResources ? hb_rsc_resource_state() : ""
+		,	sizeof(current.resources)) == 0) {
+		return;
+	}
+	dirty = FALSE;
+	snapshot_build(&staging);
+	if (have_state) {
+		if (!snapshot_changed(&staging, &current)) {
+			return;
+		}
+		++version;
+		changelog_diff(&current, &staging);
+	}else{
+		/*
+		 * Start from the clock, so versions from before a restart
+		 * are (most likely) older than ours and get a resync.
+		 */
+		version = (unsigned long)time(NULL);
+		clfloor = version;
+		have_state = TRUE;
+	}
+	current = staging;
+	snapshot_publish();
+}
+
+/*
+ * Append the changes made since version 'since' to 'changes', one line
+ * each: "version kind node item value", tab separated.  Returns FALSE
+ * if some of them are no longer in the log, and the caller has to
+ * start over from a full copy of the state.
+ */
+gboolean
+hb_snapshot_changes(unsigned long since, GString * changes)
+{
+	int	j;
+
+	hb_snapshot_update();
+	if (since < clfloor || since > version) {
+		return FALSE;
+	}
+	for (j=0; j < clcount; ++j) {
+		const struct hb_change *	c
+		=	&changelog[(clfirst + j) % CHANGELOG_SIZE];
+
+		if (c->version <= since) {
+			continue;
+		}
+		g_string_append_printf(changes, "%lu\t%s\t%s\t%s\t%s\n"
+		,	c->version, c->kind, c->node, c->item, c->value);
+	}
+	return TRUE;
+}
+
+static gboolean
+hb_snapshot_refresh(gpointer data)
+{
+	hb_snapshot_dirty();
+	hb_snapshot_update();
+	return TRUE;
+}
+
+int
+hb_snapshot_init(void)
+{
+	const char *	tmppath = HB_SNAPSHOT_FILE ".new";
+	struct group *	gr;
+	int		fd;
+	void *		map;
+
+	if (shared != NULL) {
+		return HA_OK;
+	}
+	unlink(tmppath);
+	if ((fd = open(tmppath, O_RDWR|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR)) < 0) {
+		cl_perror("snapshot: cannot create %s", tmppath);
+		return HA_FAIL;
+	}
+	/* Readable by the same folks who may use the API */
+	if ((gr = getgrnam(HA_APIGROUP)) == NULL
+	||	fchown(fd, 0, gr->gr_gid) < 0
+	||	fchmod(fd, S_IRUSR|S_IWUSR|S_IRGRP) < 0) {
+		cl_log(LOG_WARNING, "snapshot: %s readable only by root"
+		,	HB_SNAPSHOT_FILE);
+	}
+	if (ftruncate(fd, sizeof(*shared)) < 0
+	||	(map = mmap(NULL, sizeof(*shared), PROT_READ|PROT_WRITE
+		,	MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		cl_perror("snapshot: cannot map %s", tmppath);
+		close(fd);
+		unlink(tmppath);
+		return HA_FAIL;
+	}
+	close(fd);
+
+	shared = map;
+	shared->magic = HB_SNAPSHOT_MAGIC;
+	shared->size = sizeof(*shared);
+	shared->valid = TRUE;
+	shared->pid = getpid();
+	hb_snapshot_update();
+	snapshot_publish();
+
+	/* Clients only ever see a completely set up snapshot */
+	if (rename(tmppath, HB_SNAPSHOT_FILE) < 0) {
+		cl_perror("snapshot: cannot rename %s", tmppath);
+		hb_snapshot_shutdown();
+		unlink(tmppath);
+		return HA_FAIL;
+	}
+	refresh_id = Gmain_timeout_add_full(PRI_DUMPSTATS, config->heartbeat_ms
+	,	hb_snapshot_refresh, NULL, NULL);
+	G_main_setall_id(refresh_id, "cluster state snapshot"
+	,	config->heartbeat_ms, 50);
+	return HA_OK;
+}
+
+void
+hb_snapshot_shutdown(void)
+{
+	if (shared == NULL) {
+		return;
+	}
+	if (refresh_id != 0) {
+		Gmain_timeout_remove(refresh_id);
+		refresh_id = 0;
+	}
+	/* Anyone still mapping it goes back to asking over IPC */
+	snapshot_begin();
+	shared->valid = FALSE;
+	snapshot_end();
+	munmap(shared, sizeof(*shared));
+	shared = NULL;
+	unlink(HB_SNAPSHOT_FILE);
+}
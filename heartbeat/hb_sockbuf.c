@@ -0,0 +1,416 @@
+/*
+ * hb_sockbuf.c: socket buffer autotuning, overflow accounting and
+ *		receive timestamps
+ *
+ * When a UDP socket's receive buffer is full, the kernel throws away
+ * what arrives, and to us that looks just like loss on the network.
+ * That happens most during retransmission recovery, just when we would
+ * like to know why packets are going missing.
+ *
+ * So IP media plugins hand us their sockets when they open a medium,
+ * and we ask the kernel (SO_RXQ_OVFL) to tell the read process with
+ * each packet how many it has dropped on that socket so far.  The read
+ * process counts them, per medium, and doubles the receive buffer each
+ * time it sees the count go up, until it reaches media_bufmax.  The
+ * write process does the same with the send buffer when a write times
+ * out or the kernel is out of buffers.
+ *
+ * The count belongs to the socket, not to the node whose packet was
+ * lost, so it can't be split by node: the link statistics report it
+ * for the medium, next to each node's own sequence number gaps.
+ *
+ * The same ancillary data brings the time the kernel received each
+ * packet (SO_TIMESTAMPNS).  The read process passes it on with the
+ * packet, so that the master control process can time heartbeats by
+ * when they arrived, not by when it got round to them.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/longclock.h>
+#include <clplumbing/uids.h>
+#include <heartbeat.h>
+#include <HBcomm.h>
+#include <hb_api.h>
+#include <hb_proc.h>
+#include <hb_sockbuf.h>
+
+extern struct hb_media*		sysmedia[MAXMEDIA];
+extern int			nummedia;
+
+/* How often to complain about drops we can't tune away */
+#define	SOCKBUF_LOGMS	60000
+
+struct sockbuf_state {
+	gboolean	opened;		/* By the plugin, through us */
+	int		rsockfd;	/* -1: not ours */
+	int		wsockfd;
+	int		rcvbuf;		/* What we last asked for */
+	int		sndbuf;
+	guint32		ovfl;		/* Kernel drop count when last seen */
+	unsigned long	unlogged;	/* Drops since we last said so */
+	longclock_t	lastlog;
+};
+
+static struct sockbuf_state	sbstate[MAXMEDIA];
+static int			bufmax = -1;
+
+/* Read processes: kernel receive time of the last packet */
+#ifdef SO_TIMESTAMPNS
+static struct timespec		rxstamp;
+#endif
+static gboolean			rxstamped = FALSE;
+/* ... and where it came from (rxfromlen 0: the plugin didn't say) */
+static struct sockaddr_storage	rxfrom;
+static socklen_t		rxfromlen = 0;
+
+static struct sockbuf_state *
+sockbuf_lookup(const struct hb_media* mp)
+{
+	int	j;
+
+	for (j=0; j < nummedia && j < MAXMEDIA; ++j) {
+		if (sysmedia[j] == mp) {
+			return &sbstate[j];
+		}
+	}
+	return NULL;
+}
+
+/* The ceiling from media_bufmax: 0 means leave the buffers alone */
+static int
+sockbuf_max(void)
+{
+	if (bufmax < 0) {
+		const char *	value = GetParameterValue(KEY_MEDIABUFMAX);
+
+		bufmax = (value == NULL ? 0 : atoi(value));
+	}
+	return bufmax;
+}
+
+static int
+sockbuf_get(int sockfd, int opt)
+{
+	int		bytes = 0;
+	socklen_t	len = sizeof(bytes);
+
+	if (getsockopt(sockfd, SOL_SOCKET, opt, &bytes, &len) < 0) {
+		return 0;
+	}
+	return bytes;
+}
+
+/*
+ * Ask for twice the buffer we asked for last time, up to media_bufmax.
+ * Returns the new request, or 0 if we're already there.
+ */
+static int
+sockbuf_grow(const struct hb_media* mp, int sockfd, int opt, int cur)
+{
+	const char *	what = (opt == SO_RCVBUF ? "receive" : "send");
+	int		want;
+
+	if (sockbuf_max() <= 0 || cur >= sockbuf_max()) {
+		return 0;
+	}
+	want = (cur > sockbuf_max() / 2 ? sockbuf_max() : cur * 2);
+#if defined(SO_RCVBUFFORCE) && defined(SO_SNDBUFFORCE)
+	{
+		/* As root, net.core.[rw]mem_max needn't stop us */
+		int	force = (opt == SO_RCVBUF
+		?		SO_RCVBUFFORCE : SO_SNDBUFFORCE);
+		int	rc;
+
+		return_to_orig_privs();
+		rc = setsockopt(sockfd, SOL_SOCKET, force, &want, sizeof(want));
+		return_to_dropped_privs();
+		if (rc == 0) {
+			goto done;
+		}
+	}
+#endif
+	if (setsockopt(sockfd, SOL_SOCKET, opt, &want, sizeof(want)) < 0) {
+		cl_perror("%s %s: cannot grow %s buffer to %d bytes"
+		,	mp->type, mp->name, what, want);
+		return 0;
+	}
+#if defined(SO_RCVBUFFORCE) && defined(SO_SNDBUFFORCE)
+done:
+#endif
+	cl_log(LOG_INFO, "%s %s: %s buffer now %d bytes (asked for %d)"
+	,	mp->type, mp->name, what, sockbuf_get(sockfd, opt), want);
+	return want;
+}
+
+/*
+ * Called by a plugin's open function with the sockets it reads from
+ * and writes to (either may be -1, or both the same).
+ */
+void
+hb_sockbuf_open(struct hb_media* mp, int rsockfd, int wsockfd)
+{
+	struct sockbuf_state *	sb = sockbuf_lookup(mp);
+
+	if (sb == NULL) {
+		return;
+	}
+	memset(sb, 0, sizeof(*sb));
+	sb->opened = TRUE;
+	sb->rsockfd = rsockfd;
+	sb->wsockfd = wsockfd;
+	if (rsockfd >= 0) {
+		int	on = 1;
+
+#ifdef SO_RXQ_OVFL
+		if (setsockopt(rsockfd, SOL_SOCKET, SO_RXQ_OVFL
+		,	&on, sizeof(on)) < 0) {
+			cl_perror("%s %s: setsockopt(SO_RXQ_OVFL)"
+			,	mp->type, mp->name);
+		}
+#endif
+#ifdef SO_TIMESTAMPNS
+		if (setsockopt(rsockfd, SOL_SOCKET, SO_TIMESTAMPNS
+		,	&on, sizeof(on)) < 0) {
+			cl_perror("%s %s: setsockopt(SO_TIMESTAMPNS)"
+			,	mp->type, mp->name);
+		}
+#endif
+		sb->rcvbuf = sockbuf_get(rsockfd, SO_RCVBUF);
+	}
+	if (wsockfd >= 0) {
+		sb->sndbuf = sockbuf_get(wsockfd, SO_SNDBUF);
+	}
+}
+
+/* Publish the buffer sizes a new read or write process starts with */
+void
+hb_sockbuf_child(struct hb_media* mp)
+{
+	struct sockbuf_state *	sb = sockbuf_lookup(mp);
+
+	if (sb == NULL || !sb->opened) {
+		return;
+	}
+	if (curproc->type == PROC_HBREAD && sb->rsockfd >= 0) {
+		curproc->rcvbuf = sockbuf_get(sb->rsockfd, SO_RCVBUF);
+	}
+	if (curproc->type == PROC_HBWRITE && sb->wsockfd >= 0) {
+		curproc->sndbuf = sockbuf_get(sb->wsockfd, SO_SNDBUF);
+	}
+}
+
+/* The kernel's drop count for this medium's socket has gone up */
+static void
+sockbuf_overflow(struct hb_media* mp, struct sockbuf_state * sb
+,	guint32 ovfl)
+{
+	guint32		delta = ovfl - sb->ovfl;	/* It's cumulative */
+	int		newsize;
+
+	sb->ovfl = ovfl;
+	if (delta == 0) {
+		return;
+	}
+	curproc->rxqoverflow += delta;
+	sb->unlogged += delta;
+	if ((newsize = sockbuf_grow(mp, sb->rsockfd, SO_RCVBUF
+	,	sb->rcvbuf)) > 0) {
+		sb->rcvbuf = newsize;
+		curproc->rcvbuf = sockbuf_get(sb->rsockfd, SO_RCVBUF);
+	}else if (cmp_longclock(sub_longclock(time_longclock()
+	,	sb->lastlog), msto_longclock(SOCKBUF_LOGMS)) < 0
+	&&	cmp_longclock(sb->lastlog, zero_longclock) != 0) {
+		return;
+	}
+	cl_log(LOG_WARNING, "%s %s: %lu packet(s) dropped by the kernel:"
+	" receive buffer full", mp->type, mp->name, sb->unlogged);
+	sb->unlogged = 0;
+	sb->lastlog = time_longclock();
+}
+
+/*
+ * Look through the ancillary data a plugin received with a packet.
+ * Called for every packet in the read processes.
+ */
+void
+hb_sockbuf_control(struct hb_media* mp, struct msghdr * msg)
+{
+	struct sockbuf_state *	sb = sockbuf_lookup(mp);
+	struct cmsghdr *	cmsg;
+
+	rxstamped = FALSE;
+	if (sb == NULL || !sb->opened || sb->rsockfd < 0) {
+		return;
+	}
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL
+	;	cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET) {
+			continue;
+		}
+#ifdef SO_RXQ_OVFL
+		if (cmsg->cmsg_type == SO_RXQ_OVFL
+		&&	cmsg->cmsg_len >= CMSG_LEN(sizeof(guint32))) {
+			guint32		ovfl;
+
+			memcpy(&ovfl, CMSG_DATA(cmsg), sizeof(ovfl));
+			sockbuf_overflow(mp, sb, ovfl);
+		}
+#endif
+#ifdef SO_TIMESTAMPNS
+		if (cmsg->cmsg_type == SCM_TIMESTAMPNS
+		&&	cmsg->cmsg_len >= CMSG_LEN(sizeof(rxstamp))) {
+			memcpy(&rxstamp, CMSG_DATA(cmsg), sizeof(rxstamp));
+			rxstamped = TRUE;
+		}
+#endif
+	}
+}
+
+/*
+ * When did the packet the plugin just returned reach our socket?
+ * FALSE if the kernel didn't say, or said something we can't believe
+ * (the wall clock moved under us).
+ */
+gboolean
+hb_sockbuf_arrival(longclock_t * arrived)
+{
+#ifdef SO_TIMESTAMPNS
+	struct timespec	now;
+	long		age_ms;
+
+	if (!rxstamped || clock_gettime(CLOCK_REALTIME, &now) < 0) {
+		return FALSE;
+	}
+	rxstamped = FALSE;
+	age_ms = (long)(now.tv_sec - rxstamp.tv_sec) * 1000L
+	+	(now.tv_nsec - rxstamp.tv_nsec) / 1000000L;
+	if (age_ms < 0 || age_ms > config->deadtime_ms) {
+		return FALSE;
+	}
+	*arrived = sub_longclock(time_longclock(), msto_longclock(age_ms));
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+/*
+ * Where did the packet the plugin just returned come from?  FALSE if it
+ * didn't get it through hb_sockbuf_recvfrom().
+ */
+gboolean
+hb_sockbuf_source(struct sockaddr_storage * from)
+{
+	if (rxfromlen == 0) {
+		return FALSE;
+	}
+	memset(from, 0, sizeof(*from));
+	memcpy(from, &rxfrom, rxfromlen);
+	rxfromlen = 0;
+	return TRUE;
+}
+
+/* recvfrom(), for plugins, but with the ancillary data looked at */
+ssize_t
+hb_sockbuf_recvfrom(struct hb_media* mp, int sockfd, void * buf
+,	size_t len, int flags, struct sockaddr * from, socklen_t * fromlen)
+{
+	union {
+		struct cmsghdr	align;
+		char		space[HBCOMM_CMSGLEN];
+	}		control;
+	struct iovec	iov;
+	struct msghdr	msg;
+	ssize_t		rc;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = from;
+	msg.msg_namelen = (fromlen == NULL ? 0 : *fromlen);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.space;
+	msg.msg_controllen = sizeof(control.space);
+
+	rxfromlen = 0;
+	if ((rc = recvmsg(sockfd, &msg, flags)) < 0) {
+		return rc;
+	}
+	if (fromlen != NULL) {
+		*fromlen = msg.msg_namelen;
+	}
+	if (from != NULL && msg.msg_namelen > 0
+	&&	msg.msg_namelen <= sizeof(rxfrom)) {
+		memcpy(&rxfrom, from, msg.msg_namelen);
+		rxfromlen = msg.msg_namelen;
+	}
+	hb_sockbuf_control(mp, &msg);
+	return rc;
+}
+
+/*
+ * A write to this medium failed with this errno: if it looks like the
+ * send buffer was full, make it bigger.
+ */
+void
+hb_sockbuf_write_failed(struct hb_media* mp, int err)
+{
+	struct sockbuf_state *	sb = sockbuf_lookup(mp);
+	int			newsize;
+
+	if (sb == NULL || !sb->opened || sb->wsockfd < 0) {
+		return;
+	}
+	if (err != EINTR && err != ENOBUFS && err != EAGAIN
+	&&	err != EWOULDBLOCK) {
+		return;
+	}
+	if ((newsize = sockbuf_grow(mp, sb->wsockfd, SO_SNDBUF
+	,	sb->sndbuf)) > 0) {
+		sb->sndbuf = newsize;
+		curproc->sndbuf = sockbuf_get(sb->wsockfd, SO_SNDBUF);
+	}
+}
+
+/* Packets the kernel dropped on this medium's receive socket so far */
+unsigned long
+hb_sockbuf_overflow(const char * medianame)
+{
+	unsigned long	total = 0;
+	int		j;
+
+	for (j=0; j < procinfo->nprocs && j < MAXPROCS; ++j) {
+		volatile struct process_info*	p = &procinfo->info[j];
+
+		if (p->type == PROC_HBREAD
+		&&	p->medianum >= 0 && p->medianum < nummedia
+		&&	strcmp(sysmedia[p->medianum]->name, medianame) == 0) {
+			total += p->rxqoverflow;
+		}
+	}
+	return total;
+}
@@ -0,0 +1,44 @@
+/*
+ * hb_sockbuf.h: socket buffer autotuning, overflow accounting and
+ *		receive timestamps
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _HB_SOCKBUF_H
+#define _HB_SOCKBUF_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <clplumbing/longclock.h>
+#include <heartbeat.h>
+
+/* Called by plugins (via CommImports) */
+void	hb_sockbuf_open(struct hb_media* mp, int rsockfd, int wsockfd);
+ssize_t	hb_sockbuf_recvfrom(struct hb_media* mp, int sockfd, void * buf
+,		size_t len, int flags, struct sockaddr * from
+,		socklen_t * fromlen);
+void	hb_sockbuf_control(struct hb_media* mp, struct msghdr * msg);
+
+/* Read and write child processes */
+void	hb_sockbuf_child(struct hb_media* mp);
+gboolean hb_sockbuf_arrival(longclock_t * arrived);
+gboolean hb_sockbuf_source(struct sockaddr_storage * from);
+void	hb_sockbuf_write_failed(struct hb_media* mp, int err);
+
+/* Master control process */
+unsigned long
+	hb_sockbuf_overflow(const char * medianame);
+
+#endif /* _HB_SOCKBUF_H */
@@ -0,0 +1,407 @@
+/*
+ * hb_totalorder.c: sequencer for cluster-wide total order broadcast
+ *
+ * Clients mark a cluster message F_TOTALORDER when they want it
+ * delivered everywhere in the same order as every other such message,
+ * from whatever node.  The message itself goes out as usual.  One node,
+ * the sequencer, then sends out T_TOSEQ messages giving the next global
+ * sequence numbers to the (F_ORIG, F_HBGENERATION, F_SEQ) of the marked
+ * messages it has seen, in batches.  The client library holds marked
+ * messages back until their number comes up.
+ *
+ * The sequencer is whoever sent the last T_TOSEQ, for as long as it is
+ * alive.  Otherwise (at startup, or when it dies) it is the first live
+ * normal node in our configuration, which then stamps every marked
+ * message nobody has stamped yet, continuing from the highest global
+ * number it has seen.  A batch the old sequencer sent just before it
+ * died, and which didn't reach everyone, can make those few messages
+ * come out in a different order on different nodes.  Outside that
+ * window the order is the same everywhere.
+ *
+ * Every node remembers the last TO_MAXSTAMPED messages it has seen
+ * stamped, so that a T_TOSEQ which gets here ahead of the message it
+ * stamps doesn't leave that message waiting for a stamp, and a new
+ * sequencer doesn't stamp it a second time.  A message still not
+ * stamped after TO_EXPIRE deadtimes is forgotten.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <clplumbing/longclock.h>
+#include <clplumbing/Gmain_timeout.h>
+#include <heartbeat.h>
+#include <ha_msg.h>
+#include <heartbeat_private.h>
+#include <hb_api_core.h>
+#include <hb_totalorder.h>
+
+#define	TO_BATCH_MAX	64	/* Stamps per T_TOSEQ */
+#define	TO_MAXPENDING	4096	/* Unstamped messages we remember */
+#define	TO_MAXSTAMPED	4096	/* Stamped ones we remember */
+#define	TO_EXPIRE	2	/* Deadtimes to wait for a stamp */
+
+/* A marked message which hasn't been stamped (as far as we know) */
+struct to_msgid {
+	char		orig[HOSTLENG];
+	seqno_t		gen;
+	seqno_t		seq;
+	gboolean	stamped;	/* By us, in a batch still on its way */
+	longclock_t	seen;
+};
+
+extern struct node_info*	curnode;
+
+static GQueue*		pending = NULL;
+static GHashTable*	stamped = NULL;		/* "orig gen seq" */
+static GQueue*		stampedq = NULL;	/* Its keys, oldest first */
+static seqno_t		next_gseq = 1;		/* Next global number */
+static char		sequencer[HOSTLENG];	/* Sent the last T_TOSEQ */
+static longclock_t	started;
+static longclock_t	lastsent;		/* Our last T_TOSEQ */
+static guint		check_id = 0;
+static guint		flush_id = 0;
+
+static gboolean	to_flush(gpointer data);
+
+static gboolean
+to_node_alive(const struct node_info * node)
+{
+	return node != NULL && node->nodetype == NORMALNODE_I
+	&&	STRNCMP_CONST(node->status, DEADSTATUS) != 0
+	&&	STRNCMP_CONST(node->status, INITSTATUS) != 0;
+}
+
+/* Are we the one who hands out global sequence numbers? */
+static gboolean
+to_we_are_sequencer(void)
+{
+	int	j;
+
+	if (sequencer[0] != EOS && to_node_alive(lookup_node(sequencer))) {
+		return strcmp(sequencer, curnode->nodename) == 0;
+	}
+	/*
+	 * Give the current sequencer (if any) a chance to be heard
+	 * before we take over from it at startup.
+	 */
+	if (sequencer[0] == EOS
+	&&	longclockto_ms(sub_longclock(time_longclock(), started))
+	<	(unsigned long)config->deadtime_ms) {
+		return FALSE;
+	}
+	for (j=0; j < config->nodecount; ++j) {
+		if (to_node_alive(&config->nodes[j])) {
+			return &config->nodes[j] == curnode;
+		}
+	}
+	return FALSE;
+}
+
+static void
+to_schedule_flush(void)
+{
+	if (flush_id == 0) {
+		/* After whatever else we've already read this time around */
+		flush_id = Gmain_timeout_add_full(PRI_CLIENTMSG, 0
+		,	to_flush, NULL, NULL);
+	}
+}
+
+static gboolean
+to_is_stamped(const char * orig, seqno_t gen, seqno_t seq)
+{
+	char	key[HOSTLENG+40];
+
+	snprintf(key, sizeof(key), "%s %lx %lx", orig, gen, seq);
+	return g_hash_table_lookup(stamped, key) != NULL;
+}
+
+static void
+to_note_stamped(const char * orig, seqno_t gen, seqno_t seq)
+{
+	char *	key;
+
+	if (to_is_stamped(orig, gen, seq)) {
+		return;
+	}
+	if (stampedq->length >= TO_MAXSTAMPED) {
+		key = g_queue_pop_head(stampedq);
+		g_hash_table_remove(stamped, key);
+		g_free(key);
+	}
+	key = g_strdup_printf("%s %lx %lx", orig, gen, seq);
+	g_hash_table_insert(stamped, key, key);
+	g_queue_push_tail(stampedq, key);
+}
+
+static int
+to_send_batch(const char * list)
+{
+	struct ha_msg*	msg;
+	char		first[32];
+
+	snprintf(first, sizeof(first), "%lx", next_gseq);
+	if ((msg = ha_msg_new(4)) == NULL
+	||	ha_msg_add(msg, F_TYPE, T_TOSEQ) != HA_OK
+	||	ha_msg_add(msg, F_TOGSEQ, first) != HA_OK
+	||	(*list != EOS && ha_msg_add(msg, F_TOLIST, list) != HA_OK)) {
+		cl_log(LOG_ERR, "to_send_batch: cannot create message");
+		if (msg != NULL) {
+			ha_msg_del(msg);
+		}
+		return HA_FAIL;
+	}
+	lastsent = time_longclock();
+	return send_cluster_msg(msg);
+}
+
+/* Send out stamps for everything we've seen but nobody has stamped */
+static gboolean
+to_flush(gpointer data)
+{
+	GList*		l;
+
+	flush_id = 0;
+	if (pending == NULL || !to_we_are_sequencer()) {
+		return FALSE;
+	}
+	l = pending->head;
+	while (l != NULL) {
+		GString*		list = g_string_new("");
+		struct to_msgid*	batch[TO_BATCH_MAX];
+		int			n = 0;
+		int			j;
+		int			rc;
+
+		for (; l != NULL && n < TO_BATCH_MAX; l = l->next) {
+			struct to_msgid*	id = l->data;
+
+			if (id->stamped) {
+				continue;
+			}
+			g_string_append_printf(list, "%s %lx %lx\n"
+			,	id->orig, id->gen, id->seq);
+			batch[n++] = id;
+		}
+		rc = (n == 0 ? HA_FAIL : to_send_batch(list->str));
+		g_string_free(list, TRUE);
+		if (rc != HA_OK) {
+			/* Still unstamped: to_check() tries again */
+			break;
+		}
+		for (j=0; j < n; ++j) {
+			batch[j]->stamped = TRUE;
+			to_note_stamped(batch[j]->orig, batch[j]->gen
+			,	batch[j]->seq);
+		}
+		next_gseq += n;
+	}
+	return FALSE;
+}
+
+/* Forget about a message once somebody has stamped it */
+static void
+to_stamped(const char * orig, seqno_t gen, seqno_t seq)
+{
+	GList*		l;
+
+	to_note_stamped(orig, gen, seq);
+	for (l = pending->head; l != NULL; l = l->next) {
+		struct to_msgid*	id = l->data;
+
+		if (id->seq == seq && id->gen == gen
+		&&	strcmp(id->orig, orig) == 0) {
+			g_queue_delete_link(pending, l);
+			free(id);
+			return;
+		}
+	}
+}
+
+/* Received a T_TOSEQ message from the sequencer */
+static void
+HBDoMsg_T_TOSEQ(const char * type, struct node_info * fromnode
+,	TIME_T msgtime, seqno_t seqno, const char * iface, struct ha_msg * msg)
+{
+	const char *	cfirst = ha_msg_value(msg, F_TOGSEQ);
+	const char *	clist = ha_msg_value(msg, F_TOLIST);
+	seqno_t		first;
+	gchar **	lines;
+	int		j;
+	int		n = 0;
+
+	if (cfirst == NULL || sscanf(cfirst, "%lx", &first) != 1) {
+		cl_log(LOG_ERR, "Bad " T_TOSEQ " message from %s"
+		,	fromnode->nodename);
+		return;
+	}
+	strncpy(sequencer, fromnode->nodename, sizeof(sequencer)-1);
+
+	lines = g_strsplit(clist != NULL ? clist : "", "\n", 0);
+	for (j=0; lines[j] != NULL; ++j) {
+		char		orig[HOSTLENG];
+		seqno_t		gen;
+		seqno_t		seq;
+
+		if (sscanf(lines[j], "%99s %lx %lx", orig, &gen, &seq) != 3) {
+			continue;
+		}
+		to_stamped(orig, gen, seq);
+		++n;
+	}
+	g_strfreev(lines);
+	if (first + n > next_gseq) {
+		next_gseq = first + n;
+	}
+
+	/* Our clients put the messages in order */
+	heartbeat_monitor(msg, KEEPIT, iface);
+}
+
+/*
+ * Note a client message marked for total order.  Called for every
+ * message we're about to hand to our clients.
+ */
+void
+hb_totalorder_msg(const struct ha_msg * msg)
+{
+	const char *		orig;
+	const char *		cgen;
+	const char *		cseq;
+	struct to_msgid*	id;
+
+	if (pending == NULL || ha_msg_value(msg, F_TOTALORDER) == NULL) {
+		return;
+	}
+	if ((orig = ha_msg_value(msg, F_ORIG)) == NULL
+	||	(cgen = ha_msg_value(msg, F_HBGENERATION)) == NULL
+	||	(cseq = ha_msg_value(msg, F_SEQ)) == NULL
+	||	(id = MALLOCT(struct to_msgid)) == NULL) {
+		return;
+	}
+	memset(id, 0, sizeof(*id));
+	strncpy(id->orig, orig, sizeof(id->orig)-1);
+	if (sscanf(cgen, "%lx", &id->gen) != 1
+	||	sscanf(cseq, "%lx", &id->seq) != 1
+	||	to_is_stamped(id->orig, id->gen, id->seq)) {
+		/* Its T_TOSEQ got here first */
+		free(id);
+		return;
+	}
+	id->seen = time_longclock();
+	if (pending->length >= TO_MAXPENDING) {
+		cl_log(LOG_WARNING, "Too many messages waiting for a"
+		" global sequence number: %s's %lx dropped"
+		,	orig, id->seq);
+		free(id);
+		return;
+	}
+	g_queue_push_tail(pending, id);
+	if (to_we_are_sequencer()) {
+		to_schedule_flush();
+	}
+}
+
+/*
+ * Take over as sequencer if the old one went away.  Once anyone has
+ * used total order, the sequencer also speaks up every half deadtime,
+ * so that nodes which (re)join hear who it is before they'd step in.
+ */
+static gboolean
+to_check(gpointer data)
+{
+	longclock_t		now = time_longclock();
+	longclock_t		expire;
+	struct to_msgid*	id;
+	int			nexpired = 0;
+
+	/* Its stamp went missing, or whoever would send it died first */
+	expire = msto_longclock(TO_EXPIRE * config->deadtime_ms);
+	while ((id = g_queue_peek_head(pending)) != NULL
+	&&	cmp_longclock(sub_longclock(now, id->seen), expire) > 0) {
+		g_queue_pop_head(pending);
+		free(id);
+		++nexpired;
+	}
+	if (nexpired > 0) {
+		cl_log(LOG_WARNING, "%d messages never got a global"
+		" sequence number", nexpired);
+	}
+
+	if (!to_we_are_sequencer()) {
+		return TRUE;
+	}
+	if (pending->length > 0) {
+		to_schedule_flush();
+	}else if (next_gseq > 1
+	&&	longclockto_ms(sub_longclock(time_longclock(), lastsent))
+	>=	(unsigned long)config->deadtime_ms/2) {
+		to_send_batch("");
+	}
+	return TRUE;
+}
+
+void
+hb_totalorder_init(void)
+{
+	if (pending != NULL) {
+		return;
+	}
+	pending = g_queue_new();
+	stamped = g_hash_table_new(g_str_hash, g_str_equal);
+	stampedq = g_queue_new();
+	started = time_longclock();
+	hb_register_msg_callback(T_TOSEQ, HBDoMsg_T_TOSEQ);
+	check_id = Gmain_timeout_add_full(PRI_CLIENTMSG, config->heartbeat_ms
+	,	to_check, NULL, NULL);
+	G_main_setall_id(check_id, "total order sequencer check"
+	,	config->heartbeat_ms, 50);
+}
+
+void
+hb_totalorder_shutdown(void)
+{
+	struct to_msgid*	id;
+	char *			key;
+
+	if (pending == NULL) {
+		return;
+	}
+	if (check_id != 0) {
+		Gmain_timeout_remove(check_id);
+		check_id = 0;
+	}
+	if (flush_id != 0) {
+		Gmain_timeout_remove(flush_id);
+		flush_id = 0;
+	}
+	while ((id = g_queue_pop_head(pending)) != NULL) {
+		free(id);
+	}
+	g_queue_free(pending);
+	pending = NULL;
+	g_hash_table_destroy(stamped);
+	stamped = NULL;
+	while ((key = g_queue_pop_head(stampedq)) != NULL) {
+		g_free(key);
+	}
+	g_queue_free(stampedq);
+	stampedq = NULL;
+}
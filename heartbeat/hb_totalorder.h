@@ -0,0 +1,28 @@
+/*
+ * hb_totalorder.h: sequencer for cluster-wide total order broadcast
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _HB_TOTALORDER_H
+#define _HB_TOTALORDER_H
+
+#include <ha_msg.h>
+
+/* Master control process only */
+void	hb_totalorder_init(void);
+void	hb_totalorder_msg(const struct ha_msg * msg);
+void	hb_totalorder_shutdown(void);
+
+#endif /* _HB_TOTALORDER_H */
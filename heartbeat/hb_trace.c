@@ -0,0 +1,67 @@
+/*
+ * hb_trace.c: support for heartbeat's static (USDT) tracepoints
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <heartbeat.h>
+#include <ha_msg.h>
+#include <hb_trace.h>
+
+#if defined(HB_USDT) && defined(HAVE_SYS_SDT_H)
+/* The tracer increments these when it attaches to the probe */
+#	define	HB_TRACE_DEFINE(name)					\
+		unsigned short HB_TRACE_SEMAPHORE(name)			\
+		__attribute__((section(".probes")));
+HB_TRACE_PROBES(HB_TRACE_DEFINE)
+#endif
+
+void
+hb_trace_msginfo(const struct ha_msg * msg, const char ** node
+,	unsigned long * seq, const char ** type)
+{
+	const char *	cseq;
+
+	*node = ha_msg_value(msg, F_ORIG);
+	*type = ha_msg_value(msg, F_TYPE);
+	*seq = 0;
+	if ((cseq = ha_msg_value(msg, F_SEQ)) != NULL) {
+		sscanf(cseq, "%lx", seq);
+	}
+	if (*node == NULL) {
+		*node = "";
+	}
+	if (*type == NULL) {
+		*type = "";
+	}
+}
+
+/*
+ * The read children never parse what they read, so this has to.
+ * Only called when someone is tracing pkt__read.
+ */
+void
+hb_trace_pkt_read(const char * medium, const void * pkt, int len)
+{
+	struct ha_msg *	msg;
+
+	if ((msg = wirefmt2msg(pkt, len, 0)) == NULL) {
+		HB_TRACE(pkt__read, "", 0UL, "", medium);
+		return;
+	}
+	HB_TRACE_MSG(pkt__read, msg, medium);
+	ha_msg_del(msg);
+}
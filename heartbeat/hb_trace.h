@@ -0,0 +1,92 @@
+/*
+ * hb_trace.h: static (USDT) tracepoints for heartbeat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _HB_TRACE_H
+#define _HB_TRACE_H
+
+#include <ha_msg.h>
+
+/*
+ * Every probe is in the "heartbeat" provider and takes the same
+ * first three arguments:
+ *
+ *	arg0	node name (char *)
+ *	arg1	sequence number (unsigned long, 0 if none)
+ *	arg2	message type (char *)
+ *	arg3	probe specific - see the list below
+ *
+ * node__dead and link__status have no message: they pass the last
+ * seqno heard from the node, and the new status in place of the type.
+ *
+ * Probes are built only with configure --enable-usdt on systems with
+ * <sys/sdt.h>.  Each has a semaphore, so work done to gather its
+ * arguments is skipped unless a tracer is actually attached.  Always
+ * write probes as:
+ *
+ *	if (HB_TRACE_ENABLED(name)) {
+ *		... gather arguments ...
+ *		HB_TRACE(name, node, seq, type, extra);
+ *	}
+ *
+ * Without USDT support HB_TRACE_ENABLED() is constant 0 and the
+ * whole block is optimized away.
+ */
+#define	HB_TRACE_PROBES(P)						\
+	P(pkt__read)		/* read child got a packet: medium */	\
+	P(msg__start)		/* MCP starts on a packet: iface */	\
+	P(msg__verdict)		/* should_drop_message(): verdict */	\
+	P(msg__done)		/* MCP done with a packet: iface */	\
+	P(xmit__hist)		/* added to xmit history: depth */	\
+	P(rexmit)		/* packet retransmitted: to node */	\
+	P(node__dead)		/* mark_node_dead(): ms silent */	\
+	P(link__status)		/* change_link_status(): iface */	\
+	P(api__send)		/* delivered to API client: client */	\
+	P(notify__world)	/* notify_world(): old status */
+
+#if defined(HB_USDT) && defined(HAVE_SYS_SDT_H)
+#	define	_SDT_HAS_SEMAPHORES	1
+#	include <sys/sdt.h>
+#	define	HB_TRACE_SEMAPHORE(name)	heartbeat_##name##_semaphore
+#	define	HB_TRACE_DECLARE(name)					\
+		extern unsigned short HB_TRACE_SEMAPHORE(name);
+HB_TRACE_PROBES(HB_TRACE_DECLARE)
+#	define	HB_TRACE_ENABLED(name)	(HB_TRACE_SEMAPHORE(name) != 0)
+#	define	HB_TRACE(name, node, seq, type, extra)			\
+		DTRACE_PROBE4(heartbeat, name, node, seq, type, extra)
+#else
+#	define	HB_TRACE_ENABLED(name)	0
+#	define	HB_TRACE(name, node, seq, type, extra)	/* Nothing */
+#endif
+
+/* Fire a probe which describes a message we already have parsed */
+#define	HB_TRACE_MSG(name, msg, extra)					\
+	do {								\
+		if (HB_TRACE_ENABLED(name)) {				\
+			const char *	trnode_;			\
+			unsigned long	trseq_;				\
+			const char *	trtype_;			\
+			hb_trace_msginfo((msg), &trnode_, &trseq_	\
+			,	&trtype_);				\
+			HB_TRACE(name, trnode_, trseq_, trtype_, (extra)); \
+		}							\
+	} while (0)
+
+void	hb_trace_msginfo(const struct ha_msg * msg, const char ** node
+,		unsigned long * seq, const char ** type);
+void	hb_trace_pkt_read(const char * medium, const void * pkt, int len);
+
+#endif /* _HB_TRACE_H */
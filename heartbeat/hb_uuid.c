@@ -20,6 +20,7 @@
 #include <lha_internal.h>
 #include <clplumbing/cl_uuid.h>
 #include <heartbeat.h>
+#include <hb_snapshot.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -644,6 +645,7 @@ read_node_uuid_file(struct sys_config * cfg)
 		}
 		thisnode->weight = weight;
 		strncpy(thisnode->site, site, sizeof(thisnode->site));
+		hb_snapshot_dirty();
 	}
 	fclose(f);
 	/*
@@ -256,6 +256,14 @@
 #include <hb_signal.h>
 #include <hb_config.h>
 #include <hb_resource.h>
+#include <hb_metrics.h>
+#include <hb_pktfilter.h>
+#include <hb_rclass.h>
+#include <hb_dedup.h>
+#include <hb_sockbuf.h>
+#include <hb_snapshot.h>
+#include <hb_totalorder.h>
+#include <hb_trace.h>
 #include <apphb.h>
 #include <clplumbing/cl_uuid.h>
 #include "clplumbing/setproctitle.h"
@@ -317,6 +325,8 @@ static int			CoreProcessCount = 0;
 static int			managed_child_count= 0;
 int				UseOurOwnPoll = FALSE;
 static longclock_t		NextPoll = 0UL;
+static longclock_t		clustermsg_arrival = 0UL; /* of the message
+							   * being processed */
 static int			ClockJustJumped = FALSE;
 longclock_t			local_takeover_time = 0L;
 static int 			deadtime_tmpadd_count = 0;
@@ -375,9 +385,6 @@ static void	change_link_status(struct node_info* hip, struct link *lnk
 static void	comm_now_up(void);
 static void	make_daemon(void);
 static void	hb_del_ipcmsg(IPC_Message* m);
-static
-IPC_Message*	hb_new_ipcmsg(const void* data, int len, IPC_Channel* ch
-,			int refcnt);
 static void	send_to_all_media(const char * smsg, int len);
 static int	should_drop_message(struct node_info* node
 ,		const struct ha_msg* msg, const char *iface, int *);
@@ -390,7 +397,10 @@ static void	init_xmit_hist (struct msg_xmit_hist * hist);
 static void	process_rexmit(struct msg_xmit_hist * hist
 ,			struct ha_msg* msg);
 static void	update_ackseq(seqno_t new_ackseq) ;
-static void	process_clustermsg(struct ha_msg* msg, struct link* lnk);
+static void	process_clustermsg(struct ha_msg* msg, struct link* lnk
+,			longclock_t arrived);
+static void	do_process_clustermsg(struct ha_msg* msg, struct link* lnk
+,			longclock_t arrived);
 extern void	process_registerevent(IPC_Channel* chan,  gpointer user_data);
 static void	nak_rexmit(struct msg_xmit_hist * hist, 
 			   seqno_t seqno, const char*, const char * reason);
@@ -437,6 +447,16 @@ static gboolean	polled_input_dispatch(GSource* source,
 static gboolean	APIregistration_dispatch(IPC_Channel* chan, gpointer user_data);
 static gboolean	FIFO_child_msg_dispatch(IPC_Channel* chan, gpointer udata);
 static gboolean	read_child_dispatch(IPC_Channel* chan, gpointer user_data);
+static void	update_link_stats(struct node_info * thisnode
+,			struct link * lnk, const struct ha_msg * msg
+,			const char * type, seqno_t seqno, seqno_t gen
+,			seqno_t prevseq, int missing_packet, longclock_t now);
+static gboolean	seq_already_seen(struct node_info * thisnode, seqno_t gen
+,			seqno_t seq);
+static gboolean	process_dup_clustermsg(const struct hb_rc_peek * pk
+,			guint32 fp, struct hb_media * mp, longclock_t arrived);
+static IPC_Message* read_child_ipcmsg(const void * pkt, int pktlen
+,			longclock_t arrived, IPC_Channel * ch);
 static gboolean hb_update_cpu_limit(gpointer p);
 
 
@@ -782,6 +802,10 @@ make_io_childpair(int medianum, int ourproc)
 		,	__FUNCTION__, mp->type, mp->name);
 		return HA_FAIL;
 	}
+	if (mp->iomedium != NULL) {
+		/* Another medium's processes do our I/O */
+		return HA_OK;
+	}
 	if (ipc_channel_pair(mp->wchan) != IPC_OK) {
 		cl_perror("%s: cannot create hb write channel IPC", __FUNCTION__);
 		goto failexit;
@@ -1029,6 +1053,9 @@ initialize_heartbeat()
 
 	SetupFifoChild();
 
+	/* Let the read children know what we've already seen */
+	hb_rclass_init();
+
 
 	/* Start up all read/write children */
 
@@ -1036,7 +1063,9 @@ initialize_heartbeat()
 		if (make_io_childpair(j, procinfo->nprocs) != HA_OK) {
 			return HA_FAIL;
 		}
-		procinfo->nprocs += 2;
+		if (sysmedia[j]->iomedium == NULL) {
+			procinfo->nprocs += 2;
+		}
 	}
 
 	master_control_process();
@@ -1073,6 +1102,7 @@ read_child(struct hb_media* mp, int medianum)
 	hb_signal_process_pending();
 	curproc->pstat = RUNNING;
 	curproc->medianum = medianum;
+	hb_sockbuf_child(mp);
 
 	if (ANYDEBUG) {
 		/* Limit ourselves to 10% of the CPU */
@@ -1084,6 +1114,10 @@ read_child(struct hb_media* mp, int medianum)
 		int		rc;
 		int		rc2;
 		int		pktlen;
+		enum hb_rc_verdict	rcv;
+		longclock_t	arrived;
+		struct sockaddr_storage	from;
+		gboolean	hasfrom;
 
 		hb_signal_process_pending();
 		if ((pkt=mp->vf->read(mp, &pktlen)) == NULL) {
@@ -1096,13 +1130,40 @@ read_child(struct hb_media* mp, int medianum)
 			}
 			continue;
 		}
+		if (!hb_sockbuf_arrival(&arrived)) {
+			arrived = time_longclock();
+		}
+		hasfrom = hb_sockbuf_source(&from);
+		if (mp->pktframed) {
+			switch (hb_pktfilter_check(mp, pkt, pktlen)) {
+			case HB_PKTF_PASS:
+				pkt = (char *)pkt + HB_PKTF_HDRLEN;
+				pktlen -= HB_PKTF_HDRLEN;
+				break;
+			case HB_PKTF_SAMPLED:
+				curproc->pktkfiltered += HB_PKTF_SAMPLE;
+				continue;
+			default:
+				++curproc->pktrejected;
+				continue;
+			}
+		}
+		rcv = hb_rclass_classify(pkt, pktlen, medianum
+		,	hasfrom ? (struct sockaddr *)&from : NULL);
+		++curproc->rclass[rcv];
+		if (rcv != HB_RC_PASS && rcv != HB_RC_UNPARSED) {
+			continue;
+		}
 		hb_signal_process_pending();
+		if (HB_TRACE_ENABLED(pkt__read)) {
+			hb_trace_pkt_read(mp->name, pkt, pktlen);
+		}
 		
-		imsg = wirefmt2ipcmsg(pkt, pktlen, ourchan);
+		imsg = read_child_ipcmsg(pkt, pktlen, arrived, ourchan);
 		if (NULL == imsg) {
 			++nullcount;
 			if (nullcount > maxnullcount) {
-				cl_perror("%d NULL wirefmt2ipcmsg() returns"
+				cl_perror("%d NULL read_child_ipcmsg() returns"
 				" in a row. Exiting.", maxnullcount);
 				exit(10);
 			}
@@ -1127,6 +1188,49 @@ read_child(struct hb_media* mp, int medianum)
 	}
 }
 
+/*
+ * Package a packet for the master control process, with the time it
+ * reached us on the end
+ */
+static IPC_Message*
+read_child_ipcmsg(const void * pkt, int pktlen, longclock_t arrived
+,	IPC_Channel * ch)
+{
+	static char *	buf = NULL;
+	static int	bufsize = 0;
+	int		len = pktlen + (int)sizeof(arrived);
+
+	if (len > bufsize) {
+		char *	newbuf = realloc(buf, len);
+
+		if (newbuf == NULL) {
+			return NULL;
+		}
+		buf = newbuf;
+		bufsize = len;
+	}
+	memcpy(buf, pkt, pktlen);
+	memcpy(buf + pktlen, &arrived, sizeof(arrived));
+	return wirefmt2ipcmsg(buf, len, ch);
+}
+
+/*
+ * A message hb_pending_write() took off the write child's queue but
+ * couldn't copy.  It goes out next instead.
+ */
+static IPC_Message*	write_held = NULL;
+
+static IPC_Message*
+write_next(IPC_Channel* ourchan)
+{
+	IPC_Message*	ipcmsg;
+
+	if ((ipcmsg = write_held) != NULL) {
+		write_held = NULL;
+		return ipcmsg;
+	}
+	return ipcmsgfromIPC(ourchan);
+}
 
 /* Create a write child process (to write messages to hb medium) */
 static void
@@ -1150,6 +1254,7 @@ write_child(struct hb_media* mp, int medianum)
 	drop_privs(0, 0);	/* Become nobody */
 	curproc->pstat = RUNNING;
 	curproc->medianum = medianum;
+	hb_sockbuf_child(mp);
 
 	if (ANYDEBUG) {
 		/* Limit ourselves to 40% of the CPU */
@@ -1157,7 +1262,7 @@ write_child(struct hb_media* mp, int medianum)
 		cl_cpu_limit_setpercent(40);
 	}
 	for (;;) {
-		IPC_Message*	ipcmsg = ipcmsgfromIPC(ourchan);
+		IPC_Message*	ipcmsg = write_next(ourchan);
 		int		rc;
 		int		saveerrno;
 		hb_signal_process_pending();
@@ -1169,12 +1274,19 @@ write_child(struct hb_media* mp, int medianum)
 		
 		setmsalarm(config->heartbeat_ms);
 		errno = 0;
-		rc = mp->vf->write(mp, ipcmsg->msg_body, ipcmsg->msg_len);
+		if (mp->pktframed) {
+			rc = hb_pktfilter_write(mp, ipcmsg->msg_body
+			,	ipcmsg->msg_len);
+		}else{
+			rc = mp->vf->write(mp, ipcmsg->msg_body
+			,	ipcmsg->msg_len);
+		}
 		saveerrno=errno;
 		cancelmstimer();
 		hb_signal_process_pending();
 
 		if (rc != HA_OK) {
+			hb_sockbuf_write_failed(mp, saveerrno);
 			if (saveerrno == EINTR) {
 				int	flushcount = 0;
 				if (!mp->suppresserrs) {
@@ -1183,6 +1295,13 @@ write_child(struct hb_media* mp, int medianum)
 					,	mp->type, mp->name);
 				}
 				/* Throw away messages currently in our input queue */
+				if (write_held != NULL) {
+					++flushcount;
+					if (write_held->msg_done) {
+						write_held->msg_done(write_held);
+					}
+					write_held = NULL;
+				}
 				while (ourchan->recv_queue->current_qlen > 0) {
 					IPC_Message*	fmsg;
 					++flushcount;
@@ -1264,6 +1383,47 @@ write_child(struct hb_media* mp, int medianum)
 	}
 }
 
+/*
+ * Hand a write child the next message in its queue if there is one
+ * already waiting, so a medium can interleave it with one it is still
+ * sending.  The caller frees what we return.
+ */
+void *
+hb_pending_write(struct hb_media* mp, int * lenp)
+{
+	IPC_Channel*	ourchan = mp->wchan[P_READFD];
+	IPC_Message*	ipcmsg;
+	char *		copy;
+
+	if (write_held != NULL) {
+		ipcmsg = write_held;
+		write_held = NULL;
+	}else{
+		if (ourchan == NULL
+		||	!ourchan->ops->is_message_pending(ourchan)) {
+			return NULL;
+		}
+		if ((ipcmsg = ipcmsgfromIPC(ourchan)) == NULL) {
+			return NULL;
+		}
+	}
+	if ((copy = malloc(ipcmsg->msg_len + 1)) == NULL) {
+		/* Leave it for the write loop to send as it stands */
+		cl_log(LOG_ERR, "%s: out of memory copying a %d byte message"
+		" for %s %s: sending it later"
+		,	__FUNCTION__, (int)ipcmsg->msg_len, mp->type, mp->name);
+		write_held = ipcmsg;
+		return NULL;
+	}
+	memcpy(copy, ipcmsg->msg_body, ipcmsg->msg_len);
+	copy[ipcmsg->msg_len] = EOS;
+	*lenp = ipcmsg->msg_len;
+	if (ipcmsg->msg_done) {
+		ipcmsg->msg_done(ipcmsg);
+	}
+	return copy;
+}
+
 
 /*
  * Read FIFO stream messages and translate to IPC msgs
@@ -1374,6 +1534,7 @@ static gboolean
 FIFO_child_msg_dispatch(IPC_Channel* source, gpointer user_data)
 {
 	struct ha_msg*	msg;
+	hbm_time_t	start = hb_metrics_now();
 
 	if (DEBUGDETAILS) {
 		cl_log(LOG_DEBUG, "FIFO_child_msg_dispatch() {");
@@ -1386,12 +1547,89 @@ FIFO_child_msg_dispatch(IPC_Channel* source, gpointer user_data)
 		/* send_cluster_msg disposes of "msg" */
 		send_cluster_msg(msg);
 	}
+	hb_metrics_observe(HBM_DISPATCH_FIFO, start);
 	if (DEBUGDETAILS) {
 		cl_log(LOG_DEBUG, "}/*FIFO_child_msg_dispatch*/;");
 	}
 	return TRUE;
 }
 
+/*
+ * Has the master control process already dealt with this sequence
+ * number from this node, so that should_drop_message() would call
+ * another copy of it a DUPLICATE or DROPIT?
+ */
+static gboolean
+seq_already_seen(struct node_info * thisnode, seqno_t gen, seqno_t seq)
+{
+	struct seqtrack *	t = &thisnode->track;
+	int			j;
+
+	if (gen != t->generation || t->last_seq == NOSEQUENCE
+	||	seq > t->last_seq) {
+		return FALSE;
+	}
+	for (j=0; j < t->nmissing; ++j) {
+		if (t->seqmissing[j] == seq) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * A copy of a packet we've already processed, heard on another medium?
+ * If so, do what should_drop_message() and do_process_clustermsg()
+ * would have done with it, without parsing or authenticating it again:
+ * keep the link it came in on up, and count it.
+ *
+ * Anything out of the ordinary (test packet loss, a debug client which
+ * wants to see duplicates, a node we think is dead) gets the full
+ * treatment instead.
+ */
+static gboolean
+process_dup_clustermsg(const struct hb_rc_peek * pk, guint32 fp
+,	struct hb_media * mp, longclock_t arrived)
+{
+	struct node_info *	thisnode;
+	struct link *		lnk;
+	int			action;
+
+	if (!pk->hasseq || TESTRCV || debug_client_count > 0) {
+		return FALSE;
+	}
+	thisnode = lookup_node(pk->from);
+	if (thisnode == NULL || thisnode->nodetype != NORMALNODE_I
+	||	strcmp(thisnode->status, DEADSTATUS) == 0
+	||	!seq_already_seen(thisnode, pk->gen, pk->seq)
+	||	!hb_dedup_check(thisnode, pk->gen, pk->seq, fp)) {
+		return FALSE;
+	}
+
+	action = (pk->seq == thisnode->track.last_seq ? DUPLICATE : DROPIT);
+	if (HB_TRACE_ENABLED(msg__verdict)) {
+		HB_TRACE(msg__verdict, thisnode->nodename, pk->seq, pk->type
+		,	action);
+	}
+	lnk = lookup_iface(thisnode, mp->name);
+	if (lnk) {
+		update_link_stats(thisnode, lnk, NULL, pk->type, pk->seq
+		,	pk->gen, thisnode->track.last_seq, FALSE, arrived);
+	}
+	if (action == DROPIT) {
+		hb_metrics_drop(HBM_DROP_IGNORED);
+		return TRUE;
+	}
+	hb_metrics_drop(HBM_DROP_DUPLICATE);
+	if (lnk) {
+		lnk->lastupdate = arrived;
+		if (strcasecmp(lnk->status, LINKUP) != 0) {
+			change_link_status(thisnode, lnk, LINKUP);
+		}
+	}
+	return TRUE;
+}
+
 /*
  * We read a packet from a read child 
  */
@@ -1401,6 +1639,13 @@ read_child_dispatch(IPC_Channel* source, gpointer user_data)
 	struct ha_msg*	msg = NULL;
 	struct hb_media** mp = user_data;
 	int	media_idx = mp - &sysmedia[0];
+	hbm_time_t	start = hb_metrics_now();
+	IPC_Message*	imsg = NULL;
+	int		bodylen;
+	longclock_t	arrived;
+	struct hb_rc_peek	pk;
+	gboolean	peeked;
+	guint32		fp = 0;
 
 	if (media_idx < 0 || media_idx >= MAXMEDIA) {
 		cl_log(LOG_ERR, "read child_dispatch: media index is %d"
@@ -1419,19 +1664,65 @@ read_child_dispatch(IPC_Channel* source, gpointer user_data)
 		}
 		return TRUE;
 	}
-	msg = msgfromIPC(source, MSG_NEEDAUTH);
+	hb_metrics_media_in(media_idx);
+	if (source->ops->recv(source, &imsg) != IPC_OK || imsg == NULL) {
+		hb_metrics_drop(HBM_DROP_UNREADABLE);
+		hb_metrics_observe(HBM_DISPATCH_CLUSTER, start);
+		return TRUE;
+	}
+
+	/* The read child put the time the packet arrived on the end */
+	if ((bodylen = (int)imsg->msg_len - (int)sizeof(arrived)) < 0) {
+		hb_metrics_drop(HBM_DROP_UNREADABLE);
+		if (imsg->msg_done) {
+			imsg->msg_done(imsg);
+		}
+		hb_metrics_observe(HBM_DISPATCH_CLUSTER, start);
+		return TRUE;
+	}
+	memcpy(&arrived, (char *)imsg->msg_body + bodylen, sizeof(arrived));
+
+	/* Copies of packets heard on another medium take a short cut */
+	peeked = hb_rclass_peek(imsg->msg_body, bodylen, &pk)
+	&&	pk.hasseq;
+	if (peeked) {
+		fp = hb_dedup_fingerprint(imsg->msg_body, bodylen);
+		if (process_dup_clustermsg(&pk, fp, *mp, arrived)) {
+			if (imsg->msg_done) {
+				imsg->msg_done(imsg);
+			}
+			hb_metrics_observe(HBM_DISPATCH_CLUSTER, start);
+			return TRUE;
+		}
+	}
+
+	msg = wirefmt2msg(imsg->msg_body, bodylen, MSG_NEEDAUTH);
 	if (msg != NULL) {
 		const char * from = ha_msg_value(msg, F_ORIG);
 		struct link* lnk = NULL;
 		struct node_info* nip;
 
 		if (from != NULL && (nip=lookup_node(from)) != NULL) {
-			lnk = lookup_iface(nip, (*mp)->name);
+			/* One medium reads for every ping node */
+			lnk = lookup_iface(nip, nip->nodetype == PINGNODE_I
+			?	nip->nodename : (*mp)->name);
 		}
 
-		process_clustermsg(msg, lnk);
+		process_clustermsg(msg, lnk, arrived);
 		ha_msg_del(msg);  msg = NULL;
+
+		/* Remember it if more copies would only be duplicates */
+		if (peeked && (nip=lookup_node(pk.from)) != NULL
+		&&	seq_already_seen(nip, pk.gen, pk.seq)) {
+			hb_dedup_record(nip, pk.gen, pk.seq, fp);
+		}
+	}else{
+		hb_metrics_drop(HBM_DROP_UNREADABLE);
+	}
+	if (imsg->msg_done) {
+		imsg->msg_done(imsg);
 	}
+	hb_metrics_observe(HBM_DISPATCH_CLUSTER, start);
 	if (DEBUGDETAILS) {
 		cl_log(LOG_DEBUG
 		,	"}/*read_child_dispatch*/;");
@@ -1512,6 +1803,7 @@ master_control_process(void)
 	int			j;
 	GMainLoop*		mainloop;
 	guint			id;
+	const char *		metricsock;
 
 	write_hostcachefile = G_main_add_tempproc_trigger(PRI_WRITECACHE
 	,	write_hostcachedata, "write_hostcachedata"
@@ -1620,6 +1912,20 @@ master_control_process(void)
 	,	api_audit_clients, NULL, NULL);
 	G_main_setall_id(id, "client audit", 5000, 100);
 
+	/* Serve our internal metrics, if asked to */
+	if ((metricsock = GetParameterValue(KEY_METRICSOCK)) != NULL) {
+		hb_metrics_init(metricsock);
+	}
+
+	/* Let API clients read cluster state without asking us */
+	hb_snapshot_init();
+
+	/* Hand out global sequence numbers, if we're the one to do it */
+	hb_totalorder_init();
+
+	/* Keep the read children's view of what we've seen fresh */
+	hb_rclass_start();
+
 	/* Reset timeout times to "now" */
 	for (j=0; j < config->nodecount; ++j) {
 		struct node_info *	hip;
@@ -1679,7 +1985,12 @@ hb_del_ipcmsg(IPC_Message* m)
 	}
 }
 
-static IPC_Message*
+/*
+ * Make an IPC message which can be queued on several channels at once.
+ * It is freed when it has been sent (or dropped) refcnt times.
+ * All the channels must have the same msgpad as 'ch'.
+ */
+IPC_Message*
 hb_new_ipcmsg(const void* data, int len, IPC_Channel* ch, int refcnt)
 {
 	IPC_Message*	hdr;
@@ -1724,6 +2035,15 @@ hb_new_ipcmsg(const void* data, int len, IPC_Channel* ch, int refcnt)
 	return hdr;
 }
 
+/* Take one more reference to a message from hb_new_ipcmsg() */
+void
+hb_ref_ipcmsg(IPC_Message* m)
+{
+	int	refcnt = POINTER_TO_SIZE_T(m->msg_private); /*pointer cast as int*/
+
+	m->msg_private = GINT_TO_POINTER(refcnt+1);
+}
+
 
 
 /* Send this message to all of our heartbeat media */
@@ -1787,6 +2107,7 @@ send_to_all_media(const char * smsg, int len)
 				}
 			}
 		}else if (!mp->vf->isping()) {
+			hb_metrics_media_out(j);
 			++numwrites;
 		}
 		alarm(0);
@@ -2179,6 +2500,10 @@ hb_mcp_final_shutdown(gpointer p)
 		break;
 	}
 	hb_close_watchdog();
+	hb_metrics_shutdown();
+	hb_snapshot_shutdown();
+	hb_totalorder_shutdown();
+	api_shutdown();
 
 	/* Whack 'em */
 	hb_kill_core_children(SIGKILL);
@@ -3088,6 +3413,7 @@ HBDoMsg_T_REXMIT(const char * type, struct node_info * fromnode
 {
 	heartbeat_monitor(msg, PROTOCOL, iface);
 	if (fromnode != curnode) {
+		HBM_INC(HBM_REXMIT_REQ_RCVD);
 		process_rexmit(&msghist, msg);
 	}
 }
@@ -3099,7 +3425,7 @@ HBDoMsg_T_STATUS(const char * type, struct node_info * fromnode
 {
 
 	const char *	status;
-	longclock_t		messagetime = time_longclock();
+	longclock_t		messagetime = clustermsg_arrival;
 	const char	*tmpstr;
 	long		deadtime;
 	int		protover;
@@ -3130,7 +3456,8 @@ HBDoMsg_T_STATUS(const char * type, struct node_info * fromnode
 		hb_remove_msg_callback(T_ACKMSG);
 	}
 
-	if (fromnode->local_lastupdate) {
+	if (fromnode->local_lastupdate
+	&&	cmp_longclock(messagetime, fromnode->local_lastupdate) > 0) {
 		long		heartbeat_ms;
 		heartbeat_ms = longclockto_ms(sub_longclock
 		(	messagetime, fromnode->local_lastupdate));
@@ -3171,6 +3498,7 @@ HBDoMsg_T_STATUS(const char * type, struct node_info * fromnode
 		heartbeat_monitor(fromnode->saved_status_msg, KEEPIT, iface);
 		ha_msg_del(fromnode->saved_status_msg);
 		fromnode->saved_status_msg = NULL;
+		hb_snapshot_dirty();
 	}
 	/* Is the node status the same? */
 	if (strcasecmp(fromnode->status, status) != 0
@@ -3226,6 +3554,7 @@ HBDoMsg_T_STATUS(const char * type, struct node_info * fromnode
 		}
 		
 		strncpy(fromnode->status, status, sizeof(fromnode->status));
+		hb_snapshot_dirty();
 		if (!fromnode->status_suppressed) {
 			QueueRemoteRscReq(PerformQueuedNotifyWorld, msg);
 			heartbeat_monitor(msg, KEEPIT, iface);
@@ -3247,7 +3576,10 @@ HBDoMsg_T_STATUS(const char * type, struct node_info * fromnode
 	}
 
 	fromnode->rmt_lastupdate = msgtime;
-	fromnode->local_lastupdate = messagetime;
+	/* Another medium may have brought us something later already */
+	if (cmp_longclock(messagetime, fromnode->local_lastupdate) > 0) {
+		fromnode->local_lastupdate = messagetime;
+	}
 	fromnode->status_seqno = seqno;
 
 }
@@ -3447,12 +3779,196 @@ send_ack_if_necessary(const struct ha_msg* m)
 	
 }
 
+/*
+ * Fold one sample into a scaled EWMA with a gain of 1/LINKSTAT_SCALE.
+ * Same arithmetic as the RFC 3550 jitter estimator.
+ */
+#define	LINKSTAT_EWMA(avg, sample)					\
+	((avg) += (sample) - (((avg) + (LINKSTAT_SCALE/2)) >> LINKSTAT_SHIFT))
+
+/*
+ * Measure the round trip time of one of our packets from an ACK
+ * carried by the given link.  The ACK is sent by the peer when the
+ * first copy of our packet reached it, so this is the round trip
+ * over the fastest outbound path and this inbound link.
+ */
+static void
+update_link_rtt(struct link_stats * ls, const struct ha_msg * msg
+,	longclock_t now)
+{
+	struct msg_xmit_hist*	hist = &msghist;
+	const char *		to = ha_msg_value(msg, F_TO);
+	const char *		ackseq_str = ha_msg_value(msg, F_ACKSEQ);
+	seqno_t			ackseq;
+	int			slot;
+	unsigned long		rtt;
+
+	if (to == NULL || strcmp(to, curnode->nodename) != 0
+	||	ackseq_str == NULL
+	||	sscanf(ackseq_str, "%lx", &ackseq) != 1
+	||	ackseq > hist->hiseq
+	||	hist->hiseq - ackseq >= MAXMSGHIST) {
+		return;
+	}
+	slot = hist->lastmsg - (int)(hist->hiseq - ackseq);
+	if (slot < 0) {
+		slot += MAXMSGHIST;
+	}
+	if (hist->seqnos[slot] != ackseq
+	||	cmp_longclock(hist->xmittime[slot], zero_longclock) == 0) {
+		return;
+	}
+	rtt = longclockto_ms(sub_longclock(now, hist->xmittime[slot]));
+	if (ls->rttsamples++ == 0) {
+		ls->rtt = rtt;
+	}else{
+		/* Classic SRTT: 7/8 old + 1/8 new */
+		ls->rtt = (7*ls->rtt + rtt)/8;
+	}
+}
+
+/*
+ * Keep the rolling per-link statistics current.
+ *
+ * Called for every packet we hear from another node, whatever
+ * should_drop_message() thought of it.  'prevseq' is the node's
+ * last_seq from before should_drop_message() got a look at it, so
+ * we can tell new packets from copies already heard on another link.
+ * 'msg' is NULL for copies process_dup_clustermsg() took care of.
+ */
+static void
+update_link_stats(struct node_info * thisnode, struct link * lnk
+,	const struct ha_msg * msg, const char * type, seqno_t seqno
+,	seqno_t gen, seqno_t prevseq, int missing_packet, longclock_t now)
+{
+	struct link_stats *	ls = &lnk->stats;
+	struct seqtrack *	t = &thisnode->track;
+
+	/* Whatever our read process dropped came in before this one */
+	hb_fold_stale_link_stats(thisnode, lnk);
+	++ls->rcvd;
+
+	if (seqno != 0) {
+		if (gen != ls->lastgen || ls->lastseq == 0) {
+			/* First packet, or the sender restarted */
+			ls->lastgen = gen;
+			ls->lastseq = seqno;
+		}else if (seqno <= ls->lastseq) {
+			/*
+			 * Late, or retransmitted: its hole (if any) was
+			 * counted when we went past it, and a copy is
+			 * counted as a duplicate below.  Don't go back.
+			 */
+		}else if (seqno - ls->lastseq > MAXMSGHIST) {
+			/* A hole too big to be loss */
+			ls->lastseq = seqno;
+		}else{
+			ls->lost += seqno - ls->lastseq - 1;
+			ls->lastseq = seqno;
+		}
+
+		if (missing_packet
+		||	(t->last_seq == seqno && prevseq != seqno)) {
+			/* First copy of this packet on any link */
+			t->firstseq = seqno;
+			t->firstarrival = now;
+			LINKSTAT_EWMA(ls->skew, 0);
+		}else if (seqno <= t->last_seq && gen == t->generation) {
+			++ls->dup;
+			if (seqno == t->firstseq) {
+				/* The kernel may have had this copy first */
+				LINKSTAT_EWMA(ls->skew
+				,	cmp_longclock(now, t->firstarrival) > 0
+				?	longclockto_ms(sub_longclock(now
+				,		t->firstarrival))
+				:	0);
+			}
+		}
+	}
+
+	if (strcmp(type, T_STATUS) == 0) {
+		if (cmp_longclock(ls->laststatus, zero_longclock) != 0) {
+			unsigned long	interval;
+			unsigned long	delta;
+
+			interval = longclockto_ms(sub_longclock(now
+			,	ls->laststatus));
+			if (ls->lastinterval != 0) {
+				delta = interval > ls->lastinterval
+				?	interval - ls->lastinterval
+				:	ls->lastinterval - interval;
+				LINKSTAT_EWMA(ls->jitter, delta);
+			}
+			ls->lastinterval = interval;
+		}
+		ls->laststatus = now;
+	}else if (msg != NULL && strcmp(type, T_ACKMSG) == 0) {
+		update_link_rtt(ls, msg, now);
+	}
+}
+
+/*
+ * Count in the copies from thisnode which our read process for lnk
+ * dropped as stale (see hb_rclass.c) since we last looked.  They were
+ * heard on this link, and are duplicates.  Move lastseq past them too,
+ * or the next packet we do get here would count them as lost.
+ */
+void
+hb_fold_stale_link_stats(struct node_info * thisnode, struct link * lnk)
+{
+	struct link_stats *	ls = &lnk->stats;
+	struct hb_rc_stale	st;
+	unsigned long		n;
+	int			j;
+
+	for (j=0; j < nummedia; ++j) {
+		if (strcmp(sysmedia[j]->name, lnk->name) == 0) {
+			break;
+		}
+	}
+	if (j >= nummedia || !hb_rclass_stale(j, thisnode, &st)
+	||	st.count == ls->stale) {
+		return;
+	}
+	n = st.count - ls->stale;
+	ls->stale = st.count;
+	ls->rcvd += n;
+	ls->dup += n;
+
+	if (st.gen > ls->lastgen || ls->lastseq == 0) {
+		ls->lastgen = st.gen;
+		ls->lastseq = st.maxseq;
+	}else if (st.gen == ls->lastgen && st.maxseq > ls->lastseq) {
+		/* Whatever of the gap these didn't fill was lost */
+		if (st.maxseq - ls->lastseq <= MAXMSGHIST
+		&&	st.maxseq - ls->lastseq > n) {
+			ls->lost += st.maxseq - ls->lastseq - n;
+		}
+		ls->lastseq = st.maxseq;
+	}
+}
+
 /*
  * Process an incoming message from our read child processes
  * That is, packets coming from other nodes.
  */
 static void
-process_clustermsg(struct ha_msg* msg, struct link* lnk)
+process_clustermsg(struct ha_msg* msg, struct link* lnk, longclock_t arrived)
+{
+	const char *	iface = (lnk == NULL ? "?" : lnk->name);
+
+	HB_TRACE_MSG(msg__start, msg, iface);
+	do_process_clustermsg(msg, lnk, arrived);
+	HB_TRACE_MSG(msg__done, msg, iface);
+}
+
+/*
+ * 'arrived' is when the packet reached us: by the kernel's clock if
+ * the medium could tell us, otherwise when the read child got it.
+ */
+static void
+do_process_clustermsg(struct ha_msg* msg, struct link* lnk
+,	longclock_t arrived)
 {
 	struct node_info *	thisnode = NULL;
 	const char*		iface;
@@ -3465,9 +3981,11 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 	int			action;
 	const char *		cseq;
 	seqno_t			seqno = 0;
-	longclock_t		messagetime = now;
+	longclock_t		messagetime = arrived;
 	int			missing_packet =0 ;
+	seqno_t			prevseq;
 
+	clustermsg_arrival = arrived;	/* For the message callbacks */
 
 	if (lnk == NULL) {
 		iface = "?";
@@ -3522,6 +4040,7 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 		,	iface
 		,	(from? from : "<?>"));
 		cl_log_message(LOG_ERR, msg);
+		hb_metrics_drop(HBM_DROP_MALFORMED);
 		return;
 	}
 	if (cseq != NULL) {
@@ -3532,6 +4051,7 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 			,	iface
 			,	(from? from : "<?>"));
 			cl_log_message(LOG_ERR, msg);
+			hb_metrics_drop(HBM_DROP_MALFORMED);
 			return;
 		}
 	}else{
@@ -3543,6 +4063,7 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 			,	iface
 			,	(from? from : "<?>"));
 			cl_log_message(LOG_ERR, msg);
+			hb_metrics_drop(HBM_DROP_MALFORMED);
 			return;
 		}
 	}
@@ -3551,6 +4072,7 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 	
 
 	if (sscanf(ts, TIME_X, &msgtime) != 1 || ts == 0 || msgtime == 0) {
+		hb_metrics_drop(HBM_DROP_MALFORMED);
 		return;
 	}
 	
@@ -3563,6 +4085,7 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 			,   "process_status_message: bad node [%s] in message"
 			,	from);
 			cl_log_message(LOG_ERR, msg);
+			hb_metrics_drop(HBM_DROP_UNKNOWN_NODE);
 			return;
 		}else{
 			/* If a node isn't in our config, then add it... */
@@ -3596,6 +4119,7 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 		if (thisnode != curnode &&  TestRand(rcv_loss_prob)) {
 			char* match = strstr(TestOpts->allow_nodes,from);
 			if ( NULL == match || ';' != *(match+strlen(from)) ) {
+				hb_metrics_drop(HBM_DROP_TESTLOSS);
 				return;
 			}
 		}
@@ -3606,14 +4130,31 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 
 	/* Is this message a duplicate, or destined for someone else? */
 
+	prevseq = thisnode->track.last_seq;
 	action=should_drop_message(thisnode, msg, iface, &missing_packet);
+	hb_rclass_seen(thisnode);
+	if (HB_TRACE_ENABLED(msg__verdict)) {
+		HB_TRACE(msg__verdict, thisnode->nodename, seqno, type, action);
+	}
+	if (lnk) {
+		const char *	cgen = ha_msg_value(msg, F_HBGENERATION);
+		seqno_t		gen = 0;
+
+		if (cgen != NULL) {
+			sscanf(cgen, "%lx", &gen);
+		}
+		update_link_stats(thisnode, lnk, msg, type, seqno, gen
+		,	prevseq, missing_packet, messagetime);
+	}
 	switch (action) {
 		case DROPIT:
 		/* Ignore it */
+		hb_metrics_drop(HBM_DROP_IGNORED);
 		heartbeat_monitor(msg, action, iface);
 		return;
 		
 		case DUPLICATE:
+		hb_metrics_drop(HBM_DROP_DUPLICATE);
 		heartbeat_monitor(msg, action, iface);
 		/* fall through */
 		case KEEPIT:
@@ -4452,6 +4993,7 @@ set_local_status(const char * newstatus)
 		 */
 
 		strncpy(curnode->status, newstatus, sizeof(curnode->status));
+		hb_snapshot_dirty();
 		send_local_status();
 		cl_log(LOG_INFO, "Local status now set to: '%s'", newstatus);
 		return HA_OK;
@@ -4652,8 +5194,13 @@ change_link_status(struct node_info *hip, struct link *lnk
 	}
 
 	strncpy(lnk->status, newstat, sizeof(lnk->status));
+	hb_snapshot_dirty();
 	cl_log(LOG_INFO, "Link %s:%s %s.", hip->nodename
 	,	lnk->name, lnk->status);
+	if (HB_TRACE_ENABLED(link__status)) {
+		HB_TRACE(link__status, hip->nodename, hip->track.last_seq
+		,	lnk->status, lnk->name);
+	}
 
 	if (	ha_msg_add(lmsg, F_TYPE, T_IFSTATUS) != HA_OK
 	||	ha_msg_add(lmsg, F_NODE, hip->nodename) != HA_OK
@@ -4675,6 +5222,11 @@ static void
 mark_node_dead(struct node_info *hip)
 {
 	cl_log(LOG_WARNING, "node %s: is dead", hip->nodename);
+	if (HB_TRACE_ENABLED(node__dead)) {
+		HB_TRACE(node__dead, hip->nodename, hip->track.last_seq
+		,	DEADSTATUS, longclockto_ms(sub_longclock(time_longclock()
+		,	hip->local_lastupdate)));
+	}
 
 	if (hip == curnode) {
 		/* Uh, oh... we're dead! */
@@ -4694,7 +5246,8 @@ mark_node_dead(struct node_info *hip)
 		--live_node_count;
 	}
 	strncpy(hip->status, DEADSTATUS, sizeof(hip->status));
-	
+	hb_snapshot_dirty();
+
 
 	/* THIS IS RESOURCE WORK!  FIXME */
 	hb_rsc_recover_dead_resources(hip);
@@ -4737,6 +5290,9 @@ cause_shutdown_restart()
 void
 heartbeat_monitor(struct ha_msg * msg, int msgtype, const char * iface)
 {
+	if (msgtype == KEEPIT) {
+		hb_totalorder_msg(msg);
+	}
 	api_heartbeat_monitor(msg, msgtype, iface);
 }
 
@@ -5914,7 +6470,7 @@ process_outbound_packet(struct msg_xmit_hist*	hist
 	*/
 
 	/* Direct message to "loopback" processing */
-	process_clustermsg(msg, NULL);
+	process_clustermsg(msg, NULL, time_longclock());
 
 	send_to_all_media(smsg, len);
 	free(smsg);
@@ -6116,6 +6672,7 @@ init_xmit_hist (struct msg_xmit_hist * hist)
 		hist->msgq[j] = NULL;
 		hist->seqnos[j] = 0;
 		hist->lastrexmit[j] = zero_longclock;
+		hist->xmittime[j] = zero_longclock;
 	}
 }
 
@@ -6230,7 +6787,9 @@ add2_xmit_hist (struct msg_xmit_hist * hist, struct ha_msg* msg
 	hist->msgq[slot] = msg;
 	hist->seqnos[slot] = seq;
 	hist->lastrexmit[slot] = 0L;
+	hist->xmittime[slot] = time_longclock();
 	hist->lastmsg = slot;
+	HB_TRACE_MSG(xmit__hist, msg, hist->hiseq - hist->lowseq);
 	
 	if (enable_flow_control
 	&&	live_node_count > 1) {
@@ -6411,6 +6970,9 @@ process_rexmit(struct msg_xmit_hist * hist, struct ha_msg* msg)
 			/* If it didn't convert, throw original msg away */
 			if (smsg != NULL) {
 				hist->lastrexmit[msgslot] = now;
+				HBM_INC(HBM_REXMIT_SENT);
+				HB_TRACE_MSG(rexmit, hist->msgq[msgslot]
+				,	fromnodename);
 				send_to_all_media(smsg
 				  ,	len);
 				free(smsg);
@@ -6450,6 +7012,7 @@ nak_rexmit(struct msg_xmit_hist * hist,
 	}
 	
 	snprintf(sseqno, sizeof(sseqno), "%lx", seqno);
+	HBM_INC(HBM_REXMIT_NAKS);
 	cl_log(LOG_ERR, "Cannot rexmit pkt %lu for %s: %s", 
 	       seqno, fromnodename, reason);
 	
@@ -49,6 +49,7 @@ extern int		WeAreRestarting;
 extern int		shutdown_in_progress;
 extern longclock_t	local_takeover_time;
 extern enum comm_state	heartbeat_comm_state;
+extern int		debug_client_count;	/* hb_api.c */
 
 /* Used by signal handlers */
 void hb_init_watchdog(void);
@@ -83,6 +84,16 @@ gboolean hb_mcp_final_shutdown(gpointer p);
 
 struct ha_msg * add_control_msg_fields(struct ha_msg* ret);
 
+/* Reference counted IPC messages shared between several channels */
+IPC_Message*	hb_new_ipcmsg(const void* data, int len, IPC_Channel* ch
+,			int refcnt);
+void		hb_ref_ipcmsg(IPC_Message* m);
+
+/* Next message queued for a write child (NULL: none yet) */
+void *		hb_pending_write(struct hb_media* mp, int * lenp);
+void		hb_fold_stale_link_stats(struct node_info * thisnode
+,			struct link * lnk);
+
 /* simple replacement for deprecated g_strdown(); */
 void inplace_ascii_strdown(char *str);
 #endif /* _HEARTBEAT_PRIVATE_H */
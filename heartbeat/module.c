@@ -43,9 +43,13 @@
 #include <ha_msg.h>
 #include <hb_module.h>
 #include <hb_signal.h>
+#include <heartbeat_private.h>
 #include <pils/generic.h>
 #include <HBcomm.h>
 #include <hb_config.h>
+#include <hb_pktfilter.h>
+#include <hb_sockbuf.h>
+#include <hb_ping.h>
 #include <stonith/st_ttylock.h>
 
 #ifndef RTLD_NOW
@@ -65,6 +69,7 @@ static GHashTable*	Parameters = NULL;
 static void		RegisterNewMedium(struct hb_media* mp);
 const char *	GetParameterValue(const char * name);
 static void		RegisterCleanup(void(*)(void));
+static const char *	PeerNodeName(int n);
 struct hb_media_imports	CommImports =
 {	GetParameterValue	/* So plugins can get option values */
 ,	RegisterNewMedium
@@ -73,6 +78,17 @@ struct hb_media_imports	CommImports =
 ,	StringToBaud
 ,	RegisterCleanup
 ,	hb_signal_process_pending
+,	hb_pktfilter_attach
+,	hb_sockbuf_open
+,	hb_sockbuf_recvfrom
+,	hb_sockbuf_control
+,	hb_ping_add
+,	hb_ping_open
+,	hb_ping_close
+,	hb_ping_read
+,	hb_ping_write
+,	hb_pending_write
+,	PeerNodeName
 };
 
 extern struct hb_media* sysmedia[];
@@ -218,3 +234,26 @@ RegisterCleanup(void(*fun)(void))
 {
 	localdie = fun;
 }
+
+/*
+ * PeerNodeName() lets media which send to every other node walk the
+ * node table without reaching into config.
+ */
+static const char *
+PeerNodeName(int n)
+{
+	int	j;
+
+	for (j = 0; j < config->nodecount; ++j) {
+		const struct node_info *	node = &config->nodes[j];
+
+		if (node->nodetype != NORMALNODE_I
+		||	strcasecmp(node->nodename, localnodename) == 0) {
+			continue;
+		}
+		if (n-- == 0) {
+			return node->nodename;
+		}
+	}
+	return NULL;
+}
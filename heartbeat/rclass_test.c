@@ -0,0 +1,144 @@
+/*
+ * rclass_test: the read processes' media_ratelimit against spoofed
+ *		senders
+ *
+ * A stranger who writes a known node's name in F_ORIG, and sends far
+ * more than the limit, must not use up that node's share: the node's
+ * own packets, from its own address, must all still get through.
+ * Returns the number of checks which failed.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <glib.h>
+#include <heartbeat.h>
+#include <ha_msg.h>
+#include <hb_api.h>
+#include <hb_config.h>
+#include <heartbeat_private.h>
+#include <hb_rclass.h>
+
+#define	TESTNODE	"node1"
+#define	TESTRATE	10		/* media_ratelimit */
+#define	TESTGEN		1
+#define	TESTSEQ		100		/* node1's last message */
+
+/* What hb_rclass.c needs from the rest of heartbeat */
+static struct sys_config	testconfig;
+struct sys_config *		config = &testconfig;
+int				debug_client_count = 0;
+
+static int	errcount = 0;
+
+const char *	GetParameterValue(const char * name);
+int		main(int argc, char ** argv);
+
+const char *
+GetParameterValue(const char * name)
+{
+	static char	rate[16];
+
+	if (strcmp(name, KEY_MEDIARATE) == 0) {
+		snprintf(rate, sizeof(rate), "%d", TESTRATE);
+		return rate;
+	}
+	return NULL;
+}
+
+static void
+check(gboolean ok, const char * what)
+{
+	printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+	if (!ok) {
+		++errcount;
+	}
+}
+
+static struct sockaddr_in
+addr(const char * ip)
+{
+	struct sockaddr_in	a;
+
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	inet_pton(AF_INET, ip, &a.sin_addr);
+	return a;
+}
+
+/* Send n status packets "from" orig, return how many got through */
+static int
+send_status(const struct sockaddr_in * from, const char * orig
+,	seqno_t * seq, int n)
+{
+	char	pkt[512];
+	int	passed = 0;
+	int	j;
+
+	for (j=0; j < n; ++j) {
+		int	len;
+
+		len = snprintf(pkt, sizeof(pkt), "%s%s=%s\n%s=%s\n%s=%lx\n"
+		"%s=%lx\n%s", MSG_START, F_TYPE, T_STATUS, F_ORIG, orig
+		,	F_SEQ, (unsigned long)(*seq)++
+		,	F_HBGENERATION, (unsigned long)TESTGEN, MSG_END);
+		if (hb_rclass_classify(pkt, len+1, 0
+		,	(const struct sockaddr *)from) == HB_RC_PASS) {
+			++passed;
+		}
+	}
+	return passed;
+}
+
+int
+main(int argc, char ** argv)
+{
+	struct node_info *	node = &config->nodes[0];
+	struct sockaddr_in	real = addr("192.168.1.1");
+	struct sockaddr_in	spoofer = addr("10.9.9.9");
+	seqno_t			realseq = TESTSEQ;
+	seqno_t			fakeseq = TESTSEQ;
+	int			n;
+
+	node->nodetype = NORMALNODE_I;
+	strncpy(node->nodename, TESTNODE, sizeof(node->nodename)-1);
+	strncpy(node->status, ACTIVESTATUS, sizeof(node->status)-1);
+	node->track.generation = TESTGEN;
+	node->track.last_seq = TESTSEQ;
+	config->nodecount = 1;
+	config->rtjoinconfig = HB_JOIN_NONE;
+
+	if (hb_rclass_init() != HA_OK) {
+		printf("FAIL: cannot set up the seen table\n");
+		return 1;
+	}
+
+	n = send_status(&spoofer, TESTNODE, &fakeseq, 10*TESTRATE);
+	check(n <= TESTRATE, "a flood from a stranger is held to the limit");
+
+	n = send_status(&real, TESTNODE, &realseq, TESTRATE);
+	check(n == TESTRATE, "the node it claims to be still gets through");
+
+	n = send_status(&real, TESTNODE, &realseq, TESTRATE);
+	check(n < TESTRATE, "... until it is over the limit itself");
+
+	return errcount;
+}
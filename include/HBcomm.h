@@ -20,6 +20,9 @@
 #ifndef HBCOMM_H
 #	define HBCOMM_H 1
 
+#include <sys/types.h>
+#include <sys/socket.h>
+
 #define HB_COMM_TYPE	HBcomm
 #define HB_COMM_TYPE_S	"HBcomm"
 
@@ -49,11 +52,39 @@ struct hb_media_imports {
 	int		(*StrToBaud)(const char *);	/* Convert baudrate */
 	void		(*RegisterCleanup)(void(*)(void));
 	void		(*CheckForEvents)(void);	/* Check for signals */
+	void		(*FilterMedium)(struct hb_media* mp, int sockfd);
+					/* Have packets filtered (media_filter) */
+	void		(*TuneMedium)(struct hb_media* mp, int rsockfd
+	,			int wsockfd);	/* Count and tune socket buffers */
+	ssize_t		(*RecvFrom)(struct hb_media* mp, int sockfd
+	,			void * buf, size_t len, int flags
+	,			struct sockaddr * from, socklen_t * fromlen);
+					/* recvfrom() on a tuned socket */
+	void		(*MediumControl)(struct hb_media* mp
+	,			struct msghdr * msg);
+					/* Ancillary data from a tuned socket */
+	int		(*PingAdd)(struct hb_media* mp, const char * plugin
+	,			const char * host);
+					/* Have the ping engine ping host */
+	int		(*PingOpen)(struct hb_media* mp);
+	int		(*PingClose)(struct hb_media* mp);
+	void*		(*PingRead)(struct hb_media* mp, int* lenp);
+	int		(*PingWrite)(struct hb_media* mp, void* msg, int len);
+					/* The ping engine's medium functions */
+	void*		(*NextWrite)(struct hb_media* mp, int* lenp);
+					/* Write child: next queued message, if
+					 * any (caller frees it) */
+	const char *	(*PeerNode)(int n);
+					/* n'th normal node other than us, or
+					 * NULL past the last */
 	/* Actually there are lots of other dependencies that ought to
 	 * be handled, but this is a start ;-)
 	 */
 };
 
+/* Room to leave for ancillary data to hand to MediumControl */
+#define	HBCOMM_CMSGLEN	128
+
 #define	PKTTRACE	4
 #define	PKTCONTTRACE	5
 
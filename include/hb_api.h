@@ -64,6 +64,74 @@ typedef void (*llc_cstatus_callback_t) (const char *node
 ,	const char * client, const char * status
 ,	void* private_date);
 
+typedef void (*llc_reply_callback_t) (unsigned long reqid
+,	const struct ha_msg* reply, void* private_data);
+
+/*
+ *	Rolling receive statistics for one heartbeat link, as seen
+ *	by the local node.  Times are in milliseconds.
+ */
+struct ll_linkstats {
+	unsigned long	rcvd;	/* packets received on this link */
+	unsigned long	lost;	/* gaps in the sender's sequence numbers */
+	unsigned long	dup;	/* packets already received on another link */
+	unsigned long	jitter;	/* smoothed heartbeat inter-arrival jitter */
+	unsigned long	skew;	/* smoothed delay behind the fastest link */
+	unsigned long	rtt;	/* smoothed ACK round trip (0: no samples) */
+	unsigned long	age;	/* time since we last heard on this link */
+	unsigned long	ovfl;	/* our receive buffer overflows on this
+				 * medium, for all nodes */
+};
+
+/* Messages we've read from heartbeat, but not yet handed over */
+struct ll_msgq_stats {
+	unsigned long	queued;		/* messages waiting to be read */
+	unsigned long	queued_bytes;	/* ... and their total size */
+	unsigned long	max_bytes;	/* set_msgq_limit() (0: no limit) */
+	unsigned long	dropped;	/* messages dropped over the limit */
+	unsigned long	dropped_bytes;	/* ... and their total size */
+};
+
+/* The whole cluster as seen by get_cluster_state() */
+struct ll_link_state {
+	const char *	name;
+	const char *	status;
+};
+
+struct ll_node_state {
+	const char *		name;
+	const char *		status;
+	const char *		type;
+	const char *		site;
+	int			weight;
+	int			nlinks;
+	struct ll_link_state*	links;
+};
+
+struct ll_cluster_state {
+	unsigned long		version;
+	int			nnodes;
+	struct ll_node_state*	nodes;
+};
+
+/*
+ * One change reported by get_changes().  'kind' is one of
+ *	"node"		node status is now 'value' ("deleted" if it's gone)
+ *	"link"		interface 'item' status is now 'value'
+ *	"weight"	node weight is now 'value'
+ *	"site"		node site is now 'value'
+ *	"client"	local client 'item' is now 'value' (join or leave)
+ *	"resources"	our resource state is now 'value'
+ * 'item' is "" when it doesn't apply.
+ */
+struct ll_state_change {
+	unsigned long		version;
+	const char *		kind;
+	const char *		node;
+	const char *		item;
+	const char *		value;
+};
+
 typedef struct ll_cluster {
 	void *		ll_cluster_private;
 	struct llc_ops*	llc_ops;
@@ -277,7 +345,9 @@ struct llc_ops {
 	int		(*msgready)(ll_cluster_t*);
 /*
  *	setmsgsignal:	Associates the given signal with the "message waiting"
- *			condition.
+ *			condition.  Heartbeat sends it at most once per pass
+ *			through its main loop.  Signal 0 (the default) means
+ *			no signal: wait for inputfd() to become readable.
  */
 	int		(*setmsgsignal)(ll_cluster_t*, int signo);
 /*
@@ -392,6 +462,103 @@ struct llc_ops {
 	
 	     
 	const char * (*errmsg)(ll_cluster_t*);
+
+/*
+ *	if_stats:	Fill in the receive statistics of the given interface
+ *			to the given node.
+ */
+	int		(*if_stats)(ll_cluster_t*, const char * nodename
+,			const char *iface, struct ll_linkstats * stats);
+
+/*
+ *	set_msg_filter:	Only deliver messages whose F_TYPE is in 'types'
+ *			and whose originating node is in 'nodes'.
+ *			Both are NULL-terminated lists; NULL (or an empty
+ *			list) means no restriction.  The filtering is done
+ *			by heartbeat, before messages are sent to us.
+ *			Messages sent to this client by name always pass.
+ */
+	int		(*set_msg_filter)(ll_cluster_t*, const char ** types
+,			const char ** nodes);
+
+/*
+ *	get_cluster_state: Return the status, type, weight and site of
+ *			every node, and the status of each of its
+ *			interfaces, all at once.  If the state is still
+ *			at version 'since' *state is set to NULL instead.
+ *			Pass 0 to always get it.  The state belongs to
+ *			us, and is good until the next call.
+ */
+	int		(*get_cluster_state)(ll_cluster_t*, unsigned long since
+,			const struct ll_cluster_state ** state);
+
+/*
+ *	send_request:	Send an API query (API_NODESTATUS, API_IFLIST, ...)
+ *			without waiting for its answer.  'fields' is a
+ *			NULL-terminated list of name, value pairs to go
+ *			in the request (F_NODENAME, host, NULL, say).
+ *			Returns the request id, or 0 on failure.
+ *
+ *			'callback' is called from rcvmsg() (and so from
+ *			a G_main_add_ll_cluster() dispatch function)
+ *			with each reply heartbeat sends - several for
+ *			queries answered with API_MORE.  Any number of
+ *			requests may be outstanding.  One heartbeat
+ *			can't carry out gets a single API_FAILURE reply.
+ *			If we sign off first, it is called once more
+ *			with a NULL reply.
+ *			API_CLIENTSTATUS can't be sent this way.
+ */
+	unsigned long	(*send_request)(ll_cluster_t*, const char * reqtype
+,			const char ** fields, llc_reply_callback_t callback
+,			void * private_data);
+
+/*
+ *	get_changes:	Return what changed since state version 'since'
+ *			(from get_cluster_state() or an earlier call),
+ *			oldest first, and the version they bring us to.
+ *			If heartbeat no longer remembers that far back
+ *			*nchanges is set to -1: call get_cluster_state()
+ *			with 0 and carry on from its version.  The
+ *			changes belong to us, and are good until the
+ *			next call.
+ */
+	int		(*get_changes)(ll_cluster_t*, unsigned long since
+,			unsigned long * version
+,			const struct ll_state_change ** changes, int * nchanges);
+
+/*
+ *	set_msgq_limit:	Limit how many bytes of messages we keep queued
+ *			up for a client which isn't reading them (64M
+ *			by default, 0 for no limit).  Past that, new
+ *			messages are dropped, except for the answers to
+ *			our own requests.
+ */
+	int		(*set_msgq_limit)(ll_cluster_t*, unsigned long maxbytes);
+
+/*
+ *	get_msgq_stats:	Return the state of our message queue, and how
+ *			much has been dropped from it.
+ */
+	int		(*get_msgq_stats)(ll_cluster_t*
+,			struct ll_msgq_stats * stats);
+
+/*
+ *	send_total_ordered_clustermsg: Send a message to all cluster
+ *			members, to be delivered on every node in the
+ *			same order as every other message sent this
+ *			way, from any node (our own included).  One node
+ *			numbers them all, so each costs an extra batched
+ *			message's latency over send_ordered_clustermsg.
+ *			Don't filter these message types away with
+ *			set_msg_filter(): ordered delivery would stop
+ *			at the first one we never get.  A message whose
+ *			place in the order is still unknown after five
+ *			seconds is delivered anyway, with the field
+ *			F_TOBROKEN ("tobroken") set to tell you so.
+ */
+	int		(*send_total_ordered_clustermsg)(ll_cluster_t*
+,			struct ha_msg* msg);
 };
 
 /* Parameters we can ask for via get_parameter */
@@ -443,6 +610,12 @@ struct llc_ops {
 #define KEY_ENV		"env"
 #define KEY_MEMRESERVE	"memreserve"
 #define KEY_MAX_REXMIT_DELAY "max_rexmit_delay"
+#define KEY_METRICSOCK	"metrics_socket"
+#define KEY_MEDIAFILTER	"media_filter"
+#define KEY_MEDIARATE	"media_ratelimit"
+#define KEY_MEDIABUFMAX	"media_bufmax"
+#define KEY_SERIALFRAME	"serial_framing"
+#define KEY_SERIALZLIB	"serial_compress"
 #define KEY_LOG_CONFIG_CHANGES "record_config_changes"
 #define KEY_LOG_PENGINE_INPUTS "record_pengine_inputs"
 #define KEY_CONFIG_WRITES_ENABLED "enable_config_writes"
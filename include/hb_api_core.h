@@ -49,7 +49,10 @@ typedef struct client_process {
 	const char*	removereason;/* non-NULL if client is being removed */
 	IPC_Channel*chan;	/* client IPC channel */
 	GCHSource*	gsource;	/* return from G_main_add_fd() */
-	int    	signal;		/* What signal to indicate new msgs */
+	int    	signal;		/* Signal for new msgs (0: none) */
+	int	sigpending;	/* TRUE if it is owed that signal */
+	GHashTable*	type_filter;	/* F_TYPEs it wants (NULL: all) */
+	GHashTable*	node_filter;	/* F_ORIGs it wants (NULL: all) */
 	int   	desired_types;	/* A bit mask of desired message types*/
 	struct client_process*  next;
 	GHashTable*	seq_snapshot_table;
@@ -88,6 +91,9 @@ typedef struct client_process {
 #define	API_SIGNOFF		"signoff"
 #define	API_SETFILTER		"setfilter"
 #	define	F_FILTERMASK	"fmask"
+#define	API_SETMSGFILTER	"setmsgfilter"
+#	define	F_FILTERTYPES	"ftypes"	/* space separated */
+#	define	F_FILTERNODES	"fnodes"	/* space separated */
 #define	API_SETSIGNAL		"setsignal"
 #	define	F_SIGNAL	"signal"
 #define	API_NODELIST		"nodelist"
@@ -98,11 +104,25 @@ typedef struct client_process {
 #define	API_NODESITE		"nodesite"
 #define	API_NODETYPE		"nodetype"
 #define	API_NUMNODES		"numnodes"
+#define	API_GETCLUSTERSTATE	"clusterstate"
+#	define	F_STATEVERSION	"stversion"
+#	define	F_CLUSTERSTATE	"cstate"
+#define	API_GETCHANGES		"changes"	/* Since F_STATEVERSION */
+#	define	F_CHANGES	"changelist"
+#	define	F_RESYNC	"resync"
 
 #define	API_IFLIST		"iflist"
 #	define	F_IFNAME	"ifname"
 #define	API_IFLIST_END		"iflist-end"
 #define	API_IFSTATUS		"ifstatus"
+#	define	F_LINKRCVD	"lnkrcvd"
+#	define	F_LINKLOST	"lnklost"
+#	define	F_LINKDUP	"lnkdup"
+#	define	F_LINKJITTER	"lnkjitter"
+#	define	F_LINKSKEW	"lnkskew"
+#	define	F_LINKRTT	"lnkrtt"
+#	define	F_LINKAGE	"lnkage"
+#	define	F_LINKOVFL	"lnkovfl"
 #define	API_GETPARM		"getparm"
 #define	API_GETRESOURCES	"getrsc"
 
@@ -115,6 +135,16 @@ typedef struct client_process {
 #define API_SET_SENDQLEN	"set_sendqlen"
 #	define F_SENDQLEN	"sendqlen"
 
+/* Echoed back in the response, so requests can be pipelined */
+#define	F_REQID			"reqid"
+
+/* Total order broadcast (send_total_ordered_clustermsg()) */
+#define	F_TOTALORDER		"totord"	/* Marks a client message */
+#define	T_TOSEQ			"toseq"		/* From the sequencer */
+#	define	F_TOGSEQ	"togseq"	/* Global number of the first */
+#	define	F_TOLIST	"tolist"	/* "orig gen seq" per line */
+#define	F_TOBROKEN		"tobroken"	/* Delivered out of order */
+
 #define	API_OK			"OK"
 #define	API_FAILURE		"fail"
 #define	API_BADREQ		"badreq"
@@ -138,7 +168,10 @@ void api_process_registration(struct ha_msg *msg);
 void process_api_msgs(fd_set* inputs, fd_set* exceptions);
 int  compute_msp_fdset(fd_set* set, int fd1, int fd2);
 gboolean api_audit_clients(gpointer p);
+void api_shutdown(void);
 client_proc_t*	find_client(const char * fromid, const char * pid);
+struct node_info;
+const char *	api_node_status(const struct node_info *node);
 gboolean	all_clients_resume(void);
 gboolean	all_clients_pause(void);
 
@@ -0,0 +1,87 @@
+/*
+ * hb_snapshot.h: layout of the read-only cluster state snapshot which
+ *		heartbeat publishes in shared memory for its API clients.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * NOTE:  Like hb_api_core.h, this is shared only between heartbeat and
+ * its client library, and should NOT be installed anywhere.
+ */
+
+#ifndef _HB_SNAPSHOT_H
+#	define _HB_SNAPSHOT_H 1
+
+#include <sys/types.h>
+#include <heartbeat.h>
+
+#define	HB_SNAPSHOT_FILE	HA_VARRUNDIR "/heartbeat/clusterstate"
+#define	HB_SNAPSHOT_MAGIC	0x48425331	/* "HBS1" */
+
+#define	HB_SNAP_MAXLINKS	(4*MAXNODE)	/* links[] pool size */
+#define	HB_SNAP_MAXCLIENTS	64
+#define	HB_SNAP_CLIENTIDLEN	32	/* == sizeof(client_proc_t.client_id) */
+
+/*
+ * The master control process is the only writer.  It makes seq odd,
+ * updates everything after it, then makes seq even again.  Readers
+ * copy what they want out between two reads of an even seq and retry
+ * if it changed.  A reader that can't get a stable copy, or finds
+ * valid == 0, should just ask heartbeat over IPC instead.
+ */
+
+#define	HB_SNAP_BARRIER()	__sync_synchronize()
+
+struct hb_snap_link {
+	char		name[HOSTLENG];		/* ping links are named for the node */
+	char		status[STATUSLENG];
+};
+
+struct hb_snap_node {
+	char		name[HOSTLENG];
+	char		status[STATUSLENG];	/* as API_NODESTATUS reports it */
+	char		site[HOSTLENG];
+	int		nodetype;		/* NORMALNODE_I or PINGNODE_I */
+	int		weight;
+	int		firstlink;		/* index into links[] */
+	int		nlinks;			/* -1: not in the snapshot */
+};
+
+struct hb_snapshot {
+	unsigned		magic;
+	unsigned		size;		/* sizeof(struct hb_snapshot) */
+	volatile unsigned	seq;		/* odd while being updated */
+	/* Everything below here is protected by seq */
+	unsigned		valid;		/* FALSE once heartbeat stops */
+	unsigned long		version;	/* bumped on every change */
+	pid_t			pid;		/* of the master control process */
+	char			resources[STATUSLENG];	/* "": ask over IPC */
+	int			nnodes;
+	int			nlinks;
+	int			nclients;	/* local clients; -1: too many */
+	char			clients[HB_SNAP_MAXCLIENTS][HB_SNAP_CLIENTIDLEN];
+	struct hb_snap_node	nodes[MAXNODE];
+	struct hb_snap_link	links[HB_SNAP_MAXLINKS];
+};
+
+/* Publishing side - master control process only */
+int	hb_snapshot_init(void);
+void	hb_snapshot_dirty(void);
+void	hb_snapshot_update(void);
+unsigned long	hb_snapshot_version(void);
+gboolean	hb_snapshot_changes(unsigned long since, GString * changes);
+void	hb_snapshot_shutdown(void);
+
+#endif /* _HB_SNAPSHOT_H */
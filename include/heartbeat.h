@@ -246,6 +246,32 @@ struct seqtrack {
 				      *we send back an ACK
 				    */
 	seqno_t		ackseq; /* ACKed seq*/
+	seqno_t		firstseq;	/* seq of last newly arrived msg */
+	longclock_t	firstarrival;	/* ... and when it first arrived */
+};
+
+/*
+ * Rolling receive statistics for one link to one node.
+ * Updated for every packet (including cross-media duplicates), so
+ * everything in here has to stay O(1) and allocation free.
+ * Time values are in ms; jitter and skew are kept scaled by
+ * LINKSTAT_SCALE so the 1/16 gain EWMA doesn't lose precision.
+ */
+#define	LINKSTAT_SHIFT	4
+#define	LINKSTAT_SCALE	(1UL<<LINKSTAT_SHIFT)
+struct link_stats {
+	unsigned long	rcvd;		/* packets heard on this link */
+	unsigned long	lost;		/* gaps in the sender's seq stream */
+	unsigned long	dup;		/* copies already heard elsewhere */
+	seqno_t		lastseq;	/* highest seq seen on this link */
+	seqno_t		lastgen;	/* sender generation of lastseq */
+	longclock_t	laststatus;	/* arrival time of last T_STATUS */
+	unsigned long	lastinterval;	/* last T_STATUS inter-arrival */
+	unsigned long	jitter;		/* EWMA |interval delta| (scaled) */
+	unsigned long	skew;		/* EWMA delay vs. first copy (scaled) */
+	unsigned long	rtt;		/* smoothed ACK round trip time */
+	unsigned long	rttsamples;
+	unsigned long	stale;		/* read process drops counted so far */
 };
 
 struct link {
@@ -254,6 +280,7 @@ struct link {
 	int		isping;
 	char		status[STATUSLENG]; /* up or down */
 	TIME_T rmt_lastupdate; /* node's idea of last update time for this link */
+	struct link_stats stats;
 };
 
 #define	NORMALNODE_I	0
@@ -348,6 +375,9 @@ struct hb_media {
 		/* Written to by the read child processes.  */
 	GCHSource*	readsource;
 	GCHSource*	writesource;
+	gboolean	pktframed;	/* Packets carry a hb_pktfilter header */
+	gboolean	pktfiltered;	/* ... which the kernel checks for us */
+	struct hb_media*iomedium;	/* Does our I/O for us (no processes) */
 };
 
 int parse_authfile(void);
@@ -356,6 +386,7 @@ struct msg_xmit_hist {
 	struct ha_msg*	msgq[MAXMSGHIST];
 	seqno_t		seqnos[MAXMSGHIST];
 	longclock_t	lastrexmit[MAXMSGHIST];
+	longclock_t	xmittime[MAXMSGHIST];	/* for ACK round trip times */
 	int		lastmsg;
 	seqno_t		hiseq;
 	seqno_t		lowseq; /* one less than min actually present */
@@ -42,12 +42,15 @@
 #include <sys/utsname.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdarg.h>
 #include <heartbeat.h>
 #include <hb_api_core.h>
 #include <hb_api.h>
+#include <hb_snapshot.h>
 #include <glib.h>
 #include <clplumbing/cl_random.h>
+#include "totalorder.h"
 
 #define CLIENTID_MAXLEN		36
 struct sys_config *		config  = NULL;
@@ -70,12 +73,21 @@ struct iflist_entry {
 };
 
 /*
- *	Queue of messages to be read later...
+ *	Queue of messages to be read later: a ring which doubles when full
  */
 struct MsgQueue {
 	struct ha_msg *		value;
-	struct MsgQueue *	next;
-	struct MsgQueue *	prev;
+	size_t			len;		/* get_stringlen(value) */
+};
+#define	MSGQ_MINSIZE	16
+#define	MSGQ_MAXIDLE	1024	/* Free anything bigger once it empties */
+#define	MSGQ_MAXBYTES	(64*1024*1024)	/* Default set_msgq_limit() */
+
+/* A send_request() we haven't had the (final) answer to */
+struct pending_req {
+	unsigned long		reqid;
+	llc_reply_callback_t	callback;
+	void *			private_data;
 };
 
 typedef struct gen_callback {
@@ -97,7 +109,7 @@ typedef struct order_seq {
 
 /* Order Queue */
 struct orderQ {
-	struct ha_msg *		orderQ[MAXMSGHIST];
+	struct ha_msg **	orderQ;		/* MAXMSGHIST, once needed */
 	int			curr_index;
 	seqno_t			curr_oseqno;
 	seqno_t			curr_gen;
@@ -144,9 +156,28 @@ typedef struct llc_private {
 	struct nodelist_entry*	currnode;	/* corresponds to last return value of nextnode */
 	struct iflist_entry*	nextif;		/* Next interface for walkif */
 	struct iflist_entry*	currif;		/* corresponds to last return value of nextif */
+	struct hb_snapshot*	snap;		/* Shared cluster state (read only) */
+	struct ll_cluster_state	cstate;		/* From get_cluster_state() */
+	gchar **		cstate_lines;	/* Strings cstate points into */
+	struct ll_link_state*	cstate_links;	/* Links cstate points into */
+	GQueue*			pending;	/* Outstanding send_request()s */
+	gchar**			changes_lines;	/* Split up get_changes() text */
+	struct ll_state_change*	changes;	/* Points into changes_lines */
+	unsigned long		last_reqid;	/* Last send_request() id */
 	/* Messages to be read after current call completes */
-	struct MsgQueue *	firstQdmsg;
-	struct MsgQueue *	lastQdmsg;
+	struct MsgQueue *	msgq;		/* msgq_size slots */
+	int			msgq_size;
+	int			msgq_first;	/* Oldest message */
+	int			msgq_count;
+	size_t			msgq_bytes;	/* Sum of their lengths */
+	size_t			msgq_maxbytes;	/* 0: no limit */
+	int			msgq_dropping;	/* Since it was last empty */
+	unsigned long		msgq_dropped;
+	unsigned long		msgq_dropbytes;
+	/* Total order delivery - see totalorder.c */
+	struct llc_totalorder	to;
+	/* From set_msg_filter(): heartbeat leaves ordered messages to us */
+	GHashTable*		type_filter;	/* F_TYPEs we want (NULL: all) */
 	/* The next two items are for ordered message delivery */
 	order_seq_t		order_seq_head;	/* head of order_seq list */
 	order_queue_t*		order_queue_head;/* head of order queue */
@@ -174,7 +205,20 @@ static int		get_iflist(llc_private_t*, const char *host);
 static void		zap_iflist(llc_private_t*);
 static void		zap_order_seq(llc_private_t* pi);
 static void		zap_order_queue(llc_private_t* pi);
+static void		reset_orderQ(struct orderQ* q);
 static void		zap_msg_queue(llc_private_t* pi);
+static void		zap_cluster_state(llc_private_t* pi);
+static void		zap_pending(llc_private_t* pi);
+static void		zap_changes(llc_private_t* pi);
+static int		set_msgq_limit(ll_cluster_t*, unsigned long maxbytes);
+static int		get_msgq_stats(ll_cluster_t*
+,	struct ll_msgq_stats * stats);
+static int		send_total_ordered_clustermsg(ll_cluster_t* lcl
+,	struct ha_msg* msg);
+static struct ha_msg *	to_pop(llc_private_t* pi);
+static void		zap_type_filter(llc_private_t* pi);
+static void		snap_map(llc_private_t* pi);
+static void		snap_unmap(llc_private_t* pi);
 static int		enqueue_msg(llc_private_t*,struct ha_msg*);
 static struct ha_msg*	dequeue_msg(llc_private_t*);
 static gen_callback_t*	search_gen_callback(const char * type, llc_private_t*);
@@ -211,6 +255,19 @@ get_clientstatus(ll_cluster_t*, const char *host, const char *clientid
 static const char *	get_nodetype(ll_cluster_t*, const char *host);
 static const char *	get_ifstatus(ll_cluster_t*, const char *host
 ,	const char * intf);
+static int		get_ifstats(ll_cluster_t*, const char *host
+,	const char * intf, struct ll_linkstats * stats);
+static int		get_cluster_state(ll_cluster_t*, unsigned long since
+,	const struct ll_cluster_state ** state);
+static unsigned long	send_request(ll_cluster_t*, const char * reqtype
+,	const char ** fields, llc_reply_callback_t callback
+,	void * private_data);
+static void		reply_callback(llc_private_t* pi, struct ha_msg* msg);
+static int		get_changes(ll_cluster_t*, unsigned long since
+,	unsigned long * version, const struct ll_state_change ** changes
+,	int * nchanges);
+static int		set_msg_filter(ll_cluster_t*, const char ** types
+,	const char ** nodes);
 static char *		get_parameter(ll_cluster_t*, const char* pname);
 static const char *	get_resources(ll_cluster_t*);
 static int		get_inputfd(ll_cluster_t*);
@@ -427,6 +484,7 @@ hb_api_signon(struct ll_cluster* cinfo, const char * clientid)
 	if (strcmp(result, API_OK) == 0) {
 		rc = HA_OK;
 		pi->SignedOn = TRUE;
+		snap_map(pi);
 	} else /* if (strcmp(result, API_BADREQ) == 0) */ {
 		const char* failreason = ha_msg_value(reply, F_COMMENT);
 		if (failreason){
@@ -535,6 +593,10 @@ hb_api_signoff(struct ll_cluster* cinfo,gboolean need_destroy_chan)
 		}
 	}
 	pi->SignedOn = FALSE;
+	snap_unmap(pi);
+	zap_pending(pi);
+	llc_to_zap(&pi->to);
+	zap_type_filter(pi);
 	zap_order_seq(pi);
 	zap_order_queue(pi);
 
@@ -563,6 +625,8 @@ hb_api_delete(struct ll_cluster* ci)
 	/* Free up interface and node lists */
 	zap_iflist(pi);
 	zap_nodelist(pi);
+	zap_cluster_state(pi);
+	zap_changes(pi);
 
 	/* Free up the message queue */
 	zap_msg_queue(pi);
@@ -846,6 +910,401 @@ cached_node_info(llc_private_t *pi, const char *host, unsigned stale_ms)
 	return pi->currnode;
 }
 
+/*
+ * Shared-memory cluster state (see hb_snapshot.h)
+ *
+ * While we're signed on, the simple queries below are answered from
+ * heartbeat's snapshot without any system calls at all.  If we can't
+ * map it, or can't get a consistent look at it, or it doesn't have
+ * what we want, we ask heartbeat over IPC as before.
+ */
+#define	SNAP_TRIES	1000
+
+typedef gboolean (*snap_reader_t)(const struct hb_snapshot* s, gpointer data);
+
+struct snap_query {
+	const char *		host;
+	const char *		ifname;
+	struct hb_snap_node	node;
+	struct hb_snap_link	link;
+};
+
+static void
+snap_map(llc_private_t* pi)
+{
+	struct stat	sbuf;
+	void *		map;
+	int		fd;
+
+	snap_unmap(pi);
+	if ((fd = open(HB_SNAPSHOT_FILE, O_RDONLY)) < 0) {
+		return;
+	}
+	if (fstat(fd, &sbuf) == 0
+	&&	sbuf.st_size >= (off_t)sizeof(struct hb_snapshot)
+	&&	(map = mmap(NULL, sizeof(struct hb_snapshot), PROT_READ
+		,	MAP_SHARED, fd, 0)) != MAP_FAILED) {
+		pi->snap = map;
+		if (pi->snap->magic != HB_SNAPSHOT_MAGIC
+		||	pi->snap->size != sizeof(struct hb_snapshot)) {
+			snap_unmap(pi);
+		}
+	}
+	close(fd);
+}
+
+static void
+snap_unmap(llc_private_t* pi)
+{
+	if (pi->snap != NULL) {
+		munmap(pi->snap, sizeof(struct hb_snapshot));
+		pi->snap = NULL;
+	}
+}
+
+/*
+ * Run 'fn' against a consistent view of the snapshot.  It may be run
+ * more than once, so it must only copy things out.  Returns HA_FAIL if
+ * there's no usable snapshot, or if 'fn' returned FALSE.
+ */
+static int
+snap_read(llc_private_t* pi, snap_reader_t fn, gpointer data)
+{
+	const struct hb_snapshot*	s = pi->snap;
+	unsigned			seq;
+	gboolean			ok;
+	int				j;
+
+	if (s == NULL || pi->chan == NULL || pi->chan->ch_status != IPC_CONNECT) {
+		return HA_FAIL;
+	}
+	for (j=0; j < SNAP_TRIES; ++j) {
+		seq = s->seq;
+		HB_SNAP_BARRIER();
+		if (seq & 1) {
+			continue;
+		}
+		ok = s->valid && fn(s, data);
+		HB_SNAP_BARRIER();
+		if (s->seq == seq) {
+			return ok ? HA_OK : HA_FAIL;
+		}
+	}
+	return HA_FAIL;
+}
+
+static int
+snap_node_index(const struct hb_snapshot* s, const char * host)
+{
+	int	j;
+
+	for (j=0; j < s->nnodes && j < MAXNODE; ++j) {
+		if (strncasecmp(s->nodes[j].name, host, HOSTLENG) == 0) {
+			return j;
+		}
+	}
+	return -1;
+}
+
+static gboolean
+snap_get_node(const struct hb_snapshot* s, gpointer data)
+{
+	struct snap_query*	q = data;
+	int			j;
+
+	if ((j = snap_node_index(s, q->host)) < 0) {
+		return FALSE;
+	}
+	q->node = s->nodes[j];
+	return TRUE;
+}
+
+static gboolean
+snap_get_link(const struct hb_snapshot* s, gpointer data)
+{
+	struct snap_query*	q = data;
+	int			j;
+	int			k;
+
+	if ((j = snap_node_index(s, q->host)) < 0) {
+		return FALSE;
+	}
+	q->node = s->nodes[j];
+	for (k = q->node.firstlink; k >= 0 && k < HB_SNAP_MAXLINKS
+	&&	k < q->node.firstlink + q->node.nlinks; ++k) {
+		if (strncmp(s->links[k].name, q->ifname, HOSTLENG) == 0) {
+			q->link = s->links[k];
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Look up a node in the snapshot */
+static int
+snap_node(llc_private_t* pi, const char * host, struct snap_query* q)
+{
+	q->host = host;
+	if (snap_read(pi, snap_get_node, q) != HA_OK) {
+		return HA_FAIL;
+	}
+	q->node.name[HOSTLENG-1] = EOS;
+	q->node.status[STATUSLENG-1] = EOS;
+	q->node.site[HOSTLENG-1] = EOS;
+	return HA_OK;
+}
+
+/* Look up one of a node's links in the snapshot */
+static int
+snap_link(llc_private_t* pi, const char * host, const char * ifname
+,	struct snap_query* q)
+{
+	q->host = host;
+	q->ifname = ifname;
+	if (snap_read(pi, snap_get_link, q) != HA_OK) {
+		return HA_FAIL;
+	}
+	q->link.name[HOSTLENG-1] = EOS;
+	q->link.status[STATUSLENG-1] = EOS;
+	return HA_OK;
+}
+
+static gboolean
+snap_count_nodes(const struct hb_snapshot* s, gpointer data)
+{
+	int*	count = data;
+	int	j;
+
+	*count = 0;
+	for (j=0; j < s->nnodes && j < MAXNODE; ++j) {
+		if (s->nodes[j].nodetype == NORMALNODE_I) {
+			++*count;
+		}
+	}
+	return *count > 0;
+}
+
+static gboolean
+snap_get_resources(const struct hb_snapshot* s, gpointer data)
+{
+	char*	buf = data;
+
+	/* Empty if heartbeat isn't managing resources */
+	memcpy(buf, s->resources, STATUSLENG);
+	buf[STATUSLENG-1] = EOS;
+	return *buf != EOS;
+}
+
+struct snap_client {
+	const char *		id;
+	gboolean		online;
+};
+
+static gboolean
+snap_find_client(const struct hb_snapshot* s, gpointer data)
+{
+	struct snap_client*	c = data;
+	int			j;
+
+	if (s->nclients < 0) {
+		return FALSE;
+	}
+	c->online = FALSE;
+	for (j=0; j < s->nclients && j < HB_SNAP_MAXCLIENTS; ++j) {
+		if (strncmp(s->clients[j], c->id, HB_SNAP_CLIENTIDLEN) == 0) {
+			c->online = TRUE;
+			break;
+		}
+	}
+	return TRUE;
+}
+
+struct snap_nodes {
+	int			count;
+	struct hb_snap_node	nodes[MAXNODE];
+};
+
+static gboolean
+snap_get_nodes(const struct hb_snapshot* s, gpointer data)
+{
+	struct snap_nodes*	n = data;
+
+	n->count = s->nnodes;
+	if (n->count <= 0 || n->count > MAXNODE) {
+		return FALSE;
+	}
+	memcpy(n->nodes, s->nodes, n->count * sizeof(n->nodes[0]));
+	return TRUE;
+}
+
+struct snap_links {
+	const char *		host;
+	int			count;
+	struct hb_snap_link	links[MAXMEDIA];
+};
+
+static gboolean
+snap_get_links(const struct hb_snapshot* s, gpointer data)
+{
+	struct snap_links*	l = data;
+	const struct hb_snap_node* node;
+	int			j;
+
+	if ((j = snap_node_index(s, l->host)) < 0) {
+		return FALSE;
+	}
+	node = &s->nodes[j];
+	l->count = node->nlinks;
+	if (l->count <= 0 || l->count > MAXMEDIA || node->firstlink < 0
+	||	node->firstlink + l->count > HB_SNAP_MAXLINKS) {
+		return FALSE;
+	}
+	memcpy(l->links, &s->links[node->firstlink]
+	,	l->count * sizeof(l->links[0]));
+	return TRUE;
+}
+
+static const char *
+snap_nodetype(int nodetype)
+{
+	switch (nodetype) {
+		case NORMALNODE_I:	return NORMALNODE;
+		case PINGNODE_I:	return PINGNODE;
+	}
+	return UNKNOWNNODE;
+}
+
+/*
+ * Format the whole cluster state the way API_GETCLUSTERSTATE would,
+ * unless it's still at version st->since.
+ */
+struct snap_state {
+	unsigned long		since;
+	unsigned long		version;
+	GString*		text;	/* NULL: unchanged */
+};
+
+static gboolean
+snap_get_state(const struct hb_snapshot* s, gpointer data)
+{
+	struct snap_state*	st = data;
+	int			j;
+	int			k;
+
+	st->version = s->version;
+	if (st->since != 0 && st->version == st->since) {
+		if (st->text != NULL) {
+			g_string_free(st->text, TRUE);
+			st->text = NULL;
+		}
+		return TRUE;
+	}
+	if (st->text == NULL) {
+		st->text = g_string_sized_new(4096);
+	}else{
+		g_string_truncate(st->text, 0);
+	}
+	if (s->nnodes <= 0 || s->nnodes > MAXNODE) {
+		return FALSE;
+	}
+	for (j=0; j < s->nnodes; ++j) {
+		const struct hb_snap_node*	sn = &s->nodes[j];
+
+		if (sn->nlinks < 0 || sn->firstlink < 0
+		||	sn->firstlink + sn->nlinks > HB_SNAP_MAXLINKS) {
+			return FALSE;
+		}
+		g_string_append_printf(st->text, "%.*s\t%.*s\t%s\t%d\t%.*s"
+		,	HOSTLENG, sn->name, STATUSLENG, sn->status
+		,	snap_nodetype(sn->nodetype), sn->weight
+		,	HOSTLENG, sn->site);
+		for (k = sn->firstlink; k < sn->firstlink + sn->nlinks; ++k) {
+			g_string_append_printf(st->text, "\t%.*s\t%.*s"
+			,	HOSTLENG, s->links[k].name
+			,	STATUSLENG, s->links[k].status);
+		}
+		g_string_append_c(st->text, '\n');
+	}
+	return TRUE;
+}
+
+/* Build our node list (as get_nodelist() would) from the snapshot */
+static int
+snap_nodelist(llc_private_t* pi)
+{
+	struct snap_nodes*	n;
+	struct nodelist_entry*	nl;
+	int			j;
+
+	if (pi->snap == NULL || (n = MALLOCT(struct snap_nodes)) == NULL) {
+		return HA_FAIL;
+	}
+	if (snap_read(pi, snap_get_nodes, n) != HA_OK) {
+		free(n);
+		return HA_FAIL;
+	}
+	for (j=0; j < n->count; ++j) {
+		struct hb_snap_node*	sn = &n->nodes[j];
+
+		sn->name[HOSTLENG-1] = EOS;
+		sn->status[STATUSLENG-1] = EOS;
+		if ((nl = MALLOCT(struct nodelist_entry)) == NULL
+		||	(nl->name = strdup(sn->name)) == NULL) {
+			free(nl);
+			zap_nodelist(pi);
+			free(n);
+			return HA_FAIL;
+		}
+		nl->status = strdup(sn->status);
+		nl->type = strdup(snap_nodetype(sn->nodetype));
+		nl->timestamp = cl_times();
+		nl->next = pi->nodelist;
+		pi->nodelist = nl;
+	}
+	pi->nextnode = pi->nodelist;
+	free(n);
+	return HA_OK;
+}
+
+/* Build our interface list (as get_iflist() would) from the snapshot */
+static int
+snap_iflist(llc_private_t* pi, const char * host)
+{
+	struct snap_links*	l;
+	struct iflist_entry*	e;
+	int			j;
+
+	if (pi->snap == NULL || (l = MALLOCT(struct snap_links)) == NULL) {
+		return HA_FAIL;
+	}
+	l->host = host;
+	if (snap_read(pi, snap_get_links, l) != HA_OK
+	||	(pi->iflist_host = strdup(host)) == NULL) {
+		free(l);
+		return HA_FAIL;
+	}
+	for (j=0; j < l->count; ++j) {
+		struct hb_snap_link*	sl = &l->links[j];
+
+		sl->name[HOSTLENG-1] = EOS;
+		sl->status[STATUSLENG-1] = EOS;
+		if ((e = MALLOCT(struct iflist_entry)) == NULL
+		||	(e->name = strdup(sl->name)) == NULL) {
+			free(e);
+			zap_iflist(pi);
+			free(l);
+			return HA_FAIL;
+		}
+		e->status = strdup(sl->status);
+		e->timestamp = cl_times();
+		e->next = pi->iflist;
+		pi->iflist = e;
+	}
+	pi->nextif = pi->iflist;
+	free(l);
+	return HA_OK;
+}
+
 static const char *
 get_nodestatus(ll_cluster_t* lcl, const char *host)
 {
@@ -857,6 +1316,7 @@ get_nodestatus(ll_cluster_t* lcl, const char *host)
 	const char *		ret;
 	llc_private_t*		pi;
 	const struct nodelist_entry *ne;
+	struct snap_query	q;
 
 	ClearLog();
 	if (!ISOURS(lcl)) {
@@ -875,6 +1335,10 @@ get_nodestatus(ll_cluster_t* lcl, const char *host)
 		status = ne->status;
 		goto skip_ipc;
 	}
+	if (snap_node(pi, host, &q) == HA_OK) {
+		status = q.node.status;
+		goto skip_ipc;
+	}
 
 	if ((request = hb_api_boilerplate(API_NODESTATUS)) == NULL) {
 		return NULL;
@@ -927,6 +1391,7 @@ get_nodeweight(ll_cluster_t* lcl, const char *host)
 	const char *		weight_s;
 	int			ret;
 	llc_private_t*		pi;
+	struct snap_query	q;
 
 	ClearLog();
 	if (!ISOURS(lcl)) {
@@ -939,6 +1404,9 @@ get_nodeweight(ll_cluster_t* lcl, const char *host)
 		ha_api_log(LOG_ERR, "not signed on");
 		return -1;
 	}
+	if (snap_node(pi, host, &q) == HA_OK) {
+		return q.node.weight;
+	}
 
 	if ((request = hb_api_boilerplate(API_NODEWEIGHT)) == NULL) {
 		return -1;
@@ -987,6 +1455,7 @@ get_nodesite(ll_cluster_t* lcl, const char *host)
 	static char		sitebuf[HOSTLENG];
 	const char *		ret;
 	llc_private_t*		pi;
+	struct snap_query	q;
 
 	ClearLog();
 	if (!ISOURS(lcl)) {
@@ -999,6 +1468,11 @@ get_nodesite(ll_cluster_t* lcl, const char *host)
 		ha_api_log(LOG_ERR, "not signed on");
 		return NULL;
 	}
+	if (snap_node(pi, host, &q) == HA_OK) {
+		memset(sitebuf, 0, sizeof(sitebuf));
+		strncpy(sitebuf, q.node.site, sizeof(sitebuf) - 1);
+		return sitebuf;
+	}
 
 	if ((request = hb_api_boilerplate(API_NODESITE)) == NULL) {
 		return NULL;
@@ -1050,6 +1524,7 @@ get_clientstatus(ll_cluster_t* lcl, const char *host
 	static char		statbuf[128];
 	const char *		clientname;
 	const char *		ret;
+	struct snap_client	c;
 	
 	ClearLog();
 	if (!ISOURS(lcl)){
@@ -1110,6 +1585,12 @@ get_clientstatus(ll_cluster_t* lcl, const char *host
 		ha_api_log(LOG_ERR, "client status : bad nodename");
 		return NULL;
 	}
+	/* We can only see our own node's clients in the snapshot */
+	c.id = clientname;
+	if (strcasecmp(host, OurNode) == 0
+	&&	snap_read(pi, snap_find_client, &c) == HA_OK) {
+		return c.online ? ONLINESTATUS : OFFLINESTATUS;
+	}
 	if ((request = hb_api_boilerplate(API_CLIENTSTATUS)) == NULL) {
 		ha_api_log(LOG_ERR, "hb_api_boilerplate failed");
 		return NULL;
@@ -1164,6 +1645,7 @@ get_nodetype(ll_cluster_t* lcl, const char *host)
 	const char *		ret;
 	llc_private_t*		pi;
 	const struct nodelist_entry *ne;
+	struct snap_query	q;
 
 	ClearLog();
 	if (!ISOURS(lcl)) {
@@ -1182,6 +1664,10 @@ get_nodetype(ll_cluster_t* lcl, const char *host)
 		status = ne->type;
 		goto skip_ipc;
 	}
+	if (snap_node(pi, host, &q) == HA_OK) {
+		status = snap_nodetype(q.node.nodetype);
+		goto skip_ipc;
+	}
 
 
 	if ((request = hb_api_boilerplate(API_NODETYPE)) == NULL) {
@@ -1246,6 +1732,9 @@ get_num_nodes(ll_cluster_t* lcl)
 		ha_api_log(LOG_ERR, "not signed on");
 		return -1;
 	}
+	if (snap_read(pi, snap_count_nodes, &num) == HA_OK) {
+		return num;
+	}
 	
 	if ((request = hb_api_boilerplate(API_NUMNODES)) == NULL) {
 		return -1;
@@ -1348,6 +1837,7 @@ get_resources(ll_cluster_t* lcl)
 	const char *		rvalue;
 	char *			ret;
 	llc_private_t*		pi;
+	static char		retvalue[64];
 
 	ClearLog();
 	if (!ISOURS(lcl)) {
@@ -1360,6 +1850,9 @@ get_resources(ll_cluster_t* lcl)
 		ha_api_log(LOG_ERR, "not signed on");
 		return NULL;
 	}
+	if (snap_read(pi, snap_get_resources, retvalue) == HA_OK) {
+		return retvalue;
+	}
 
 	if ((request = hb_api_boilerplate(API_GETRESOURCES)) == NULL) {
 		return NULL;
@@ -1380,7 +1873,6 @@ get_resources(ll_cluster_t* lcl)
 	if ((result = ha_msg_value(reply, F_APIRESULT)) != NULL
 	&&	strcmp(result, API_OK) == 0
 	&&	(rvalue = ha_msg_value(reply, F_RESOURCES)) != NULL) {
-		static char		retvalue[64];
 		strncpy(retvalue, rvalue, sizeof(retvalue)-1);
 		retvalue[DIMOF(retvalue)-1] = EOS;
 		ret = retvalue;
@@ -1453,100 +1945,763 @@ static const char *
 get_mynodeid(ll_cluster_t* lcl)
 {
 	if (!ISOURS(lcl)) {
-		ha_api_log(LOG_ERR, "get_mynodeid: bad cinfo");
-		return NULL;
+		ha_api_log(LOG_ERR, "get_mynodeid: bad cinfo");
+		return NULL;
+	}
+	return (OurNode);
+}
+
+
+
+static struct iflist_entry *
+cached_intf_info(llc_private_t *pi, const char *host, const char *ifname, unsigned stale_ms)
+{
+	if (!pi->iflist_host || strcmp(pi->iflist_host, host) ||
+	    !pi->currif || !pi->currif->name || strcmp(pi->currif->name, ifname))
+		return NULL;
+
+	/* longclock_t is long enough. */
+	if (longclockto_ms(cl_times() - pi->currif->timestamp) > stale_ms)
+		return NULL;
+
+	return pi->currif;
+}
+
+/*
+ * Return the status of the given interface for the given machine.
+ */
+static const char *
+get_ifstatus(ll_cluster_t* lcl, const char *host, const char * ifname)
+{
+	struct ha_msg*		request;
+	struct ha_msg*		reply = NULL;
+	const char *		result;
+	const char *		status = NULL;
+	static char		statbuf[128];
+	const char *		ret;
+	llc_private_t* pi;
+	const struct iflist_entry *ie;
+	struct snap_query	q;
+
+	ClearLog();
+	if (!ISOURS(lcl)) {
+		ha_api_log(LOG_ERR, "get_ifstatus: bad cinfo");
+		return NULL;
+	}
+	pi = (llc_private_t*)lcl->ll_cluster_private;
+	if (!pi->SignedOn) {
+		ha_api_log(LOG_ERR, "not signed on");
+		return NULL;
+	}
+	ie = cached_intf_info(pi, host, ifname, 2000);
+	if (ie && ie->status) {
+		status = ie->status;
+		goto skip_ipc;
+	}
+	if (snap_link(pi, host, ifname, &q) == HA_OK) {
+		status = q.link.status;
+		goto skip_ipc;
+	}
+
+	if ((request = hb_api_boilerplate(API_IFSTATUS)) == NULL) {
+		return NULL;
+	}
+	if (ha_msg_add(request, F_NODENAME, host) != HA_OK) {
+		ha_api_log(LOG_ERR, "get_ifstatus: cannot add field");
+		ZAPMSG(request);
+		return NULL;
+	}
+	if (ha_msg_add(request, F_IFNAME, ifname) != HA_OK) {
+		ha_api_log(LOG_ERR, "get_ifstatus: cannot add field");
+		ZAPMSG(request);
+		return NULL;
+	}
+
+	/* Send message */
+	if (msg2ipcchan(request, pi->chan) != HA_OK) {
+		ZAPMSG(request);
+		ha_api_perror("Can't send message to IPC Channel");
+		return NULL;
+	}
+	ZAPMSG(request);
+
+	/* Read reply... */
+	if ((reply=read_api_msg(pi)) == NULL) {
+		return NULL;
+	}
+	if ((result = ha_msg_value(reply, F_APIRESULT)) != NULL
+	&&	strcmp(result, API_OK) == 0
+	&&	(status = ha_msg_value(reply,F_STATUS)) != NULL) {
+
+skip_ipc:
+                memset(statbuf, 0, sizeof(statbuf));
+		strncpy(statbuf, status, sizeof(statbuf) - 1);
+		ret = statbuf;
+	}else{
+		ret = NULL;
+	}
+	if (reply)
+		ZAPMSG(reply);
+
+	return ret;
+}
+
+/*
+ * Return the receive statistics of the given interface for the given machine.
+ */
+static int
+get_ifstats(ll_cluster_t* lcl, const char *host, const char * ifname
+,	struct ll_linkstats * stats)
+{
+	struct ha_msg*		request;
+	struct ha_msg*		reply;
+	const char *		result;
+	llc_private_t*		pi;
+	size_t			j;
+	struct {
+		const char *	name;
+		unsigned long *	value;
+	} fields[] = {
+		{F_LINKRCVD,	&stats->rcvd},
+		{F_LINKLOST,	&stats->lost},
+		{F_LINKDUP,	&stats->dup},
+		{F_LINKJITTER,	&stats->jitter},
+		{F_LINKSKEW,	&stats->skew},
+		{F_LINKRTT,	&stats->rtt},
+		{F_LINKAGE,	&stats->age},
+		{F_LINKOVFL,	&stats->ovfl},
+	};
+
+	ClearLog();
+	if (!ISOURS(lcl)) {
+		ha_api_log(LOG_ERR, "get_ifstats: bad cinfo");
+		return HA_FAIL;
+	}
+	pi = (llc_private_t*)lcl->ll_cluster_private;
+	if (!pi->SignedOn) {
+		ha_api_log(LOG_ERR, "not signed on");
+		return HA_FAIL;
+	}
+
+	if ((request = hb_api_boilerplate(API_IFSTATUS)) == NULL) {
+		return HA_FAIL;
+	}
+	if (ha_msg_add(request, F_NODENAME, host) != HA_OK
+	||	ha_msg_add(request, F_IFNAME, ifname) != HA_OK) {
+		ha_api_log(LOG_ERR, "get_ifstats: cannot add field");
+		ZAPMSG(request);
+		return HA_FAIL;
+	}
+
+	/* Send message */
+	if (msg2ipcchan(request, pi->chan) != HA_OK) {
+		ZAPMSG(request);
+		ha_api_perror("Can't send message to IPC Channel");
+		return HA_FAIL;
+	}
+	ZAPMSG(request);
+
+	/* Read reply... */
+	if ((reply=read_api_msg(pi)) == NULL) {
+		return HA_FAIL;
+	}
+	if ((result = ha_msg_value(reply, F_APIRESULT)) == NULL
+	||	strcmp(result, API_OK) != 0) {
+		ZAPMSG(reply);
+		return HA_FAIL;
+	}
+	memset(stats, 0, sizeof(*stats));
+	for (j=0; j < DIMOF(fields); ++j) {
+		const char *	value = ha_msg_value(reply, fields[j].name);
+		if (value == NULL) {
+			/* Older heartbeat: only the status is reported */
+			ha_api_log(LOG_ERR, "get_ifstats: no %s in reply"
+			,	fields[j].name);
+			ZAPMSG(reply);
+			return HA_FAIL;
+		}
+		*fields[j].value = strtoul(value, NULL, 10);
+	}
+	ZAPMSG(reply);
+
+	return HA_OK;
+}
+
+/*
+ * Join a NULL-terminated list of names with spaces, into a g_malloc()ed
+ * string.  NULL or an empty list gives an empty string.
+ */
+static char *
+join_namelist(const char ** names)
+{
+	GString *	str = g_string_new("");
+	char *		ret;
+
+	for (; names != NULL && *names != NULL; ++names) {
+		if (strchr(*names, ' ') != NULL) {
+			g_string_free(str, TRUE);
+			return NULL;
+		}
+		if (str->len > 0) {
+			g_string_append_c(str, ' ');
+		}
+		g_string_append(str, *names);
+	}
+	ret = str->str;
+	g_string_free(str, FALSE);
+	return ret;
+}
+
+/*
+ * Ask heartbeat to only send us messages of these types, from these
+ * nodes.  Either list can be NULL (or empty), meaning all of them.
+ * Messages addressed to us in particular always get through.
+ */
+static int
+set_msg_filter(ll_cluster_t* lcl, const char ** types, const char ** nodes)
+{
+	struct ha_msg*		request;
+	struct ha_msg*		reply;
+	const char *		result;
+	char *			ctypes;
+	char *			cnodes;
+	int			rc;
+	llc_private_t*		pi;
+
+	ClearLog();
+	if (!ISOURS(lcl)) {
+		ha_api_log(LOG_ERR, "set_msg_filter: bad cinfo");
+		return HA_FAIL;
+	}
+	pi = (llc_private_t*)lcl->ll_cluster_private;
+	if (!pi->SignedOn) {
+		ha_api_log(LOG_ERR, "not signed on");
+		return HA_FAIL;
+	}
+
+	ctypes = join_namelist(types);
+	cnodes = join_namelist(nodes);
+	if (ctypes == NULL || cnodes == NULL) {
+		ha_api_log(LOG_ERR, "set_msg_filter: bad name in list");
+		g_free(ctypes);
+		g_free(cnodes);
+		return HA_FAIL;
+	}
+	if ((request = hb_api_boilerplate(API_SETMSGFILTER)) == NULL) {
+		g_free(ctypes);
+		g_free(cnodes);
+		return HA_FAIL;
+	}
+	rc = ha_msg_add(request, F_FILTERTYPES, ctypes);
+	if (rc == HA_OK) {
+		rc = ha_msg_add(request, F_FILTERNODES, cnodes);
+	}
+	g_free(ctypes);
+	g_free(cnodes);
+	if (rc != HA_OK) {
+		ha_api_log(LOG_ERR, "set_msg_filter: cannot add field");
+		ZAPMSG(request);
+		return HA_FAIL;
+	}
+
+	/* Send message */
+	if (msg2ipcchan(request, pi->chan) != HA_OK) {
+		ZAPMSG(request);
+		ha_api_perror("Can't send message to IPC Channel");
+		return HA_FAIL;
+	}
+	ZAPMSG(request);
+
+	/* Read reply... */
+	if ((reply=read_api_msg(pi)) == NULL) {
+		return HA_FAIL;
+	}
+	if ((result = ha_msg_value(reply, F_APIRESULT)) != NULL
+	&&	strcmp(result, API_OK) == 0) {
+		rc = HA_OK;
+	}else{
+		rc = HA_FAIL;
+	}
+	ZAPMSG(reply);
+
+	if (rc == HA_OK) {
+		/* Ordered messages come anyway: see type_filter_ok() */
+		zap_type_filter(pi);
+		for (; types != NULL && *types != NULL; ++types) {
+			if (pi->type_filter == NULL) {
+				pi->type_filter = g_hash_table_new_full(
+					g_str_hash, g_str_equal, g_free, NULL);
+			}
+			g_hash_table_insert(pi->type_filter
+			,	g_strdup(*types), GINT_TO_POINTER(1));
+		}
+	}
+	return rc;
+}
+
+static void
+zap_type_filter(llc_private_t* pi)
+{
+	if (pi->type_filter != NULL) {
+		g_hash_table_destroy(pi->type_filter);
+		pi->type_filter = NULL;
+	}
+}
+
+/*
+ * Does our type filter let this message through?  Heartbeat filters
+ * everything but messages with F_ORDERSEQ, which it has to pass so
+ * we can put them in order: we filter those once they are.
+ */
+static gboolean
+type_filter_ok(llc_private_t* pi, const struct ha_msg* msg)
+{
+	const char *	type;
+
+	if (pi->type_filter == NULL
+	||	ha_msg_value(msg, F_ORDERSEQ) == NULL
+	||	ha_msg_value(msg, F_TOID) != NULL) {
+		return TRUE;
+	}
+	type = ha_msg_value(msg, F_TYPE);
+	return type != NULL && g_hash_table_lookup(pi->type_filter, type) != NULL;
+}
+
+/*
+ * Zap the state from our last get_cluster_state()
+ */
+static void
+zap_cluster_state(llc_private_t* pi)
+{
+	g_strfreev(pi->cstate_lines);
+	g_free(pi->cstate.nodes);
+	g_free(pi->cstate_links);
+	pi->cstate_lines = NULL;
+	pi->cstate_links = NULL;
+	memset(&pi->cstate, 0, sizeof(pi->cstate));
+}
+
+/* Return the next tab separated field, and step past it */
+static char *
+cstate_field(char ** pos)
+{
+	char *	ret = *pos;
+	char *	tab;
+
+	if (ret == NULL) {
+		return NULL;
+	}
+	if ((tab = strchr(ret, '\t')) != NULL) {
+		*tab = EOS;
+		*pos = tab+1;
+	}else{
+		*pos = NULL;
+	}
+	return ret;
+}
+
+/*
+ * Split up a cluster state as sent by heartbeat (one line per node:
+ * name status type weight site [ifname ifstatus]...) into pi->cstate.
+ */
+static int
+parse_cluster_state(llc_private_t* pi, const char * text, unsigned long version)
+{
+	struct ll_cluster_state*	cs = &pi->cstate;
+	struct ll_link_state*		lk;
+	gchar **			line;
+	const char *			p;
+	int				nlines = 0;
+	int				ntabs = 0;
+
+	zap_cluster_state(pi);
+	for (p = text; *p != EOS; ++p) {
+		if (*p == '\t') {
+			++ntabs;
+		}else if (*p == '\n') {
+			++nlines;
+		}
+	}
+	pi->cstate_lines = g_strsplit(text, "\n", 0);
+	cs->nodes = g_new0(struct ll_node_state, nlines+1);
+	lk = pi->cstate_links = g_new0(struct ll_link_state, ntabs/2+1);
+	cs->version = version;
+
+	for (line = pi->cstate_lines; *line != NULL; ++line) {
+		struct ll_node_state*	ns = &cs->nodes[cs->nnodes];
+		char *			pos = *line;
+		const char *		weight;
+
+		if (*pos == EOS) {
+			continue;
+		}
+		if ((ns->name = cstate_field(&pos)) == NULL
+		||	(ns->status = cstate_field(&pos)) == NULL
+		||	(ns->type = cstate_field(&pos)) == NULL
+		||	(weight = cstate_field(&pos)) == NULL
+		||	(ns->site = cstate_field(&pos)) == NULL) {
+			ha_api_log(LOG_ERR, "bad cluster state [%s]", *line);
+			zap_cluster_state(pi);
+			return HA_FAIL;
+		}
+		ns->weight = atoi(weight);
+		ns->links = lk;
+		while ((lk->name = cstate_field(&pos)) != NULL) {
+			if ((lk->status = cstate_field(&pos)) == NULL) {
+				ha_api_log(LOG_ERR, "bad cluster state for %s"
+				,	ns->name);
+				zap_cluster_state(pi);
+				return HA_FAIL;
+			}
+			++lk;
+			++ns->nlinks;
+		}
+		++cs->nnodes;
+	}
+	return HA_OK;
+}
+
+/*
+ * Return the whole cluster state, or NULL in *state if it hasn't
+ * changed since version 'since'.
+ */
+static int
+get_cluster_state(ll_cluster_t* lcl, unsigned long since
+,	const struct ll_cluster_state ** state)
+{
+	struct ha_msg*		request;
+	struct ha_msg*		reply;
+	const char *		result;
+	const char *		cversion;
+	const char *		cstate;
+	char			vbuf[32];
+	unsigned long		version;
+	llc_private_t*		pi;
+	struct snap_state	ss;
+	int			rc;
+
+	ClearLog();
+	if (!ISOURS(lcl)) {
+		ha_api_log(LOG_ERR, "get_cluster_state: bad cinfo");
+		return HA_FAIL;
+	}
+	pi = (llc_private_t*)lcl->ll_cluster_private;
+
+	if (!pi->SignedOn) {
+		ha_api_log(LOG_ERR, "not signed on");
+		return HA_FAIL;
+	}
+	*state = NULL;
+
+	/* The snapshot has everything we need, if we have it */
+	ss.since = since;
+	ss.text = NULL;
+	rc = snap_read(pi, snap_get_state, &ss);
+	if (rc == HA_OK && ss.text != NULL) {
+		rc = parse_cluster_state(pi, ss.text->str, ss.version);
+		if (rc == HA_OK) {
+			*state = &pi->cstate;
+		}
+	}
+	if (ss.text != NULL) {
+		g_string_free(ss.text, TRUE);
+	}
+	if (rc == HA_OK) {
+		return HA_OK;
+	}
+
+	if ((request = hb_api_boilerplate(API_GETCLUSTERSTATE)) == NULL) {
+		return HA_FAIL;
+	}
+	snprintf(vbuf, sizeof(vbuf), "%lu", since);
+	if (ha_msg_add(request, F_STATEVERSION, vbuf) != HA_OK) {
+		ha_api_log(LOG_ERR, "get_cluster_state: cannot add field");
+		ZAPMSG(request);
+		return HA_FAIL;
+	}
+
+	/* Send message */
+	if (msg2ipcchan(request, pi->chan) != HA_OK) {
+		ZAPMSG(request);
+		ha_api_perror("Can't send message to IPC Channel");
+		return HA_FAIL;
+	}
+	ZAPMSG(request);
+
+	/* Read reply... */
+	if ((reply=read_api_msg(pi)) == NULL) {
+		return HA_FAIL;
+	}
+	rc = HA_FAIL;
+	if ((result = ha_msg_value(reply, F_APIRESULT)) != NULL
+	&&	strcmp(result, API_OK) == 0
+	&&	(cversion = ha_msg_value(reply, F_STATEVERSION)) != NULL
+	&&	sscanf(cversion, "%lu", &version) == 1) {
+		if ((cstate = ha_msg_value(reply, F_CLUSTERSTATE)) != NULL) {
+			rc = parse_cluster_state(pi, cstate, version);
+			if (rc == HA_OK) {
+				*state = &pi->cstate;
+			}
+		}else if (version != 0 && version == since) {
+			rc = HA_OK;
+		}
+	}else{
+		const char* failreason = ha_msg_value(reply, F_COMMENT);
+		if (failreason){
+			ha_api_log(LOG_ERR,  "%s", failreason);
+		}
+	}
+	ZAPMSG(reply);
+
+	return rc;
+}
+/*
+ * Zap the changes from our last get_changes()
+ */
+static void
+zap_changes(llc_private_t* pi)
+{
+	g_strfreev(pi->changes_lines);
+	g_free(pi->changes);
+	pi->changes_lines = NULL;
+	pi->changes = NULL;
+}
+
+/*
+ * Return the changes since version 'since', or -1 in *nchanges if
+ * heartbeat can't tell us all of them any more.
+ */
+static int
+get_changes(ll_cluster_t* lcl, unsigned long since, unsigned long * version
+,	const struct ll_state_change ** changes, int * nchanges)
+{
+	struct ha_msg*		request;
+	struct ha_msg*		reply;
+	const char *		result;
+	const char *		cversion;
+	const char *		text;
+	char			vbuf[32];
+	llc_private_t*		pi;
+	gchar **		line;
+	int			rc;
+
+	ClearLog();
+	if (!ISOURS(lcl)) {
+		ha_api_log(LOG_ERR, "get_changes: bad cinfo");
+		return HA_FAIL;
 	}
-	return (OurNode);
-}
+	pi = (llc_private_t*)lcl->ll_cluster_private;
 
+	if (!pi->SignedOn) {
+		ha_api_log(LOG_ERR, "not signed on");
+		return HA_FAIL;
+	}
+	zap_changes(pi);
+	*changes = NULL;
+	*nchanges = 0;
 
+	if ((request = hb_api_boilerplate(API_GETCHANGES)) == NULL) {
+		return HA_FAIL;
+	}
+	snprintf(vbuf, sizeof(vbuf), "%lu", since);
+	if (ha_msg_add(request, F_STATEVERSION, vbuf) != HA_OK) {
+		ha_api_log(LOG_ERR, "get_changes: cannot add field");
+		ZAPMSG(request);
+		return HA_FAIL;
+	}
 
-static struct iflist_entry *
-cached_intf_info(llc_private_t *pi, const char *host, const char *ifname, unsigned stale_ms)
-{
-	if (!pi->iflist_host || strcmp(pi->iflist_host, host) ||
-	    !pi->currif || !pi->currif->name || strcmp(pi->currif->name, ifname))
-		return NULL;
+	/* Send message */
+	if (msg2ipcchan(request, pi->chan) != HA_OK) {
+		ZAPMSG(request);
+		ha_api_perror("Can't send message to IPC Channel");
+		return HA_FAIL;
+	}
+	ZAPMSG(request);
 
-	/* longclock_t is long enough. */
-	if (longclockto_ms(cl_times() - pi->currif->timestamp) > stale_ms)
-		return NULL;
+	/* Read reply... */
+	if ((reply=read_api_msg(pi)) == NULL) {
+		return HA_FAIL;
+	}
+	if ((result = ha_msg_value(reply, F_APIRESULT)) == NULL
+	||	strcmp(result, API_OK) != 0
+	||	(cversion = ha_msg_value(reply, F_STATEVERSION)) == NULL
+	||	sscanf(cversion, "%lu", version) != 1) {
+		const char* failreason = ha_msg_value(reply, F_COMMENT);
+		if (failreason){
+			ha_api_log(LOG_ERR,  "%s", failreason);
+		}
+		ZAPMSG(reply);
+		return HA_FAIL;
+	}
+	rc = HA_OK;
+	if (ha_msg_value(reply, F_RESYNC) != NULL) {
+		*nchanges = -1;
+	}else if ((text = ha_msg_value(reply, F_CHANGES)) != NULL) {
+		/* version kind node item value - one line per change */
+		pi->changes_lines = g_strsplit(text, "\n", 0);
+		pi->changes = g_new0(struct ll_state_change
+		,	g_strv_length(pi->changes_lines)+1);
+		for (line = pi->changes_lines; *line != NULL; ++line) {
+			struct ll_state_change*	c = &pi->changes[*nchanges];
+			char *			pos = *line;
+			const char *		cv;
+
+			if (*pos == EOS) {
+				continue;
+			}
+			if ((cv = cstate_field(&pos)) == NULL
+			||	sscanf(cv, "%lu", &c->version) != 1
+			||	(c->kind = cstate_field(&pos)) == NULL
+			||	(c->node = cstate_field(&pos)) == NULL
+			||	(c->item = cstate_field(&pos)) == NULL
+			||	(c->value = cstate_field(&pos)) == NULL) {
+				ha_api_log(LOG_ERR, "bad change [%s]", *line);
+				zap_changes(pi);
+				*nchanges = 0;
+				rc = HA_FAIL;
+				break;
+			}
+			++*nchanges;
+		}
+		*changes = pi->changes;
+	}
+	ZAPMSG(reply);
 
-	return pi->currif;
+	return rc;
 }
-
 /*
- * Return the status of the given interface for the given machine.
+ * Send a request without waiting for the answer.  Heartbeat echoes
+ * our F_REQID in its reply, which CallbackCall() hands to 'callback'.
  */
-static const char *
-get_ifstatus(ll_cluster_t* lcl, const char *host, const char * ifname)
+static unsigned long
+send_request(ll_cluster_t* lcl, const char * reqtype, const char ** fields
+,	llc_reply_callback_t callback, void * private_data)
 {
 	struct ha_msg*		request;
-	struct ha_msg*		reply = NULL;
-	const char *		result;
-	const char *		status = NULL;
-	static char		statbuf[128];
-	const char *		ret;
-	llc_private_t* pi;
-	const struct iflist_entry *ie;
+	struct pending_req*	pr;
+	char			idbuf[32];
+	llc_private_t*		pi;
+	int			j;
 
 	ClearLog();
 	if (!ISOURS(lcl)) {
-		ha_api_log(LOG_ERR, "get_ifstatus: bad cinfo");
-		return NULL;
+		ha_api_log(LOG_ERR, "send_request: bad cinfo");
+		return 0;
 	}
 	pi = (llc_private_t*)lcl->ll_cluster_private;
+
 	if (!pi->SignedOn) {
 		ha_api_log(LOG_ERR, "not signed on");
-		return NULL;
+		return 0;
 	}
-	ie = cached_intf_info(pi, host, ifname, 2000);
-	if (ie && ie->status) {
-		status = ie->status;
-		goto skip_ipc;
+	/* Remote client status comes back from the other node, untagged */
+	if (reqtype == NULL || callback == NULL
+	||	strcmp(reqtype, API_SIGNON) == 0
+	||	strcmp(reqtype, API_SIGNOFF) == 0
+	||	strcmp(reqtype, API_CLIENTSTATUS) == 0) {
+		ha_api_log(LOG_ERR, "send_request: bad request type");
+		return 0;
+	}
+	if (pi->pending == NULL) {
+		pi->pending = g_queue_new();
 	}
+	if (++pi->last_reqid == 0) {
+		++pi->last_reqid;
+	}
+	snprintf(idbuf, sizeof(idbuf), "%lu", pi->last_reqid);
 
-	if ((request = hb_api_boilerplate(API_IFSTATUS)) == NULL) {
-		return NULL;
+	if ((request = hb_api_boilerplate(reqtype)) == NULL) {
+		return 0;
 	}
-	if (ha_msg_add(request, F_NODENAME, host) != HA_OK) {
-		ha_api_log(LOG_ERR, "get_ifstatus: cannot add field");
+	if (ha_msg_add(request, F_REQID, idbuf) != HA_OK) {
+		ha_api_log(LOG_ERR, "send_request: cannot add field");
 		ZAPMSG(request);
-		return NULL;
+		return 0;
 	}
-	if (ha_msg_add(request, F_IFNAME, ifname) != HA_OK) {
-		ha_api_log(LOG_ERR, "get_ifstatus: cannot add field");
+	for (j=0; fields != NULL && fields[j] != NULL; j += 2) {
+		if (fields[j+1] == NULL
+		||	ha_msg_add(request, fields[j], fields[j+1]) != HA_OK) {
+			ha_api_log(LOG_ERR, "send_request: bad field [%s]"
+			,	fields[j]);
+			ZAPMSG(request);
+			return 0;
+		}
+	}
+	if ((pr = MALLOCT(struct pending_req)) == NULL) {
+		ha_api_log(LOG_ERR, "send_request: out of memory");
 		ZAPMSG(request);
-		return NULL;
+		return 0;
 	}
 
 	/* Send message */
 	if (msg2ipcchan(request, pi->chan) != HA_OK) {
 		ZAPMSG(request);
+		free(pr);
 		ha_api_perror("Can't send message to IPC Channel");
-		return NULL;
+		return 0;
 	}
 	ZAPMSG(request);
 
-	/* Read reply... */
-	if ((reply=read_api_msg(pi)) == NULL) {
-		return NULL;
-	}
-	if ((result = ha_msg_value(reply, F_APIRESULT)) != NULL
-	&&	strcmp(result, API_OK) == 0
-	&&	(status = ha_msg_value(reply,F_STATUS)) != NULL) {
+	pr->reqid = pi->last_reqid;
+	pr->callback = callback;
+	pr->private_data = private_data;
+	g_queue_push_tail(pi->pending, pr);
+	return pr->reqid;
+}
 
-skip_ipc:
-                memset(statbuf, 0, sizeof(statbuf));
-		strncpy(statbuf, status, sizeof(statbuf) - 1);
-		ret = statbuf;
-	}else{
-		ret = NULL;
+/*
+ * Hand a reply to whoever sent the request.  Replies come back in
+ * the order we sent the requests, so this is normally the first one.
+ */
+static void
+reply_callback(llc_private_t* pi, struct ha_msg* msg)
+{
+	const char *		creqid = ha_msg_value(msg, F_REQID);
+	const char *		result = ha_msg_value(msg, F_APIRESULT);
+	struct pending_req*	pr = NULL;
+	unsigned long		reqid;
+	GList*			l;
+
+	if (creqid == NULL || sscanf(creqid, "%lu", &reqid) != 1
+	||	pi->pending == NULL) {
+		return;
 	}
-	if (reply)
-		ZAPMSG(reply);
+	for (l = pi->pending->head; l != NULL; l = l->next) {
+		if (((struct pending_req*)l->data)->reqid == reqid) {
+			pr = l->data;
+			break;
+		}
+	}
+	if (pr == NULL) {
+		ha_api_log(LOG_ERR, "reply to unknown request %lu", reqid);
+		return;
+	}
+	if (result != NULL && strcmp(result, API_MORE) == 0) {
+		pr->callback(reqid, msg, pr->private_data);
+		return;
+	}
+	g_queue_remove(pi->pending, pr);
+	pr->callback(reqid, msg, pr->private_data);
+	free(pr);
+}
 
-	return ret;
+/*
+ * Forget about outstanding requests, letting their callbacks know.
+ */
+static void
+zap_pending(llc_private_t* pi)
+{
+	struct pending_req*	pr;
+
+	if (pi->pending == NULL) {
+		return;
+	}
+	while ((pr = g_queue_pop_head(pi->pending)) != NULL) {
+		pr->callback(pr->reqid, NULL, pr->private_data);
+		free(pr);
+	}
+	g_queue_free(pi->pending);
+	pi->pending = NULL;
 }
 /*
  * Zap our list of nodes
@@ -1592,19 +2747,13 @@ zap_order_queue(llc_private_t* pi)
 {
 	order_queue_t *	oq = pi->order_queue_head;
 	order_queue_t *	next;
-	int		i;
 
 	while (oq != NULL) {
 		next = oq->next;
-		for (i = 0; i < MAXMSGHIST; i++){
-			if (oq->node.orderQ[i]){
-				ZAPMSG(oq->node.orderQ[i]);
-				oq->node.orderQ[i] = NULL;
-			}
-			if (oq->cluster.orderQ[i]){
-				ZAPMSG(oq->cluster.orderQ[i]);
-				oq->cluster.orderQ[i] = NULL;
-			}
+		reset_orderQ(&oq->node);
+		reset_orderQ(&oq->cluster);
+		if (oq->leave_msg != NULL) {
+			ZAPMSG(oq->leave_msg);
 		}
 		free(oq);
 		oq = next;     
@@ -1615,17 +2764,14 @@ zap_order_queue(llc_private_t* pi)
 static void
 zap_msg_queue(llc_private_t* pi)
 {
-	struct MsgQueue* qelem = pi->firstQdmsg;
-	struct MsgQueue* next;
+	struct ha_msg*	msg;
 
-	while (qelem != NULL){
-		next = qelem->next;
-		ZAPMSG(qelem->value);
-		free(qelem);
-		qelem = next;	 
+	while ((msg = dequeue_msg(pi)) != NULL) {
+		ZAPMSG(msg);
 	}
-	pi->firstQdmsg = NULL;
-	pi->lastQdmsg = NULL;
+	free(pi->msgq);
+	pi->msgq = NULL;
+	pi->msgq_size = 0;
 }
 
 static struct nodelist_entry*
@@ -1739,29 +2885,62 @@ static void destroy_iflist(struct iflist_entry *e)
 }
 
 /*
- * Enqueue a message to be read later.
+ * Enqueue a message to be read later.  Unless it's the answer to
+ * one of our requests, it's dropped if we already have msgq_maxbytes
+ * worth of messages waiting.
  */
 static int
 enqueue_msg(llc_private_t* pi, struct ha_msg* msg)
 {
-	struct MsgQueue*	newQelem;
+	const char *		type;
+	struct MsgQueue*	q;
+	size_t			len;
+	int			j;
+
 	if (msg == NULL) {
 		return(HA_FAIL);
 	}
-	if ((newQelem = MALLOCT(struct MsgQueue)) == NULL) {
-		return(HA_FAIL);
-	}
-	newQelem->value = msg;
-	newQelem->prev = pi->lastQdmsg;
-	newQelem->next = NULL;
-	if (pi->lastQdmsg != NULL) {
-		pi->lastQdmsg->next = newQelem;
-	}
-	pi->lastQdmsg = newQelem;
-	if (pi->firstQdmsg == NULL) {
-		pi->firstQdmsg = newQelem;
+	len = get_stringlen(msg);
+	if (pi->msgq_maxbytes != 0
+	&&	pi->msgq_bytes + len > pi->msgq_maxbytes
+	&&	((type = ha_msg_value(msg, F_TYPE)) == NULL
+	||	strcmp(type, T_APIRESP) != 0)) {
+		goto drop;
 	}
+	if (pi->msgq_count == pi->msgq_size) {
+		int	newsize = pi->msgq_size ? 2*pi->msgq_size : MSGQ_MINSIZE;
+
+		q = (struct MsgQueue*)malloc(newsize*sizeof(*q));
+		if (q == NULL) {
+			goto drop;
+		}
+		for (j=0; j < pi->msgq_count; ++j) {
+			q[j] = pi->msgq[(pi->msgq_first + j) % pi->msgq_size];
+		}
+		free(pi->msgq);
+		pi->msgq = q;
+		pi->msgq_size = newsize;
+		pi->msgq_first = 0;
+	}
+	q = &pi->msgq[(pi->msgq_first + pi->msgq_count) % pi->msgq_size];
+	q->value = msg;
+	q->len = len;
+	++pi->msgq_count;
+	pi->msgq_bytes += len;
 	return HA_OK;
+
+drop:
+	if (!pi->msgq_dropping) {
+		ha_api_log(LOG_WARNING, "message queue full (%lu messages"
+		", %lu bytes): dropping messages"
+		,	(unsigned long)pi->msgq_count
+		,	(unsigned long)pi->msgq_bytes);
+		pi->msgq_dropping = TRUE;
+	}
+	++pi->msgq_dropped;
+	pi->msgq_dropbytes += len;
+	ZAPMSG(msg);
+	return HA_FAIL;
 }
 
 /*
@@ -1770,32 +2949,70 @@ enqueue_msg(llc_private_t* pi, struct ha_msg* msg)
 static struct ha_msg *
 dequeue_msg(llc_private_t* pi)
 {
-	struct MsgQueue*	qret;
-	struct ha_msg*		ret = NULL;
-	
-
-	qret = pi->firstQdmsg;
+	struct MsgQueue*	q;
 
-	if (qret != NULL) {
-		ret = qret->value;
-		pi->firstQdmsg=qret->next;
-		if (pi->firstQdmsg) {
-			pi->firstQdmsg->prev = NULL;
+	if (pi->msgq_count == 0) {
+		return(NULL);
+	}
+	q = &pi->msgq[pi->msgq_first];
+	pi->msgq_first = (pi->msgq_first + 1) % pi->msgq_size;
+	--pi->msgq_count;
+	pi->msgq_bytes -= q->len;
+
+	if (pi->msgq_count == 0) {
+		struct ha_msg*	ret = q->value;
+
+		pi->msgq_dropping = FALSE;
+		pi->msgq_first = 0;
+		/* Don't hang on to a big ring after a burst */
+		if (pi->msgq_size > MSGQ_MAXIDLE) {
+			free(pi->msgq);
+			pi->msgq = NULL;
+			pi->msgq_size = 0;
 		}
-		memset(qret, 0, sizeof(*qret));
-		
-		/*
-		 * The only two pointers to this element are the first pointer,
-		 * and the prev pointer of the next element in the queue.
-		 * (or possibly lastQdmsg... See below)
-		 */
-		free(qret);
+		return(ret);
+	}
+	return(q->value);
+}
+
+/*
+ * Set the most we'll keep in our message queue
+ */
+static int
+set_msgq_limit(ll_cluster_t* lcl, unsigned long maxbytes)
+{
+	llc_private_t*	pi;
+
+	ClearLog();
+	if (!ISOURS(lcl)) {
+		ha_api_log(LOG_ERR, "set_msgq_limit: bad cinfo");
+		return HA_FAIL;
 	}
-	if (pi->firstQdmsg == NULL) {
-		 /* Zap lastQdmsg if it pointed at this Q element */
-		pi->lastQdmsg=NULL;
+	pi = (llc_private_t*)lcl->ll_cluster_private;
+	pi->msgq_maxbytes = maxbytes;
+	return HA_OK;
+}
+
+/*
+ * Return our message queue statistics
+ */
+static int
+get_msgq_stats(ll_cluster_t* lcl, struct ll_msgq_stats * stats)
+{
+	llc_private_t*	pi;
+
+	ClearLog();
+	if (!ISOURS(lcl)) {
+		ha_api_log(LOG_ERR, "get_msgq_stats: bad cinfo");
+		return HA_FAIL;
 	}
-	return(ret);
+	pi = (llc_private_t*)lcl->ll_cluster_private;
+	stats->queued = pi->msgq_count;
+	stats->queued_bytes = pi->msgq_bytes;
+	stats->max_bytes = pi->msgq_maxbytes;
+	stats->dropped = pi->msgq_dropped;
+	stats->dropped_bytes = pi->msgq_dropbytes;
+	return HA_OK;
 }
 
 /*
@@ -1892,10 +3109,12 @@ read_api_msg(llc_private_t* pi)
 			continue;
 		}
 		if ((type=ha_msg_value(msg, F_TYPE)) != NULL
-		&&	strcmp(type, T_APIRESP) == 0) {
+		&&	strcmp(type, T_APIRESP) == 0
+		&&	ha_msg_value(msg, F_REQID) == NULL) {
 			return(msg);
 		}
-		/* Got an unexpected non-api message */
+		/* Got an unexpected non-api message (or a send_request()
+		 * reply) */
 		/* Queue it up for reading later */
 		enqueue_msg(pi, msg);
 	}
@@ -1963,6 +3182,8 @@ moveup_backupQ(struct orderQ* q)
 	if (q->backupQ){
 		struct orderQ* backup_q = q->backupQ;
 		
+		/* Ours must be empty by now: only the slots can go */
+		free(q->orderQ);
 		memcpy(q, backup_q, sizeof(struct orderQ));
 		
 		if (backup_q->backupQ != NULL){
@@ -1973,7 +3194,7 @@ moveup_backupQ(struct orderQ* q)
 		q->backupQ = NULL;
 	}else {
 		/*the queue must be empty*/
-		for (i = 0; i < MAXMSGHIST; i++) {
+		for (i = 0; q->orderQ != NULL && i < MAXMSGHIST; i++) {
 			if (q->orderQ[i]){
 				cl_log(LOG_ERR, "moveup_backupQ:"
 				       "queue is not empty"
@@ -1998,7 +3219,7 @@ pop_orderQ(struct orderQ * q)
 {
 	struct ha_msg *	msg;
 
-	if (q->orderQ[q->curr_index]){
+	if (q->orderQ != NULL && q->orderQ[q->curr_index]){
 		msg = q->orderQ[q->curr_index];
 		q->orderQ[q->curr_index] = NULL;
 		q->curr_index = (q->curr_index + 1) % MAXMSGHIST;
@@ -2041,12 +3262,13 @@ reset_orderQ(struct orderQ* q)
 {
 	int i;
 
-	for (i =0 ;i < MAXMSGHIST; i++){
+	for (i =0 ; q->orderQ != NULL && i < MAXMSGHIST; i++){
 		if (q->orderQ[i]){
 			ha_msg_del(q->orderQ[i]);
 			q->orderQ[i] = 0;
 		}
 	}
+	free(q->orderQ);
 	
 	if (q->backupQ != NULL){
 		reset_orderQ(q->backupQ);
@@ -2186,7 +3408,7 @@ process_ordered_msg(struct orderQ* q, struct ha_msg* msg,
 		}
 		q->curr_oseqno = oseq - 1;
 		
-		for (i = 0; i < MAXMSGHIST; i++) {
+		for (i = 0; q->orderQ != NULL && i < MAXMSGHIST; i++) {
 			/* Clear order queue, msg obsoleted */
 			if (q->orderQ[i]){
 				ha_msg_del(q->orderQ[i]);
@@ -2200,6 +3422,27 @@ process_ordered_msg(struct orderQ* q, struct ha_msg* msg,
 	
 
  out:
+	/* The one we're expecting needn't go through the queue at all */
+	if (popmsg && msg_oseq_compare(q->curr_oseqno + 1,
+				       q->curr_gen,oseq, gen) == 0
+	&&	(q->orderQ == NULL || q->orderQ[q->curr_index] == NULL)) {
+		q->curr_index = (q->curr_index + 1) % MAXMSGHIST;
+		q->curr_oseqno++;
+		return msg;
+	}
+
+	/* Only peers whose messages arrive out of order get slots */
+	if (q->orderQ == NULL) {
+		q->orderQ = (struct ha_msg **)
+			calloc(MAXMSGHIST, sizeof(struct ha_msg *));
+		if (q->orderQ == NULL) {
+			cl_log(LOG_ERR, "process_ordered_msg: "
+			       "allocating memory for orderQ failed");
+			ha_msg_del(msg);
+			return NULL;
+		}
+	}
+
 	/* Put the new received packet in queue */
 	q->orderQ[(q->curr_index + oseq - q->curr_oseqno -1 ) % MAXMSGHIST] = msg;
 	
@@ -2273,6 +3516,25 @@ process_client_status_msg(llc_private_t* pi, struct ha_msg* msg,
 
 }
 
+/*
+ * The next message in total order, if there is one.  One whose global
+ * number never came goes out anyway, marked F_TOBROKEN.
+ */
+static struct ha_msg *
+to_pop(llc_private_t* pi)
+{
+	struct ha_msg *	msg = llc_to_pop(&pi->to);
+	const char *	orig;
+
+	if (msg != NULL && ha_msg_value(msg, F_TOBROKEN) != NULL) {
+		orig = ha_msg_value(msg, F_ORIG);
+		ha_api_log(LOG_WARNING, "no global sequence number for a"
+		" message from %s: delivering it out of order"
+		,	orig != NULL ? orig : "?");
+	}
+	return msg;
+}
+
 /*
  *	Process msg gotten from IPC or msgQ.
  */
@@ -2290,6 +3552,7 @@ process_hb_msg(llc_private_t* pi, struct ha_msg* msg)
 	seqno_t		seq;
 	const char*	ccligen;
 	seqno_t		cligen;
+	const char *	mtype;
 	
 	
 	if ((cseq = ha_msg_value(msg, F_SEQ)) == NULL
@@ -2303,6 +3566,24 @@ process_hb_msg(llc_private_t* pi, struct ha_msg* msg)
 		return msg;
 	}
 	
+	/* Total order: the sequencer's numbers, or a message to number */
+	if ((mtype = ha_msg_value(msg, F_TYPE)) != NULL
+	&&	strcmp(mtype, T_TOSEQ) == 0) {
+		llc_to_stamps(&pi->to, msg);
+		ZAPMSG(msg);
+		return to_pop(pi);
+	}
+	if (ha_msg_value(msg, F_TOTALORDER) != NULL
+	&&	(from_node = ha_msg_value(msg, F_ORIG)) != NULL) {
+		if (llc_to_hold(&pi->to, msg, from_node, gen, seq) != HA_OK) {
+			ha_api_log(LOG_ERR, "too many messages waiting for"
+			" their global sequence number: dropped one from %s"
+			,	from_node);
+			ZAPMSG(msg);
+		}
+		return to_pop(pi);
+	}
+	
 	
 	if ((ccligen = ha_msg_value(msg, F_CLIENT_GENERATION)) == NULL
 	    ||	sscanf(ccligen, "%lx", &cligen) != 1){
@@ -2359,10 +3640,11 @@ process_hb_msg(llc_private_t* pi, struct ha_msg* msg)
 	}
 }
 /*
- * Read a heartbeat message.  Read from the queue first.
+ * Read a heartbeat message, whether or not our type filter wants it.
+ * Read from the queue first.
  */
 static struct ha_msg *
-read_hb_msg(ll_cluster_t* llc, int blocking)
+read_hb_msg_any(ll_cluster_t* llc, int blocking)
 {
 	llc_private_t*	pi;
 	struct ha_msg*	msg;
@@ -2379,6 +3661,11 @@ read_hb_msg(ll_cluster_t* llc, int blocking)
 		return NULL;
 	}
 
+	/* Anything which is now next in global order */
+	if ((retmsg = to_pop(pi)) != NULL) {
+		return retmsg;
+	}
+
 	/* Process msg from msgQ */
 	while ((msg = dequeue_msg(pi))){
 		if ((retmsg = process_hb_msg(pi, msg)))
@@ -2442,6 +3729,24 @@ read_hb_msg(ll_cluster_t* llc, int blocking)
 	}
 }
 
+/*
+ * Read a heartbeat message we asked for.
+ */
+static struct ha_msg *
+read_hb_msg(ll_cluster_t* llc, int blocking)
+{
+	struct ha_msg*	msg;
+
+	while ((msg = read_hb_msg_any(llc, blocking)) != NULL) {
+		if (type_filter_ok((llc_private_t*)llc->ll_cluster_private
+		,	msg)) {
+			return msg;
+		}
+		ZAPMSG(msg);
+	}
+	return NULL;
+}
+
 /*
  * Add a callback for the given message type.
  */
@@ -2522,6 +3827,13 @@ CallbackCall(llc_private_t* p, struct ha_msg * msg)
 	if (mtype == NULL) {
 		return(0);
 	}
+
+	/* Special case: reply to send_request() */
+
+	if (strcmp(mtype, T_APIRESP) == 0 && ha_msg_value(msg, F_REQID)) {
+		reply_callback(p, msg);
+		return(1);
+	}
 	
 	/* Special case: node status (change) */
 
@@ -2700,6 +4012,9 @@ init_nodewalk (ll_cluster_t* ci)
 	}
 	zap_nodelist(pi);
 
+	if (snap_nodelist(pi) == HA_OK) {
+		return HA_OK;
+	}
 	return(get_nodelist(pi));
 }
 
@@ -2770,6 +4085,9 @@ init_ifwalk (ll_cluster_t* ci, const char * host)
 		return HA_FAIL;
 	}
 	zap_iflist(pi);
+	if (snap_iflist(pi, host) == HA_OK) {
+		return HA_OK;
+	}
 	return(get_iflist(pi, host));
 }
 
@@ -2881,7 +4199,7 @@ msgready(ll_cluster_t*ci )
 		ha_api_log(LOG_ERR, "not signed on");
 		return 0;
 	}
-	if (pi->firstQdmsg) {
+	if (pi->msgq_count > 0 || llc_to_ready(&pi->to)) {
 		return 1;
 	}
 
@@ -3317,6 +4635,40 @@ send_ordered_clustermsg(ll_cluster_t* lcl, struct ha_msg* msg)
 	return ret;
 }
 
+/*
+ * Send a message to the cluster, to be delivered everywhere in the
+ * same order as every other message sent this way.
+ */
+static int
+send_total_ordered_clustermsg(ll_cluster_t* lcl, struct ha_msg* msg)
+{
+	llc_private_t* pi;
+
+	ClearLog();
+	if (!ISOURS(lcl)) {
+		ha_api_log(LOG_ERR, "%s: bad cinfo", __FUNCTION__);
+		return HA_FAIL;
+	}
+	pi = (llc_private_t*)lcl->ll_cluster_private;
+
+	if (!pi->SignedOn) {
+		ha_api_log(LOG_ERR, "not signed on");
+		return HA_FAIL;
+	}
+	if (pi->iscasual) {
+		ha_api_log(LOG_ERR, "%s: casual client", __FUNCTION__);
+		return HA_FAIL;
+	}
+	if (ha_msg_value(msg, F_TO) != NULL
+	||	ha_msg_mod(msg, F_TOTALORDER, "1") != HA_OK) {
+		ha_api_log(LOG_ERR, "%s: bad message", __FUNCTION__);
+		return HA_FAIL;
+	}
+	/* We'll want to see our own message come back in order */
+	llc_to_enable(&pi->to);
+	return msg2ipcchan(msg, pi->chan);
+}
+
 static int
 send_ordered_nodemsg(ll_cluster_t* lcl, struct ha_msg* msg
 ,			const char * nodename)
@@ -3497,6 +4849,14 @@ static struct llc_ops heartbeat_ops = {
 	set_sendq_len,
 	socket_set_send_block_mode,
 	APIError,		
+	get_ifstats,
+	set_msg_filter,
+	get_cluster_state,
+	send_request,
+	get_changes,
+	set_msgq_limit,
+	get_msgq_stats,
+	send_total_ordered_clustermsg,
 };
 
 
@@ -3522,6 +4882,7 @@ hb_cluster_new()
 	memset(ret, 0, sizeof(*ret));
 
 	hb->PrivateId = OurID;
+	hb->msgq_maxbytes = MSGQ_MAXBYTES;
 	ret->ll_cluster_private = hb;
 	ret->llc_ops = &heartbeat_ops;
 	
@@ -0,0 +1,265 @@
+/*
+ * order_bench: throughput and latency of ordered cluster messages,
+ *		per-sender (FIFO) order against total order.
+ *
+ * Start it on every node at about the same time, with the same options:
+ *
+ *	order_bench [-m fifo|total] [-n count] [-r rate] [-s size] [-w secs]
+ *
+ * Each copy sends 'count' messages of 'size' bytes at 'rate' per second
+ * (0: as fast as it can), and reads every order_bench message from every
+ * node until its own have all come back, or 'secs' seconds after it is
+ * done sending.  It reports how many it delivered, the delivery rate,
+ * the send to delivery latency of its own messages, and a digest of
+ * the order it delivered everything in.  In total order every node
+ * should print the same digest.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <clplumbing/cl_log.h>
+#include <hb_api_core.h>
+#include <hb_api.h>
+
+#define	BENCHTYPE	"order-bench"
+#define	F_BENCHPID	"bench_pid"
+#define	F_BENCHSEQ	"bench_seq"
+#define	F_BENCHTS	"bench_ts"
+#define	F_BENCHPAD	"bench_pad"
+
+typedef long long	usec_t;
+
+static ll_cluster_t*	hb;
+static const char *	mynode;
+static char		mypid[16];
+static usec_t *		latency;	/* Of our own messages */
+static int		nsent = 0;	/* Our own messages */
+static int		nback = 0;	/* ... which have come back */
+static long		ndelivered = 0;	/* From everyone */
+static unsigned		digest = 2166136261U;
+
+static usec_t	now_us(void);
+static void	deliver(struct ha_msg * msg);
+static void	drain(int timeout_ms);
+static int	cmp_usec(const void * a, const void * b);
+static void	usage(const char * cmd);
+int		main(int argc, char ** argv);
+
+static usec_t
+now_us(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return (usec_t)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+/* Account for one order_bench message, from whichever node */
+static void
+deliver(struct ha_msg * msg)
+{
+	const char *	orig = ha_msg_value(msg, F_ORIG);
+	const char *	pid = ha_msg_value(msg, F_BENCHPID);
+	const char *	seq = ha_msg_value(msg, F_BENCHSEQ);
+	const char *	ts = ha_msg_value(msg, F_BENCHTS);
+	const char *	p;
+	char		id[256];
+
+	if (orig == NULL || pid == NULL || seq == NULL || ts == NULL) {
+		return;
+	}
+	++ndelivered;
+
+	/* FNV-1a over who sent what, in the order we got it */
+	snprintf(id, sizeof(id), "%s:%s:%s;", orig, pid, seq);
+	for (p = id; *p != EOS; ++p) {
+		digest = (digest ^ (unsigned char)*p) * 16777619U;
+	}
+
+	if (strcmp(orig, mynode) == 0 && strcmp(pid, mypid) == 0
+	&&	nback < nsent) {
+		latency[nback++] = now_us() - (usec_t)strtod(ts, NULL);
+	}
+}
+
+/* Deliver whatever is ready, waiting up to timeout_ms for the first */
+static void
+drain(int timeout_ms)
+{
+	struct pollfd	pfd;
+	struct ha_msg *	msg;
+
+	pfd.fd = hb->llc_ops->inputfd(hb);
+	pfd.events = POLLIN;
+	if (!hb->llc_ops->msgready(hb) && poll(&pfd, 1, timeout_ms) <= 0) {
+		return;
+	}
+	while (hb->llc_ops->msgready(hb)) {
+		if ((msg = hb->llc_ops->readmsg(hb, 0)) == NULL) {
+			break;
+		}
+		deliver(msg);
+		ha_msg_del(msg);
+	}
+}
+
+static int
+cmp_usec(const void * a, const void * b)
+{
+	usec_t	x = *(const usec_t *)a;
+	usec_t	y = *(const usec_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+usage(const char * cmd)
+{
+	fprintf(stderr, "usage: %s [-m fifo|total] [-n count] [-r rate]"
+	" [-s size] [-w secs]\n", cmd);
+	exit(1);
+}
+
+int
+main(int argc, char ** argv)
+{
+	int		total = 0;
+	int		count = 1000;
+	int		rate = 0;
+	int		size = 64;
+	int		waitsecs = 10;
+	char *		pad;
+	usec_t		start;
+	usec_t		sent;
+	usec_t		deadline;
+	usec_t		elapsed;
+	int		flag;
+	int		j;
+
+	while ((flag = getopt(argc, argv, "m:n:r:s:w:")) != EOF) {
+		switch (flag) {
+		case 'm':
+			if (strcmp(optarg, "total") == 0) {
+				total = 1;
+			}else if (strcmp(optarg, "fifo") != 0) {
+				usage(argv[0]);
+			}
+			break;
+		case 'n':	count = atoi(optarg);		break;
+		case 'r':	rate = atoi(optarg);		break;
+		case 's':	size = atoi(optarg);		break;
+		case 'w':	waitsecs = atoi(optarg);	break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (count <= 0 || size <= 0 || rate < 0) {
+		usage(argv[0]);
+	}
+
+	cl_log_set_entity(argv[0]);
+	cl_log_enable_stderr(TRUE);
+	cl_log_set_facility(LOG_USER);
+
+	hb = ll_cluster_new("heartbeat");
+	if (hb->llc_ops->signon(hb, "order_bench") != HA_OK) {
+		cl_log(LOG_ERR, "Cannot sign on with heartbeat: %s"
+		,	hb->llc_ops->errmsg(hb));
+		exit(2);
+	}
+	mynode = hb->llc_ops->get_mynodeid(hb);
+	snprintf(mypid, sizeof(mypid), "%d", (int)getpid());
+	latency = (usec_t *)calloc(count, sizeof(usec_t));
+	pad = malloc(size+1);
+	if (latency == NULL || pad == NULL) {
+		cl_log(LOG_ERR, "Out of memory");
+		exit(3);
+	}
+	memset(pad, 'x', size);
+	pad[size] = EOS;
+
+	start = now_us();
+	for (j=0; j < count; ++j) {
+		struct ha_msg *	msg;
+		char		seq[16];
+		char		ts[32];
+		int		rc;
+
+		if (rate > 0) {
+			/* Keep to the schedule, reading while we wait */
+			usec_t	due = start + (usec_t)j*1000000/rate;
+			usec_t	t;
+
+			while ((t = now_us()) < due) {
+				drain((int)((due - t + 999)/1000));
+			}
+		}
+		snprintf(seq, sizeof(seq), "%d", j);
+		snprintf(ts, sizeof(ts), "%.0f", (double)now_us());
+		if ((msg = ha_msg_new(6)) == NULL
+		||	ha_msg_add(msg, F_TYPE, BENCHTYPE) != HA_OK
+		||	ha_msg_add(msg, F_BENCHPID, mypid) != HA_OK
+		||	ha_msg_add(msg, F_BENCHSEQ, seq) != HA_OK
+		||	ha_msg_add(msg, F_BENCHTS, ts) != HA_OK
+		||	ha_msg_add(msg, F_BENCHPAD, pad) != HA_OK) {
+			cl_log(LOG_ERR, "Cannot create message");
+			exit(4);
+		}
+		rc = (total
+		?	hb->llc_ops->send_total_ordered_clustermsg(hb, msg)
+		:	hb->llc_ops->send_ordered_clustermsg(hb, msg));
+		ha_msg_del(msg);
+		if (rc != HA_OK) {
+			cl_log(LOG_ERR, "Cannot send message: %s"
+			,	hb->llc_ops->errmsg(hb));
+			exit(5);
+		}
+		++nsent;
+		drain(0);
+	}
+	sent = now_us();
+
+	deadline = sent + (usec_t)waitsecs*1000000;
+	while (nback < count && now_us() < deadline) {
+		drain(100);
+	}
+	/* Give the other nodes' stragglers a moment too */
+	drain(100);
+	elapsed = now_us() - start;
+
+	printf("mode %s: sent %d in %.3fs, delivered %ld in %.3fs"
+	" (%.0f msgs/s)\n"
+	,	total ? "total" : "fifo", count, (sent - start)/1e6
+	,	ndelivered, elapsed/1e6, ndelivered/(elapsed/1e6));
+	if (nback > 0) {
+		qsort(latency, nback, sizeof(usec_t), cmp_usec);
+		printf("latency (us, %d of ours back): p50 %lld p90 %lld"
+		" p99 %lld max %lld\n", nback
+		,	latency[nback*50/100], latency[nback*90/100]
+		,	latency[nback*99/100], latency[nback-1]);
+	}
+	printf("order digest %08x\n", digest);
+
+	hb->llc_ops->signoff(hb, TRUE);
+	hb->llc_ops->delete(hb);
+	return nback == count ? 0 : 6;
+}
@@ -0,0 +1,131 @@
+/*
+ * request_test: pipelined (send_request()) API requests against a
+ *		running heartbeat
+ *
+ * A request heartbeat ignores must still be answered, or the client
+ * waits on it forever; the request sent right after it must get its
+ * answer as usual.  Returns the number of checks which failed.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <heartbeat.h>
+#include <ha_msg.h>
+#include <hb_api_core.h>
+#include <hb_api.h>
+
+#define	TESTWAIT	10	/* Seconds, for both answers */
+
+/* What came back for one request */
+struct answer {
+	gboolean	done;
+	int		order;		/* 1: answered first */
+	char		result[16];
+};
+
+static int	errcount = 0;
+static int	nanswered = 0;
+
+int		main(int argc, char ** argv);
+
+static void
+check(gboolean ok, const char * what)
+{
+	printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+	if (!ok) {
+		++errcount;
+	}
+}
+
+static void
+got_reply(unsigned long reqid, const struct ha_msg * reply, void * private)
+{
+	struct answer *	a = private;
+	const char *	result = NULL;
+
+	if (reply != NULL
+	&&	(result = ha_msg_value(reply, F_APIRESULT)) != NULL
+	&&	strcmp(result, API_MORE) == 0) {
+		return;
+	}
+	a->done = TRUE;
+	a->order = ++nanswered;
+	strncpy(a->result, result == NULL ? "?" : result
+	,	sizeof(a->result)-1);
+}
+
+int
+main(int argc, char ** argv)
+{
+	ll_cluster_t *	hb;
+	const char *	node;
+	const char *	ignored[] = {F_SENDQLEN, "0", NULL};
+	const char *	normal[] = {F_NODENAME, NULL, NULL};
+	struct answer	ianswer;
+	struct answer	nanswer;
+	time_t		deadline;
+
+	cl_log_set_entity(argv[0]);
+	cl_log_enable_stderr(TRUE);
+	memset(&ianswer, 0, sizeof(ianswer));
+	memset(&nanswer, 0, sizeof(nanswer));
+
+	hb = ll_cluster_new("heartbeat");
+	if (hb->llc_ops->signon(hb, NULL) != HA_OK) {
+		printf("FAIL: cannot sign on with heartbeat: %s\n"
+		,	hb->llc_ops->errmsg(hb));
+		return 1;
+	}
+	node = hb->llc_ops->get_mynodeid(hb);
+	normal[1] = node;
+
+	/* A zero send queue length is refused, without an answer */
+	check(hb->llc_ops->send_request(hb, API_SET_SENDQLEN, ignored
+	,	got_reply, &ianswer) != 0, "an ignored request is sent");
+	check(hb->llc_ops->send_request(hb, API_NODESTATUS, normal
+	,	got_reply, &nanswer) != 0, "a normal request is sent after it");
+
+	deadline = time(NULL) + TESTWAIT;
+	while ((!ianswer.done || !nanswer.done) && time(NULL) < deadline) {
+		struct pollfd	pfd;
+
+		if (!hb->llc_ops->msgready(hb)) {
+			pfd.fd = hb->llc_ops->inputfd(hb);
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			poll(&pfd, 1, 1000);
+		}
+		hb->llc_ops->rcvmsg(hb, 0);
+	}
+
+	check(ianswer.done && strcmp(ianswer.result, API_FAILURE) == 0
+	,	"the ignored request is answered, with a failure");
+	check(nanswer.done && strcmp(nanswer.result, API_OK) == 0
+	,	"the normal request gets its answer");
+	check(ianswer.order == 1 && nanswer.order == 2
+	,	"... after the ignored one");
+
+	hb->llc_ops->signoff(hb, TRUE);
+	hb->llc_ops->delete(hb);
+	return errcount;
+}
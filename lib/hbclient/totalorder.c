@@ -0,0 +1,320 @@
+/*
+ * totalorder.c: total order delivery for heartbeat API clients
+ *
+ * Messages marked F_TOTALORDER are held until the sequencer's T_TOSEQ
+ * gives them their global number, then handed out in that order.  We
+ * only start paying attention once we've seen or sent one, and start
+ * delivering from the first T_TOSEQ after that.
+ *
+ * A number given to a message from before we started paying attention
+ * (older than the first one we got from the same node) is skipped
+ * right away.  One given to a message which doesn't turn up within
+ * waitms is skipped then; a message whose number doesn't turn up
+ * within waitms is handed out anyway, out of order, marked F_TOBROKEN
+ * so the client can tell.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <clplumbing/cl_log.h>
+#include <heartbeat.h>
+#include <ha_msg.h>
+#include <hb_api_core.h>
+#include "totalorder.h"
+
+#define	TO_MAXHELD	4096
+
+struct to_heldmsg {
+	struct ha_msg *	msg;
+	longclock_t	since;
+};
+
+/* The first marked message we got from a node */
+struct to_origin {
+	seqno_t		gen;
+	seqno_t		seq;
+};
+
+static void
+to_key(char * key, size_t len, const char * orig, seqno_t gen, seqno_t seq)
+{
+	snprintf(key, len, "%s %lx %lx", orig, gen, seq);
+}
+
+static void
+to_heldmsg_free(gpointer data)
+{
+	struct to_heldmsg *	h = data;
+
+	if (h->msg != NULL) {
+		ha_msg_del(h->msg);
+	}
+	g_free(h);
+}
+
+void
+llc_to_enable(struct llc_totalorder * to)
+{
+	if (to->held != NULL) {
+		return;
+	}
+	to->held = g_hash_table_new_full(g_str_hash, g_str_equal
+	,	g_free, to_heldmsg_free);
+	to->stamps = g_hash_table_new_full(g_str_hash, g_str_equal
+	,	g_free, g_free);
+	to->origins = g_hash_table_new_full(g_str_hash, g_str_equal
+	,	g_free, g_free);
+	to->next = 0;
+	to->floor = 0;
+	to->waiting = zero_longclock;
+	if (to->waitms == 0) {
+		to->waitms = LLC_TO_WAITMS;
+	}
+}
+
+/*
+ * Hold on to a marked message until its number comes up.  HA_FAIL (and
+ * the message is still the caller's) if we're holding too many already.
+ */
+int
+llc_to_hold(struct llc_totalorder * to, struct ha_msg * msg
+,	const char * orig, seqno_t gen, seqno_t seq)
+{
+	char			key[HOSTLENG+40];
+	struct to_heldmsg *	h;
+
+	llc_to_enable(to);
+	if (g_hash_table_lookup(to->origins, orig) == NULL) {
+		struct to_origin *	o = g_new(struct to_origin, 1);
+
+		o->gen = gen;
+		o->seq = seq;
+		g_hash_table_insert(to->origins, g_strdup(orig), o);
+	}
+	if (g_hash_table_size(to->held) >= TO_MAXHELD) {
+		return HA_FAIL;
+	}
+	h = g_new(struct to_heldmsg, 1);
+	h->msg = msg;
+	h->since = time_longclock();
+	to_key(key, sizeof(key), orig, gen, seq);
+	g_hash_table_replace(to->held, g_strdup(key), h);
+	return HA_OK;
+}
+
+/* Give up on the message with this key ever turning up? */
+static gboolean
+to_give_up(struct llc_totalorder * to, const char * key)
+{
+	char			orig[HOSTLENG];
+	seqno_t			gen;
+	seqno_t			seq;
+	const struct to_origin*	o;
+	longclock_t		now = time_longclock();
+
+	if (sscanf(key, "%99s %lx %lx", orig, &gen, &seq) == 3
+	&&	(o = g_hash_table_lookup(to->origins, orig)) != NULL
+	&&	(gen < o->gen || (gen == o->gen && seq < o->seq))) {
+		/* From before we were listening */
+		return TRUE;
+	}
+	if (cmp_longclock(to->waiting, zero_longclock) == 0) {
+		to->waiting = now;
+		return FALSE;
+	}
+	return longclockto_ms(sub_longclock(now, to->waiting)) >= to->waitms;
+}
+
+/* Record the global numbers in a T_TOSEQ */
+void
+llc_to_stamps(struct llc_totalorder * to, const struct ha_msg * msg)
+{
+	const char *	cfirst = ha_msg_value(msg, F_TOGSEQ);
+	const char *	clist = ha_msg_value(msg, F_TOLIST);
+	const char *	from = ha_msg_value(msg, F_ORIG);
+	seqno_t		first;
+	gchar **	lines;
+	int		j;
+
+	if (to->held == NULL || from == NULL
+	||	cfirst == NULL || sscanf(cfirst, "%lx", &first) != 1) {
+		return;
+	}
+	if (to->next == 0) {
+		to->next = first;
+	}
+	if (strcmp(from, to->sequencer) != 0) {
+		/* Whatever the old sequencer didn't get out, it never will */
+		if (to->sequencer[0] != EOS) {
+			to->floor = first;
+		}
+		strncpy(to->sequencer, from, sizeof(to->sequencer)-1);
+	}
+	if (clist == NULL) {
+		return;
+	}
+	lines = g_strsplit(clist, "\n", 0);
+	for (j=0; lines[j] != NULL; ++j) {
+		char	gseq[32];
+
+		if (lines[j][0] == EOS || first + j < to->next) {
+			continue;
+		}
+		snprintf(gseq, sizeof(gseq), "%lx", first + j);
+		g_hash_table_replace(to->stamps, g_strdup(gseq)
+		,	g_strdup(lines[j]));
+	}
+	g_strfreev(lines);
+}
+
+/*
+ * Step over numbers which will never be filled, and return the key of
+ * the message which is next in global order (which we may not have yet)
+ */
+static const char *
+to_next_key(struct llc_totalorder * to, char * gseq, size_t len)
+{
+	const char *	key;
+
+	if (to->held == NULL || to->next == 0) {
+		return NULL;
+	}
+	for (;;) {
+		snprintf(gseq, len, "%lx", to->next);
+		if ((key = g_hash_table_lookup(to->stamps, gseq)) != NULL) {
+			if (g_hash_table_lookup(to->held, key) != NULL
+			||	!to_give_up(to, key)) {
+				return key;
+			}
+			g_hash_table_remove(to->stamps, gseq);
+		}else if (to->next >= to->floor) {
+			return NULL;
+		}
+		++to->next;
+		to->waiting = zero_longclock;
+	}
+}
+
+/* What to_overdue() looks with, and what it found */
+struct to_find {
+	const struct llc_totalorder *	to;
+	gpointer			key;
+};
+
+/* g_hash_table_find() callback: has this one waited too long? */
+static gboolean
+to_overdue(gpointer key, gpointer value, gpointer user_data)
+{
+	const struct to_heldmsg *	h = value;
+	struct to_find *		f = user_data;
+
+	if (longclockto_ms(sub_longclock(time_longclock(), h->since))
+	<	f->to->waitms) {
+		return FALSE;
+	}
+	f->key = key;
+	return TRUE;
+}
+
+/* A held message whose number never came, marked so, if there is one */
+static struct ha_msg *
+to_pop_overdue(struct llc_totalorder * to)
+{
+	struct to_find		f;
+	struct to_heldmsg *	h;
+	struct ha_msg *		msg;
+
+	f.to = to;
+	f.key = NULL;
+	if ((h = g_hash_table_find(to->held, to_overdue, &f)) == NULL) {
+		return NULL;
+	}
+	g_hash_table_steal(to->held, f.key);
+	g_free(f.key);
+	msg = h->msg;
+	g_free(h);
+	if (ha_msg_mod(msg, F_TOBROKEN, "1") != HA_OK) {
+		/* Better late and unmarked than never */
+		cl_log(LOG_ERR, "%s: cannot mark a message out of order"
+		,	__FUNCTION__);
+	}
+	return msg;
+}
+
+/*
+ * Return the next message in global order, if we have it, or one which
+ * has waited too long for its number (with F_TOBROKEN set)
+ */
+struct ha_msg *
+llc_to_pop(struct llc_totalorder * to)
+{
+	char		gseq[32];
+	const char *	key;
+	gpointer	origkey;
+	gpointer	h;
+	struct ha_msg *	msg;
+
+	if (to->held == NULL) {
+		return NULL;
+	}
+	if ((key = to_next_key(to, gseq, sizeof(gseq))) == NULL
+	||	!g_hash_table_lookup_extended(to->held, key, &origkey, &h)) {
+		return to_pop_overdue(to);
+	}
+	g_hash_table_steal(to->held, key);
+	g_free(origkey);
+	g_hash_table_remove(to->stamps, gseq);
+	++to->next;
+	to->waiting = zero_longclock;
+	msg = ((struct to_heldmsg *)h)->msg;
+	g_free(h);
+	return msg;
+}
+
+gboolean
+llc_to_ready(struct llc_totalorder * to)
+{
+	char		gseq[32];
+	const char *	key;
+	struct to_find	f;
+
+	if (to->held == NULL) {
+		return FALSE;
+	}
+	f.to = to;
+	f.key = NULL;
+	return ((key = to_next_key(to, gseq, sizeof(gseq))) != NULL
+	&&	g_hash_table_lookup(to->held, key) != NULL)
+	||	g_hash_table_find(to->held, to_overdue, &f) != NULL;
+}
+
+void
+llc_to_zap(struct llc_totalorder * to)
+{
+	if (to->held == NULL) {
+		return;
+	}
+	g_hash_table_destroy(to->held);
+	g_hash_table_destroy(to->stamps);
+	g_hash_table_destroy(to->origins);
+	to->held = NULL;
+	to->stamps = NULL;
+	to->origins = NULL;
+	to->sequencer[0] = EOS;
+}
@@ -0,0 +1,51 @@
+/*
+ * totalorder.h: total order delivery for heartbeat API clients
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef _HBCLIENT_TOTALORDER_H
+#define _HBCLIENT_TOTALORDER_H
+
+#include <glib.h>
+#include <clplumbing/longclock.h>
+#include <heartbeat.h>
+#include <ha_msg.h>
+
+#define	LLC_TO_WAITMS	5000	/* Plenty for retransmissions */
+
+/* One client's messages waiting for their global numbers */
+struct llc_totalorder {
+	GHashTable*	held;		/* "orig gen seq" -> held message */
+	GHashTable*	stamps;		/* global number -> "orig gen seq" */
+	GHashTable*	origins;	/* node -> first one we got */
+	seqno_t		next;		/* Next to deliver (0: not yet) */
+	seqno_t		floor;		/* Numbers below may never come */
+	longclock_t	waiting;	/* ... for next, since */
+	unsigned long	waitms;		/* Before we give up on anything */
+	char		sequencer[HOSTLENG];
+};
+
+#define	LLC_TO_ENABLED(to)	((to)->held != NULL)
+
+void		llc_to_enable(struct llc_totalorder * to);
+int		llc_to_hold(struct llc_totalorder * to, struct ha_msg * msg
+,			const char * orig, seqno_t gen, seqno_t seq);
+void		llc_to_stamps(struct llc_totalorder * to
+,			const struct ha_msg * toseq);
+struct ha_msg *	llc_to_pop(struct llc_totalorder * to);
+gboolean	llc_to_ready(struct llc_totalorder * to);
+void		llc_to_zap(struct llc_totalorder * to);
+
+#endif /* _HBCLIENT_TOTALORDER_H */
@@ -0,0 +1,147 @@
+/*
+ * totalorder_test: what a client's total order delivery does when a
+ *		message's global number never comes
+ *
+ * It has to be delivered anyway once it has waited long enough, marked
+ * F_TOBROKEN, and the messages whose numbers do come must still be
+ * delivered in order, unmarked.  Returns the number of checks which
+ * failed.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <heartbeat.h>
+#include <ha_msg.h>
+#include <hb_api_core.h>
+#include "totalorder.h"
+
+#define	TESTNODE	"node1"
+#define	TESTSEQUENCER	"node2"
+#define	TESTGEN		1
+#define	TESTWAITMS	200
+
+static int	errcount = 0;
+
+int		main(int argc, char ** argv);
+
+static void
+check(gboolean ok, const char * what)
+{
+	printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+	if (!ok) {
+		++errcount;
+	}
+}
+
+/* A marked message from TESTNODE, numbered seq */
+static struct ha_msg *
+marked(seqno_t seq)
+{
+	struct ha_msg *	msg = ha_msg_new(4);
+	char		cseq[32];
+
+	snprintf(cseq, sizeof(cseq), "%lx", seq);
+	if (msg == NULL
+	||	ha_msg_add(msg, F_ORIG, TESTNODE) != HA_OK
+	||	ha_msg_add(msg, F_SEQ, cseq) != HA_OK
+	||	ha_msg_add(msg, F_TOTALORDER, "1") != HA_OK) {
+		printf("FAIL: cannot make a test message\n");
+		exit(1);
+	}
+	return msg;
+}
+
+/* The sequencer gives TESTNODE's message seq the global number gseq */
+static void
+stamp(struct llc_totalorder * to, seqno_t gseq, seqno_t seq)
+{
+	struct ha_msg *	msg = ha_msg_new(4);
+	char		cgseq[32];
+	char		line[64];
+
+	snprintf(cgseq, sizeof(cgseq), "%lx", gseq);
+	snprintf(line, sizeof(line), "%s %lx %lx", TESTNODE
+	,	(unsigned long)TESTGEN, seq);
+	if (msg == NULL
+	||	ha_msg_add(msg, F_TYPE, T_TOSEQ) != HA_OK
+	||	ha_msg_add(msg, F_ORIG, TESTSEQUENCER) != HA_OK
+	||	ha_msg_add(msg, F_TOGSEQ, cgseq) != HA_OK
+	||	ha_msg_add(msg, F_TOLIST, line) != HA_OK) {
+		printf("FAIL: cannot make a test T_TOSEQ\n");
+		exit(1);
+	}
+	llc_to_stamps(to, msg);
+	ha_msg_del(msg);
+}
+
+/* Is this TESTNODE's message seq, and is it marked out of order? */
+static gboolean
+is(struct ha_msg * msg, seqno_t seq, gboolean broken)
+{
+	const char *	cseq;
+	seqno_t		s;
+	gboolean	ok;
+
+	if (msg == NULL) {
+		return FALSE;
+	}
+	ok = (cseq = ha_msg_value(msg, F_SEQ)) != NULL
+	&&	sscanf(cseq, "%lx", &s) == 1 && s == seq
+	&&	(ha_msg_value(msg, F_TOBROKEN) != NULL) == broken;
+	ha_msg_del(msg);
+	return ok;
+}
+
+int
+main(int argc, char ** argv)
+{
+	struct llc_totalorder	to;
+
+	memset(&to, 0, sizeof(to));
+	to.waitms = TESTWAITMS;
+	llc_to_enable(&to);
+
+	/* 1 is numbered 1: in order */
+	llc_to_hold(&to, marked(1), TESTNODE, TESTGEN, 1);
+	stamp(&to, 1, 1);
+	check(is(llc_to_pop(&to), 1, FALSE), "a numbered message goes out");
+
+	/* 2 never gets a number */
+	llc_to_hold(&to, marked(2), TESTNODE, TESTGEN, 2);
+	check(llc_to_pop(&to) == NULL && !llc_to_ready(&to)
+	,	"an unnumbered message is held");
+	usleep(2*TESTWAITMS*1000);
+	check(llc_to_ready(&to), "... until it has waited too long");
+	check(is(llc_to_pop(&to), 2, TRUE)
+	,	"then it goes out, marked out of order");
+
+	/* 3 is numbered 2, 4 is numbered 3: back in order, unmarked */
+	llc_to_hold(&to, marked(4), TESTNODE, TESTGEN, 4);
+	llc_to_hold(&to, marked(3), TESTNODE, TESTGEN, 3);
+	stamp(&to, 2, 3);
+	stamp(&to, 3, 4);
+	check(is(llc_to_pop(&to), 3, FALSE)
+	&&	is(llc_to_pop(&to), 4, FALSE)
+	,	"later numbered messages go out in order, unmarked");
+	check(llc_to_pop(&to) == NULL, "nothing is delivered twice");
+
+	llc_to_zap(&to);
+	return errcount;
+}
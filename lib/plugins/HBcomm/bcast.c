@@ -258,6 +258,8 @@ bcast_open(struct hb_media* mp)
 		bcast_close(mp);
 		return(HA_FAIL);
 	}
+	OurImports->FilterMedium(mp, ei->rsocket);
+	OurImports->TuneMedium(mp, ei->rsocket, ei->wsocket);
 	PILCallLog(LOG, PIL_INFO
 	,	"UDP Broadcast heartbeat started on port %d (%d) interface %s"
 	,	localudpport, ei->port, mp->name);
@@ -328,7 +330,8 @@ bcast_read(struct hb_media* mp, int * lenp)
 			   ,	ei->rsocket, ei->wsocket);
 	}
 
-	if ((numbytes=recvfrom(ei->rsocket, bcast_pkt, MAXMSG-1, MSG_WAITALL
+	if ((numbytes=OurImports->RecvFrom(mp, ei->rsocket, bcast_pkt
+	,	MAXMSG-1, MSG_WAITALL
 	,	(struct sockaddr *)&their_addr, &addr_len)) == -1) {
 		if (errno != EINTR) {
 			PILCallLog(LOG, PIL_CRIT
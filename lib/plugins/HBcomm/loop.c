@@ -0,0 +1,922 @@
+/*
+ * loop.c: loopback communication plugin for heartbeat.
+ *
+ * Connects several heartbeat instances running on one host through
+ * unix datagram sockets in a shared "bus" directory, and imposes
+ * delay, jitter, loss, duplication, reordering and partitions on
+ * the traffic according to a schedule file.  It exists so that
+ * membership and retransmission behaviour can be tested and
+ * measured reproducibly without real networks.
+ *
+ * ha.cf:
+ *	loop <busdir> [schedule-file]
+ *
+ * Each instance binds <busdir>/<nodename>.sock and sends every
+ * packet to all the other *.sock files in <busdir>.  More than one
+ * "loop" line (with different bus directories) gives more than one
+ * independent link.
+ *
+ * The schedule file defaults to <busdir>/schedule.  It is reread
+ * whenever it changes.  Each line is:
+ *
+ *	<seconds> <from-node|*> <to-node|*> <setting> ...
+ *
+ * with settings
+ *	delay=<ms> jitter=<ms> loss=<prob> dup=<prob> reorder=<prob>
+ *	down	(partition - drop everything)
+ *	up	(heal a partition)
+ *
+ * Times are seconds after the modification time of <busdir>/epoch,
+ * or after this medium was opened if there is no such file.  Every
+ * line whose time has passed and whose nodes match a packet applies
+ * in file order, so later lines override earlier ones.  Impairments
+ * are applied by the receiver, so the same file can be shared by
+ * all instances.  Packets with reorder set skip the delay queue.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#ifdef HAVE_STRINGS_H
+#include <strings.h>
+#endif
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/poll.h>
+
+#include <heartbeat.h>
+#include <HBcomm.h>
+#include <test.h>
+
+/*
+ * Plugin information
+ */
+#define PIL_PLUGINTYPE          HB_COMM_TYPE
+#define PIL_PLUGINTYPE_S        HB_COMM_TYPE_S
+#define PIL_PLUGIN              loop
+#define PIL_PLUGIN_S            "loop"
+#define PIL_PLUGINLICENSE	LICENSE_LGPL
+#define PIL_PLUGINLICENSEURL	URL_LGPL
+#include <pils/plugin.h>
+
+/*
+ * Macros/Defines
+ */
+#define ISLOOPOBJECT(mp) ((mp) && ((mp)->vf == (void*)&loopOps))
+#define LOOPASSERT(mp)	g_assert(ISLOOPOBJECT(mp))
+
+#define LOG		PluginImports->log
+#define MALLOC		PluginImports->alloc
+#define STRDUP  	PluginImports->mstrdup
+#define FREE		PluginImports->mfree
+
+#define	LOOP_SOCKSUFFIX	".sock"
+#define	LOOP_SCHEDULE	"schedule"
+#define	LOOP_EPOCH	"epoch"
+#define	LOOP_MAXPEERS	64	/* Other instances on one bus */
+#define	LOOP_MAXQUEUE	1024	/* Delayed packets held by a reader */
+#define	LOOP_RECHECK	1000.0	/* ms between schedule file checks */
+#define	LOOP_RESCAN	1000.0	/* ms between bus scans, changed or not */
+
+/* Which settings a schedule line changes */
+#define	LOOP_SET_DELAY		0x01
+#define	LOOP_SET_JITTER		0x02
+#define	LOOP_SET_LOSS		0x04
+#define	LOOP_SET_DUP		0x08
+#define	LOOP_SET_REORDER	0x10
+#define	LOOP_SET_DOWN		0x20
+
+/*
+ * Structure Declarations
+ */
+
+struct loop_impair {
+	double	delay;		/* ms */
+	double	jitter;		/* +/- ms */
+	double	loss;		/* probabilities 0..1 */
+	double	dup;
+	double	reorder;
+	int	down;
+};
+
+struct loop_rule {
+	double			at;	/* seconds after epoch */
+	char			from[HOSTLENG];
+	char			to[HOSTLENG];
+	int			setmask;
+	struct loop_impair	v;
+	struct loop_rule *	next;
+};
+
+struct loop_pkt {
+	struct loop_pkt *	next;
+	double			due;	/* ms, wall clock */
+	int			len;
+	char			data[1];
+};
+
+struct loop_private {
+	char *			busdir;
+	char *			schedule;
+	char			sockpath[PATH_MAX];
+	int			rsocket;
+	int			wsocket;
+
+	char *			peers[LOOP_MAXPEERS];
+	int			npeers;
+	time_t			busmtime;
+	double			lastscan;	/* ms, wall clock */
+
+	struct loop_rule *	rules;
+	time_t			schedmtime;
+	double			epoch;	/* ms, wall clock */
+	double			lastcheck;
+
+	struct loop_pkt *	queue;	/* sorted by due time */
+	int			queuelen;
+	unsigned long		overflows;
+};
+
+/*
+ * Function Prototypes
+ */
+
+PIL_rc PIL_PLUGIN_INIT(PILPlugin *us, const PILPluginImports *imports);
+
+static int loop_parse(const char *line);
+static struct hb_media* loop_new(const char *busdir, const char *schedule);
+static int loop_open(struct hb_media *mp);
+static int loop_close(struct hb_media *mp);
+static void* loop_read(struct hb_media *mp, int* lenp);
+static int loop_write(struct hb_media *mp, void *msg, int len);
+static int loop_descr(char **buffer);
+static int loop_mtype(char **buffer);
+static int loop_isping(void);
+
+static double loop_now(void);
+static void loop_scan_peers(struct loop_private *lp);
+static void loop_load_schedule(struct loop_private *lp, double now);
+static void loop_free_rules(struct loop_private *lp);
+static void loop_impairment(struct loop_private *lp, const char *from
+,		double now, struct loop_impair *imp);
+static void loop_admit(struct loop_private *lp, const char *buf, int len
+,		double now);
+static void loop_enqueue(struct loop_private *lp, const char *data, int len
+,		double due);
+
+/*
+ * External Data
+ */
+
+extern struct hb_media *sysmedia[];
+extern int nummedia;
+extern char *localnodename;
+
+/*
+ * Module Public Data
+ */
+
+const char hb_media_name[] = "Loopback simulated network";
+
+static struct hb_media_fns loopOps = {
+	NULL,
+	loop_parse,
+	loop_open,
+	loop_close,
+	loop_read,
+	loop_write,
+	loop_mtype,
+	loop_descr,
+	loop_isping
+};
+
+PIL_PLUGIN_BOILERPLATE2("1.0", Debug)
+static const PILPluginImports*  PluginImports;
+static PILPlugin*               OurPlugin;
+static PILInterface*		OurInterface;
+static struct hb_media_imports*	OurImports;
+static void*			interfprivate;
+
+/* Packet returned by loop_read(), and outbound packet with its header */
+static char			loop_pkt[MAXMSG];
+static char			loop_wpkt[HOSTLENG + MAXMSG];
+
+
+/*
+ * Implmentation
+ */
+
+PIL_rc PIL_PLUGIN_INIT(PILPlugin *us, const PILPluginImports *imports)
+{
+	/* Force the compiler to do a little type checking */
+	(void)(PILPluginInitFun)PIL_PLUGIN_INIT;
+
+	PluginImports = imports;
+	OurPlugin = us;
+
+	/* Register ourself as a plugin */
+	imports->register_plugin(us, &OurPIExports);
+
+	/*  Register our interface implementation */
+ 	return imports->register_interface(us, PIL_PLUGINTYPE_S,
+		PIL_PLUGIN_S, &loopOps, NULL,
+		&OurInterface, (void*)&OurImports, interfprivate);
+}
+
+static int loop_parse(const char *line)
+{
+	const char *bp = line;
+	int toklen;
+	struct hb_media *mp;
+	char busdir[MAXLINE];
+	char schedule[MAXLINE];
+
+	/* Skip over white space, then grab the bus directory */
+	bp += strspn(bp, WHITESPACE);
+	toklen = strcspn(bp, WHITESPACE);
+	if (toklen >= (int)sizeof(busdir)) {
+		PILCallLog(LOG, PIL_CRIT, "loop: bus directory name too long");
+		return HA_FAIL;
+	}
+	strncpy(busdir, bp, toklen);
+	bp += toklen;
+	busdir[toklen] = EOS;
+
+	if (*busdir == EOS) {
+		return HA_OK;
+	}
+	if (*busdir != '/') {
+		PILCallLog(LOG, PIL_CRIT
+		,	"loop: bus directory [%s] must be an absolute path"
+		,	busdir);
+		return HA_FAIL;
+	}
+
+	bp += strspn(bp, WHITESPACE);
+	toklen = strcspn(bp, WHITESPACE);
+	if (toklen >= (int)sizeof(schedule)) {
+		PILCallLog(LOG, PIL_CRIT, "loop: schedule file name too long");
+		return HA_FAIL;
+	}
+	strncpy(schedule, bp, toklen);
+	schedule[toklen] = EOS;
+
+	if (!(mp = loop_new(busdir, *schedule == EOS ? NULL : schedule))) {
+		return HA_FAIL;
+	}
+	sysmedia[nummedia++] = mp;
+
+	return HA_OK;
+}
+
+static int loop_mtype(char **buffer)
+{
+	*buffer = STRDUP(PIL_PLUGIN_S);
+	if (!*buffer) {
+		PILCallLog(LOG, PIL_CRIT, "loop: memory allocation error (line %d)",
+				(__LINE__ - 2) );
+		return 0;
+	}
+
+	return strlen(*buffer);
+}
+
+static int loop_descr(char **buffer)
+{
+	*buffer = STRDUP(hb_media_name);
+	if (!*buffer) {
+		PILCallLog(LOG, PIL_CRIT, "loop: memory allocation error (line %d)",
+				(__LINE__ - 2) );
+		return 0;
+	}
+
+	return strlen(*buffer);
+}
+
+static int loop_isping(void)
+{
+	return 0;
+}
+
+/*
+ *	Create new loopback heartbeat object
+ *	The medium is named after its bus directory
+ */
+static struct hb_media*
+loop_new(const char *busdir, const char *schedule)
+{
+	struct loop_private *lp;
+	struct hb_media *ret;
+	char sched[PATH_MAX];
+
+	if (schedule == NULL) {
+		snprintf(sched, sizeof(sched), "%s/%s", busdir, LOOP_SCHEDULE);
+		schedule = sched;
+	}
+	if (!(lp = (struct loop_private*)MALLOC(sizeof(*lp)))) {
+		PILCallLog(LOG, PIL_CRIT, "loop: memory allocation error (line %d)",
+			(__LINE__ - 2) );
+		return NULL;
+	}
+	memset(lp, 0, sizeof(*lp));
+	lp->rsocket = -1;
+	lp->wsocket = -1;
+	lp->busdir = STRDUP(busdir);
+	lp->schedule = STRDUP(schedule);
+
+	ret = (struct hb_media*)MALLOC(sizeof(struct hb_media));
+	if (ret == NULL || lp->busdir == NULL || lp->schedule == NULL) {
+		PILCallLog(LOG, PIL_CRIT, "loop: memory allocation error (line %d)",
+			(__LINE__ - 2) );
+		if (lp->busdir) {
+			FREE(lp->busdir);
+		}
+		if (lp->schedule) {
+			FREE(lp->schedule);
+		}
+		FREE(lp);
+		if (ret) {
+			FREE(ret);
+		}
+		return NULL;
+	}
+	memset(ret, 0, sizeof(*ret));
+	ret->pd = (void*)lp;
+	if (!(ret->name = STRDUP(busdir))) {
+		PILCallLog(LOG, PIL_CRIT, "loop: memory allocation error (line %d)",
+			(__LINE__ - 2) );
+		FREE(lp->busdir);
+		FREE(lp->schedule);
+		FREE(lp);
+		FREE(ret);
+		return NULL;
+	}
+
+	return ret;
+}
+
+/*
+ *	Open loopback heartbeat interface
+ */
+static int loop_open(struct hb_media* mp)
+{
+	struct loop_private *lp;
+	struct sockaddr_un addr;
+
+	LOOPASSERT(mp);
+	lp = (struct loop_private*)mp->pd;
+
+	if (localnodename == NULL) {
+		PILCallLog(LOG, PIL_CRIT, "loop: local node name unknown");
+		return HA_FAIL;
+	}
+	if (snprintf(lp->sockpath, sizeof(lp->sockpath), "%s/%s%s"
+	,	lp->busdir, localnodename, LOOP_SOCKSUFFIX)
+	>=	(int)sizeof(addr.sun_path)) {
+		PILCallLog(LOG, PIL_CRIT, "loop: socket path %s/%s%s too long"
+		,	lp->busdir, localnodename, LOOP_SOCKSUFFIX);
+		return HA_FAIL;
+	}
+	if (mkdir(lp->busdir, 0755) < 0 && errno != EEXIST) {
+		PILCallLog(LOG, PIL_CRIT, "loop: cannot create %s: %s"
+		,	lp->busdir, strerror(errno));
+		return HA_FAIL;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, lp->sockpath, sizeof(addr.sun_path)-1);
+
+	if ((lp->rsocket = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0
+	||	(lp->wsocket = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+		PILCallLog(LOG, PIL_CRIT, "loop: cannot create socket: %s"
+		,	strerror(errno));
+		loop_close(mp);
+		return HA_FAIL;
+	}
+	/* A socket left over from a previous run of this node */
+	unlink(lp->sockpath);
+	if (bind(lp->rsocket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		PILCallLog(LOG, PIL_CRIT, "loop: cannot bind %s: %s"
+		,	lp->sockpath, strerror(errno));
+		loop_close(mp);
+		return HA_FAIL;
+	}
+	if (fcntl(lp->rsocket, F_SETFD, FD_CLOEXEC) < 0
+	||	fcntl(lp->wsocket, F_SETFD, FD_CLOEXEC) < 0) {
+		PILCallLog(LOG, PIL_CRIT, "loop: error setting close-on-exec flag: %s",
+			strerror(errno));
+	}
+
+	lp->epoch = loop_now();
+	lp->lastcheck = 0.0;
+	loop_load_schedule(lp, lp->epoch);
+	loop_scan_peers(lp);
+
+	PILCallLog(LOG, PIL_INFO, "loop: started on %s (schedule %s)"
+	,	lp->sockpath, lp->schedule);
+
+	return HA_OK;
+}
+
+/*
+ *	Close loopback heartbeat interface
+ */
+static int loop_close(struct hb_media* mp)
+{
+	struct loop_private *lp;
+	struct loop_pkt *pkt;
+	int rc = HA_OK;
+	int j;
+
+	LOOPASSERT(mp);
+	lp = (struct loop_private*)mp->pd;
+
+	if (lp->rsocket >= 0) {
+		if (close(lp->rsocket) < 0) {
+			rc = HA_FAIL;
+		}
+		lp->rsocket = -1;
+	}
+	if (lp->wsocket >= 0) {
+		if (close(lp->wsocket) < 0) {
+			rc = HA_FAIL;
+		}
+		lp->wsocket = -1;
+	}
+	for (j=0; j < lp->npeers; ++j) {
+		FREE(lp->peers[j]);
+		lp->peers[j] = NULL;
+	}
+	lp->npeers = 0;
+	lp->busmtime = 0;
+	lp->lastscan = 0.0;
+	while ((pkt = lp->queue) != NULL) {
+		lp->queue = pkt->next;
+		FREE(pkt);
+	}
+	lp->queuelen = 0;
+	loop_free_rules(lp);
+	return rc;
+}
+
+/* Wall clock in ms - it has to agree between instances */
+static double
+loop_now(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/*
+ * Find the other instances on our bus.  Rescans when the bus directory
+ * changes, which is when a node starts or stops - and every LOOP_RESCAN
+ * anyway, since st_mtime can't tell two changes in one second apart.
+ */
+static void
+loop_scan_peers(struct loop_private *lp)
+{
+	struct stat	sbuf;
+	DIR *		dp;
+	struct dirent *	de;
+	const char *	ours;
+	size_t		slen = sizeof(LOOP_SOCKSUFFIX) - 1;
+	int		j;
+	double		now = loop_now();
+
+	if (stat(lp->busdir, &sbuf) < 0
+	||	(sbuf.st_mtime == lp->busmtime
+	&&	now - lp->lastscan < LOOP_RESCAN)) {
+		return;
+	}
+	if ((dp = opendir(lp->busdir)) == NULL) {
+		return;
+	}
+	lp->busmtime = sbuf.st_mtime;
+	lp->lastscan = now;
+	for (j=0; j < lp->npeers; ++j) {
+		FREE(lp->peers[j]);
+		lp->peers[j] = NULL;
+	}
+	lp->npeers = 0;
+
+	ours = strrchr(lp->sockpath, '/') + 1;
+	while ((de = readdir(dp)) != NULL && lp->npeers < LOOP_MAXPEERS) {
+		size_t	nlen = strlen(de->d_name);
+		char	path[PATH_MAX];
+
+		if (nlen <= slen
+		||	strcmp(de->d_name + nlen - slen, LOOP_SOCKSUFFIX) != 0
+		||	strcmp(de->d_name, ours) == 0) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", lp->busdir, de->d_name);
+		if ((lp->peers[lp->npeers] = STRDUP(path)) != NULL) {
+			++lp->npeers;
+		}
+	}
+	closedir(dp);
+
+	if (DEBUGPKT) {
+		PILCallLog(LOG, PIL_DEBUG, "loop: %d peers on %s"
+		,	lp->npeers, lp->busdir);
+	}
+}
+
+static void
+loop_free_rules(struct loop_private *lp)
+{
+	struct loop_rule *	r;
+
+	while ((r = lp->rules) != NULL) {
+		lp->rules = r->next;
+		FREE(r);
+	}
+}
+
+/*
+ * (Re)read the schedule file and the epoch if either has changed.
+ * A line that does not parse is logged and ignored.
+ */
+static void
+loop_load_schedule(struct loop_private *lp, double now)
+{
+	struct stat		sbuf;
+	char			epochfile[PATH_MAX];
+	FILE *			fp;
+	char			line[MAXLINE];
+	struct loop_rule **	tail;
+	int			lineno = 0;
+
+	if (now - lp->lastcheck < LOOP_RECHECK) {
+		return;
+	}
+	lp->lastcheck = now;
+
+	snprintf(epochfile, sizeof(epochfile), "%s/%s", lp->busdir, LOOP_EPOCH);
+	if (stat(epochfile, &sbuf) == 0) {
+		lp->epoch = sbuf.st_mtime * 1000.0;
+	}
+
+	if (stat(lp->schedule, &sbuf) < 0) {
+		if (lp->rules) {
+			PILCallLog(LOG, PIL_INFO, "loop: schedule %s removed"
+			,	lp->schedule);
+			loop_free_rules(lp);
+		}
+		lp->schedmtime = 0;
+		return;
+	}
+	if (sbuf.st_mtime == lp->schedmtime
+	||	(fp = fopen(lp->schedule, "r")) == NULL) {
+		return;
+	}
+	lp->schedmtime = sbuf.st_mtime;
+	loop_free_rules(lp);
+	tail = &lp->rules;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		struct loop_rule	r;
+		char *			tok;
+		char *			end;
+		int			ok = TRUE;
+
+		++lineno;
+		memset(&r, 0, sizeof(r));
+		if ((tok = strtok(line, WHITESPACE)) == NULL || *tok == '#') {
+			continue;
+		}
+		r.at = strtod(tok, &end);
+		if (*end != EOS || r.at < 0.0) {
+			ok = FALSE;
+		}
+		if ((tok = strtok(NULL, WHITESPACE)) == NULL) {
+			ok = FALSE;
+		}else{
+			strncpy(r.from, tok, sizeof(r.from)-1);
+		}
+		if ((tok = strtok(NULL, WHITESPACE)) == NULL) {
+			ok = FALSE;
+		}else{
+			strncpy(r.to, tok, sizeof(r.to)-1);
+		}
+		while (ok && (tok = strtok(NULL, WHITESPACE)) != NULL) {
+			char *		eq = strchr(tok, '=');
+			double		val = 0.0;
+			int		bit = 0;
+
+			if (eq) {
+				*eq = EOS;
+				val = strtod(eq+1, &end);
+				if (*end != EOS || val < 0.0) {
+					ok = FALSE;
+					break;
+				}
+			}
+			if (strcmp(tok, "down") == 0 && !eq) {
+				r.v.down = TRUE;
+				bit = LOOP_SET_DOWN;
+			}else if (strcmp(tok, "up") == 0 && !eq) {
+				r.v.down = FALSE;
+				bit = LOOP_SET_DOWN;
+			}else if (strcmp(tok, "delay") == 0 && eq) {
+				r.v.delay = val;
+				bit = LOOP_SET_DELAY;
+			}else if (strcmp(tok, "jitter") == 0 && eq) {
+				r.v.jitter = val;
+				bit = LOOP_SET_JITTER;
+			}else if (strcmp(tok, "loss") == 0 && eq && val <= 1.0) {
+				r.v.loss = val;
+				bit = LOOP_SET_LOSS;
+			}else if (strcmp(tok, "dup") == 0 && eq && val <= 1.0) {
+				r.v.dup = val;
+				bit = LOOP_SET_DUP;
+			}else if (strcmp(tok, "reorder") == 0 && eq && val <= 1.0){
+				r.v.reorder = val;
+				bit = LOOP_SET_REORDER;
+			}else{
+				ok = FALSE;
+				break;
+			}
+			r.setmask |= bit;
+		}
+		if (!ok || r.setmask == 0) {
+			PILCallLog(LOG, PIL_WARN, "loop: %s line %d ignored"
+			,	lp->schedule, lineno);
+			continue;
+		}
+		if ((*tail = (struct loop_rule*)MALLOC(sizeof(r))) == NULL) {
+			PILCallLog(LOG, PIL_CRIT
+			,	"loop: memory allocation error (line %d)"
+			,	(__LINE__ - 3) );
+			break;
+		}
+		**tail = r;
+		tail = &(*tail)->next;
+	}
+	fclose(fp);
+
+	PILCallLog(LOG, PIL_INFO, "loop: loaded schedule %s", lp->schedule);
+}
+
+#define	LOOP_MATCH(pat, name)	(strcmp((pat), "*") == 0		\
+				||	strcasecmp((pat), (name)) == 0)
+
+/* Work out what currently happens to packets from 'from' to us */
+static void
+loop_impairment(struct loop_private *lp, const char *from, double now
+,	struct loop_impair *imp)
+{
+	struct loop_rule *	r;
+	double			elapsed = (now - lp->epoch) / 1000.0;
+
+	memset(imp, 0, sizeof(*imp));
+	for (r = lp->rules; r != NULL; r = r->next) {
+		if (r->at > elapsed
+		||	!LOOP_MATCH(r->from, from)
+		||	!LOOP_MATCH(r->to, localnodename)) {
+			continue;
+		}
+		if (r->setmask & LOOP_SET_DELAY) {
+			imp->delay = r->v.delay;
+		}
+		if (r->setmask & LOOP_SET_JITTER) {
+			imp->jitter = r->v.jitter;
+		}
+		if (r->setmask & LOOP_SET_LOSS) {
+			imp->loss = r->v.loss;
+		}
+		if (r->setmask & LOOP_SET_DUP) {
+			imp->dup = r->v.dup;
+		}
+		if (r->setmask & LOOP_SET_REORDER) {
+			imp->reorder = r->v.reorder;
+		}
+		if (r->setmask & LOOP_SET_DOWN) {
+			imp->down = r->v.down;
+		}
+	}
+}
+
+/* Insert a copy of a packet into the delay queue, keeping it sorted */
+static void
+loop_enqueue(struct loop_private *lp, const char *data, int len, double due)
+{
+	struct loop_pkt *	pkt;
+	struct loop_pkt **	pp;
+
+	if (lp->queuelen >= LOOP_MAXQUEUE) {
+		if (lp->overflows++ == 0) {
+			PILCallLog(LOG, PIL_WARN
+			,	"loop: delay queue on %s full - dropping"
+			,	lp->busdir);
+		}
+		return;
+	}
+	if ((pkt = (struct loop_pkt*)MALLOC(sizeof(*pkt) + len)) == NULL) {
+		return;
+	}
+	memcpy(pkt->data, data, len);
+	pkt->len = len;
+	pkt->due = due;
+
+	for (pp = &lp->queue; *pp && (*pp)->due <= due; pp = &(*pp)->next) {
+		/* Nothing */;
+	}
+	pkt->next = *pp;
+	*pp = pkt;
+	++lp->queuelen;
+}
+
+/*
+ * Decide the fate of a packet just received from the bus.
+ * The probability draws use the same RandThresh() as the
+ * OnlyForTesting loss hooks in heartbeat itself.
+ */
+static void
+loop_admit(struct loop_private *lp, const char *buf, int len, double now)
+{
+	const char *		from = buf;
+	const char *		data;
+	struct loop_impair	imp;
+	int			copies = 1;
+	int			j;
+
+	if ((data = memchr(buf, EOS, len < HOSTLENG ? len : HOSTLENG)) == NULL){
+		PILCallLog(LOG, PIL_WARN, "loop: malformed packet on %s"
+		,	lp->busdir);
+		return;
+	}
+	++data;
+	len -= data - buf;
+
+	loop_impairment(lp, from, now, &imp);
+	if (imp.down || (imp.loss > 0.0 && RandThresh(imp.loss))) {
+		if (DEBUGPKT) {
+			PILCallLog(LOG, PIL_DEBUG, "loop: dropped %d bytes from %s"
+			,	len, from);
+		}
+		return;
+	}
+	if (imp.dup > 0.0 && RandThresh(imp.dup)) {
+		++copies;
+	}
+	for (j=0; j < copies; ++j) {
+		double	due = now + imp.delay;
+
+		if (imp.jitter > 0.0) {
+			due += imp.jitter * (2.0 * rand() / RAND_MAX - 1.0);
+		}
+		if (due < now || (imp.reorder > 0.0 && RandThresh(imp.reorder))) {
+			due = now;
+		}
+		loop_enqueue(lp, data, len, due);
+	}
+}
+
+/*
+ * Receive a heartbeat packet from the loopback bus.
+ * Blocks until a packet is due for delivery.
+ */
+static void *
+loop_read(struct hb_media* mp, int *lenp)
+{
+	struct loop_private *lp;
+	static char rbuf[HOSTLENG + MAXMSG];
+
+	LOOPASSERT(mp);
+	lp = (struct loop_private*)mp->pd;
+
+	for (;;) {
+		double		now = loop_now();
+		struct pollfd	pfd;
+		int		timeout = -1;
+		int		numbytes;
+		int		rc;
+
+		loop_load_schedule(lp, now);
+
+		if (lp->queue && lp->queue->due <= now) {
+			struct loop_pkt *	pkt = lp->queue;
+
+			lp->queue = pkt->next;
+			--lp->queuelen;
+			numbytes = pkt->len < MAXMSG ? pkt->len : MAXMSG-1;
+			memcpy(loop_pkt, pkt->data, numbytes);
+			FREE(pkt);
+			loop_pkt[numbytes] = EOS;
+			if (DEBUGPKTCONT) {
+				PILCallLog(LOG, PIL_DEBUG, "%s", loop_pkt);
+			}
+			*lenp = numbytes + 1;
+			return loop_pkt;
+		}
+
+		if (lp->queue) {
+			timeout = (int)(lp->queue->due - now) + 1;
+		}else if (lp->rules) {
+			/* Schedule changes can happen with nothing queued */
+			timeout = (int)LOOP_RECHECK;
+		}
+		pfd.fd = lp->rsocket;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if ((rc = poll(&pfd, 1, timeout)) < 0) {
+			if (errno != EINTR) {
+				PILCallLog(LOG, PIL_CRIT, "loop: poll error: %s"
+				,	strerror(errno));
+			}
+			return NULL;
+		}
+		if (rc == 0) {
+			continue;
+		}
+		if ((numbytes = recv(lp->rsocket, rbuf, sizeof(rbuf)-1
+		,	MSG_DONTWAIT)) <= 0) {
+			if (numbytes < 0 && errno != EINTR && errno != EAGAIN) {
+				PILCallLog(LOG, PIL_CRIT
+				,	"loop: error receiving from socket: %s"
+				,	strerror(errno));
+				return NULL;
+			}
+			continue;
+		}
+		if (DEBUGPKT) {
+			PILCallLog(LOG, PIL_DEBUG, "loop: received %d byte packet"
+			,	numbytes);
+		}
+		loop_admit(lp, rbuf, numbytes, loop_now());
+	}
+}
+
+/*
+ * Send a heartbeat packet to every other instance on the bus.
+ * Instances which have gone away are quietly skipped.
+ */
+static int
+loop_write(struct hb_media* mp, void *pkt, int len)
+{
+	struct loop_private *lp;
+	struct sockaddr_un addr;
+	int hdrlen;
+	int j;
+
+	LOOPASSERT(mp);
+	lp = (struct loop_private*)mp->pd;
+
+	hdrlen = strlen(localnodename) + 1;
+	if (hdrlen > HOSTLENG || len > MAXMSG) {
+		return HA_FAIL;
+	}
+	memcpy(loop_wpkt, localnodename, hdrlen);
+	memcpy(loop_wpkt + hdrlen, pkt, len);
+
+	loop_scan_peers(lp);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	for (j=0; j < lp->npeers; ++j) {
+		strncpy(addr.sun_path, lp->peers[j], sizeof(addr.sun_path)-1);
+		if (sendto(lp->wsocket, loop_wpkt, hdrlen + len, MSG_DONTWAIT
+		,	(struct sockaddr *)&addr, sizeof(addr)) < 0
+		&&	errno != ECONNREFUSED && errno != ENOENT
+		&&	errno != EAGAIN && !mp->suppresserrs) {
+			PILCallLog(LOG, PIL_CRIT
+			,	"loop: Unable to send to %s len=%d: %s"
+			,	lp->peers[j], len, strerror(errno));
+		}
+	}
+
+	if (DEBUGPKT) {
+		PILCallLog(LOG, PIL_DEBUG, "loop: sent %d bytes to %d peers"
+		,	len, lp->npeers);
+   	}
+	if (DEBUGPKTCONT) {
+		PILCallLog(LOG, PIL_DEBUG, "%s", (const char*)pkt);
+   	}
+	return HA_OK;
+}
@@ -352,6 +352,8 @@ mcast_open(struct hb_media* hbm)
 		mcast_close(hbm);
 		return(HA_FAIL);
 	}
+	OurImports->FilterMedium(hbm, mcp->rsocket);
+	OurImports->TuneMedium(hbm, mcp->rsocket, mcp->wsocket);
 	if (Debug) {
 		PILCallLog(LOG, PIL_DEBUG
 		,	"%s: read socket: %d"
@@ -419,7 +421,8 @@ mcast_read(struct hb_media* hbm, int *lenp)
 	MCASTASSERT(hbm);
 	mcp = (struct mcast_private *) hbm->pd;
 	
-	if ((numbytes=recvfrom(mcp->rsocket, mcast_pkt, MAXMSG-1, 0
+	if ((numbytes=OurImports->RecvFrom(hbm, mcp->rsocket, mcast_pkt
+	,	MAXMSG-1, 0
 	,	(struct sockaddr *)&their_addr, &addr_len)) < 0) {
 		if (errno != EINTR) {
 			PILCallLog(LOG, PIL_CRIT, "Error receiving from socket: %s"
@@ -337,6 +337,7 @@ mcast6_open(struct hb_media* hbm)
 		,	"%s: read socket: %d"
 		,	__FUNCTION__, mcp->rsocket);
 	}
+	OurImports->TuneMedium(hbm, mcp->rsocket, mcp->wsocket);
 
 	PILCallLog(LOG, PIL_INFO, "UDP multicast heartbeat started for [%s]:%s "
 		"on interface %s (hops=%d loop=%d)" ,
@@ -398,7 +399,8 @@ mcast6_read(struct hb_media* hbm, int *lenp)
 	MCASTASSERT(hbm);
 	mcp = (struct mcast6_private *) hbm->pd;
 
-	if ((numbytes=recvfrom(mcp->rsocket, mcast6_pkt, MAXMSG-1, 0
+	if ((numbytes=OurImports->RecvFrom(hbm, mcp->rsocket, mcast6_pkt
+	,	MAXMSG-1, 0
 	,	(struct sockaddr *)&their_addr, &addr_len)) < 0) {
 		if (errno != EINTR) {
 			PILCallLog(LOG, PIL_CRIT, "Error receiving from socket: %s"
@@ -27,10 +27,11 @@
  * but proof of concept only. It will break if things break.
  *
  * It is here only in case someone finds time to pick this up and add RDS
- * specific error handling to sendto() and others, figure out when to use
+ * specific error handling to the rest of it, figure out when to use
  * RDS_CANCEL_SENT_TO (and how to get the necessary information into the
- * plugin), how to handle necessary retries on congestion and whatever else is
- * necessary to make it actually work.
+ * plugin) and whatever else is necessary to make it actually work.
+ * Sends to a congested peer (EAGAIN, ENOBUFS) are retried for a little
+ * while now, and counted per peer.
  *
  * And, how to sensibly configure (and reconfigure, preferably at runtime)
  * the list of peers this thing talks to.
@@ -63,6 +64,8 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <poll.h>
 
 #ifndef HAVE_INET_ATON
 	extern  int     inet_aton(const char *, struct in_addr *);
@@ -76,6 +79,7 @@
 
 #include <heartbeat.h>
 #include <HBcomm.h>
+#include <clplumbing/longclock.h>
 
 /*
  * Plugin information
@@ -101,6 +105,12 @@
 
 #define	MAXBINDTRIES	1
 
+/* Retrying sends to congested peers: first wait, and the most in all */
+#define	RDS_RETRYMS	1
+#define	RDS_RETRYMAXMS	32
+/* How often to report peers we've had trouble sending to */
+#define	RDS_STATSECS	300
+
 static int largest_msg_size = 0;
 
 /*
@@ -121,6 +131,24 @@ struct rds_private {
 	 * comes in handy.
 	 */
 	GHashTable *peer_addresses;
+
+	/* The same peers, as we send to them (write process) */
+	struct rds_peer *peers;
+	int *pending;			/* Peers still to send to */
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr *mmsg;		/* One per pending peer */
+#endif
+	longclock_t laststats;
+};
+
+struct rds_peer {
+	const char *name;
+	const struct sockaddr_in *addr;
+	unsigned long sent;		/* Packets the kernel took */
+	unsigned long retried;		/* ... after it said it was congested */
+	unsigned long dropped;		/* Packets we gave up on */
+	unsigned long troubles;		/* retried + dropped when last logged */
+	int err;			/* Last send: 0 or errno */
 };
 
 
@@ -138,6 +166,13 @@ static void* rds_read(struct hb_media *mp, int* lenp);
 static int rds_write(struct hb_media *mp, void *msg, int len);
 
 static int HB_make_sock(struct hb_media *mp);
+static int rds_open_peers(struct rds_private *ei);
+static void rds_free_peers(struct rds_private *ei);
+static void rds_send_pending(struct rds_private *ei, int npending,
+		void *pkt, int len);
+static void rds_log_stats(struct hb_media *mp);
+static int rds_msince(longclock_t then);
+static int rds_wait(struct rds_private *ei, int waitms);
 
 static struct rds_private* new_ip_interface(const char *ifn);
 
@@ -420,6 +455,12 @@ static int rds_open(struct hb_media* mp)
 	ei->socket = HB_make_sock(mp);
 	if (ei->socket < 0)
 		return HA_FAIL;
+	if (rds_open_peers(ei) != HA_OK) {
+		close(ei->socket);
+		ei->socket = -1;
+		return HA_FAIL;
+	}
+	OurImports->TuneMedium(mp, ei->socket, ei->socket);
 
 	PILCallLog(LOG, PIL_INFO, "rds: started on %s %s:%d",
 		ei->interface, inet_ntoa(ei->my_addr.sin_addr), localrdsport);
@@ -443,6 +484,7 @@ static int rds_close(struct hb_media* mp)
 		}
 		ei->socket = -1;
 	}
+	rds_free_peers(ei);
 	return rc;
 }
 
@@ -465,7 +507,8 @@ rds_read(struct hb_media* mp, int *lenp)
 	ei = (struct rds_private*)mp->pd;
 
 	addr_len = sizeof(struct sockaddr);
-	if ((numbytes = recvfrom(ei->socket, rds_pkt, MAXMSG-1, 0,
+	if ((numbytes = OurImports->RecvFrom(mp, ei->socket, rds_pkt,
+		MAXMSG-1, 0,
 		(struct sockaddr *)&their_addr, &addr_len)) == -1) {
 		if (errno != EINTR) {
 			PILCallLog(LOG, PIL_CRIT, "rds: error receiving from socket: %s",
@@ -501,53 +544,186 @@ rds_read(struct hb_media* mp, int *lenp)
  * Send a heartbeat packet over unicast RDS/IP interface
  */
 
-struct state_on_stack {
-	struct hb_media *mp;
-	char *peer;
-	void *pkt;
-	int len;
-	int err_count;
-};
+static void rds_add_peer(gpointer key, gpointer value, gpointer user_data)
+{
+	struct rds_private *ei = user_data;
+	struct rds_peer *p = &ei->peers[ei->n_peers++];
 
-static void rds_sendto_one(gpointer key, gpointer value, gpointer user_data)
+	memset(p, 0, sizeof(*p));
+	p->name = key;
+	p->addr = value;
+}
+
+/* Set up to send to the peers from the rds line, all at once */
+static int rds_open_peers(struct rds_private *ei)
 {
-	struct state_on_stack *s = user_data;
-	struct sockaddr_in *addr = value;
-	struct rds_private *ei = s->mp->pd;
-	const char *this_peer = key;
-	int rc;
+	int n = g_hash_table_size(ei->peer_addresses);
+
+	rds_free_peers(ei);
+	ei->peers = MALLOC(n * sizeof(*ei->peers));
+	ei->pending = MALLOC(n * sizeof(*ei->pending));
+#ifdef HAVE_SENDMMSG
+	ei->mmsg = MALLOC(n * sizeof(*ei->mmsg));
+	if (ei->mmsg == NULL) {
+		PILCallLog(LOG, PIL_CRIT, "rds: cannot alloc mmsghdr");
+		rds_free_peers(ei);
+		return HA_FAIL;
+	}
+	memset(ei->mmsg, 0, n * sizeof(*ei->mmsg));
+#endif
+	if (ei->peers == NULL || ei->pending == NULL) {
+		PILCallLog(LOG, PIL_CRIT, "rds: cannot alloc peers");
+		rds_free_peers(ei);
+		return HA_FAIL;
+	}
+	ei->n_peers = 0;
+	g_hash_table_foreach(ei->peer_addresses, rds_add_peer, ei);
+	ei->laststats = time_longclock();
+	return HA_OK;
+}
 
-	if (s->peer && strcmp(s->peer, this_peer)) {
-		if (DEBUGPKT) {
-			PILCallLog(LOG, PIL_DEBUG, "rds: %s != %s, NOT sending to %s",
-					this_peer, s->peer, inet_ntoa(addr->sin_addr));
+static void rds_free_peers(struct rds_private *ei)
+{
+	if (ei->peers) {
+		FREE(ei->peers);
+		ei->peers = NULL;
+	}
+	if (ei->pending) {
+		FREE(ei->pending);
+		ei->pending = NULL;
+	}
+#ifdef HAVE_SENDMMSG
+	if (ei->mmsg) {
+		FREE(ei->mmsg);
+		ei->mmsg = NULL;
+	}
+#endif
+}
+
+/*
+ * Send pkt once to each of the first npending peers in ei->pending,
+ * in as few system calls as we can, and note how it went in their err.
+ */
+static void rds_send_pending(struct rds_private *ei, int npending,
+		void *pkt, int len)
+{
+	int j;
+#ifdef HAVE_SENDMMSG
+	struct iovec iov;
+	int sent;
+
+	iov.iov_base = pkt;
+	iov.iov_len = len;
+	for (j = 0; j < npending; ++j) {
+		struct msghdr *h = &ei->mmsg[j].msg_hdr;
+
+		/* Casting away const: sendmmsg doesn't write to it */
+		h->msg_name = (void*)(unsigned long)ei->peers[ei->pending[j]].addr;
+		h->msg_namelen = sizeof(struct sockaddr_in);
+		h->msg_iov = &iov;
+		h->msg_iovlen = 1;
+	}
+	for (j = 0; j < npending; j += sent) {
+		sent = sendmmsg(ei->socket, &ei->mmsg[j], npending - j,
+				MSG_DONTWAIT);
+		if (sent > 0) {
+			int k;
+
+			for (k = j; k < j + sent; ++k)
+				ei->peers[ei->pending[k]].err = 0;
+			continue;
+		}
+		/* Sending to this one failed; go on with the next */
+		ei->peers[ei->pending[j]].err = errno;
+		sent = 1;
+		if (errno == EINTR) {
+			/* Out of time: nobody after that got it either */
+			for (++j; j < npending; ++j)
+				ei->peers[ei->pending[j]].err = EINTR;
 		}
-		return;
 	}
+#else
+	for (j = 0; j < npending; ++j) {
+		struct rds_peer *p = &ei->peers[ei->pending[j]];
 
-	rc = sendto(ei->socket, s->pkt, s->len, MSG_DONTWAIT, addr, sizeof(*addr));
-	/* FIXME
-	 * handle RDS specific meaning of error codes like EMSGSIZE, EAGAIN, ENOBUFS
-	 */
-	if (rc != s->len) {
-		s->err_count++;
-		if (!s->mp->suppresserrs) {
-			PILCallLog(LOG, PIL_CRIT, "sendto(%s) failed: [%d] %s",
-				inet_ntoa(addr->sin_addr), rc, strerror(errno));
+		if (sendto(ei->socket, pkt, len, MSG_DONTWAIT,
+			(const struct sockaddr *)p->addr, sizeof(*p->addr)) == len) {
+			p->err = 0;
+			continue;
+		}
+		p->err = errno;
+		if (errno == EINTR) {
+			for (++j; j < npending; ++j)
+				ei->peers[ei->pending[j]].err = EINTR;
 		}
-		return;
 	}
-	if (DEBUGPKT) {
-		PILCallLog(LOG, PIL_DEBUG, "rds: sent %d bytes to %s", rc,
-			inet_ntoa(addr->sin_addr));
+#endif
+}
+
+static int rds_msince(longclock_t then)
+{
+	return (int)longclockto_ms(sub_longclock(time_longclock(), then));
+}
+
+/*
+ * Wait waitms before retrying congested peers.  RDS congestion is per
+ * destination, so POLLOUT on the socket usually comes right back: sleep
+ * out whatever is left.  Returns -1 (EINTR) if our write timer went off.
+ */
+static int rds_wait(struct rds_private *ei, int waitms)
+{
+	longclock_t start = time_longclock();
+	struct pollfd pfd;
+	int left;
+	int rc;
+
+	pfd.fd = ei->socket;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	rc = poll(&pfd, 1, waitms);
+	while ((rc >= 0 || errno != EINTR)
+			&& (left = waitms - rds_msince(start)) > 0) {
+		rc = poll(NULL, 0, left);
+	}
+	return (rc < 0 && errno == EINTR) ? -1 : 0;
+}
+
+/* Say how sending to our peers went, if there was any trouble */
+static void rds_log_stats(struct hb_media *mp)
+{
+	struct rds_private *ei = mp->pd;
+	longclock_t now = time_longclock();
+	int j;
+
+	if (cmp_longclock(sub_longclock(now, ei->laststats),
+			msto_longclock(RDS_STATSECS*1000L)) < 0)
+		return;
+	ei->laststats = now;
+
+	for (j = 0; j < ei->n_peers; ++j) {
+		struct rds_peer *p = &ei->peers[j];
+		unsigned long troubles = p->retried + p->dropped;
+
+		if (troubles == p->troubles && !ANYDEBUG)
+			continue;
+		p->troubles = troubles;
+		PILCallLog(LOG, troubles ? PIL_INFO : PIL_DEBUG,
+			"rds: %s to %s: %lu sent, %lu after retries, %lu dropped",
+			ei->interface, p->name, p->sent, p->retried, p->dropped);
 	}
 }
 
 static int
 rds_write(struct hb_media* mp, void *pkt, int len)
 {
-	struct state_on_stack s;
 	struct rds_private *ei = mp->pd;
+	int npending;
+	int nfailed = 0;
+	longclock_t start = time_longclock();
+	int waitms = RDS_RETRYMS;
+	int totalms = 0;
+	int tries;
+	int j;
 #if 0
 	char node[64];
 	char ns_len[3];
@@ -556,11 +732,6 @@ rds_write(struct hb_media* mp, void *pkt, int len)
 #endif
 
 	RDSASSERT(mp);
-	s.mp = mp;
-	s.peer = NULL;
-	s.pkt = pkt;
-	s.len = len;
-	s.err_count = 0;
 
 #if 0
 	/* We assume that the F_TO field, if present, is always the first field
@@ -588,17 +759,69 @@ rds_write(struct hb_media* mp, void *pkt, int len)
 		if (DEBUGPKT) {
 			PILCallLog(LOG, PIL_DEBUG, "rds: detected node message to %s", dest);
 		}
-		/* not yet enabled! s.peer = dest; */
+		/* not yet enabled! only put dest in ei->pending */
 	}
 #endif
 
-	g_hash_table_foreach(ei->peer_addresses, rds_sendto_one, &s);
+	for (j = 0; j < ei->n_peers; ++j)
+		ei->pending[j] = j;
+	npending = ei->n_peers;
+
+	/* A congested peer gets a few more tries, as long as
+	 * that doesn't add up to more than RDS_RETRYMAXMS */
+	for (tries = 1; npending > 0; ++tries) {
+		int nretry = 0;
+
+		rds_send_pending(ei, npending, pkt, len);
+		for (j = 0; j < npending; ++j) {
+			struct rds_peer *p = &ei->peers[ei->pending[j]];
+			gboolean congested = (p->err == EAGAIN
+				|| p->err == EWOULDBLOCK || p->err == ENOBUFS);
+
+			if (p->err == 0) {
+				p->sent++;
+				if (tries > 1)
+					p->retried++;
+				continue;
+			}
+			if (congested && totalms + waitms <= RDS_RETRYMAXMS) {
+				ei->pending[nretry++] = ei->pending[j];
+				continue;
+			}
+			p->dropped++;
+			nfailed++;
+			if (!mp->suppresserrs && p->err != EINTR) {
+				PILCallLog(LOG, congested ? PIL_WARN : PIL_CRIT,
+					"rds: sendto(%s) failed after %d tries: %s",
+					inet_ntoa(p->addr->sin_addr), tries,
+					strerror(p->err));
+			}
+		}
+		npending = nretry;
+		if (npending > 0) {
+			if (rds_wait(ei, waitms) < 0) {
+				/* Write timeout: give up on the rest */
+				for (j = 0; j < npending; ++j)
+					ei->peers[ei->pending[j]].dropped++;
+				nfailed += npending;
+				break;
+			}
+			/* What it really took, sends included */
+			totalms = rds_msince(start);
+			waitms *= 2;
+		}
+	}
 
+	if (DEBUGPKT) {
+		PILCallLog(LOG, PIL_DEBUG, "rds: sent %d bytes to %d of %d peers",
+			len, ei->n_peers - nfailed, ei->n_peers);
+	}
 	if (DEBUGPKTCONT) {
 		PILCallLog(LOG, PIL_DEBUG, "%s", (const char*)pkt);
 	}
+	rds_log_stats(mp);
 
-	if (s.err_count >= ei->n_peers)
+	if (nfailed >= ei->n_peers)
 		return HA_FAIL;
 
 	if (len > largest_msg_size) {
@@ -36,11 +36,16 @@
 #include <sys/utsname.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/mman.h>
+#ifdef HAVE_ZLIB_H
+#	include <zlib.h>
+#endif
 
 #include <heartbeat.h>
 #include <HBcomm.h>
 #include <clplumbing/longclock.h>
 #include <clplumbing/timers.h>
+#include <clplumbing/cl_misc.h>
 
 
 
@@ -52,16 +57,78 @@
 #define PIL_PLUGINLICENSEURL	URL_LGPL
 #include <pils/plugin.h>
 
+#ifndef MAP_ANONYMOUS
+#	define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+/*
+ * Binary framing
+ *
+ * Two ends which both offer it send each other COBS encoded frames,
+ * each between a pair of zero bytes, instead of text.  A frame holds
+ * up to SF_PAYLOAD bytes of one message and ends in a CRC32 of the
+ * rest of it.  Messages which fit in a single frame are sent ahead of
+ * the remaining frames of bigger ones, so a heartbeat never waits
+ * behind a long message.
+ *
+ * Each end offers framing with an SF_HELLO text line every
+ * SF_HELLOSECS seconds, between messages.  An old peer skips it like
+ * any other line outside a message, never offers anything back, and so
+ * keeps getting text.  If we hear neither a hello nor a good frame for
+ * SF_PEERSECS we go back to text too.
+ */
+#define	SF_HELLO	"HBFRAME1"
+#define	SF_HELLOSECS	5
+#define	SF_PEERSECS	(3*SF_HELLOSECS)
+#define	SF_CAP_FRAME	0x01	/* Can take frames */
+#define	SF_CAP_ZLIB	0x02	/* ... with compressed messages in them */
+
+#define	SF_MAGIC	0xA5
+#define	SF_HDRLEN	6	/* magic, flags, msgid(2), fragment(2) */
+#define	SF_CRCLEN	4
+#define	SF_PAYLOAD	256
+#define	SF_FRAMELEN	(SF_HDRLEN+SF_PAYLOAD+SF_CRCLEN)
+#define	SF_WIRELEN	(SF_FRAMELEN+(SF_FRAMELEN/254)+3)
+#define	SF_LAST		0x01	/* Last frame of its message */
+#define	SF_ZLIB		0x02	/* Message is compressed */
+#define	SF_ZMIN		128	/* Don't bother compressing less */
+#define	SF_MAXQ		32	/* Messages we interleave at once */
+
+/* What the read process has heard, for the write process */
+struct serial_peer {
+	volatile int		caps;	/* SF_CAP_* the other end offered */
+	volatile longclock_t	seen;	/* When we last heard from it */
+};
 
 struct serial_private {
         char *			ttyname;
         int			ttyfd;		/* For direct TTY i/o */ 
 	int			consecutive_errors;
         struct hb_media*	next;
+	struct serial_peer*	peer;		/* Shared with our children */
+	longclock_t		lasthello;	/* Write process */
+	char			rbuf[512];	/* Read process: input not */
+	int			rpos;		/* ... used up yet */
+	int			rlen;
+};
+
+/* A message being sent in frames */
+struct sf_msg {
+	char *		buf;
+	int		len;
+	int		off;		/* Sent so far */
+	int		frag;		/* Next fragment number */
+	int		flags;
+	guint16		msgid;
+	gboolean	owned;		/* We free buf */
+	gboolean	pulled;		/* From NextWrite, not our caller */
 };
 
 static int		serial_baud = 0;
+static int		serial_bps = 0;
 static const char *	baudstring;
+static int		serial_caps = 0;	/* SF_CAP_* we offer */
+static guint32		crctable[256];
 
 /* Used to maintain a list of our serial ports in the ring */
 static struct hb_media*		lastserialport;
@@ -70,6 +137,8 @@ static struct hb_media*	serial_new(const char * value);
 static void*		serial_read(struct hb_media *mp, int* lenp);
 static char *		ttygets(char * inbuf, int length
 ,				struct serial_private *tty);
+static int		ttygetc(struct serial_private *tty);
+static int		serial_offer(void);
 static int		serial_write(struct hb_media*mp, void *msg , int len);
 static int		serial_open(struct hb_media* mp);
 static int		ttysetup(int fd, const char * ourtty);
@@ -181,6 +250,7 @@ compute_fragment_write_delay(void)
 	}
 	
 	fragment_write_delay = (1.0*FRAGSIZE)/(rate_bps/8)*1000000;
+	serial_bps = rate_bps;
 	return HA_OK;
 }
 
@@ -188,8 +258,20 @@ compute_fragment_write_delay(void)
 static int
 serial_init (void)
 {
+	guint32	c;
+	int	j;
+	int	k;
+
 	lastserialport = NULL;
 
+	for (j=0; j < 256; ++j) {
+		c = (guint32)j;
+		for (k=0; k < 8; ++k) {
+			c = (c & 1) ? (0xEDB88320U ^ (c >> 1)) : (c >> 1);
+		}
+		crctable[j] = c;
+	}
+
 	/* This eventually ought be done through the configuration API */
 	if (serial_baud <= 0) {
 		if ((baudstring  = OurImports->ParamValue("baud")) != NULL) {
@@ -253,14 +335,30 @@ serial_new (const char * port)
 			 * for this object in the parent process of us all...
 			 * otherwise we can't do this linking stuff...
 			 */
+			memset(sp, 0, sizeof(*sp));
 			sp->next = lastserialport;
 			lastserialport=ret;
+			sp->ttyfd = -1;
 			sp->ttyname = STRDUP(port);
+			/* Our read and write processes both see this */
+			sp->peer = mmap(NULL, sizeof(struct serial_peer)
+			,	PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS
+			,	-1, 0);
+			if (sp->peer == MAP_FAILED) {
+				PILCallLog(LOG, PIL_WARN, "No binary framing"
+				" on %s: %s", port, strerror(errno));
+				sp->peer = NULL;
+			}else{
+				memset(sp->peer, 0, sizeof(*sp->peer));
+			}
 			if (sp->ttyname != NULL) {
 				sp->consecutive_errors = 0;
 				ret->name = sp->ttyname;
 				ret->pd = sp;
 			}else{
+				if (sp->peer != NULL) {
+					munmap(sp->peer, sizeof(*sp->peer));
+				}
 				FREE(sp);
 				sp = NULL;
 			}
@@ -283,6 +381,7 @@ serial_open (struct hb_media* mp)
 
 	TTYASSERT(mp);
 	sp = (struct serial_private*)mp->pd;
+	serial_caps = serial_offer();
 	if (OurImports->devlock(sp->ttyname) < 0) {
 		PILCallLog(LOG, PIL_CRIT, "cannot lock line %s", sp->ttyname);
 		return(HA_FAIL);
@@ -292,6 +391,7 @@ serial_open (struct hb_media* mp)
 	}
 	PILCallLog(LOG, PIL_INFO, "Starting serial heartbeat on tty %s (%s baud)"
 	,	sp->ttyname, baudstring);
+
 	return(HA_OK);
 }
 
@@ -332,6 +432,10 @@ ttysetup(int fd, const char * ourtty)
 	ti.c_iflag &= ~(IGNBRK|IUCLC|IXANY|IXOFF|IXON|ICRNL|PARMRK);
 	/* Unsure if I want PARMRK or not...  It may not matter much */
 	ti.c_iflag |=  (INPCK|ISTRIP|IGNCR|BRKINT);
+	if (serial_caps & SF_CAP_FRAME) {
+		/* Frames need all eight bits of every byte */
+		ti.c_iflag &= ~(ISTRIP|IGNCR);
+	}
 
 	ti.c_oflag &= ~(OPOST);
 	ti.c_cflag &= ~(CBAUD|CSIZE|PARENB);
@@ -431,31 +535,255 @@ serial_localdie(void)
 
 
 static char		serial_pkt[MAXMSG];
+static char		sf_asm[MAXMSG];	/* A message arriving in pieces */
+static int		sf_asmlen;
+static int		sf_asmflags;
+static int		sf_asmnext = -1;	/* Fragment we want next */
+static guint16		sf_asmid;
 
-/* This function does all the reading from our tty ports */
+/* What we offer our peers (SF_CAP_*), from the configuration */
+static int
+serial_offer(void)
+{
+	const char *	value;
+	int		on;
+	int		caps = 0;
+
+	value = OurImports->ParamValue("serial_framing");
+	if (value == NULL || cl_str_to_boolean(value, &on) != HA_OK || on) {
+		caps |= SF_CAP_FRAME;
+	}
+#ifdef HAVE_ZLIB_H
+	value = OurImports->ParamValue("serial_compress");
+	if (caps && value != NULL && cl_str_to_boolean(value, &on) == HA_OK
+	&&	on) {
+		caps |= SF_CAP_ZLIB;
+	}
+#endif
+	return caps;
+}
+
+/* What we and our peer can both do right now */
+static int
+serial_peercaps(struct serial_private* sp)
+{
+	longclock_t	seen;
+
+	if (serial_caps == 0 || sp->peer == NULL) {
+		return 0;
+	}
+	seen = sp->peer->seen;
+	if (cmp_longclock(seen, zero_longclock) == 0
+	||	cmp_longclock(sub_longclock(time_longclock(), seen)
+	,		msto_longclock(SF_PEERSECS*1000L)) > 0) {
+		return 0;
+	}
+	return sp->peer->caps & serial_caps;
+}
+
+/* We just heard from a peer which can take frames */
+static void
+serial_heard(struct serial_private* sp, int caps)
+{
+	if (sp->peer == NULL) {
+		return;
+	}
+	if (caps >= 0) {
+		if (ANYDEBUG && caps != sp->peer->caps) {
+			PILCallLog(LOG, PIL_DEBUG, "%s: peer offers 0x%x"
+			,	sp->ttyname, caps);
+		}
+		sp->peer->caps = caps;
+	}
+	sp->peer->seen = time_longclock();
+}
+
+static guint32
+serial_crc32(const unsigned char * p, int len)
+{
+	guint32	c = 0xFFFFFFFFU;
+
+	while (len-- > 0) {
+		c = crctable[(c ^ *p++) & 0xFF] ^ (c >> 8);
+	}
+	return c ^ 0xFFFFFFFFU;
+}
+
+/* COBS: 'out' has no zero bytes, and at most one byte in 254 more */
+static int
+cobs_encode(const unsigned char * in, int len, unsigned char * out)
+{
+	unsigned char *	code = out;
+	unsigned char *	o = out + 1;
+	int		n = 1;
+	int		j;
+
+	for (j=0; j < len; ++j) {
+		if (in[j] == 0) {
+			*code = n;
+			code = o++;
+			n = 1;
+		}else{
+			*o++ = in[j];
+			if (++n == 0xFF) {
+				*code = n;
+				code = o++;
+				n = 1;
+			}
+		}
+	}
+	*code = n;
+	return o - out;
+}
+
+static int
+cobs_decode(const unsigned char * in, int len, unsigned char * out
+,	int outmax)
+{
+	int	i = 0;
+	int	o = 0;
+
+	while (i < len) {
+		int	code = in[i++];
+		int	k;
+
+		if (code == 0 || i + code - 1 > len) {
+			return -1;
+		}
+		for (k=1; k < code; ++k) {
+			if (o >= outmax) {
+				return -1;
+			}
+			out[o++] = in[i++];
+		}
+		if (code != 0xFF && i < len) {
+			if (o >= outmax) {
+				return -1;
+			}
+			out[o++] = 0;
+		}
+	}
+	return o;
+}
+
+/* Hand up a message which came to us in frames */
 static void *
-serial_read(struct hb_media* mp, int *lenp)
+serial_deliver(const char * msg, int len, int flags, int *lenp)
+{
+	if (flags & SF_ZLIB) {
+#ifdef HAVE_ZLIB_H
+		uLongf	outlen = MAXMSG-1;
+
+		if (uncompress((Bytef*)serial_pkt, &outlen
+		,	(const Bytef*)msg, len) != Z_OK) {
+			PILCallLog(LOG, PIL_WARN
+			,	"serial_read: bad compressed message");
+			return NULL;
+		}
+		len = outlen;
+#else
+		return NULL;
+#endif
+	}else{
+		if (len >= MAXMSG) {
+			return NULL;
+		}
+		memcpy(serial_pkt, msg, len);
+	}
+	serial_pkt[len] = EOS;
+	*lenp = len;
+	return serial_pkt;
+}
+
+/* Read one frame (its opening zero is already read) */
+static void *
+serial_read_frame(struct serial_private* sp, int *lenp, gboolean* eofp)
+{
+	unsigned char	enc[SF_WIRELEN];
+	unsigned char	frame[SF_FRAMELEN];
+	int		n = 0;
+	int		c;
+	int		flen;
+	int		plen;
+	int		flags;
+	int		frag;
+	guint16		msgid;
+	guint32		crc;
+
+	for (;;) {
+		if ((c = ttygetc(sp)) == EOF) {
+			*eofp = TRUE;
+			return NULL;
+		}
+		if (c == 0) {
+			if (n == 0) {
+				continue;	/* Closing zero of the last one */
+			}
+			break;
+		}
+		if (n >= (int)sizeof(enc)) {
+			/* Not one of ours: let it go, back to lines */
+			return NULL;
+		}
+		enc[n++] = c;
+	}
+	flen = cobs_decode(enc, n, frame, sizeof(frame));
+	if (flen < SF_HDRLEN + SF_CRCLEN || frame[0] != SF_MAGIC) {
+		return NULL;
+	}
+	crc = ((guint32)frame[flen-4] << 24) | ((guint32)frame[flen-3] << 16)
+	|	((guint32)frame[flen-2] << 8) | (guint32)frame[flen-1];
+	if (serial_crc32(frame, flen - SF_CRCLEN) != crc) {
+		if (DEBUGPKT) {
+			PILCallLog(LOG, PIL_DEBUG, "%s: bad frame CRC"
+			,	sp->ttyname);
+		}
+		return NULL;
+	}
+	serial_heard(sp, -1);
+	sp->consecutive_errors = 0;
+
+	flags = frame[1];
+	msgid = (frame[2] << 8) | frame[3];
+	frag = (frame[4] << 8) | frame[5];
+	plen = flen - SF_HDRLEN - SF_CRCLEN;
+
+	if (frag == 0 && (flags & SF_LAST)) {
+		/* A whole message - maybe in the middle of a bigger one */
+		return serial_deliver((char*)frame + SF_HDRLEN, plen, flags
+		,	lenp);
+	}
+	if (frag == 0) {
+		sf_asmid = msgid;
+		sf_asmflags = flags;
+		sf_asmlen = 0;
+		sf_asmnext = 0;
+	}
+	if (frag != sf_asmnext || msgid != sf_asmid
+	||	sf_asmlen + plen > MAXMSG) {
+		sf_asmnext = -1;	/* Lost a piece: drop the rest */
+		return NULL;
+	}
+	memcpy(sf_asm + sf_asmlen, frame + SF_HDRLEN, plen);
+	sf_asmlen += plen;
+	++sf_asmnext;
+	if ((flags & SF_LAST) == 0) {
+		return NULL;
+	}
+	sf_asmnext = -1;
+	return serial_deliver(sf_asm, sf_asmlen, sf_asmflags, lenp);
+}
+
+/* Collect a text message, given its MSG_START line */
+static void *
+serial_read_text(struct serial_private* thissp, char * buf, int *lenp)
 {
-	char			buf[MAXMSG];
-	struct serial_private*	thissp;
-	int			startlen;
-	const char *		start = MSG_START;
 	const char *		end = MSG_END;
 	int			endlen;
 	char			*p;
 	int			len = 0;
 	int			tmplen;
 
-
-	
-	
-	TTYASSERT(mp);
-	thissp = (struct serial_private*)mp->pd;
-
-	startlen = strlen(start);
-	if (start[startlen-1] == '\n') {
-		--startlen;
-	}
 	endlen = strlen(end);
 	if (end[endlen-1] == '\n') {
 		--endlen;
@@ -465,14 +793,6 @@ serial_read(struct hb_media* mp, int *lenp)
 	serial_pkt[0] = 0;
 	p = serial_pkt;
 	
-	/* Skip until we find a MSG_START (hopefully we skip nothing) */
-	while (ttygets(buf, MAXMSG, thissp) != NULL
-	       &&	strncmp(buf, start, startlen) != 0) {
-		
-		
-		/*nothing*/
-	}
-	
 	len = strnlen(buf, MAXMSG) + 1;
 	if(len >=  MAXMSG){
 		PILCallLog(LOG, PIL_CRIT,  "serial_read:MSG_START exceeds MAXMSG");
@@ -533,6 +853,275 @@ serial_read(struct hb_media* mp, int *lenp)
 	return(serial_pkt);	
 }
 
+/* This function does all the reading from our tty ports */
+static void *
+serial_read(struct hb_media* mp, int *lenp)
+{
+	char			buf[MAXMSG];
+	struct serial_private*	thissp;
+	int			startlen;
+	const char *		start = MSG_START;
+	int			c;
+	void *			pkt;
+	gboolean		eof = FALSE;
+
+	TTYASSERT(mp);
+	thissp = (struct serial_private*)mp->pd;
+
+	startlen = strlen(start);
+	if (start[startlen-1] == '\n') {
+		--startlen;
+	}
+
+	/* Skip until we find a message (hopefully we skip nothing) */
+	for (;;) {
+		if ((c = ttygetc(thissp)) == EOF) {
+			return NULL;
+		}
+		if (c == 0) {
+			pkt = serial_read_frame(thissp, lenp, &eof);
+			if (pkt != NULL || eof) {
+				return pkt;
+			}
+			continue;
+		}
+		buf[0] = c;
+		buf[1] = EOS;
+		if (c != '\n' && ttygets(buf+1, MAXMSG-1, thissp) == NULL) {
+			return NULL;
+		}
+		if (strncmp(buf, start, startlen) == 0) {
+			return serial_read_text(thissp, buf, lenp);
+		}
+		if (strncmp(buf, SF_HELLO " ", sizeof(SF_HELLO)) == 0) {
+			serial_heard(thissp, atoi(buf + sizeof(SF_HELLO)));
+		}
+	}
+}
+
+/* How long writing 'len' bytes (and waiting for them to go) may take */
+static long
+serial_write_ms(int len)
+{
+	return ((long)len * 10000L) / (serial_bps > 0 ? serial_bps : 300)
+	+	500L;
+}
+
+/* Write to our tty, complaining (now and then) when it won't take it */
+static int
+serial_ttywrite(struct hb_media* mp, const char * buf, int len
+,	gboolean drain)
+{
+	int			ourtty = ((struct serial_private*)(mp->pd))->ttyfd;
+	static gboolean		warnyet=FALSE;
+	static longclock_t	warninterval;
+	static longclock_t	lastwarn;
+	int			wrc;
+
+	if (!warnyet) {
+		warninterval = msto_longclock(RTS_WARNTIME*1000L);
+	}
+	setmsalarm(drain ? serial_write_ms(len) : 500);
+	wrc = write(ourtty, buf, len);
+	if (drain && wrc == len && tcdrain(ourtty) < 0 && errno == EINTR) {
+		wrc = -1;
+	}
+	cancelmstimer();
+	if (DEBUGPKTCONT) {
+		PILCallLog(LOG, PIL_DEBUG, "serial write returned %d", wrc);
+	}
+		
+	if (wrc < 0 || wrc != len) {
+		if (DEBUGPKTCONT && wrc < 0) {
+			PILCallLog(LOG, PIL_DEBUG, "serial write errno was %d", errno);
+		}
+		if (wrc > 0 || (wrc < 0 && errno == EINTR)) {
+			longclock_t	now = time_longclock();
+			tcflush(ourtty, TCIOFLUSH);
+			
+			if (!warnyet
+			    ||	cmp_longclock(sub_longclock(now, lastwarn)
+					      ,		warninterval) >= 0) {
+				
+				lastwarn = now;
+				warnyet = TRUE;
+				PILCallLog(LOG, PIL_WARN
+				,	"TTY write timeout on [%s]"
+				" (no connection or bad cable"
+				"? [see documentation])"
+				,	mp->name);
+				PILCallLog(LOG, PIL_INFO
+				,	"See %s for details"
+				,	HAURL("FAQ#TTY_timeout"));
+			}
+		}else{
+			PILCallLog(LOG, PIL_CRIT, "TTY write failure on [%s]: %s"
+				   ,	mp->name, strerror(errno));
+		}
+		return HA_FAIL;
+	}
+	return HA_OK;
+}
+
+/* Offer our peer framing, if it's been a while */
+static void
+serial_hello(struct hb_media* mp)
+{
+	struct serial_private*	sp = (struct serial_private*)mp->pd;
+	longclock_t		now = time_longclock();
+	char			hello[32];
+
+	if (serial_caps == 0 || sp->peer == NULL) {
+		return;
+	}
+	if (cmp_longclock(sp->lasthello, zero_longclock) != 0
+	&&	cmp_longclock(sub_longclock(now, sp->lasthello)
+	,		msto_longclock(SF_HELLOSECS*1000L)) < 0) {
+		return;
+	}
+	sp->lasthello = now;
+	snprintf(hello, sizeof(hello), "%s %d\n", SF_HELLO, serial_caps);
+	serial_ttywrite(mp, hello, strlen(hello), FALSE);
+}
+
+/* Queue a message to go out in frames */
+static void
+sf_enqueue(struct sf_msg * m, char * p, int len, gboolean owned, int caps)
+{
+	static guint16	msgid;
+
+	memset(m, 0, sizeof(*m));
+	m->buf = p;
+	m->len = len;
+	m->owned = owned;
+	m->pulled = owned;
+	m->msgid = ++msgid;
+#ifdef HAVE_ZLIB_H
+	if ((caps & SF_CAP_ZLIB) && len >= SF_ZMIN) {
+		uLongf	zlen = compressBound(len);
+		char *	z = malloc(zlen);
+
+		if (z != NULL && compress2((Bytef*)z, &zlen, (const Bytef*)p
+		,	len, Z_BEST_SPEED) == Z_OK && (int)zlen < len) {
+			if (owned) {
+				free(p);
+			}
+			m->buf = z;
+			m->len = zlen;
+			m->owned = TRUE;
+			m->flags |= SF_ZLIB;
+		}else if (z != NULL) {
+			free(z);
+		}
+	}
+#endif
+}
+
+static void
+sf_done(struct sf_msg * m)
+{
+	if (m->owned) {
+		free(m->buf);
+	}
+	m->buf = NULL;
+}
+
+/* Send the next frame of a message */
+static int
+sf_send(struct hb_media* mp, struct sf_msg * m)
+{
+	unsigned char	frame[SF_FRAMELEN];
+	unsigned char	wire[SF_WIRELEN];
+	int		plen = m->len - m->off;
+	int		n;
+	guint32		crc;
+
+	if (plen > SF_PAYLOAD) {
+		plen = SF_PAYLOAD;
+	}
+	frame[0] = SF_MAGIC;
+	frame[1] = m->flags | (m->off + plen >= m->len ? SF_LAST : 0);
+	frame[2] = (m->msgid >> 8) & 0xFF;
+	frame[3] = m->msgid & 0xFF;
+	frame[4] = (m->frag >> 8) & 0xFF;
+	frame[5] = m->frag & 0xFF;
+	memcpy(frame + SF_HDRLEN, m->buf + m->off, plen);
+	crc = serial_crc32(frame, SF_HDRLEN + plen);
+	frame[SF_HDRLEN+plen]   = (crc >> 24) & 0xFF;
+	frame[SF_HDRLEN+plen+1] = (crc >> 16) & 0xFF;
+	frame[SF_HDRLEN+plen+2] = (crc >> 8) & 0xFF;
+	frame[SF_HDRLEN+plen+3] = crc & 0xFF;
+
+	wire[0] = 0;
+	n = 1 + cobs_encode(frame, SF_HDRLEN + plen + SF_CRCLEN, wire + 1);
+	wire[n++] = 0;
+
+	m->off += plen;
+	++m->frag;
+	return serial_ttywrite(mp, (char*)wire, n, TRUE);
+}
+
+/*
+ * Send a message in frames, along with whatever else gets queued for
+ * us meanwhile.  Each time round, a message which fits in one frame
+ * goes first; otherwise the next frame of the oldest one.
+ */
+static int
+serial_write_framed(struct hb_media* mp, void *p, int len, int caps)
+{
+	struct sf_msg	q[SF_MAXQ];
+	int		nq = 0;
+	char *		next;
+	int		nextlen;
+	int		j;
+
+	sf_enqueue(&q[nq++], p, len, FALSE, caps);
+	while (nq > 0) {
+		int	pick = 0;
+
+		for (j=0; j < nq; ++j) {
+			if (q[j].frag == 0 && q[j].len <= SF_PAYLOAD) {
+				pick = j;
+				break;
+			}
+		}
+		if (DEBUGPKT && q[pick].frag == 0) {
+			PILCallLog(LOG, PIL_DEBUG, "Sending pkt to %s"
+			" [%d bytes framed]", mp->name, q[pick].len);
+		}
+		if (sf_send(mp, &q[pick]) != HA_OK) {
+			int	saveerrno = errno;
+			int	ndropped = 0;
+
+			/* The line is stuck: don't make the rest wait too */
+			for (j=0; j < nq; ++j) {
+				if (q[j].pulled) {
+					++ndropped;
+				}
+				sf_done(&q[j]);
+			}
+			if (ndropped && !mp->suppresserrs) {
+				PILCallLog(LOG, PIL_WARN
+				,	"%d queued messages discarded due to"
+				" write errors on %s", ndropped, mp->name);
+			}
+			errno = saveerrno;
+			return HA_FAIL;
+		}
+		if (q[pick].off >= q[pick].len) {
+			sf_done(&q[pick]);
+			--nq;
+			memmove(&q[pick], &q[pick+1]
+			,	(nq - pick) * sizeof(q[0]));
+		}
+		while (nq < SF_MAXQ
+		&&	(next = OurImports->NextWrite(mp, &nextlen)) != NULL) {
+			sf_enqueue(&q[nq++], next, nextlen, TRUE, caps);
+		}
+	}
+	return HA_OK;
+}
+
 /* This function does all the writing to our tty ports */
 static int
 serial_write(struct hb_media* mp, void *p, int len)
@@ -543,16 +1132,22 @@ serial_write(struct hb_media* mp, void *p, int len)
 
 	char			*str;
 	int			str_new = 0;
-	int			wrc;
 	int			size;
-	int			ourtty;
-	static gboolean		warnyet=FALSE;
-	static longclock_t	warninterval;
-	static longclock_t	lastwarn;
+	int			caps;
 	int			i;
 	int			loop;
 	char*			datastr;
 	
+	TTYASSERT(mp);
+	ourmedia = mp;	/* Only used for the "localdie" function */
+	OurImports->RegisterCleanup(serial_localdie);
+
+	serial_hello(mp);
+	if ((caps = serial_peercaps((struct serial_private*)mp->pd)) != 0) {
+		/* Our peer reads the packet just as it is */
+		return serial_write_framed(mp, p, len, caps);
+	}
+
 	if (strncmp(p, MSG_START, string_startlen) == 0) {
 		str = p;
 		size = strlen(str);
@@ -579,17 +1174,6 @@ serial_write(struct hb_media* mp, void *p, int len)
 		return(HA_FAIL);
 	}
 
-
-	TTYASSERT(mp);
-	
-
-	if (!warnyet) {
-		warninterval = msto_longclock(RTS_WARNTIME*1000L);
-	}
-	ourmedia = mp;	/* Only used for the "localdie" function */
-	OurImports->RegisterCleanup(serial_localdie);
-	ourtty = ((struct serial_private*)(mp->pd))->ttyfd;
-
 	if (DEBUGPKT) {
 		PILCallLog(LOG, PIL_DEBUG, "Sending pkt to %s [%d bytes]"
 		,	mp->name, size);
@@ -609,44 +1193,10 @@ serial_write(struct hb_media* mp, void *p, int len)
 			datalen =  size %FRAGSIZE;
 		}
 		
-		setmsalarm(500);
-		wrc = write(ourtty, datastr, datalen);
-		cancelmstimer();
+		serial_ttywrite(mp, datastr, datalen, FALSE);
 		if (i != (loop -1)) {
 			usleep(fragment_write_delay);
 		}
-		if (DEBUGPKTCONT) {
-			PILCallLog(LOG, PIL_DEBUG, "serial write returned %d", wrc);
-		}
-		
-		if (wrc < 0 || wrc != datalen) {
-			if (DEBUGPKTCONT && wrc < 0) {
-				PILCallLog(LOG, PIL_DEBUG, "serial write errno was %d", errno);
-			}
-			if (wrc > 0 || (wrc < 0 && errno == EINTR)) {
-				longclock_t	now = time_longclock();
-				tcflush(ourtty, TCIOFLUSH);
-				
-				if (!warnyet
-				    ||	cmp_longclock(sub_longclock(now, lastwarn)
-						      ,		warninterval) >= 0) {
-					
-					lastwarn = now;
-					warnyet = TRUE;
-					PILCallLog(LOG, PIL_WARN
-					,	"TTY write timeout on [%s]"
-					" (no connection or bad cable"
-					"? [see documentation])"
-					,	mp->name);
-					PILCallLog(LOG, PIL_INFO
-					,	"See %s for details"
-					,	HAURL("FAQ#TTY_timeout"));
-				}
-			}else{
-				PILCallLog(LOG, PIL_CRIT, "TTY write failure on [%s]: %s"
-					   ,	mp->name, strerror(errno));
-			}
-		}
 		
 		datastr +=datalen;
 	}
@@ -659,24 +1209,21 @@ serial_write(struct hb_media* mp, void *p, int len)
 }
 
 
-/* Gets function for our tty */
-static char *
-ttygets(char * inbuf, int length, struct serial_private *tty)
+/* Getc function for our tty: reads as much as there is at a time */
+static int
+ttygetc(struct serial_private *tty)
 {
-	char *	cp;
-	char *	end = inbuf + length;
 	int	rc;
 	int	fd = tty->ttyfd;
 
-	for(cp=inbuf; cp < end; ++cp) {
+	while (tty->rpos >= tty->rlen) {
 		int saverr;
 		errno = 0;
-		/* One read per char -- yecch  (but it's easy) */
-		rc = read(fd, cp, 1);
+		rc = read(fd, tty->rbuf, sizeof(tty->rbuf));
 		saverr = errno;
 		OurImports->CheckForEvents();
 		errno = saverr;
-		if (rc != 1) {
+		if (rc <= 0) {
 			if (rc == 0 || errno == EINTR) {
 				PILCallLog(LOG, PIL_CRIT, "EOF in ttygets [%s]: %s [%d]"
 				,	tty->ttyname, strerror(errno), rc);
@@ -692,14 +1239,31 @@ ttygets(char * inbuf, int length, struct serial_private *tty)
 					,	tcgetpgrp(fd));
 					sleep(10);
 				}
-				return(NULL);
+				return(EOF);
 			}
 			errno = 0;
 			continue;
-		}else{
-			tty->consecutive_errors = 0;
 		}
-			
+		tty->rpos = 0;
+		tty->rlen = rc;
+		tty->consecutive_errors = 0;
+	}
+	return (unsigned char)tty->rbuf[tty->rpos++];
+}
+
+/* Gets function for our tty */
+static char *
+ttygets(char * inbuf, int length, struct serial_private *tty)
+{
+	char *	cp;
+	char *	end = inbuf + length - 1;
+	int	c;
+
+	for(cp=inbuf; cp < end; ++cp) {
+		if ((c = ttygetc(tty)) == EOF) {
+			return(NULL);
+		}
+		*cp = c;
 		if (*cp == '\n') {
 			break;
 		}
@@ -707,4 +1271,3 @@ ttygets(char * inbuf, int length, struct serial_private *tty)
 	*cp = '\0';
 	return(inbuf);
 }
-
@@ -38,7 +38,9 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netdb.h>
 
 #ifndef HAVE_INET_ATON
 	extern  int     inet_aton(const char *, struct in_addr *);
@@ -91,6 +93,13 @@ struct ip_private {
         int port;			/* UDP port */
         int rsocket;			/* Read-socket */
         int wsocket;			/* Write-socket */
+	char* peerlist;			/* Peers, or "*": NULL for one peer */
+	struct sockaddr_in* peers;	/* peerlist, resolved when opened */
+	int npeers;
+	char* pkt;			/* Receive buffer */
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr* mmsg;		/* One per peer */
+#endif
 };
 
 
@@ -106,9 +115,14 @@ static int ucast_open(struct hb_media *mp);
 static int ucast_close(struct hb_media *mp);
 static void* ucast_read(struct hb_media *mp, int* lenp);
 static int ucast_write(struct hb_media *mp, void *msg, int len);
+static int ucast_write_peers(struct hb_media *mp, void *msg, int len);
 
 static int HB_make_receive_sock(struct hb_media *ei);
 static int HB_make_send_sock(struct hb_media *mp);
+static int ucast_add_peer(struct ip_private *ei, const char *host);
+static int ucast_open_peers(struct ip_private *ei);
+static void ucast_free_peers(struct ip_private *ei);
+static int ucast_is_peer(struct ip_private *ei, const struct sockaddr_in *a);
 
 static struct ip_private* new_ip_interface(const char *ifn,
 				const char *hbaddr, int port);
@@ -178,8 +192,10 @@ static int ucast_parse(const char *line)
 	const char *bp = line;
 	int toklen;
 	struct hb_media *mp;
+	struct ip_private *ei;
 	char dev[MAXLINE];
 	char ucast[MAXLINE];
+	const char *peers;
 
 	/* Skip over white space, then grab the device */
 	bp += strspn(bp, WHITESPACE);
@@ -196,6 +212,7 @@ static int ucast_parse(const char *line)
 		}
 #endif
 		bp += strspn(bp, WHITESPACE);
+		peers = bp;
 		toklen = strcspn(bp, WHITESPACE);
 		strncpy(ucast, bp, toklen);
 		bp += toklen;
@@ -207,8 +224,34 @@ static int ucast_parse(const char *line)
 			  dev);
 			return HA_FAIL;
 		}
-		if (!(mp = ucast_new(dev, ucast))) {
-			return HA_FAIL;
+		bp += strspn(bp, WHITESPACE);
+
+		if (*bp == EOS && strcmp(ucast, "*") != 0) {
+			/* Just the one peer */
+			if (!(mp = ucast_new(dev, ucast))) {
+				return HA_FAIL;
+			}
+		} else {
+			/*
+			 * A list of peers, or "*" for every other node,
+			 * all sharing this one medium.  They're resolved
+			 * when it's opened, after the node directives.
+			 */
+			if (strcmp(ucast, "*") == 0 && *bp != EOS) {
+				PILCallLog(LOG, PIL_CRIT,
+				  "ucast: [%s] '*' must be the only peer", dev);
+				return HA_FAIL;
+			}
+			if (!(mp = ucast_new(dev, NULL))) {
+				return HA_FAIL;
+			}
+			ei = (struct ip_private*)mp->pd;
+			if (!(ei->peerlist = STRDUP(peers))) {
+				PILCallLog(LOG, PIL_CRIT,
+				  "ucast: memory allocation error (line %d)",
+				  (__LINE__ - 2) );
+				return HA_FAIL;
+			}
 		}
 
 		sysmedia[nummedia++] = mp;
@@ -328,19 +371,174 @@ static int ucast_open(struct hb_media* mp)
 	UCASTASSERT(mp);
 	ei = (struct ip_private*)mp->pd;
 
-	if ((ei->wsocket = HB_make_send_sock(mp)) < 0)
+	if (ei->peerlist != NULL && ucast_open_peers(ei) != HA_OK) {
+		ucast_free_peers(ei);
 		return HA_FAIL;
+	}
+	if (!ei->pkt && !(ei->pkt = (char*)MALLOC(MAXMSG))) {
+		PILCallLog(LOG, PIL_CRIT, "ucast: memory allocation error (line %d)",
+			(__LINE__ - 2) );
+		ucast_free_peers(ei);
+		return HA_FAIL;
+	}
+	if ((ei->wsocket = HB_make_send_sock(mp)) < 0) {
+		ucast_close(mp);
+		return HA_FAIL;
+	}
 	if ((ei->rsocket = HB_make_receive_sock(mp)) < 0) {
 		ucast_close(mp);
 		return HA_FAIL;
 	}
+	OurImports->FilterMedium(mp, ei->rsocket);
+	OurImports->TuneMedium(mp, ei->rsocket, ei->wsocket);
+
+	if (ei->peerlist != NULL) {
+		PILCallLog(LOG, PIL_INFO,
+		  "ucast: started on port %d interface %s to %d peers",
+		  localudpport, ei->interface, ei->npeers);
+	} else {
+		PILCallLog(LOG, PIL_INFO,
+		  "ucast: started on port %d interface %s to %s",
+		  localudpport, ei->interface, inet_ntoa(ei->addr.sin_addr));
+	}
 
-	PILCallLog(LOG, PIL_INFO, "ucast: started on port %d interface %s to %s",
-		localudpport, ei->interface, inet_ntoa(ei->addr.sin_addr));
+	return HA_OK;
+}
+
+/*
+ *	Add one peer to a multi-peer medium
+ */
+static int ucast_add_peer(struct ip_private *ei, const char *host)
+{
+	struct hostent *h;
+	struct sockaddr_in *a;
+	int j;
+
+	if (!(h = gethostbyname(host))) {
+		PILCallLog(LOG, PIL_CRIT, "ucast: cannot resolve hostname %s",
+			host);
+		return HA_FAIL;
+	}
+	for (j = 0; j < ei->npeers; ++j) {
+		if (memcmp(&ei->peers[j].sin_addr, h->h_addr_list[0],
+				sizeof(struct in_addr)) == 0) {
+			/* Listed twice: once is enough */
+			return HA_OK;
+		}
+	}
+	if (ei->npeers >= MAXNODE) {
+		PILCallLog(LOG, PIL_CRIT, "ucast: too many peers on %s (max %d)",
+			ei->interface, MAXNODE);
+		return HA_FAIL;
+	}
+	a = &ei->peers[ei->npeers];
+	memset(a, 0, sizeof(*a));
+	a->sin_family = AF_INET;
+	a->sin_port = htons(ei->port);
+	memcpy(&a->sin_addr, h->h_addr_list[0], sizeof(a->sin_addr));
+#ifdef HAVE_SENDMMSG
+	memset(&ei->mmsg[ei->npeers], 0, sizeof(ei->mmsg[0]));
+	ei->mmsg[ei->npeers].msg_hdr.msg_name = a;
+	ei->mmsg[ei->npeers].msg_hdr.msg_namelen = sizeof(*a);
+#endif
+	++ei->npeers;
+	return HA_OK;
+}
+
+/*
+ *	Resolve the peers of a multi-peer medium.  "*" means every other
+ *	normal node we know of; a node we can't resolve is left out,
+ *	whereas a peer listed by hand which we can't resolve is an error.
+ */
+static int ucast_open_peers(struct ip_private *ei)
+{
+	const char *bp;
+	const char *node;
+	char host[MAXLINE];
+	int toklen;
+	int j;
+
+	ucast_free_peers(ei);
+	if (!(ei->peers = (struct sockaddr_in*)
+			MALLOC(MAXNODE * sizeof(struct sockaddr_in)))) {
+		PILCallLog(LOG, PIL_CRIT, "ucast: memory allocation error (line %d)",
+			(__LINE__ - 2) );
+		return HA_FAIL;
+	}
+#ifdef HAVE_SENDMMSG
+	if (!(ei->mmsg = (struct mmsghdr*)
+			MALLOC(MAXNODE * sizeof(struct mmsghdr)))) {
+		PILCallLog(LOG, PIL_CRIT, "ucast: memory allocation error (line %d)",
+			(__LINE__ - 2) );
+		return HA_FAIL;
+	}
+#endif
+
+	if (strcmp(ei->peerlist, "*") == 0) {
+		for (j = 0; (node = OurImports->PeerNode(j)) != NULL; ++j) {
+			if (ucast_add_peer(ei, node) != HA_OK) {
+				PILCallLog(LOG, PIL_WARN,
+				  "ucast: leaving node %s out of %s",
+				  node, ei->interface);
+			}
+		}
+		if (ei->npeers == 0) {
+			PILCallLog(LOG, PIL_WARN,
+			  "ucast: no other nodes to send to on %s",
+			  ei->interface);
+		}
+		return HA_OK;
+	}
 
+	for (bp = ei->peerlist; *bp != EOS; ) {
+		bp += strspn(bp, WHITESPACE);
+		toklen = strcspn(bp, WHITESPACE);
+		if (toklen == 0) {
+			break;
+		}
+		if (toklen >= (int)sizeof(host)) {
+			toklen = sizeof(host)-1;
+		}
+		strncpy(host, bp, toklen);
+		host[toklen] = EOS;
+		bp += strcspn(bp, WHITESPACE);
+		if (ucast_add_peer(ei, host) != HA_OK) {
+			return HA_FAIL;
+		}
+	}
 	return HA_OK;
 }
 
+static void ucast_free_peers(struct ip_private *ei)
+{
+	if (ei->peers) {
+		FREE(ei->peers);
+		ei->peers = NULL;
+	}
+#ifdef HAVE_SENDMMSG
+	if (ei->mmsg) {
+		FREE(ei->mmsg);
+		ei->mmsg = NULL;
+	}
+#endif
+	ei->npeers = 0;
+}
+
+/*
+ *	Did this packet come from one of our peers?
+ */
+static int ucast_is_peer(struct ip_private *ei, const struct sockaddr_in *a)
+{
+	int j;
+
+	for (j = 0; j < ei->npeers; ++j) {
+		if (ei->peers[j].sin_addr.s_addr == a->sin_addr.s_addr) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 /*
  *	Close UDP/IP unicast heartbeat interface
  */
@@ -364,6 +562,11 @@ static int ucast_close(struct hb_media* mp)
 		}
 		ei->wsocket = -1;
 	}
+	if (ei->pkt) {
+		FREE(ei->pkt);
+		ei->pkt = NULL;
+	}
+	ucast_free_peers(ei);
 	return rc;
 }
 
@@ -372,8 +575,6 @@ static int ucast_close(struct hb_media* mp)
  * Receive a heartbeat unicast packet from UDP interface
  */
 
-char ucast_pkt[MAXMSG];
-
 static void *
 ucast_read(struct hb_media* mp, int *lenp)
 {
@@ -386,7 +587,8 @@ ucast_read(struct hb_media* mp, int *lenp)
 	ei = (struct ip_private*)mp->pd;
 
 	addr_len = sizeof(struct sockaddr);
-	if ((numbytes = recvfrom(ei->rsocket, ucast_pkt, MAXMSG-1, 0,
+	if ((numbytes = OurImports->RecvFrom(mp, ei->rsocket, ei->pkt,
+		MAXMSG-1, 0,
 		(struct sockaddr *)&their_addr, &addr_len)) == -1) {
 		if (errno != EINTR) {
 			PILCallLog(LOG, PIL_CRIT, "ucast: error receiving from socket: %s",
@@ -399,19 +601,29 @@ ucast_read(struct hb_media* mp, int *lenp)
 		return NULL;
 	}
 	
-	ucast_pkt[numbytes] = EOS;
+	if (ei->peerlist != NULL && !ucast_is_peer(ei, &their_addr)) {
+		/* Shares our port, but isn't one of ours */
+		if (DEBUGPKT) {
+			PILCallLog(LOG, PIL_DEBUG,
+			  "ucast: ignored %d byte packet from %s", numbytes,
+			  inet_ntoa(their_addr.sin_addr));
+		}
+		return NULL;
+	}
+
+	ei->pkt[numbytes] = EOS;
 	
 	if (DEBUGPKT) {
 		PILCallLog(LOG, PIL_DEBUG, "ucast: received %d byte packet from %s",
 			numbytes, inet_ntoa(their_addr.sin_addr));
 	}
 	if (DEBUGPKTCONT) {
-		PILCallLog(LOG, PIL_DEBUG, "%s", ucast_pkt);
+		PILCallLog(LOG, PIL_DEBUG, "%s", ei->pkt);
 	}
 
 	*lenp = numbytes +1;
 	
-	return ucast_pkt;
+	return ei->pkt;
 	
 	
 }
@@ -428,6 +640,10 @@ ucast_write(struct hb_media* mp, void *pkt, int len)
 	
 	UCASTASSERT(mp);
 	ei = (struct ip_private*)mp->pd;
+
+	if (ei->peerlist != NULL) {
+		return ucast_write_peers(mp, pkt, len);
+	}
 	
 	if ((rc = sendto(ei->wsocket, pkt, len, 0
 	,		(struct sockaddr *)&ei->addr
@@ -451,6 +667,74 @@ ucast_write(struct hb_media* mp, void *pkt, int len)
 	return HA_OK;	
 }
 
+/*
+ * Send a heartbeat packet to every peer of a multi-peer medium, with
+ * as few system calls as we can.  A peer we can't send to doesn't
+ * stop us sending to the rest.
+ */
+
+static int
+ucast_write_peers(struct hb_media* mp, void *pkt, int len)
+{
+	struct ip_private *ei;
+	int rc = HA_OK;
+	int saveerrno = 0;
+	int j = 0;
+#ifdef HAVE_SENDMMSG
+	struct iovec iov;
+	int sent;
+#endif
+
+	ei = (struct ip_private*)mp->pd;
+
+#ifdef HAVE_SENDMMSG
+	iov.iov_base = pkt;
+	iov.iov_len = len;
+	for (j = 0; j < ei->npeers; ++j) {
+		ei->mmsg[j].msg_hdr.msg_iov = &iov;
+		ei->mmsg[j].msg_hdr.msg_iovlen = 1;
+	}
+	for (j = 0; j < ei->npeers; j += sent) {
+		if ((sent = sendmmsg(ei->wsocket, &ei->mmsg[j]
+		,		ei->npeers - j, 0)) > 0) {
+			continue;
+		}
+		/* Sending to peer j failed: skip it */
+		sent = 1;
+#else
+	for (j = 0; j < ei->npeers; ++j) {
+		if (sendto(ei->wsocket, pkt, len, 0
+		,	(struct sockaddr *)&ei->peers[j]
+		,	sizeof(struct sockaddr)) == len) {
+			continue;
+		}
+#endif
+		if (errno == EINTR) {
+			/* Write timeout - don't make it any later */
+			return HA_FAIL;
+		}
+		saveerrno = errno;
+		rc = HA_FAIL;
+		if (!mp->suppresserrs) {
+			PILCallLog(LOG, PIL_CRIT
+			,	"%s: Unable to send " PIL_PLUGINTYPE_S " packet %s %s:%u len=%d: %s"
+			,	__FUNCTION__, ei->interface
+			,	inet_ntoa(ei->peers[j].sin_addr), ei->port
+			,	len, strerror(errno));
+		}
+	}
+
+	if (DEBUGPKT) {
+		PILCallLog(LOG, PIL_DEBUG, "ucast: sent %d bytes to %d peers",
+		    len, ei->npeers);
+	}
+	if (DEBUGPKTCONT) {
+		PILCallLog(LOG, PIL_DEBUG, "%s", (const char*)pkt);
+	}
+	errno = saveerrno;
+	return rc;
+}
+
 #if defined(SO_REUSEPORT)
 /*
  *  Needed for OpenBSD for more than two nodes in a ucast cluster
@@ -665,13 +949,13 @@ static struct ip_private* new_ip_interface(const char *ifn,
 				const char *hbaddr, int port)
 {
 	struct ip_private *ep;
-	struct hostent *h;
+	struct hostent *h = NULL;
 
 	/*
  	 * 21 December 2002
  	 * Added by Brian TInsley <btinsley@emageon.com>
  	 */
-	if (!(h = gethostbyname(hbaddr))) {
+	if (hbaddr && !(h = gethostbyname(hbaddr))) {
 		PILCallLog(LOG, PIL_CRIT, "ucast: cannot resolve hostname");
 		return NULL;
 	}
@@ -685,7 +969,14 @@ static struct ip_private* new_ip_interface(const char *ifn,
 	/*
 	 * use address from gethostbyname
 	*/
-	memcpy(&ep->heartaddr, h->h_addr_list[0], sizeof(ep->heartaddr));
+	memset(ep, 0, sizeof(*ep));
+	if (hbaddr) {
+		memcpy(&ep->heartaddr, h->h_addr_list[0],
+			sizeof(ep->heartaddr));
+	} else {
+		/* Multi-peer: see ucast_open_peers() */
+		ep->heartaddr.s_addr = htonl(INADDR_ANY);
+	}
 
 	if (!(ep->interface = STRDUP(ifn))) {
 		PILCallLog(LOG, PIL_CRIT, "ucast: memory allocation error (line %d)",
@@ -320,6 +320,7 @@ ucast6_open(struct hb_media* hbm)
 		,	"%s: read socket: %d"
 		,	__FUNCTION__, ucp->rsocket);
 	}
+	OurImports->TuneMedium(hbm, ucp->rsocket, ucp->wsocket);
 
 	PILCallLog(LOG, PIL_INFO, "ucast6: heartbeat started for [%s]:%u "
 		"on interface %s" ,
@@ -381,7 +382,8 @@ ucast6_read(struct hb_media* hbm, int *lenp)
 	UCASTASSERT(hbm);
 	ucp = (struct ucast6_private *) hbm->pd;
 
-	if ((numbytes=recvfrom(ucp->rsocket, ucast6_pkt, MAXMSG-1, 0
+	if ((numbytes=OurImports->RecvFrom(hbm, ucp->rsocket, ucast6_pkt
+	,	MAXMSG-1, 0
 	,	(struct sockaddr *)&their_addr, &addr_len)) < 0) {
 		if (errno != EINTR) {
 			PILCallLog(LOG, PIL_CRIT, "ucast6: Error receiving from socket: %s"
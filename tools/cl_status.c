@@ -195,7 +195,7 @@ static const cmd_t cmds[] = {
 	{ "nodesite",	   nodesite, 	  "m",		TRUE},
 	{ "nodetype",      nodetype, 	  "m",		TRUE },
 	{ "listhblinks",   listhblinks,   "mv",		TRUE },
-	{ "hblinkstatus",  hblinkstatus,  "m",		TRUE },
+	{ "hblinkstatus",  hblinkstatus,  "mv",		TRUE },
 	{ "clientstatus",  clientstatus,  "m",		TRUE },
 	{ "rscstatus",     rscstatus, 	  "m",		TRUE}, 
 	{ "hbparameter",   hbparameter,	  "mp:",	TRUE},
@@ -211,6 +211,9 @@ static const char * simple_help_screen =
 "	Show the status of heartbeat clients.\n"
 "hblinkstatus <node-name> <link-name>\n"
 "	Show the status of a heartbeat link\n"
+"	Options:\n"
+"		-v	verbose: also show loss, duplicate, jitter\n"
+"			and round trip statistics for the link\n"
 "hbstatus\n"
 "	Indicate if heartbeat is running on the local system.\n"
 "	Options:\n"
@@ -841,16 +844,73 @@ __listhblinks(ll_cluster_t *hb, const char *host, int verbose)
 	return 0;
 }
 
+static void
+print_linkstats(ll_cluster_t *hb, const char * node, const char * link)
+{
+	struct ll_linkstats st;
+	unsigned long total;
+
+	if (hb->llc_ops->if_stats(hb, node, link, &st) != HA_OK) {
+		cl_log(LOG_ERR, "Cannot get heartbeat link statistics");
+		cl_log(LOG_ERR, "REASON: %s", hb->llc_ops->errmsg(hb));
+		return;
+	}
+	total = st.rcvd + st.lost;
+
+	if (FOR_HUMAN_READ == TRUE) {
+		printf("\treceived %lu packets, %lu lost (%lu.%02lu%%)"
+		,	st.rcvd, st.lost
+		,	total ? (st.lost * 100) / total : 0
+		,	total ? ((st.lost * 10000) / total) % 100 : 0);
+		printf(", %lu duplicates\n", st.dup);
+		if (st.ovfl) {
+			printf("\t%lu packets dropped by our receive buffer"
+			" on this medium (all nodes)\n", st.ovfl);
+		}
+		printf("\tjitter %lu ms, %lu ms behind fastest link"
+		,	st.jitter, st.skew);
+		if (st.rtt) {
+			printf(", rtt %lu ms", st.rtt);
+		}
+		printf("\n\tlast heard %lu ms ago\n", st.age);
+	} else {
+		printf("rcvd=%lu\nlost=%lu\ndup=%lu\njitter=%lu\n"
+		"skew=%lu\nrtt=%lu\nage=%lu\novfl=%lu\n"
+		,	st.rcvd, st.lost, st.dup, st.jitter
+		,	st.skew, st.rtt, st.age, st.ovfl);
+	}
+}
+
 static int
 hblinkstatus(ll_cluster_t *hb, int argc, char ** argv, const char * optstr)
 {
 	const char * if_status;	
 	int 	ret = UNKNOWN_ERROR;
+	gboolean VERBOSE = FALSE;
+	int option_char;
 
-	if ( general_simple_opt_deal(argc, argv, optstr) < 0 ) {
-		/* There are option errors */
-		return PARAMETER_ERROR;
-	};
+	do {
+		option_char = getopt(argc-1, argv+1, optstr);
+
+		if (option_char == -1) {
+			break;
+		}
+
+		switch (option_char) {
+			case 'm':
+				FOR_HUMAN_READ = TRUE;
+				break;
+
+			case 'v':
+				VERBOSE = TRUE;
+				break;
+
+			default:
+				cl_log(LOG_ERR, "Error: getopt returned"
+					"character code %c.", option_char);
+				return PARAMETER_ERROR;
+		}
+	} while (1);
 
 	if (argc <= optind+2) {
 		fprintf(stderr, "No enough parameter.\n");
@@ -871,6 +931,10 @@ hblinkstatus(ll_cluster_t *hb, int argc, char ** argv, const char * optstr)
 		printf("%s\n", if_status);
 	}
 
+	if (VERBOSE) {
+		print_linkstats(hb, argv[optind+1], argv[optind+2]);
+	}
+
 	if ( STRNCMP_CONST(if_status, "up") == 0 ) {
 		ret = OK; /* the link is up */
 	} else {